@@ -0,0 +1,119 @@
+// Asynchronous resolution of account names for the SIDs in a snapshot, under a deadline.
+
+#include "BulkSidLookup.h"
+#include "AccountNamePrefetch.h"
+
+const wchar_t* const AccountNamePrefetch_t::szUnresolved = L"[unresolved]";
+
+AccountNamePrefetch_t::AccountNamePrefetch_t()
+	: m_state(std::make_shared<State_t>()), m_hThread(NULL), m_ullDeadline(0), m_nUnresolved(0)
+{
+}
+
+AccountNamePrefetch_t::~AccountNamePrefetch_t()
+{
+	if (NULL != m_hThread)
+		CloseHandle(m_hThread);
+}
+
+/// <summary>
+/// Starts resolving the names of the SIDs that need network lookups on a background thread.
+/// </summary>
+void AccountNamePrefetch_t::Start(const std::vector<CSid>& sids, ULONGLONG ullDeadline)
+{
+	m_ullDeadline = ullDeadline;
+	for (std::vector<CSid>::const_iterator iterSid = sids.begin(); iterSid != sids.end(); ++iterSid)
+	{
+		// Names that can be looked up without network traffic are resolved inline.
+		if (iterSid->IsNameLookupLocal())
+			continue;
+		if (m_index.find(*iterSid) == m_index.end())
+		{
+			m_index[*iterSid] = m_state->entries.size();
+			Entry_t entry;
+			entry.sid = *iterSid;
+			m_state->entries.push_back(entry);
+		}
+	}
+	if (m_state->entries.empty())
+		return;
+
+	std::shared_ptr<State_t>* pStateRef = new std::shared_ptr<State_t>(m_state);
+	m_hThread = CreateThread(nullptr, 0, ResolveThread, pStateRef, 0, nullptr);
+	if (NULL == m_hThread)
+		delete pStateRef;
+}
+
+/// <summary>
+/// Background thread: resolves the entries' names, first in bulk, then each in turn.
+/// </summary>
+/// <param name="lpvThreadParameter">Heap-allocated std::shared_ptr to the State_t; the thread deletes it.</param>
+DWORD WINAPI AccountNamePrefetch_t::ResolveThread(LPVOID lpvThreadParameter)
+{
+	std::shared_ptr<State_t>* pStateRef = (std::shared_ptr<State_t>*)lpvThreadParameter;
+	std::shared_ptr<State_t> state = *pStateRef;
+	delete pStateRef;
+
+	// Resolve all the SIDs with one bulk lookup, priming the SID name cache. If that fails, the loop below
+	// falls back to per-SID lookups (which use any results the bulk lookup did cache).
+	std::vector<CSid> sids;
+	sids.reserve(state->entries.size());
+	for (std::vector<Entry_t>::const_iterator iterEntry = state->entries.begin(); iterEntry != state->entries.end(); ++iterEntry)
+		sids.push_back(iterEntry->sid);
+	std::wstring sErrorInfo;
+	ResolveSidNamesInBulk(sids, *state->pSidNameCache, sErrorInfo);
+
+	for (std::vector<Entry_t>::iterator iterEntry = state->entries.begin(); iterEntry != state->entries.end(); ++iterEntry)
+	{
+		std::wstring sName = iterEntry->sid.toDomainAndUsername(*state->pSidNameCache);
+		EnterCriticalSection(&state->critsec);
+		iterEntry->sName.swap(sName);
+		iterEntry->bResolved = true;
+		LeaveCriticalSection(&state->critsec);
+	}
+	return 0;
+}
+
+/// <summary>
+/// Returns "DOMAIN\USERNAME" for the SID, waiting for the background thread until the deadline if necessary.
+/// </summary>
+const std::wstring& AccountNamePrefetch_t::GetName(const CSid& sid, bool bCountUnresolved)
+{
+	static const std::wstring sUnresolved(szUnresolved);
+
+	std::unordered_map<CSid, size_t>::const_iterator iterIndex = m_index.find(sid);
+	if (iterIndex == m_index.end() || NULL == m_hThread)
+	{
+		std::unordered_map<CSid, std::wstring>::const_iterator iterLocal = m_localNames.find(sid);
+		if (iterLocal == m_localNames.end())
+			iterLocal = m_localNames.emplace(sid, sid.toDomainAndUsername()).first;
+		return iterLocal->second;
+	}
+
+	const Entry_t& entry = m_state->entries[iterIndex->second];
+	EnterCriticalSection(&m_state->critsec);
+	bool bResolved = entry.bResolved;
+	LeaveCriticalSection(&m_state->critsec);
+	if (!bResolved)
+	{
+		// Not there yet: wait for the thread to finish, but not past the deadline.
+		DWORD dwTimeout = INFINITE;
+		if (0 != m_ullDeadline)
+		{
+			ULONGLONG ullNow = GetTickCount64();
+			dwTimeout = (ullNow >= m_ullDeadline) ? 0 : DWORD(m_ullDeadline - ullNow);
+		}
+		WaitForSingleObject(m_hThread, dwTimeout);
+		EnterCriticalSection(&m_state->critsec);
+		bResolved = entry.bResolved;
+		LeaveCriticalSection(&m_state->critsec);
+	}
+	if (!bResolved)
+	{
+		if (bCountUnresolved)
+			++m_nUnresolved;
+		return sUnresolved;
+	}
+	// The background thread doesn't change sName once bResolved is set.
+	return entry.sName;
+}
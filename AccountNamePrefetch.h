@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include "CSid.h"
+
+/// <summary>
+/// Resolves account names for a set of SIDs asynchronously, under a deadline.
+/// SIDs whose names can be looked up without network traffic (see CSid::IsNameLookupLocal) are
+/// resolved inline when needed. The others are resolved on a background thread, so that one SID that
+/// needs a round trip to a domain controller can't stall the output past the deadline: a name that
+/// hasn't arrived by then is reported as unresolved, and the background thread is abandoned.
+/// </summary>
+class AccountNamePrefetch_t
+{
+public:
+	AccountNamePrefetch_t();
+	// Does not wait for the background thread; it finishes (or not) on its own.
+	~AccountNamePrefetch_t();
+
+	/// <summary>
+	/// Starts resolving the names of the distinct SIDs in the input that need network lookups on a
+	/// background thread. Call once. If the thread can't be started, names are resolved on demand.
+	/// </summary>
+	/// <param name="sids">Input: SIDs whose names will be needed; can contain duplicates</param>
+	/// <param name="ullDeadline">Input: GetTickCount64 value after which not to wait for names; 0 for no deadline</param>
+	void Start(const std::vector<CSid>& sids, ULONGLONG ullDeadline);
+
+	/// <summary>
+	/// Returns "DOMAIN\USERNAME" for the SID (empty if it can't be resolved). For a SID that's being
+	/// resolved in the background, waits for it until the deadline; if it isn't resolved by then,
+	/// returns szUnresolved. The returned reference remains valid for the life of this object, and
+	/// repeated calls for the same SID don't allocate.
+	/// </summary>
+	/// <param name="sid">Input: the SID to look up</param>
+	/// <param name="bCountUnresolved">Input: whether to add an unresolved result to UnresolvedCount (false for lookups that aren't output, such as sorting)</param>
+	const std::wstring& GetName(const CSid& sid, bool bCountUnresolved = true);
+
+	/// <summary>
+	/// Number of GetName calls that returned szUnresolved because the deadline passed.
+	/// </summary>
+	size_t UnresolvedCount() const { return m_nUnresolved; }
+
+	// Name returned for a SID whose name didn't arrive by the deadline.
+	static const wchar_t* const szUnresolved;
+
+private:
+	static DWORD WINAPI ResolveThread(LPVOID lpvThreadParameter);
+
+	struct Entry_t
+	{
+		CSid sid;
+		std::wstring sName;
+		// Set by the background thread once sName is filled in. Protected by the state's critsec.
+		bool bResolved = false;
+	};
+
+	/// <summary>
+	/// State shared with the background thread. Reference-counted so that the thread can be abandoned.
+	/// Everything the thread uses is reachable from here, including its own reference to the SID name
+	/// cache, so an abandoned thread doesn't depend on global state that the process' exit might destroy.
+	/// </summary>
+	struct State_t
+	{
+		State_t() : pSidNameCache(SidNameCacheReference()) { InitializeCriticalSection(&critsec); }
+		~State_t() { DeleteCriticalSection(&critsec); }
+		// Set up before the thread starts; only sName/bResolved change afterward.
+		std::vector<Entry_t> entries;
+		// The thread's reference to the SID name cache
+		std::shared_ptr<SidNameCache_t> pSidNameCache;
+		CRITICAL_SECTION critsec;
+
+	private:
+		State_t(const State_t&) = delete;
+		State_t& operator = (const State_t&) = delete;
+	};
+
+	std::shared_ptr<State_t> m_state;
+	// Index into m_state->entries by SID
+	std::unordered_map<CSid, size_t> m_index;
+	// Names resolved on this thread: SIDs not resolved in the background
+	std::unordered_map<CSid, std::wstring> m_localNames;
+	HANDLE m_hThread;
+	ULONGLONG m_ullDeadline;
+	size_t m_nUnresolved;
+
+private:
+	AccountNamePrefetch_t(const AccountNamePrefetch_t&) = delete;
+	AccountNamePrefetch_t& operator = (const AccountNamePrefetch_t&) = delete;
+};
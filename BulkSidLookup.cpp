@@ -0,0 +1,126 @@
+// Bulk SID-to-name resolution with LsaLookupSids2, feeding the SID name cache.
+
+// Need to define WIN32_NO_STATUS temporarily when including both Windows.h and ntstatus.h
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <NTSecAPI.h>
+#include <sstream>
+#include <unordered_set>
+#include "SysErrorMessage.h"
+#include "BulkSidLookup.h"
+
+// Maximum number of SIDs LsaLookupSids2 accepts per call
+static const size_t nMaxSidsPerLookup = 20480;
+
+/// <summary>
+/// Converts a counted LSA string to a std::wstring.
+/// </summary>
+static std::wstring LsaStringToWString(const LSA_UNICODE_STRING& lsaString)
+{
+	if (nullptr == lsaString.Buffer)
+		return std::wstring();
+	return std::wstring(lsaString.Buffer, lsaString.Length / sizeof(wchar_t));
+}
+
+/// <summary>
+/// Looks up one batch of SIDs and adds the results to the cache.
+/// </summary>
+static bool LookupBatch(LSA_HANDLE hPolicy, std::vector<PSID>& batch, SidNameCache_t& cache, std::wstring& sErrorInfo)
+{
+	PLSA_REFERENCED_DOMAIN_LIST pDomains = nullptr;
+	PLSA_TRANSLATED_NAME pNames = nullptr;
+	NTSTATUS status = LsaLookupSids2(hPolicy, 0, ULONG(batch.size()), batch.data(), &pDomains, &pNames);
+	// STATUS_SOME_NOT_MAPPED and STATUS_NONE_MAPPED still return per-SID results (with SidTypeUnknown).
+	if (STATUS_SUCCESS != status && STATUS_SOME_NOT_MAPPED != status && STATUS_NONE_MAPPED != status)
+	{
+		std::wstringstream strError;
+		strError << L"LsaLookupSids2 failed: " << SysErrorMessageWithCode(LsaNtStatusToWinError(status));
+		sErrorInfo = strError.str();
+		if (pDomains)
+			LsaFreeMemory(pDomains);
+		if (pNames)
+			LsaFreeMemory(pNames);
+		return false;
+	}
+
+	for (size_t ix = 0; ix < batch.size(); ++ix)
+	{
+		bool bResolved = false;
+		std::wstring sDomainName, sUserName;
+		if (nullptr != pNames)
+		{
+			const LSA_TRANSLATED_NAME& name = pNames[ix];
+			bResolved = (SidTypeInvalid != name.Use && SidTypeUnknown != name.Use);
+			if (bResolved)
+			{
+				sUserName = LsaStringToWString(name.Name);
+				if (nullptr != pDomains && name.DomainIndex >= 0 && ULONG(name.DomainIndex) < pDomains->Entries)
+					sDomainName = LsaStringToWString(pDomains->Domains[name.DomainIndex].Name);
+			}
+		}
+		cache.Insert(batch[ix], GetLengthSid(batch[ix]), bResolved, sDomainName, sUserName);
+	}
+
+	if (pDomains)
+		LsaFreeMemory(pDomains);
+	if (pNames)
+		LsaFreeMemory(pNames);
+	return true;
+}
+
+/// <summary>
+/// Resolves the names of a set of SIDs with LsaLookupSids2 and adds the results to the SID name cache.
+/// </summary>
+bool ResolveSidNamesInBulk(const std::vector<CSid>& sids, std::wstring& sErrorInfo)
+{
+	return ResolveSidNamesInBulk(sids, GetSidNameCache(), sErrorInfo);
+}
+
+/// <summary>
+/// Resolves the names of a set of SIDs with LsaLookupSids2 and adds the results to the given SID name cache.
+/// </summary>
+bool ResolveSidNamesInBulk(const std::vector<CSid>& sids, SidNameCache_t& cache, std::wstring& sErrorInfo)
+{
+	sErrorInfo.clear();
+
+	// Distinct SIDs that aren't already cached
+	std::unordered_set<CSid> seen;
+	std::vector<PSID> toResolve;
+	for (std::vector<CSid>::const_iterator iterSid = sids.begin(); iterSid != sids.end(); ++iterSid)
+	{
+		PSID pSid = iterSid->psid();
+		if (nullptr == pSid)
+			continue;
+		DWORD cbSid = GetLengthSid(pSid);
+		if (!seen.insert(*iterSid).second)
+			continue;
+		std::wstring sDomainName, sUserName;
+		bool bResolved = false;
+		if (!cache.Peek(pSid, cbSid, sDomainName, sUserName, bResolved))
+			toResolve.push_back(pSid);
+	}
+	if (toResolve.empty())
+		return true;
+
+	LSA_OBJECT_ATTRIBUTES objectAttributes = { 0 };
+	LSA_HANDLE hPolicy = NULL;
+	NTSTATUS status = LsaOpenPolicy(NULL, &objectAttributes, POLICY_LOOKUP_NAMES, &hPolicy);
+	if (STATUS_SUCCESS != status)
+	{
+		sErrorInfo = std::wstring(L"LsaOpenPolicy failed: ") + SysErrorMessageWithCode(LsaNtStatusToWinError(status));
+		return false;
+	}
+
+	bool retval = true;
+	std::vector<PSID> batch;
+	for (size_t ixStart = 0; ixStart < toResolve.size() && retval; ixStart += nMaxSidsPerLookup)
+	{
+		size_t ixEnd = (toResolve.size() - ixStart > nMaxSidsPerLookup) ? ixStart + nMaxSidsPerLookup : toResolve.size();
+		batch.assign(toResolve.begin() + ixStart, toResolve.begin() + ixEnd);
+		retval = LookupBatch(hPolicy, batch, cache, sErrorInfo);
+	}
+	LsaClose(hPolicy);
+	return retval;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include "CSid.h"
+
+/// <summary>
+/// Resolves the names of a set of SIDs with LsaLookupSids2 -- one call for up to thousands of SIDs,
+/// rather than a LookupAccountSidW round trip per SID -- and adds the results (including failures, as
+/// negative entries) to the process-wide SID name cache used by CSid. SIDs that already have unexpired
+/// cache entries, and duplicates, are skipped.
+/// </summary>
+/// <param name="sids">Input: SIDs to resolve; can contain duplicates</param>
+/// <param name="sErrorInfo">Output: error information on failure</param>
+/// <returns>true if successful (even if some SIDs couldn't be mapped); false otherwise</returns>
+bool ResolveSidNamesInBulk(const std::vector<CSid>& sids, std::wstring& sErrorInfo);
+
+/// <summary>
+/// ResolveSidNamesInBulk, adding the results to a specific SID name cache, such as a reference held by a background thread.
+/// </summary>
+/// <param name="sids">Input: SIDs to resolve; can contain duplicates</param>
+/// <param name="cache">Input: the cache to check and add results to</param>
+/// <param name="sErrorInfo">Output: error information on failure</param>
+/// <returns>true if successful (even if some SIDs couldn't be mapped); false otherwise</returns>
+bool ResolveSidNamesInBulk(const std::vector<CSid>& sids, SidNameCache_t& cache, std::wstring& sErrorInfo);
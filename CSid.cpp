@@ -1,26 +1,42 @@
 #include <Windows.h>
 #include <sddl.h>
 #include "MachineSid.h"
+#include "SidCodec.h"
 #include "CSid.h"
 
 
 // ------------------------------------------------------------------------------------------
-// Create a local singleton instance of MachineSid for later comparisons
-static MachineSid machineSid;
+/// <summary>
+/// Local singleton instance of MachineSid for IsMachineLocal comparisons. Created on first use rather
+/// than at program load, as retrieving the machine SID requires opening the LSA policy.
+/// </summary>
+static const MachineSid& GetMachineSid()
+{
+	// Initialization of function-local statics is thread-safe.
+	static MachineSid machineSid;
+	return machineSid;
+}
 
 // ------------------------------------------------------------------------------------------
 
-CSid::CSid() : m_pBuf(NULL)
+CSid::CSid() : m_cbSid(0)
 {
 }
 
-CSid::CSid(PSID pSid) : m_pBuf(NULL)
+CSid::CSid(PSID pSid) : m_cbSid(0)
 {
 	SetBuffer(pSid);
 }
 
-CSid::CSid(const wchar_t* szSid) : m_pBuf(NULL)
+CSid::CSid(const wchar_t* szSid) : m_cbSid(0)
 {
+	// Fast path for the S-1-... form; ConvertStringSidToSidW also handles SDDL abbreviations.
+	size_t cbSid = ParseSidString(szSid, m_buf, sizeof(m_buf));
+	if (0 != cbSid)
+	{
+		m_cbSid = DWORD(cbSid);
+		return;
+	}
 	PSID pSidToFree = NULL;
 	if (ConvertStringSidToSidW(szSid, &pSidToFree))
 	{
@@ -29,20 +45,27 @@ CSid::CSid(const wchar_t* szSid) : m_pBuf(NULL)
 	}
 }
 
-CSid::~CSid()
+CSid::CSid(const CSid& other) noexcept : m_cbSid(0)
 {
-	ClearBuffer();
+	CopyFrom(other);
 }
 
-CSid::CSid(const CSid& other) : m_pBuf(NULL)
+CSid::CSid(CSid&& other) noexcept : m_cbSid(0)
 {
-	SetBuffer(other.psid());
+	CopyFrom(other);
 }
 
-CSid& CSid::operator=(const CSid& other)
+CSid& CSid::operator=(const CSid& other) noexcept
 {
-	ClearBuffer();
-	SetBuffer(other.psid());
+	if (this != &other)
+		CopyFrom(other);
+	return *this;
+}
+
+CSid& CSid::operator=(CSid&& other) noexcept
+{
+	if (this != &other)
+		CopyFrom(other);
 	return *this;
 }
 
@@ -55,40 +78,70 @@ bool CSid::operator==(PSID pSid) const
 
 bool CSid::operator==(const CSid& other) const
 {
-	if (NULL == other.psid() || NULL == this->psid())
-		return false;
-	return 0 != EqualSid(this->psid(), other.psid());
+	// Byte comparison, consistent with hash() and operator <: two empty CSids are equal,
+	// and an empty CSid isn't equal to a non-empty one.
+	return m_cbSid == other.m_cbSid && (0 == m_cbSid || 0 == memcmp(m_buf, other.m_buf, m_cbSid));
+}
+
+bool CSid::operator<(const CSid& other) const noexcept
+{
+	DWORD cbCompare = (m_cbSid < other.m_cbSid) ? m_cbSid : other.m_cbSid;
+	int cmp = (cbCompare > 0) ? memcmp(m_buf, other.m_buf, cbCompare) : 0;
+	if (0 != cmp)
+		return cmp < 0;
+	return m_cbSid < other.m_cbSid;
+}
+
+size_t CSid::hash() const noexcept
+{
+	// FNV-1a over the SID bytes
+	size_t h = (sizeof(size_t) == 8) ? size_t(14695981039346656037ULL) : size_t(2166136261U);
+	const size_t prime = (sizeof(size_t) == 8) ? size_t(1099511628211ULL) : size_t(16777619U);
+	for (DWORD ix = 0; ix < m_cbSid; ++ix)
+	{
+		h ^= m_buf[ix];
+		h *= prime;
+	}
+	return h;
 }
 
 CSid::operator PSID() const
 {
-	return (PSID)m_pBuf;
+	return psid();
 }
 
 PSID CSid::psid() const
 {
-	return (PSID)m_pBuf;
+	return (0 != m_cbSid) ? (PSID)m_buf : NULL;
 }
 
 std::wstring CSid::toSidString() const
 {
-	std::wstring retval;
-	if (m_pBuf)
+	wchar_t szSid[cchMaxSidString];
+	size_t cchSid = toSidString(szSid, cchMaxSidString);
+	return std::wstring(szSid, cchSid);
+}
+
+size_t CSid::toSidString(wchar_t* szBuf, size_t cchBuf) const
+{
+	if (0 == m_cbSid)
 	{
-		wchar_t* szSid = NULL;
-		if (ConvertSidToStringSidW(this->psid(), &szSid))
-		{
-			retval = szSid;
-			LocalFree(szSid);
-		}
+		if (cchBuf > 0)
+			szBuf[0] = L'\0';
+		return 0;
 	}
-	return retval;
+	return FormatSidString(m_buf, m_cbSid, szBuf, cchBuf);
 }
 
 std::wstring CSid::toDomainAndUsername(bool bReturnSidOnFailure /*= false*/) const
+{
+	return toDomainAndUsername(GetSidNameCache(), bReturnSidOnFailure);
+}
+
+std::wstring CSid::toDomainAndUsername(SidNameCache_t& cache, bool bReturnSidOnFailure /*= false*/) const
 {
 	std::wstring sDomainName, sUserName;
-	if (Lookup(sDomainName, sUserName))
+	if (Lookup(cache, sDomainName, sUserName))
 	{
 		if (sDomainName.empty())
 			return sUserName;
@@ -123,25 +176,30 @@ std::wstring CSid::toDomainAndUserNameIfNoNetworkNeeded() const
 	// which SOUNDED as though it will resolve a SID locally only, but it turns out that it WILL go off-box to resolve a SID the LSA doesn't have cached.
 
 	std::wstring retval;
-	// Don't look up S-1-5-21-* unless it's the local machine SID. Anything else is good, for the time being.
-	// Note that this code will translate well-known SIDs to localized names on the machine where it executes.
-	bool bDoLookup =
-		IsMachineLocal() ||
-		!TestNtAuthorityRID(psid(), SECURITY_NT_NON_UNIQUE);
-	if (bDoLookup)
+	if (IsNameLookupLocal())
 		retval = toDomainAndUsername();
 	if (0 == retval.length())
 		retval = toSidString();
 	return retval;
 }
 
+bool CSid::IsNameLookupLocal() const
+{
+	// Don't look up S-1-5-21-* unless it's the local machine SID. Anything else is good, for the time being.
+	// Note that this code will translate well-known SIDs to localized names on the machine where it executes.
+	// The RID test comes first: IsMachineLocal needs the machine SID, which takes LSA calls to get the first time.
+	return
+		!TestNtAuthorityRID(psid(), SECURITY_NT_NON_UNIQUE) ||
+		IsMachineLocal();
+}
+
 bool CSid::IsMachineLocal() const
 {
 	if (NULL == psid())
 		return false;
 
 	BOOL bEqual = FALSE;
-	return (0 != EqualDomainSid(machineSid.Get(), psid(), &bEqual)) && bEqual;
+	return (0 != EqualDomainSid(GetMachineSid().Get(), psid(), &bEqual)) && bEqual;
 }
 
 //static
@@ -172,44 +230,86 @@ bool CSid::TestNtAuthorityRID(PSID pSid, DWORD dwRid)
 	return (dwRid == *GetSidSubAuthority(pSid, 0));
 }
 
+/// <summary>
+/// Resolver for the process-wide SID name cache: LookupAccountSidW.
+/// </summary>
+static bool LookupAccountSidResolver(const void* pSid, size_t /*cbSid*/, std::wstring& sDomainName, std::wstring& sUserName)
+{
+	const DWORD cchMaxName = 256;
+	WCHAR UserName[cchMaxName];
+	WCHAR DomainName[cchMaxName];
+	DWORD cchUserSize = cchMaxName;
+	DWORD cchDomainSize = cchMaxName;
+	SID_NAME_USE eNameUse;
+	if (LookupAccountSidW(NULL, (PSID)pSid, UserName, &cchUserSize, DomainName, &cchDomainSize, &eNameUse))
+	{
+		sDomainName = DomainName;
+		sUserName = UserName;
+		return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Clock for the process-wide SID name cache.
+/// </summary>
+static uint64_t SidNameCacheTickCount()
+{
+	return GetTickCount64();
+}
+
+/// <summary>
+/// Returns a reference to the process-wide cache of SID-to-name lookups used by CSid; created on first use.
+/// </summary>
+std::shared_ptr<SidNameCache_t> SidNameCacheReference()
+{
+	static std::shared_ptr<SidNameCache_t> st_pSidNameCache = std::make_shared<SidNameCache_t>(LookupAccountSidResolver, SidNameCacheTickCount);
+	return st_pSidNameCache;
+}
+
+/// <summary>
+/// Process-wide cache of SID-to-name lookups used by CSid; created on first use.
+/// </summary>
+SidNameCache_t& GetSidNameCache()
+{
+	return *SidNameCacheReference();
+}
+
 bool CSid::Lookup(std::wstring& sDomainName, std::wstring& sUserName) const
+{
+	return Lookup(GetSidNameCache(), sDomainName, sUserName);
+}
+
+bool CSid::Lookup(SidNameCache_t& cache, std::wstring& sDomainName, std::wstring& sUserName) const
 {
 	sDomainName.clear();
 	sUserName.clear();
-	if (m_pBuf)
+	if (0 != m_cbSid)
 	{
-		const DWORD cchMaxName = 256;
-		WCHAR UserName[cchMaxName];
-		WCHAR DomainName[cchMaxName];
-		DWORD cchUserSize = cchMaxName;
-		DWORD cchDomainSize = cchMaxName;
-		SID_NAME_USE eNameUse;
-		if (LookupAccountSidW(NULL, psid(), UserName, &cchUserSize, DomainName, &cchDomainSize, &eNameUse))
-		{
-			sDomainName = DomainName;
-			sUserName = UserName;
-			return true;
-		}
+		return cache.Lookup(m_buf, m_cbSid, sDomainName, sUserName);
 	}
 	return false;
 }
 
-void CSid::ClearBuffer()
+void CSid::ClearBuffer() noexcept
 {
-	if (m_pBuf)
-	{
-		delete[] m_pBuf;
-		m_pBuf = NULL;
-	}
+	m_cbSid = 0;
 }
 
 void CSid::SetBuffer(PSID pSid)
 {
+	ClearBuffer();
 	if (IsValidSid(pSid))
 	{
 		DWORD dwLength = GetLengthSid(pSid);
-		m_pBuf = new byte[dwLength];
-		CopySid(dwLength, m_pBuf, pSid);
+		if (dwLength <= sizeof(m_buf) && CopySid(dwLength, m_buf, pSid))
+			m_cbSid = dwLength;
 	}
 }
 
+void CSid::CopyFrom(const CSid& other) noexcept
+{
+	m_cbSid = other.m_cbSid;
+	if (0 != m_cbSid)
+		memcpy(m_buf, other.m_buf, m_cbSid);
+}
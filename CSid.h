@@ -2,10 +2,15 @@
 
 #include <Windows.h>
 #include <string>
+#include <functional>
+#include <memory>
+#include "SidNameCache.h"
+#include "SidCodec.h"
 
 // ------------------------------------------------------------------------------------------
 /// <summary>
-/// Class to represent a SID and manage its memory
+/// Class to represent a SID. The SID is stored inline (no heap allocation), so CSid objects are
+/// cheap to copy and move and can be used as keys in ordered and hashed containers.
 /// </summary>
 class CSid
 {
@@ -28,15 +33,29 @@ public:
 	/// Change this signature to CSid(const wchar_t* szSid, bool bIsSDDL = false);
 	/// </summary>
 	CSid(const wchar_t* szSid);
-	// Destructor
-	~CSid();
-	// Copy constructor
-	CSid(const CSid& other);
-	// assignment operator
-	CSid& operator = (const CSid& other);
-	// equality operators
+	// Copy and move (the SID is stored inline, so moves are copies that can't fail)
+	CSid(const CSid& other) noexcept;
+	CSid(CSid&& other) noexcept;
+	CSid& operator = (const CSid& other) noexcept;
+	CSid& operator = (CSid&& other) noexcept;
+	// equality operators. Two empty CSids are equal; an empty CSid doesn't equal any PSID.
 	bool operator == (PSID pSid) const;
 	bool operator == (const CSid& other) const;
+	bool operator != (const CSid& other) const { return !(*this == other); }
+	/// <summary>
+	/// Ordering by SID bytes (empty CSid first); consistent with operator == and hash().
+	/// </summary>
+	bool operator < (const CSid& other) const noexcept;
+
+	/// <summary>
+	/// Length of the SID in bytes; 0 if empty.
+	/// </summary>
+	DWORD length() const noexcept { return m_cbSid; }
+
+	/// <summary>
+	/// Hash of the SID's bytes, for std::hash.
+	/// </summary>
+	size_t hash() const noexcept;
 
 	// Conversion to raw type
 	operator PSID() const;
@@ -48,6 +67,14 @@ public:
 	/// </summary>
 	/// <returns></returns>
 	std::wstring toSidString() const;
+
+	/// <summary>
+	/// Writes the string representation of the SID to a caller-supplied buffer, without allocating.
+	/// </summary>
+	/// <param name="szBuf">Output: null-terminated SID string; empty if the CSid is empty</param>
+	/// <param name="cchBuf">Input: size of szBuf in characters; cchMaxSidString is always enough</param>
+	/// <returns>Number of characters written, not counting the null terminator</returns>
+	size_t toSidString(wchar_t* szBuf, size_t cchBuf) const;
 	// Conversion to name (if possible)
 	
 	/// <summary>
@@ -57,6 +84,11 @@ public:
 	/// <returns>"DOMAIN\USERNAME" associated with the SID; empty string or SID string if conversion not possible</returns>
 	std::wstring toDomainAndUsername(bool bReturnSidOnFailure = false) const;
 
+	/// <summary>
+	/// toDomainAndUsername using a specific SID name cache, such as a reference held by a background thread.
+	/// </summary>
+	std::wstring toDomainAndUsername(SidNameCache_t& cache, bool bReturnSidOnFailure = false) const;
+
 	/// <summary>
 	/// Lookup and conversion to username (without domain), if possible.
 	/// </summary>
@@ -77,6 +109,12 @@ public:
 	/// <returns>true if this SID has the same base SID as the local machine's SID</returns>
 	bool IsMachineLocal() const;
 
+	/// <summary>
+	/// Returns true if name lookup for this SID can be performed without network traffic: local
+	/// accounts and well-known SIDs, but not domain SIDs (S-1-5-21-*) other than the machine's.
+	/// </summary>
+	bool IsNameLookupLocal() const;
+
 	/// <summary>
 	/// Reports whether the SID is an NT SERVICE SID (begins with S-1-5-80)
 	/// </summary>
@@ -101,10 +139,36 @@ private:
 
 	// Conversion to domain\name strings
 	bool Lookup(std::wstring& sDomainName, std::wstring& sUserName) const;
+	bool Lookup(SidNameCache_t& cache, std::wstring& sDomainName, std::wstring& sUserName) const;
 
 private:
-	void ClearBuffer();
+	void ClearBuffer() noexcept;
 	void SetBuffer(PSID pSid);
-	byte* m_pBuf;
+	void CopyFrom(const CSid& other) noexcept;
+	// The SID, valid if m_cbSid is nonzero
+	alignas(DWORD) BYTE m_buf[SECURITY_MAX_SID_SIZE];
+	DWORD m_cbSid;
 };
 
+/// <summary>
+/// Hashing support, so CSid can be used as a key in unordered containers.
+/// </summary>
+namespace std
+{
+	template<> struct hash<CSid>
+	{
+		size_t operator()(const CSid& sid) const noexcept { return sid.hash(); }
+	};
+}
+
+/// <summary>
+/// Process-wide cache of SID-to-name lookups, used by CSid's name conversions.
+/// </summary>
+SidNameCache_t& GetSidNameCache();
+
+/// <summary>
+/// Returns a reference to the process-wide SID name cache. A thread that its caller might abandon holds
+/// one, so that the cache remains valid while the thread uses it, even if the thread is still running
+/// when the process' static objects are destroyed.
+/// </summary>
+std::shared_ptr<SidNameCache_t> SidNameCacheReference();
@@ -13,16 +13,41 @@
 /// </summary>
 DbgOut_t dbgOut;
 
-// Single instance of a managed collection of shareable std::wofstream instances.
-// Heap-allocated when the first instance of DbgOut_InternalBufferImpl is created, and never deleted,
-// to ensure that the destructors of global instances of DbgOut_InternalBufferImpl defined in arbitrary
-// other compilation units always have a valid WofstreamManager_t to access.
-WofstreamManager_t* DbgOut_InternalBufferImpl::st_pWofstreamMgr = nullptr;
+/// <summary>
+/// Single instance of a managed collection of shareable std::wofstream instances, created the first time
+/// a DbgOut_InternalBufferImpl writes to a file. Heap-allocated and never deleted, to ensure that the
+/// destructors of global instances of DbgOut_InternalBufferImpl defined in arbitrary other compilation
+/// units always have a valid WofstreamManager_t to access.
+/// </summary>
+static WofstreamManager_t& WofstreamMgr()
+{
+	// Initialization of function-local statics is thread-safe.
+	static WofstreamManager_t* pWofstreamMgr = new WofstreamManager_t;
+	return *pWofstreamMgr;
+}
 
 // Singleton instances of critical section objects to serialize access to std::wcout and std::wcerr.
-// Bool to indicate whether they've been initialized.
+// Initialized the first time any instance writes to std::wcout or std::wcerr; never deleted.
 static CRITICAL_SECTION gb_critsecWCout, gb_critsecWCerr;
-static bool gb_bCritSecsInitialized = false;
+static INIT_ONCE gb_initOnceCritSecs = INIT_ONCE_STATIC_INIT;
+
+/// <summary>
+/// INIT_ONCE callback that initializes the std::wcout and std::wcerr critical sections.
+/// </summary>
+static BOOL CALLBACK InitStdStreamCritSecs(PINIT_ONCE, PVOID, PVOID*)
+{
+	InitializeCriticalSection(&gb_critsecWCout);
+	InitializeCriticalSection(&gb_critsecWCerr);
+	return TRUE;
+}
+
+/// <summary>
+/// Ensures that the std::wcout and std::wcerr critical sections have been initialized.
+/// </summary>
+static void EnsureStdStreamCritSecs()
+{
+	InitOnceExecuteOnce(&gb_initOnceCritSecs, InitStdStreamCritSecs, nullptr, nullptr);
+}
 
 // ------------------------------------------------------------------------------------------
 
@@ -36,27 +61,11 @@ DbgOut_InternalBufferImpl::DbgOut_InternalBufferImpl() :
 	m_bAcquiredOutput(false),
 	m_bPrependTimestamp(false)
 {
-	// First one in instantiates a heap-allocated instance of the WofstreamManager_t for which the
-	// destructor never gets called. This ensures that global instances of DbgOut_InternalBufferImpl
-	// defined in other compilation units always have a valid WofstreamManager_t to use when their
-	// destructors are invoked
-	if (nullptr == st_pWofstreamMgr)
-	{
-		st_pWofstreamMgr = new WofstreamManager_t;
-	}
-
-	// Initialize this instance's synchronization mechanisms.
+	// Initialize this instance's synchronization mechanisms. The shared WofstreamManager_t and the
+	// wcout/wcerr critical sections are initialized on first use, keeping the construction of global
+	// instances (which happens at program load) inexpensive.
 	InitializeCriticalSection(&m_critsecConfig);
 	InitializeCriticalSection(&m_critsecOutput);
-
-	// and initialize the global wcout/wcerr critical sections if not already done
-	if (!gb_bCritSecsInitialized)
-	{
-		gb_bCritSecsInitialized = true;
-		InitializeCriticalSection(&gb_critsecWCout);
-		InitializeCriticalSection(&gb_critsecWCerr);
-	}
-
 }
 
 DbgOut_InternalBufferImpl::~DbgOut_InternalBufferImpl()
@@ -119,7 +128,7 @@ bool DbgOut_InternalBufferImpl::WriteToFile(const wchar_t* szFilename, bool bApp
 		if (szFilename && *szFilename)
 		{
 			// Try to get a pointer to a (possibly shared) std::wofstream instance.
-			if (st_pWofstreamMgr->GetWofstream(szFilename, &m_pStreamSync, bAppend, uSizeThreshold))
+			if (WofstreamMgr().GetWofstream(szFilename, &m_pStreamSync, bAppend, uSizeThreshold))
 			{
 				m_bWriteToFile = true;
 				retval = true;
@@ -259,6 +268,7 @@ int DbgOut_InternalBufferImpl::sync()
 			if (m_bWriteToWCout)
 			{
 				// Serialize access to std::wcout
+				EnsureStdStreamCritSecs();
 				EnterCriticalSection(&gb_critsecWCout);
 				// Exception handling to ensure that the Leave API gets called
 				try { std::wcout << sOutput << std::flush; } catch(...) {}
@@ -267,6 +277,7 @@ int DbgOut_InternalBufferImpl::sync()
 			if (m_bWriteToWCerr)
 			{
 				// Serialize access to std::wcerr
+				EnsureStdStreamCritSecs();
 				EnterCriticalSection(&gb_critsecWCerr);
 				// Exception handling to ensure that the Leave API gets called
 				try { std::wcerr << sOutput << std::flush; } catch(...) {}
@@ -314,7 +325,7 @@ void DbgOut_InternalBufferImpl::releaseFile()
 		{
 			// WofstreamManager_t is responsible for allocating/deallocating instances.
 			// We don't delete it here. Just don't reference it anymore.
-			st_pWofstreamMgr->ReleaseWofstream(m_pStreamSync);
+			WofstreamMgr().ReleaseWofstream(m_pStreamSync);
 			m_pStreamSync = nullptr;
 		}
 		m_bWriteToFile = false;
@@ -121,12 +121,9 @@ private:
 	WofstreamSync_t* m_pStreamSync = nullptr;
 	HANDLE m_handle = nullptr;
 
-	// Single instance of a managed collection of shareable std::wofstream instances.
-	// Not supportable for two wofstreams to write to the same file at the same time.
-	// Heap-allocated when first class instance is created, never destroyed. Reason is that
-	// we can't control the ctor/dtor order of global instances of DbgOut_InternalBufferImpl
-	// vs. the destruction of a static instance of WofstreamManager_t.
-	static WofstreamManager_t* st_pWofstreamMgr;
+	// File streams are obtained from a single instance of a managed collection of shareable std::wofstream
+	// instances (not supportable for two wofstreams to write to the same file at the same time), which is
+	// created the first time any instance writes to a file.
 
 private:
 	// Not implemented
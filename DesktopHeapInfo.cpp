@@ -0,0 +1,307 @@
+// Desktop heap usage per window station and desktop in the current session.
+
+// Need to define WIN32_NO_STATUS temporarily when including both Windows.h and ntstatus.h
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <WtsApi32.h>
+#pragma comment(lib, "Wtsapi32.lib")
+#include <TlHelp32.h>
+#include <algorithm>
+#include <unordered_map>
+#include "NtInternal.h"
+#include "SysErrorMessage.h"
+#include "DesktopHeapInfo.h"
+
+// CompareObjectHandles is available beginning with Windows 10 v1607; look it up dynamically.
+typedef BOOL(WINAPI* pfn_CompareObjectHandles_t)(HANDLE hFirstObjectHandle, HANDLE hSecondObjectHandle);
+
+/// <summary>
+/// Callback for EnumWindowStationsW and EnumDesktopsW: collects the names into a vector.
+/// </summary>
+static BOOL CALLBACK CollectNamesCallback(LPWSTR lpszName, LPARAM lParam)
+{
+	std::vector<std::wstring>* pNames = (std::vector<std::wstring>*)lParam;
+	pNames->push_back(lpszName);
+	return TRUE;
+}
+
+/// <summary>
+/// Internal: a desktop that has been opened, so that threads' desktops can be matched against it.
+/// </summary>
+struct OpenedDesktop_t
+{
+	HDESK hDesk = NULL;
+	size_t ixInfo = 0;
+};
+
+/// <summary>
+/// Opens each desktop in the named window station, retrieves its heap size, and appends an entry for
+/// it to the desktops vector. Desktops that are opened successfully are added to openedDesktops; the
+/// caller is responsible for closing those handles.
+/// </summary>
+static void InspectWindowStation(
+	const std::wstring& sWinsta,
+	std::vector<DesktopHeapInfo_t>& desktops,
+	std::vector<OpenedDesktop_t>& openedDesktops)
+{
+	HWINSTA hWinsta = OpenWindowStationW(sWinsta.c_str(), FALSE, WINSTA_ENUMDESKTOPS);
+	if (NULL == hWinsta)
+	{
+		DesktopHeapInfo_t info;
+		info.sWindowStation = sWinsta;
+		info.sErrorInfo = SysErrorMessageWithCode();
+		desktops.push_back(info);
+		return;
+	}
+
+	std::vector<std::wstring> desktopNames;
+	if (!EnumDesktopsW(hWinsta, CollectNamesCallback, (LPARAM)&desktopNames))
+	{
+		DesktopHeapInfo_t info;
+		info.sWindowStation = sWinsta;
+		info.sErrorInfo = SysErrorMessageWithCode();
+		desktops.push_back(info);
+		CloseWindowStation(hWinsta);
+		return;
+	}
+
+	// OpenDesktopW opens desktops in the process' window station, so temporarily switch to the one being inspected.
+	HWINSTA hOrigWinsta = GetProcessWindowStation();
+	bool bSwitched = (0 != SetProcessWindowStation(hWinsta));
+	DWORD dwSwitchErr = bSwitched ? 0 : GetLastError();
+
+	for (std::vector<std::wstring>::const_iterator iterDesk = desktopNames.begin(); iterDesk != desktopNames.end(); ++iterDesk)
+	{
+		DesktopHeapInfo_t info;
+		info.sWindowStation = sWinsta;
+		info.sDesktop = *iterDesk;
+		if (!bSwitched)
+		{
+			info.sErrorInfo = SysErrorMessageWithCode(dwSwitchErr);
+			desktops.push_back(info);
+			continue;
+		}
+
+		HDESK hDesk = OpenDesktopW(iterDesk->c_str(), 0, FALSE, DESKTOP_READOBJECTS | DESKTOP_ENUMERATE);
+		if (NULL == hDesk)
+		{
+			info.sErrorInfo = SysErrorMessageWithCode();
+			desktops.push_back(info);
+			continue;
+		}
+
+		ULONG ulHeapSizeKB = 0;
+		DWORD cbNeeded = 0;
+		if (GetUserObjectInformationW(hDesk, UOI_HEAPSIZE, &ulHeapSizeKB, sizeof(ulHeapSizeKB), &cbNeeded))
+		{
+			info.ulHeapSizeKB = ulHeapSizeKB;
+			info.bHeapSizeValid = true;
+		}
+		else
+		{
+			info.sErrorInfo = SysErrorMessageWithCode();
+		}
+
+		OpenedDesktop_t opened;
+		opened.hDesk = hDesk;
+		opened.ixInfo = desktops.size();
+		openedDesktops.push_back(opened);
+		desktops.push_back(info);
+	}
+
+	if (bSwitched)
+		SetProcessWindowStation(hOrigWinsta);
+	CloseWindowStation(hWinsta);
+}
+
+/// <summary>
+/// Identifies which of the opened desktops a thread's desktop handle refers to.
+/// </summary>
+/// <returns>Index into openedDesktops, or -1 if not found</returns>
+static int MatchDesktop(
+	HDESK hThreadDesk,
+	const std::vector<OpenedDesktop_t>& openedDesktops,
+	const std::vector<DesktopHeapInfo_t>& desktops,
+	pfn_CompareObjectHandles_t pfnCompareObjectHandles)
+{
+	if (nullptr != pfnCompareObjectHandles)
+	{
+		for (size_t ix = 0; ix < openedDesktops.size(); ++ix)
+		{
+			if (pfnCompareObjectHandles(hThreadDesk, openedDesktops[ix].hDesk))
+				return int(ix);
+		}
+		return -1;
+	}
+
+	// Fallback for older versions of Windows: match on the desktop name only.
+	// Ambiguous if more than one window station has a desktop by the same name; first one wins.
+	wchar_t szName[256] = { 0 };
+	DWORD cbNeeded = 0;
+	if (!GetUserObjectInformationW(hThreadDesk, UOI_NAME, szName, sizeof(szName) - sizeof(wchar_t), &cbNeeded))
+		return -1;
+	for (size_t ix = 0; ix < openedDesktops.size(); ++ix)
+	{
+		if (0 == _wcsicmp(szName, desktops[openedDesktops[ix].ixInfo].sDesktop.c_str()))
+			return int(ix);
+	}
+	return -1;
+}
+
+/// <summary>
+/// Internal: if the thread is attached to one of the opened desktops, increments that desktop's thread count.
+/// </summary>
+static void CountThreadDesktop(DWORD dwThreadId, const std::vector<OpenedDesktop_t>& openedDesktops, const std::vector<DesktopHeapInfo_t>& desktops, pfn_CompareObjectHandles_t pfnCompareObjectHandles, std::vector<DWORD>& threadCounts)
+{
+	// GetThreadDesktop succeeds only for threads that have made GUI calls.
+	// The returned handle does not need to be closed.
+	HDESK hThreadDesk = GetThreadDesktop(dwThreadId);
+	if (NULL != hThreadDesk)
+	{
+		int ixOpened = MatchDesktop(hThreadDesk, openedDesktops, desktops, pfnCompareObjectHandles);
+		if (ixOpened >= 0)
+			++threadCounts[ixOpened];
+	}
+}
+
+/// <summary>
+/// Enumerates the window stations and desktops in the current session, retrieves each desktop's
+/// heap size, and identifies the processes in the session that have threads attached to each desktop.
+/// </summary>
+bool GetDesktopHeapInfo(DWORD dwSessionID, std::vector<DesktopHeapInfo_t>& desktops, std::wstring& sErrorInfo)
+{
+	desktops.clear();
+	sErrorInfo.clear();
+
+	// Window stations in the current session
+	std::vector<std::wstring> winstaNames;
+	if (!EnumWindowStationsW(CollectNamesCallback, (LPARAM)&winstaNames))
+	{
+		sErrorInfo = std::wstring(L"EnumWindowStationsW failed: ") + SysErrorMessageWithCode();
+		return false;
+	}
+
+	std::vector<OpenedDesktop_t> openedDesktops;
+	for (std::vector<std::wstring>::const_iterator iterWinsta = winstaNames.begin(); iterWinsta != winstaNames.end(); ++iterWinsta)
+	{
+		InspectWindowStation(*iterWinsta, desktops, openedDesktops);
+	}
+
+	// Acquire pointers to ntdll/kernelbase interfaces
+	pfn_NtGetNextThread_t NtGetNextThread = nullptr;
+	HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+	if (nullptr != ntdll)
+		NtGetNextThread = (pfn_NtGetNextThread_t)GetProcAddress(ntdll, "NtGetNextThread");
+	pfn_CompareObjectHandles_t pfnCompareObjectHandles = nullptr;
+	HMODULE kernelbase = GetModuleHandleW(L"kernelbase.dll");
+	if (nullptr != kernelbase)
+		pfnCompareObjectHandles = (pfn_CompareObjectHandles_t)GetProcAddress(kernelbase, "CompareObjectHandles");
+
+	// If NtGetNextThread isn't available, fall back to a Toolhelp snapshot of all threads in the system,
+	// grouped by process. (The snapshot can miss threads created after it's taken.)
+	std::unordered_map<DWORD, std::vector<DWORD>> threadIdsByPid;
+	bool bCanEnumerateThreads = true;
+	if (nullptr == NtGetNextThread)
+	{
+		HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+		if (INVALID_HANDLE_VALUE != hSnapshot)
+		{
+			sErrorInfo = L"NtGetNextThread is not available; enumerating threads with a Toolhelp snapshot instead";
+			THREADENTRY32 te32 = { 0 };
+			te32.dwSize = sizeof(te32);
+			for (BOOL bMore = Thread32First(hSnapshot, &te32); bMore; bMore = Thread32Next(hSnapshot, &te32))
+			{
+				threadIdsByPid[te32.th32OwnerProcessID].push_back(te32.th32ThreadID);
+			}
+			CloseHandle(hSnapshot);
+		}
+		else
+		{
+			sErrorInfo = std::wstring(L"NtGetNextThread is not available, and the Toolhelp thread snapshot failed (") + SysErrorMessageWithCode() + L"); processes attached to desktops are not listed";
+			bCanEnumerateThreads = false;
+		}
+	}
+
+	// Get information about all processes in the session, and for each of them, which desktops its threads are attached to.
+	WTS_PROCESS_INFOW* pProcessesInfo = nullptr;
+	DWORD dwProcessCount = 0, dwLevel = 0;
+	BOOL ret = FALSE;
+	if (bCanEnumerateThreads)
+	{
+#pragma warning(push)
+#pragma warning (disable: 6387) // disable false positive about invalid parameter
+		ret = WTSEnumerateProcessesExW(WTS_CURRENT_SERVER_HANDLE, &dwLevel, dwSessionID, (LPWSTR*)&pProcessesInfo, &dwProcessCount);
+#pragma warning(pop)
+		if (!ret)
+			sErrorInfo = std::wstring(L"Unable to enumerate processes: ") + SysErrorMessageWithCode();
+	}
+	if (ret)
+	{
+		// Thread counts per opened desktop for the current process; reused for each process.
+		std::vector<DWORD> threadCounts(openedDesktops.size());
+		for (DWORD ixProc = 0; ixProc < dwProcessCount; ++ixProc)
+		{
+			const WTS_PROCESS_INFOW& wtsCurrProcess = pProcessesInfo[ixProc];
+			// Skip PID 0: not a real process.
+			if (0 == wtsCurrProcess.ProcessId)
+				continue;
+
+			std::fill(threadCounts.begin(), threadCounts.end(), 0);
+			if (nullptr == NtGetNextThread)
+			{
+				// Fallback: thread IDs from the Toolhelp snapshot.
+				std::unordered_map<DWORD, std::vector<DWORD>>::const_iterator iterThreadIds = threadIdsByPid.find(wtsCurrProcess.ProcessId);
+				if (threadIdsByPid.end() != iterThreadIds)
+				{
+					for (std::vector<DWORD>::const_iterator iterTid = iterThreadIds->second.begin(); iterTid != iterThreadIds->second.end(); ++iterTid)
+					{
+						CountThreadDesktop(*iterTid, openedDesktops, desktops, pfnCompareObjectHandles, threadCounts);
+					}
+				}
+			}
+			else
+			{
+				// NtGetNextThread needs PROCESS_QUERY_INFORMATION; protected processes might allow only limited access.
+				HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, wtsCurrProcess.ProcessId);
+				if (NULL == hProcess)
+					hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, wtsCurrProcess.ProcessId);
+				if (NULL == hProcess)
+					continue;
+
+				HANDLE hThread = NULL, hNextThread = NULL;
+				while (STATUS_SUCCESS == NtGetNextThread(hProcess, hThread, THREAD_QUERY_LIMITED_INFORMATION, 0, 0, &hNextThread))
+				{
+					if (NULL != hThread)
+						CloseHandle(hThread);
+					hThread = hNextThread;
+					CountThreadDesktop(GetThreadId(hThread), openedDesktops, desktops, pfnCompareObjectHandles, threadCounts);
+				}
+				if (NULL != hThread)
+					CloseHandle(hThread);
+				CloseHandle(hProcess);
+			}
+
+			for (size_t ixOpened = 0; ixOpened < openedDesktops.size(); ++ixOpened)
+			{
+				if (threadCounts[ixOpened] > 0)
+				{
+					DesktopProcess_t proc;
+					proc.dwPID = wtsCurrProcess.ProcessId;
+					proc.sProcessName = wtsCurrProcess.pProcessName;
+					proc.dwThreadCount = threadCounts[ixOpened];
+					desktops[openedDesktops[ixOpened].ixInfo].processes.push_back(proc);
+				}
+			}
+		}
+		WTSFreeMemoryExW(WTSTypeProcessInfoLevel0, pProcessesInfo, dwProcessCount);
+	}
+
+	for (std::vector<OpenedDesktop_t>::const_iterator iterOpened = openedDesktops.begin(); iterOpened != openedDesktops.end(); ++iterOpened)
+	{
+		CloseDesktop(iterOpened->hDesk);
+	}
+
+	return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// A process that has one or more GUI threads attached to a particular desktop.
+/// </summary>
+struct DesktopProcess_t
+{
+	DWORD dwPID = 0;
+	std::wstring sProcessName;
+	DWORD dwThreadCount = 0;
+};
+
+/// <summary>
+/// Information about one desktop in one window station: its heap size and the processes
+/// that have threads attached to it.
+/// </summary>
+struct DesktopHeapInfo_t
+{
+	std::wstring sWindowStation, sDesktop;
+	// Desktop heap size in KB, as reported by UOI_HEAPSIZE; valid only if bHeapSizeValid is true.
+	ULONG ulHeapSizeKB = 0;
+	bool bHeapSizeValid = false;
+	// Error information if the desktop couldn't be opened or queried.
+	std::wstring sErrorInfo;
+	// Processes with threads attached to this desktop.
+	std::vector<DesktopProcess_t> processes;
+};
+
+/// <summary>
+/// Enumerates the window stations and desktops in the current session, retrieves each desktop's
+/// heap size, and identifies the processes in the session that have threads attached to each desktop.
+/// Requires administrative rights to inspect window stations and processes in other security contexts.
+/// </summary>
+/// <param name="dwSessionID">Input: the current process' session ID (processes in this session are inspected)</param>
+/// <param name="desktops">Output: one entry per desktop found</param>
+/// <param name="sErrorInfo">Output: error information on failure, or a non-fatal problem (such as the thread enumeration fallback) on success</param>
+/// <returns>true if the window stations could be enumerated; false otherwise</returns>
+bool GetDesktopHeapInfo(DWORD dwSessionID, std::vector<DesktopHeapInfo_t>& desktops, std::wstring& sErrorInfo);
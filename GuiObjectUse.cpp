@@ -11,11 +11,24 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <vector>
+#include <memory>
 #include "SysErrorMessage.h"
 #include "CSid.h"
 #include "FileOutput.h"
 #include "Utilities.h"
+#include "DesktopHeapInfo.h"
+#include "HandleCounts.h"
+#include "ProcessProbe.h"
 #include "ServiceLookupByPID.h"
+#include "AccountNamePrefetch.h"
+#include "RowWriter.h"
+#include "OutputSinks.h"
+#include "SnapshotColumns.h"
+#include "OpenMetricsOutput.h"
+#include "Lz4Frame.h"
+#include "RowSort.h"
 #include "NtInternal.h"
 #include "RunInSession0_Framework.h"
 
@@ -34,10 +47,665 @@ L"  -a : Show information about all processes, including processes\n"
 L"       with no User/GDI objects and /or that cannot be opened.\n"
 L"       By default, processes with no User or GDI objects or that\n"
 L"       cannot be opened are not listed.\n"
+L"  -handles : Add columns with each process' numbers of handles to\n"
+L"       WindowStation and Desktop objects.\n"
+L"  -svcinfo : Add columns with the start types of the services hosted\n"
+L"       in each process, whether the process is an own-process or a\n"
+L"       shared-process service host, and its svchost group.\n"
+L"  -ts : Add a column with the time, in milliseconds since the start of\n"
+L"       the snapshot, that each row's counters were read. The TOTAL row\n"
+L"       reports the time span over which the counters were collected.\n"
+L"  -drift N : After the snapshot, re-read the counters of the first N\n"
+L"       listed processes and report the sums of the absolute changes\n"
+L"       in a DRIFT row.\n"
+L"  -sort column[:asc|:desc] : List processes sorted by a column,\n"
+L"       ascending by default, with ties in PID order, so that\n"
+L"       successive snapshots line up. Columns: session, pid, name,\n"
+L"       ppid, services, userSid, userName, userObjects,\n"
+L"       userObjectsPeak, gdiObjects, gdiObjectsPeak, readTimeMs,\n"
+L"       windowStationHandles, desktopHandles (the last two require\n"
+L"       -handles). Names are compared ordinally. Applies to\n"
+L"       -readsnapshot and to the rows that -drift re-reads.\n"
+L"  -budget seconds : Maximum time to spend probing processes. Processes\n"
+L"       are probed largest-first; when time runs out, the rows collected\n"
+L"       so far are output, followed by a SKIPPED row with the number of\n"
+L"       processes not probed. Use a value smaller than -t.\n"
+L"  -namewait seconds : Maximum time, from the start of the snapshot, to\n"
+L"       wait for account names that need network lookups (e.g., domain\n"
+L"       accounts). Names that haven't arrived by then are reported as\n"
+L"       [unresolved]. By default, waits as long as the lookups take.\n"
+L"  -gentle [percent] : Low-impact mode. Runs at background CPU, I/O\n"
+L"       and memory priority, and paces probing to use at most the given\n"
+L"       percentage of one CPU core (default 2). Reports to stderr how\n"
+L"       much the pacing lengthened the run.\n"
+L"  -desktops : Instead of listing processes, list the desktops in each\n"
+L"       window station in the session, with each desktop's heap size\n"
+L"       and the processes that have threads attached to it.\n"
+L"  -format tsv|ndjson|columnar|openmetrics : Output format for the\n"
+L"       process listing. tsv (the default) is tab-delimited text with\n"
+L"       headers. ndjson writes one JSON object per line, with a \"type\"\n"
+L"       of process, total, global, drift or skipped, and numeric\n"
+L"       counters. columnar writes a compact binary file (use with -o)\n"
+L"       that can be memory-mapped and scanned; see SnapshotColumns.h.\n"
+L"       It doesn't record -handles or -svcinfo columns.\n"
+L"       openmetrics writes gauges per process (labelled with session,\n"
+L"       PID, name, user and services) and per session, in OpenMetrics\n"
+L"       text format; see OpenMetricsOutput.h.\n"
+L"  -outfile file : Write each snapshot to the file instead of stdout,\n"
+L"       replacing it atomically (through a temporary file that is\n"
+L"       renamed), so readers never see a partial snapshot. With\n"
+L"       -format openmetrics and a .prom file name, suitable for the\n"
+L"       node_exporter textfile collector. Use a full path.\n"
+L"  -watch seconds : Take a snapshot every interval until interrupted\n"
+L"       or until output to stdout fails. In session 0, runs until\n"
+L"       the -t timeout. With -format columnar, requires -outfile\n"
+L"       (which holds one snapshot).\n"
+L"  -compress : Compress the output (in any format) as it is written,\n"
+L"       on a background thread, in LZ4 frame format with bounded\n"
+L"       memory. Applies to stdout (including -o) and -outfile. Read\n"
+L"       it with -decompress, -readsnapshot, or the lz4 tool.\n"
+L"  -decompress file : Instead of taking a snapshot, write the\n"
+L"       decompressed contents of a file written with -compress to\n"
+L"       stdout. Use with -here.\n"
+L"  -readsnapshot file : Instead of taking a snapshot, list the\n"
+L"       contents of a columnar snapshot file (which may be compressed)\n"
+L"       as tab-delimited text. Use with -here.\n"
+L"  -writerstats : Report to stderr, at the end, how the output was\n"
+L"       written: output goes through a bounded queue to a writer\n"
+L"       thread, so that a slow reader (e.g., of the pipe from session\n"
+L"       0) doesn't hold up collection. Reports the bytes written, the\n"
+L"       time spent writing, the most queued chunks, and how many times\n"
+L"       and for how long output waited for room in the queue.\n"
+L"  -startup : Report to stderr a breakdown of startup latency: process\n"
+L"       creation to program entry (loader and static initialization),\n"
+L"       program entry to the start of the listing code, and from there\n"
+L"       until output is first written. In session 0, these are the\n"
+L"       service's, or with -installagent, those of the process the\n"
+L"       agent starts for the run (labeled as such).\n"
 ;
 
 // Forward declaration for the code to pass to the RunInSession0_Framework.
 int GuiObjectUse(int argc, wchar_t** argv);
+// Forward declaration for the -desktops option
+static int ListDesktops(DWORD dwSessionID);
+// Forward declaration for the -decompress option
+static int DecompressFile(const wchar_t* szFilename);
+
+/// <summary>
+/// Output formats for the process listing.
+/// </summary>
+enum class OutputFormat_t
+{
+    // Tab-delimited text with headers
+    Tsv,
+    // One JSON object per line
+    Ndjson,
+    // Binary columnar file (see SnapshotColumns.h)
+    Columnar,
+    // OpenMetrics text (see OpenMetricsOutput.h)
+    OpenMetrics
+};
+
+/// <summary>
+/// Columns the process listing can be sorted by.
+/// </summary>
+enum class SortColumn_t
+{
+    // Enumeration order
+    None,
+    Session,
+    Pid,
+    Name,
+    Ppid,
+    Services,
+    UserSid,
+    UserName,
+    UserObjects,
+    UserObjectsPeak,
+    GdiObjects,
+    GdiObjectsPeak,
+    ReadTime,
+    WindowStationHandles,
+    DesktopHandles
+};
+
+/// <summary>
+/// Names of the sort columns on the command line (the same as the ndjson keys).
+/// </summary>
+static const struct
+{
+    const wchar_t* szName;
+    SortColumn_t column;
+} sortColumnNames[] = {
+    { L"session", SortColumn_t::Session },
+    { L"pid", SortColumn_t::Pid },
+    { L"name", SortColumn_t::Name },
+    { L"ppid", SortColumn_t::Ppid },
+    { L"services", SortColumn_t::Services },
+    { L"userSid", SortColumn_t::UserSid },
+    { L"userName", SortColumn_t::UserName },
+    { L"userObjects", SortColumn_t::UserObjects },
+    { L"userObjectsPeak", SortColumn_t::UserObjectsPeak },
+    { L"gdiObjects", SortColumn_t::GdiObjects },
+    { L"gdiObjectsPeak", SortColumn_t::GdiObjectsPeak },
+    { L"readTimeMs", SortColumn_t::ReadTime },
+    { L"windowStationHandles", SortColumn_t::WindowStationHandles },
+    { L"desktopHandles", SortColumn_t::DesktopHandles }
+};
+
+/// <summary>
+/// Options selected on GuiObjectUse's command line.
+/// </summary>
+struct GuiObjectUseOptions_t
+{
+    // Whether to output information about all processes or just those with non-zero results.
+    bool bShowAll = false;
+    // Whether to add columns with WindowStation and Desktop handle counts.
+    bool bShowHandleCounts = false;
+    // Whether to add columns with service start types, process type, and svchost group.
+    bool bShowServiceInfo = false;
+    // Whether to add a column with the time each row's counters were read.
+    bool bShowReadTime = false;
+    // Number of listed processes to re-read at the end of the snapshot to measure drift.
+    DWORD dwDriftRows = 0;
+    // Maximum time to spend probing processes.
+    DWORD dwBudgetMilliseconds = INFINITE;
+    // Maximum time from the start of the snapshot to wait for account names that need network lookups.
+    DWORD dwNameWaitMilliseconds = INFINITE;
+    // Whether to run at background priority, and the percentage of one core to pace probing to (0 for no pacing).
+    bool bGentle = false;
+    double dCpuBudgetPercent = 0;
+    // Whether to list desktops and their heap sizes instead of processes.
+    bool bListDesktops = false;
+    // Output format for the process listing.
+    OutputFormat_t format = OutputFormat_t::Tsv;
+    // File to write each snapshot to, replacing it atomically, instead of stdout (empty for stdout).
+    std::wstring sOutputFile;
+    // Interval between snapshots in watch mode (0 for a single snapshot).
+    DWORD dwWatchMilliseconds = 0;
+    // Whether to compress the output.
+    bool bCompress = false;
+    // Compressed file to decompress to stdout instead of taking a snapshot (empty for none).
+    std::wstring sDecompressFile;
+    // Column to sort the process listing by, and whether largest first.
+    SortColumn_t sortColumn = SortColumn_t::None;
+    bool bSortDescending = false;
+    // Columnar snapshot file to read and list instead of taking a snapshot (empty for none).
+    std::wstring sReadSnapshotFile;
+    // Whether to report the startup latency breakdown to stderr.
+    bool bShowStartupTimes = false;
+    // Whether to report the output writer thread's queue statistics to stderr.
+    bool bShowWriterStats = false;
+};
+
+// Forward declaration for listing processes
+static int ListProcesses(const GuiObjectUseOptions_t& options, DWORD dwSessionID, ReplaceFileSink_t& fileSink, WriterThreadSink_t& writer);
+// Forward declaration for the -readsnapshot option
+static int ReadSnapshotFile(const wchar_t* szFilename, const GuiObjectUseOptions_t& options);
+
+/// <summary>
+/// Converts an interval between two QueryPerformanceCounter values to milliseconds.
+/// </summary>
+static double QpcIntervalMs(LONGLONG llInterval)
+{
+    static LARGE_INTEGER liFrequency = { 0 };
+    if (0 == liFrequency.QuadPart)
+        QueryPerformanceFrequency(&liFrequency);
+    return double(llInterval) * 1000.0 / double(liFrequency.QuadPart);
+}
+
+/// <summary>
+/// Converts an interval between two QueryPerformanceCounter values to milliseconds, formatted with microsecond precision.
+/// </summary>
+static std::wstring QpcIntervalToMs(LONGLONG llInterval)
+{
+    std::wstringstream str;
+    str << std::fixed << std::setprecision(3) << QpcIntervalMs(llInterval);
+    return str.str();
+}
+
+// Startup latency breakdown for the -startup option: time from process creation to wmain (loader, CRT,
+// and static initializers), and QueryPerformanceCounter values at wmain entry, at GuiObjectUse entry,
+// and when the first output was written to stdout (or to the -outfile file).
+static double st_dPreMainMs = -1;
+static LONGLONG st_llWmainEntry = 0, st_llGuiObjectUseEntry = 0, st_llFirstOutput = 0;
+
+/// <summary>
+/// Returns the current QueryPerformanceCounter value.
+/// </summary>
+static LONGLONG QpcNow()
+{
+    LARGE_INTEGER liNow;
+    QueryPerformanceCounter(&liNow);
+    return liNow.QuadPart;
+}
+
+/// <summary>
+/// Records the time of wmain entry and how long after process creation that was.
+/// </summary>
+static void RecordWmainEntry()
+{
+    st_llWmainEntry = QpcNow();
+    FILETIME ftCreation, ftExit, ftKernel, ftUser, ftNow;
+    if (GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser))
+    {
+        GetSystemTimePreciseAsFileTime(&ftNow);
+        ULARGE_INTEGER ulCreation, ulNow;
+        ulCreation.LowPart = ftCreation.dwLowDateTime;
+        ulCreation.HighPart = ftCreation.dwHighDateTime;
+        ulNow.LowPart = ftNow.dwLowDateTime;
+        ulNow.HighPart = ftNow.dwHighDateTime;
+        // FILETIME units are 100 nanoseconds
+        if (ulNow.QuadPart >= ulCreation.QuadPart)
+            st_dPreMainMs = double(ulNow.QuadPart - ulCreation.QuadPart) / 10000.0;
+    }
+}
+
+/// <summary>
+/// Records when the first output was written, if not already recorded.
+/// </summary>
+/// <param name="llWritten">Input: QueryPerformanceCounter value when it was written; 0 if nothing was</param>
+static void RecordFirstOutput(LONGLONG llWritten)
+{
+    if (0 == st_llFirstOutput)
+        st_llFirstOutput = llWritten;
+}
+
+/// <summary>
+/// Reports the startup latency breakdown to stderr (so as not to disturb the tab-delimited output).
+/// A process started by the session-0 agent is labeled as such: its startup doesn't include creating
+/// and starting a service, so it isn't comparable with a run that does.
+/// </summary>
+static void ReportStartupTimes()
+{
+    std::wstringstream strPreMain;
+    if (st_dPreMainMs >= 0)
+        strPreMain << std::fixed << std::setprecision(3) << st_dPreMainMs;
+    else
+        strPreMain << L"[unknown]";
+    std::wcerr
+        << (RunningAsAgentRequest() ? L"Startup (process started by the session-0 agent): " : L"Startup: ")
+        << L"process creation to wmain " << strPreMain.str()
+        << L" ms; wmain to GuiObjectUse " << QpcIntervalToMs(st_llGuiObjectUseEntry - st_llWmainEntry)
+        << L" ms; GuiObjectUse to first output ";
+    if (0 != st_llFirstOutput)
+        std::wcerr << QpcIntervalToMs(st_llFirstOutput - st_llGuiObjectUseEntry);
+    else
+        std::wcerr << L"[none]";
+    std::wcerr << L" ms." << std::endl;
+}
+
+/// <summary>
+/// Outputs the optional columns selected on the command line, each preceded by a tab.
+/// </summary>
+/// <param name="out">Output: row writer</param>
+/// <param name="options">Input: command-line options</param>
+/// <param name="pHandleCounts">Input: handle counts to output; nullptr for empty columns</param>
+/// <param name="pServices">Input: services whose metadata to output; nullptr for empty columns</param>
+/// <param name="pllReadInterval">Input: read time to output, as a QueryPerformanceCounter interval; nullptr for an empty column</param>
+static void OutputOptionalColumns(RowWriter_t& out, const GuiObjectUseOptions_t& options, const WinStaDesktopHandleCounts_t* pHandleCounts, const ServiceList_t* pServices, const LONGLONG* pllReadInterval)
+{
+    const wchar_t* const szTab = L"\t";
+    if (options.bShowHandleCounts)
+    {
+        if (pHandleCounts)
+        {
+            out
+                << szTab << pHandleCounts->dwWindowStationHandles
+                << szTab << pHandleCounts->dwDesktopHandles;
+        }
+        else
+        {
+            out << szTab << szTab;
+        }
+    }
+    if (options.bShowServiceInfo)
+    {
+        if (pServices)
+        {
+            out
+                << szTab << pServices->labels.sStartTypes
+                << szTab << pServices->labels.sProcessType
+                << szTab << pServices->labels.sSvchostGroups;
+        }
+        else
+        {
+            out << szTab << szTab << szTab;
+        }
+    }
+    if (options.bShowReadTime)
+    {
+        out << szTab;
+        if (pllReadInterval)
+            out.AppendFixed(QpcIntervalMs(*pllReadInterval), 3);
+    }
+}
+
+/// <summary>
+/// Outputs the tab-delimited column headers. (The other formats have no header line.)
+/// </summary>
+static void OutputHeaderRow(RowWriter_t& out, const GuiObjectUseOptions_t& options)
+{
+    if (OutputFormat_t::Tsv != options.format)
+        return;
+
+    const wchar_t* const szTab = L"\t";
+    out
+        << L"Session" << szTab
+        << L"PID" << szTab
+        << L"Process name" << szTab
+        << L"PPID" << szTab
+        << L"Services" << szTab
+        << L"User SID" << szTab
+        << L"User name" << szTab
+        << L"USER objects" << szTab
+        << L"USER objects peak" << szTab
+        << L"GDI objects" << szTab
+        << L"GDI objects peak";
+    if (options.bShowHandleCounts)
+    {
+        out
+            << szTab << L"WindowStation handles"
+            << szTab << L"Desktop handles";
+    }
+    if (options.bShowServiceInfo)
+    {
+        out
+            << szTab << L"Service start types"
+            << szTab << L"Service process type"
+            << szTab << L"Svchost group";
+    }
+    if (options.bShowReadTime)
+    {
+        out << szTab << L"Read time (ms)";
+    }
+    out.EndLine();
+}
+
+/// <summary>
+/// Outputs a JSON string, or null if the string is empty.
+/// </summary>
+static void OutputJsonStringOrNull(RowWriter_t& out, std::wstring_view sText)
+{
+    if (sText.empty())
+        out << "null";
+    else
+        out.AppendJsonString(sText);
+}
+
+/// <summary>
+/// Outputs one process' row: tab-delimited, as a JSON object on one line, into the columnar file, or as OpenMetrics samples.
+/// </summary>
+/// <param name="out">Output: row writer, for text formats</param>
+/// <param name="columns">Output: columnar file writer, for the columnar format</param>
+/// <param name="metrics">Output: OpenMetrics samples, for the OpenMetrics format</param>
+/// <param name="options">Input: command-line options</param>
+/// <param name="row">Input: the probed process</param>
+/// <param name="sUserName">Input: the name of the account executing the process</param>
+/// <param name="llSnapshotStart">Input: QueryPerformanceCounter value at the start of the snapshot</param>
+static void OutputProcessRow(RowWriter_t& out, SnapshotColumnWriter_t& columns, OpenMetricsSnapshot_t& metrics, const GuiObjectUseOptions_t& options, const ProcessRow_t& row, const std::wstring& sUserName, LONGLONG llSnapshotStart)
+{
+    if (OutputFormat_t::OpenMetrics == options.format)
+    {
+        // Processes that couldn't be opened have no samples.
+        if (row.bOpened)
+        {
+            OpenMetricsProcess_t process;
+            process.session = row.dwSessionID;
+            process.pid = row.dwPID;
+            process.processName = row.sProcessName;
+            process.userName = sUserName;
+            // Service names are each followed by a space.
+            process.services = row.services.labels.sNames;
+            while (!process.services.empty() && L' ' == process.services.back())
+                process.services.remove_suffix(1);
+            process.userObjects = row.counters.dwUserObjects;
+            process.userObjectsPeak = row.counters.dwUserObjectsPeak;
+            process.gdiObjects = row.counters.dwGdiObjects;
+            process.gdiObjectsPeak = row.counters.dwGdiObjectsPeak;
+            metrics.AddProcess(process);
+        }
+        return;
+    }
+
+    wchar_t szSid[cchMaxSidString];
+    const size_t cchSid = row.sid.toSidString(szSid, cchMaxSidString);
+    const LONGLONG llReadInterval = row.counters.llReadTime - llSnapshotStart;
+
+    if (OutputFormat_t::Columnar == options.format)
+    {
+        SnapshotColumnRow_t columnRow;
+        columnRow.session = row.dwSessionID;
+        columnRow.pid = row.dwPID;
+        columnRow.ppid = DWORD(row.ppid);
+        columnRow.processName = row.sProcessName;
+        columnRow.services = row.services.labels.sNames;
+        columnRow.userSid = std::wstring_view(szSid, cchSid);
+        columnRow.userName = sUserName;
+        if (row.bOpened)
+        {
+            columnRow.flags = SnapshotRowOpened;
+            columnRow.userObjects = row.counters.dwUserObjects;
+            columnRow.userObjectsPeak = row.counters.dwUserObjectsPeak;
+            columnRow.gdiObjects = row.counters.dwGdiObjects;
+            columnRow.gdiObjectsPeak = row.counters.dwGdiObjectsPeak;
+            const double dReadTimeUs = QpcIntervalMs(llReadInterval) * 1000.0;
+            columnRow.readTimeUs = (dReadTimeUs <= 0) ? 0 : ((dReadTimeUs >= 4294967295.0) ? 0xFFFFFFFF : uint32_t(dReadTimeUs));
+        }
+        else
+        {
+            columnRow.openError = row.dwOpenError;
+        }
+        columns.AddRow(columnRow);
+        return;
+    }
+
+    if (OutputFormat_t::Ndjson == options.format)
+    {
+        out << "{\"type\":\"process\",\"session\":" << row.dwSessionID << ",\"pid\":" << row.dwPID << ",\"name\":";
+        out.AppendJsonString(row.sProcessName);
+        if (row.bOpened)
+        {
+            if (0 != row.ppid)
+            {
+                out << ",\"ppid\":" << row.ppid;
+            }
+            else
+            {
+                out << ",\"ppid\":null,\"ppidError\":";
+                out.AppendJsonString(row.sPPIDError);
+            }
+        }
+        out << ",\"services\":[";
+        for (ServiceList_t::const_iterator iterSvc = row.services.begin(); iterSvc != row.services.end(); ++iterSvc)
+        {
+            out << ((iterSvc == row.services.begin()) ? "{\"name\":" : ",{\"name\":");
+            out.AppendJsonString(iterSvc->sServiceName);
+            if (options.bShowServiceInfo)
+            {
+                out << ",\"startType\":";
+                out.AppendJsonString(ServiceStartTypeName(iterSvc->dwStartType, iterSvc->bDelayedAutoStart));
+                out << ",\"svchostGroup\":";
+                OutputJsonStringOrNull(out, iterSvc->sSvchostGroup);
+            }
+            out << "}";
+        }
+        out << "],\"userSid\":";
+        out.AppendJsonString(std::wstring_view(szSid, cchSid));
+        out << ",\"userName\":";
+        out.AppendJsonString(sUserName);
+        if (row.bOpened)
+        {
+            out
+                << ",\"userObjects\":" << row.counters.dwUserObjects
+                << ",\"userObjectsPeak\":" << row.counters.dwUserObjectsPeak
+                << ",\"gdiObjects\":" << row.counters.dwGdiObjects
+                << ",\"gdiObjectsPeak\":" << row.counters.dwGdiObjectsPeak;
+        }
+        else
+        {
+            out << ",\"openError\":" << row.dwOpenError << ",\"openErrorMessage\":";
+            out.AppendJsonString(SysErrorMessage(row.dwOpenError));
+        }
+        if (options.bShowHandleCounts)
+        {
+            out
+                << ",\"windowStationHandles\":" << row.handleCounts.dwWindowStationHandles
+                << ",\"desktopHandles\":" << row.handleCounts.dwDesktopHandles;
+        }
+        if (options.bShowServiceInfo)
+        {
+            out << ",\"serviceProcessType\":";
+            OutputJsonStringOrNull(out, row.services.labels.sProcessType);
+        }
+        if (options.bShowReadTime && row.bOpened)
+        {
+            out << ",\"readTimeMs\":";
+            out.AppendFixed(QpcIntervalMs(llReadInterval), 3);
+        }
+        out << "}";
+        out.EndLine();
+        return;
+    }
+
+    const wchar_t* const szTab = L"\t";
+    out
+        << row.dwSessionID << szTab
+        << row.dwPID << szTab
+        << row.sProcessName << szTab;
+    if (row.bOpened)
+    {
+        if (0 != row.ppid)
+            out << row.ppid << szTab;
+        else
+            out << row.sPPIDError << szTab;
+        out
+            << row.services.labels.sNames << szTab
+            << std::wstring_view(szSid, cchSid) << szTab
+            << sUserName << szTab
+            << row.counters.dwUserObjects << szTab
+            << row.counters.dwUserObjectsPeak << szTab
+            << row.counters.dwGdiObjects << szTab
+            << row.counters.dwGdiObjectsPeak;
+        OutputOptionalColumns(out, options, &row.handleCounts, &row.services, &llReadInterval);
+    }
+    else
+    {
+        const std::wstring sErrorMessage = SysErrorMessage(row.dwOpenError);
+        out
+            << szTab
+            << row.services.labels.sNames << szTab
+            << std::wstring_view(szSid, cchSid) << szTab
+            << sUserName << szTab
+            << L"Error " << row.dwOpenError << szTab
+            << sErrorMessage << szTab
+            << L"Error " << row.dwOpenError << szTab
+            << sErrorMessage;
+        OutputOptionalColumns(out, options, &row.handleCounts, &row.services, nullptr);
+    }
+    out.EndLine();
+}
+
+/// <summary>
+/// A row of counters summarizing the snapshot.
+/// </summary>
+struct SummaryRow_t
+{
+    enum Kind_t
+    {
+        // Sums over the enumerated processes
+        Total,
+        // Session-wide usage (GR_GLOBAL)
+        Global,
+        // Sums of the absolute changes in the first listed processes' counters
+        Drift
+    };
+    Kind_t kind = Total;
+    // DRIFT: number of processes re-read, and number of listed processes that were to be re-read
+    size_t nReread = 0, nDriftRows = 0;
+    ULONGLONG ullUserObjects = 0, ullUserObjectsPeak = 0, ullGdiObjects = 0, ullGdiObjectsPeak = 0;
+    // Reported in the read time column, as a QueryPerformanceCounter interval
+    LONGLONG llReadInterval = 0;
+};
+
+/// <summary>
+/// Outputs a summary row: tab-delimited, as a JSON object on one line, into the columnar file's header, or as OpenMetrics samples.
+/// </summary>
+static void OutputSummaryRow(RowWriter_t& out, SnapshotColumnWriter_t& columns, OpenMetricsSnapshot_t& metrics, const GuiObjectUseOptions_t& options, DWORD dwSessionID, const SummaryRow_t& summary)
+{
+    const bool bDrift = (SummaryRow_t::Drift == summary.kind);
+
+    if (OutputFormat_t::OpenMetrics == options.format)
+    {
+        const OpenMetricsScope_t scope = (SummaryRow_t::Total == summary.kind) ? OpenMetricsScope_t::Total : (bDrift ? OpenMetricsScope_t::Drift : OpenMetricsScope_t::Global);
+        metrics.SetSessionCounters(scope, summary.ullUserObjects, summary.ullUserObjectsPeak, summary.ullGdiObjects, summary.ullGdiObjectsPeak);
+        return;
+    }
+
+    if (OutputFormat_t::Columnar == options.format)
+    {
+        SnapshotFileHeader_t& header = columns.Header();
+        uint64_t* pCounters = (SummaryRow_t::Total == summary.kind) ? header.totals : (bDrift ? header.drift : header.global);
+        pCounters[0] = summary.ullUserObjects;
+        pCounters[1] = summary.ullUserObjectsPeak;
+        pCounters[2] = summary.ullGdiObjects;
+        pCounters[3] = summary.ullGdiObjectsPeak;
+        if (bDrift)
+        {
+            header.driftReread = uint32_t(summary.nReread);
+            header.driftRows = uint32_t(summary.nDriftRows);
+        }
+        return;
+    }
+
+    if (OutputFormat_t::Ndjson == options.format)
+    {
+        out
+            << ((SummaryRow_t::Total == summary.kind) ? "{\"type\":\"total\"" : (bDrift ? "{\"type\":\"drift\"" : "{\"type\":\"global\""))
+            << ",\"session\":" << dwSessionID;
+        if (bDrift)
+            out << ",\"reread\":" << summary.nReread << ",\"driftRows\":" << summary.nDriftRows;
+        out
+            << ",\"userObjects\":" << summary.ullUserObjects
+            << ",\"userObjectsPeak\":" << summary.ullUserObjectsPeak
+            << ",\"gdiObjects\":" << summary.ullGdiObjects
+            << ",\"gdiObjectsPeak\":" << summary.ullGdiObjectsPeak;
+        if (options.bShowReadTime)
+        {
+            out << ",\"readTimeMs\":";
+            out.AppendFixed(QpcIntervalMs(summary.llReadInterval), 3);
+        }
+        out << "}";
+        out.EndLine();
+        return;
+    }
+
+    const wchar_t* const szTab = L"\t";
+    out << dwSessionID << szTab;
+    switch (summary.kind)
+    {
+    case SummaryRow_t::Total:
+        out << L"TOTAL" << szTab << L"[enumerated processes]" << szTab;
+        break;
+    case SummaryRow_t::Global:
+        out << L"GR_GLOBAL" << szTab << L"[Session-wide usage]" << szTab;
+        break;
+    case SummaryRow_t::Drift:
+        out << L"DRIFT" << szTab << L"[" << summary.nReread << L" of first " << summary.nDriftRows << L" processes re-read]" << szTab;
+        break;
+    }
+    out
+        << szTab
+        << szTab
+        << szTab
+        << szTab
+        << summary.ullUserObjects << szTab
+        << summary.ullUserObjectsPeak << szTab
+        << summary.ullGdiObjects << szTab
+        << summary.ullGdiObjectsPeak;
+    OutputOptionalColumns(out, options, nullptr, nullptr, &summary.llReadInterval);
+    out.EndLine();
+}
 
 
 /// <summary>
@@ -47,6 +715,8 @@ int GuiObjectUse(int argc, wchar_t** argv);
 /// </summary>
 int wmain(int argc, wchar_t** argv)
 {
+    RecordWmainEntry();
+
     //TODO: consider checking an environment variable for enabling dbgOut destinations.
     dbgOut.WriteToDebugStream(false);
 
@@ -62,7 +732,6 @@ int wmain(int argc, wchar_t** argv)
 
 
 //TODO: Output in order so that child processes are listed right after their parent.
-//TODO: Offer an option to show the desktop sizes in the current session.
 
 /// <summary>
 /// Lists processes in session 0 and the numbers of USER and GDI
@@ -73,17 +742,172 @@ int wmain(int argc, wchar_t** argv)
 /// <returns>0 if successful, negative value otherwise</returns>
 int GuiObjectUse(int argc, wchar_t** argv)
 {
+    st_llGuiObjectUseEntry = QpcNow();
     DbgOutArgcArgv(L"GuiObjectUse", argc, argv);
 
-    // Whether to output information about all processes or just those with non-zero results.
-    bool bShowAll = false;
+    GuiObjectUseOptions_t options;
 
     // Process command-line arguments
     int ixArg = 0;
     while (ixArg < argc)
     {
         if (0 == wcscmp(L"-a", argv[ixArg]))
-            bShowAll = true;
+            options.bShowAll = true;
+        else if (0 == wcscmp(L"-handles", argv[ixArg]))
+            options.bShowHandleCounts = true;
+        else if (0 == wcscmp(L"-svcinfo", argv[ixArg]))
+            options.bShowServiceInfo = true;
+        else if (0 == wcscmp(L"-ts", argv[ixArg]))
+            options.bShowReadTime = true;
+        else if (0 == wcscmp(L"-drift", argv[ixArg]))
+        {
+            if (++ixArg >= argc || 1 != swscanf_s(argv[ixArg], L"%lu", &options.dwDriftRows))
+            {
+                std::wcerr << L"Missing or invalid arg for -drift" << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == wcscmp(L"-budget", argv[ixArg]))
+        {
+            DWORD dwBudgetSeconds = 0;
+            if (++ixArg >= argc || 1 != swscanf_s(argv[ixArg], L"%lu", &dwBudgetSeconds) || 0 == dwBudgetSeconds)
+            {
+                std::wcerr << L"Missing or invalid arg for -budget" << std::endl;
+                return -1;
+            }
+            // Prevent arithmetic overflow converting seconds to milliseconds.
+            options.dwBudgetMilliseconds = (dwBudgetSeconds >= 4294967) ? INFINITE : (dwBudgetSeconds * 1000);
+        }
+        else if (0 == wcscmp(L"-namewait", argv[ixArg]))
+        {
+            DWORD dwNameWaitSeconds = 0;
+            if (++ixArg >= argc || 1 != swscanf_s(argv[ixArg], L"%lu", &dwNameWaitSeconds))
+            {
+                std::wcerr << L"Missing or invalid arg for -namewait" << std::endl;
+                return -1;
+            }
+            // Prevent arithmetic overflow converting seconds to milliseconds.
+            options.dwNameWaitMilliseconds = (dwNameWaitSeconds >= 4294967) ? INFINITE : (dwNameWaitSeconds * 1000);
+        }
+        else if (0 == wcscmp(L"-gentle", argv[ixArg]))
+        {
+            options.bGentle = true;
+            options.dCpuBudgetPercent = 2.0;
+            // Optional percentage: use the next arg if it's a number
+            double dPercent = 0;
+            if (ixArg + 1 < argc && L'-' != argv[ixArg + 1][0] && 1 == swscanf_s(argv[ixArg + 1], L"%lf", &dPercent))
+            {
+                if (dPercent <= 0 || dPercent > 100)
+                {
+                    std::wcerr << L"Invalid percentage for -gentle" << std::endl;
+                    return -1;
+                }
+                options.dCpuBudgetPercent = dPercent;
+                ++ixArg;
+            }
+        }
+        else if (0 == wcscmp(L"-desktops", argv[ixArg]))
+            options.bListDesktops = true;
+        else if (0 == wcscmp(L"-format", argv[ixArg]))
+        {
+            if (++ixArg >= argc)
+            {
+                std::wcerr << L"Missing arg for -format" << std::endl;
+                return -1;
+            }
+            if (0 == wcscmp(L"tsv", argv[ixArg]))
+                options.format = OutputFormat_t::Tsv;
+            else if (0 == wcscmp(L"ndjson", argv[ixArg]))
+                options.format = OutputFormat_t::Ndjson;
+            else if (0 == wcscmp(L"columnar", argv[ixArg]))
+                options.format = OutputFormat_t::Columnar;
+            else if (0 == wcscmp(L"openmetrics", argv[ixArg]))
+                options.format = OutputFormat_t::OpenMetrics;
+            else
+            {
+                std::wcerr << L"Invalid arg for -format: " << argv[ixArg] << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == wcscmp(L"-outfile", argv[ixArg]))
+        {
+            if (++ixArg >= argc)
+            {
+                std::wcerr << L"Missing arg for -outfile" << std::endl;
+                return -1;
+            }
+            options.sOutputFile = argv[ixArg];
+        }
+        else if (0 == wcscmp(L"-watch", argv[ixArg]))
+        {
+            DWORD dwWatchSeconds = 0;
+            if (++ixArg >= argc || 1 != swscanf_s(argv[ixArg], L"%lu", &dwWatchSeconds) || 0 == dwWatchSeconds)
+            {
+                std::wcerr << L"Missing or invalid arg for -watch" << std::endl;
+                return -1;
+            }
+            // Prevent arithmetic overflow converting seconds to milliseconds.
+            options.dwWatchMilliseconds = ((dwWatchSeconds >= 4294967) ? DWORD(4294967) : dwWatchSeconds) * 1000;
+        }
+        else if (0 == wcscmp(L"-compress", argv[ixArg]))
+            options.bCompress = true;
+        else if (0 == wcscmp(L"-decompress", argv[ixArg]))
+        {
+            if (++ixArg >= argc)
+            {
+                std::wcerr << L"Missing arg for -decompress" << std::endl;
+                return -1;
+            }
+            options.sDecompressFile = argv[ixArg];
+        }
+        else if (0 == wcscmp(L"-sort", argv[ixArg]))
+        {
+            if (++ixArg >= argc)
+            {
+                std::wcerr << L"Missing arg for -sort" << std::endl;
+                return -1;
+            }
+            // column[:asc|:desc]
+            std::wstring sColumn = argv[ixArg];
+            const size_t ixColon = sColumn.find(L':');
+            options.bSortDescending = false;
+            if (std::wstring::npos != ixColon)
+            {
+                const std::wstring sDirection = sColumn.substr(ixColon + 1);
+                sColumn.resize(ixColon);
+                if (0 == _wcsicmp(L"desc", sDirection.c_str()))
+                    options.bSortDescending = true;
+                else if (0 != _wcsicmp(L"asc", sDirection.c_str()))
+                {
+                    std::wcerr << L"Invalid sort direction for -sort: " << sDirection << std::endl;
+                    return -1;
+                }
+            }
+            options.sortColumn = SortColumn_t::None;
+            for (size_t ixName = 0; ixName < sizeof(sortColumnNames) / sizeof(sortColumnNames[0]); ++ixName)
+            {
+                if (0 == _wcsicmp(sortColumnNames[ixName].szName, sColumn.c_str()))
+                    options.sortColumn = sortColumnNames[ixName].column;
+            }
+            if (SortColumn_t::None == options.sortColumn)
+            {
+                std::wcerr << L"Invalid column for -sort: " << sColumn << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == wcscmp(L"-readsnapshot", argv[ixArg]))
+        {
+            if (++ixArg >= argc)
+            {
+                std::wcerr << L"Missing arg for -readsnapshot" << std::endl;
+                return -1;
+            }
+            options.sReadSnapshotFile = argv[ixArg];
+        }
+        else if (0 == wcscmp(L"-startup", argv[ixArg]))
+            options.bShowStartupTimes = true;
+        else if (0 == wcscmp(L"-writerstats", argv[ixArg]))
+            options.bShowWriterStats = true;
         else
         {
             std::wcerr << L"Unrecognized command line option: " << argv[ixArg] << std::endl;
@@ -92,6 +916,37 @@ int GuiObjectUse(int argc, wchar_t** argv)
         ++ixArg;
     }
 
+    // Reading a snapshot file or decompressing a file doesn't involve the session.
+    if (!options.sReadSnapshotFile.empty() || !options.sDecompressFile.empty())
+    {
+        int retval = options.sReadSnapshotFile.empty() ? DecompressFile(options.sDecompressFile.c_str()) : ReadSnapshotFile(options.sReadSnapshotFile.c_str(), options);
+        if (options.bShowStartupTimes)
+        {
+            ReportStartupTimes();
+        }
+        return retval;
+    }
+
+    // A columnar file holds one snapshot, so repeated snapshots can't share a stream.
+    if (OutputFormat_t::Columnar == options.format && 0 != options.dwWatchMilliseconds && options.sOutputFile.empty())
+    {
+        std::wcerr << L"-format columnar with -watch requires -outfile" << std::endl;
+        return -1;
+    }
+    // The columnar format has no columns for handle counts or service metadata; don't silently drop them.
+    if (OutputFormat_t::Columnar == options.format && (options.bShowHandleCounts || options.bShowServiceInfo))
+    {
+        std::wcerr << L"-format columnar doesn't record -handles or -svcinfo" << std::endl;
+        return -1;
+    }
+
+    // Handle counts are collected only with -handles.
+    if ((SortColumn_t::WindowStationHandles == options.sortColumn || SortColumn_t::DesktopHandles == options.sortColumn) && !options.bShowHandleCounts)
+    {
+        std::wcerr << L"Sorting by handle counts requires -handles" << std::endl;
+        return -1;
+    }
+
     // Determine this process' WTS session ID.
     std::wstring sErrorInfo;
     DWORD dwSessionID;
@@ -101,12 +956,220 @@ int GuiObjectUse(int argc, wchar_t** argv)
         return -1;
     }
 
-    DWORD dwUserObjects, dwUserObjectsPeak, dwGdiObjects, dwGdiObjectsPeak;
+    // Background mode lowers this process' CPU, I/O, and memory priorities.
+    // (It fails with ERROR_PROCESS_MODE_ALREADY_BACKGROUND if already in background mode.)
+    bool bBackgroundMode = false;
+    if (options.bGentle)
+    {
+        bBackgroundMode = (0 != SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN));
+        if (!bBackgroundMode && ERROR_PROCESS_MODE_ALREADY_BACKGROUND != GetLastError())
+        {
+            std::wcerr << L"Unable to enter background processing mode: " << SysErrorMessageWithCode() << std::endl;
+        }
+    }
+
+    int retval = 0;
+    if (options.bListDesktops)
+    {
+        retval = ListDesktops(dwSessionID);
+    }
+    else
+    {
+        // Output goes to stdout (if running as a service, stdout is a pipe back to the
+        // interactive session) or to the -outfile file, through a writer thread, so that
+        // a slow reader doesn't hold up collection. Snapshots written to stdout are still
+        // being written while the next snapshot is collected.
+        StdStreamSink_t stdoutSink(stdout, OutputFormat_t::Columnar == options.format || options.bCompress);
+        ReplaceFileSink_t fileSink;
+        WriterThreadSink_t writer(options.sOutputFile.empty() ? static_cast<ByteSink_t&>(stdoutSink) : static_cast<ByteSink_t&>(fileSink));
+
+        // In watch mode, take a snapshot at each interval until interrupted. A failed snapshot
+        // (reported to stderr) doesn't end watch mode, but a failure writing to stdout (e.g., the
+        // reader went away) does; it's reported by Finish below.
+        for (;;)
+        {
+            const ULONGLONG ullSnapshotStart = GetTickCount64();
+            retval = ListProcesses(options, dwSessionID, fileSink, writer);
+            if (0 == options.dwWatchMilliseconds || writer.Failed())
+                break;
+            const ULONGLONG ullElapsed = GetTickCount64() - ullSnapshotStart;
+            if (ullElapsed < options.dwWatchMilliseconds)
+                Sleep(DWORD(options.dwWatchMilliseconds - ullElapsed));
+        }
+
+        if (!writer.Finish())
+        {
+            std::wcerr << L"Unable to write the output" << std::endl;
+            retval = -4;
+        }
+        // The first output is when the writer thread first wrote to stdout or the file, not when it was formatted.
+        RecordFirstOutput(writer.Stats().llFirstWriteQpc);
+        // Backpressure: how often, and for how long, output was held up waiting for the writer thread.
+        if (options.bShowWriterStats)
+        {
+            const WriterQueueStats_t stats = writer.Stats();
+            std::wcerr
+                << L"Writer thread: " << stats.cbWritten << L" bytes written in " << stats.nChunks << L" chunks, taking "
+                << stats.ullWriteUs / 1000 << L" ms; at most " << stats.nMaxQueued << L" of " << stats.nCapacity
+                << L" chunks queued; output waited for the writer " << stats.nProducerWaits << L" times, for "
+                << stats.ullProducerWaitUs / 1000 << L" ms in total." << std::endl;
+        }
+    }
+
+    if (bBackgroundMode)
+    {
+        SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_END);
+    }
+
+    if (options.bShowStartupTimes)
+    {
+        ReportStartupTimes();
+    }
+    return retval;
+}
+
+
+/// <summary>
+/// Sorts row indexes by the -sort column, then by PID, so that the order doesn't depend on the
+/// enumeration order and snapshots can be compared line by line. (With no -sort column, leaves them as they are.)
+/// </summary>
+/// <param name="options">Input: command-line options</param>
+/// <param name="pidKeys">Input: each row's PID</param>
+/// <param name="columnKeys">Input: each row's -sort column value, or rank if it's a string column</param>
+/// <param name="order">Input/output: row indexes, in enumeration order</param>
+static void SortRowOrder(const GuiObjectUseOptions_t& options, const std::vector<uint64_t>& pidKeys, const std::vector<uint64_t>& columnKeys, std::vector<uint32_t>& order)
+{
+    if (SortColumn_t::None == options.sortColumn)
+        return;
+    // Least significant key first; each sort is stable.
+    StableRadixSort(order, pidKeys, options.bSortDescending && SortColumn_t::Pid == options.sortColumn);
+    if (SortColumn_t::Pid != options.sortColumn)
+        StableRadixSort(order, columnKeys, options.bSortDescending);
+}
+
+/// <summary>
+/// Whether a probed process is listed in the output: if any of its numbers are non-zero, or with the
+/// "show all" option (which also lists processes that couldn't be opened).
+/// </summary>
+static bool IsRowListed(const GuiObjectUseOptions_t& options, const ProcessRow_t& row)
+{
+    if (options.bShowAll)
+        return true;
+    return row.bOpened && (row.counters.dwUserObjects > 0 || row.counters.dwGdiObjects > 0 || row.counters.dwUserObjectsPeak > 0 || row.counters.dwGdiObjectsPeak > 0);
+}
+
+/// <summary>
+/// Determines the order in which to list the probed processes: enumeration order, or by the -sort column.
+/// With a -sort column, only the rows that are listed are ranked; the others follow them in enumeration
+/// order (they're visited only for the totals).
+/// </summary>
+/// <param name="options">Input: command-line options</param>
+/// <param name="rows">Input: the probed processes</param>
+/// <param name="accountNames">Input: account names, if sorting by user name</param>
+/// <param name="order">Output: indexes into rows, in listing order</param>
+static void GetRowOrder(const GuiObjectUseOptions_t& options, const std::vector<ProcessRow_t>& rows, AccountNamePrefetch_t& accountNames, std::vector<uint32_t>& order)
+{
+    order.clear();
+    order.reserve(rows.size());
+    if (SortColumn_t::None == options.sortColumn)
+    {
+        for (size_t ixRow = 0; ixRow < rows.size(); ++ixRow)
+            order.push_back(uint32_t(ixRow));
+        return;
+    }
+
+    // Keys are indexed by row; rows that aren't listed keep zero keys and empty strings, and aren't sorted.
+    std::vector<uint64_t> pidKeys(rows.size()), columnKeys(rows.size());
+    const bool bStringColumn = SortColumn_t::Name == options.sortColumn || SortColumn_t::Services == options.sortColumn ||
+        SortColumn_t::UserName == options.sortColumn || SortColumn_t::UserSid == options.sortColumn;
+    // String columns are ranked; the strings are referenced in place, except SIDs, which are formatted here.
+    std::vector<std::wstring_view> strings;
+    std::vector<std::wstring> sids;
+    std::vector<uint32_t> unlisted;
+    for (size_t ixRow = 0; ixRow < rows.size(); ++ixRow)
+    {
+        const ProcessRow_t& row = rows[ixRow];
+        if (!IsRowListed(options, row))
+        {
+            unlisted.push_back(uint32_t(ixRow));
+            if (SortColumn_t::UserSid == options.sortColumn)
+                sids.push_back(std::wstring());
+            else if (bStringColumn)
+                strings.push_back(std::wstring_view());
+            continue;
+        }
+        order.push_back(uint32_t(ixRow));
+        pidKeys[ixRow] = row.dwPID;
+        switch (options.sortColumn)
+        {
+        case SortColumn_t::Session: columnKeys[ixRow] = row.dwSessionID; break;
+        case SortColumn_t::Ppid: columnKeys[ixRow] = row.ppid; break;
+        case SortColumn_t::UserObjects: columnKeys[ixRow] = row.counters.dwUserObjects; break;
+        case SortColumn_t::UserObjectsPeak: columnKeys[ixRow] = row.counters.dwUserObjectsPeak; break;
+        case SortColumn_t::GdiObjects: columnKeys[ixRow] = row.counters.dwGdiObjects; break;
+        case SortColumn_t::GdiObjectsPeak: columnKeys[ixRow] = row.counters.dwGdiObjectsPeak; break;
+        case SortColumn_t::ReadTime: columnKeys[ixRow] = uint64_t(row.counters.llReadTime); break;
+        case SortColumn_t::WindowStationHandles: columnKeys[ixRow] = row.handleCounts.dwWindowStationHandles; break;
+        case SortColumn_t::DesktopHandles: columnKeys[ixRow] = row.handleCounts.dwDesktopHandles; break;
+        case SortColumn_t::Name: strings.push_back(row.sProcessName); break;
+        case SortColumn_t::Services: strings.push_back(row.services.labels.sNames); break;
+        // (The name is looked up again for output; count an unresolved name only then.)
+        case SortColumn_t::UserName: strings.push_back(accountNames.GetName(row.sid, false)); break;
+        case SortColumn_t::UserSid: sids.push_back(row.sid.toSidString()); break;
+        default: break;
+        }
+    }
+    if (SortColumn_t::UserSid == options.sortColumn)
+        strings.assign(sids.begin(), sids.end());
+    if (bStringColumn)
+        RankStrings(strings, columnKeys);
+
+    SortRowOrder(options, pidKeys, columnKeys, order);
+    order.insert(order.end(), unlisted.begin(), unlisted.end());
+}
+
+/// <summary>
+/// Lists processes in the session and the numbers of USER and GDI
+/// resources they've used, as tab-delimited text with headers.
+/// </summary>
+/// <param name="options">Command-line options</param>
+/// <param name="dwSessionID">The current process' session ID</param>
+/// <param name="fileSink">The -outfile file, opened and committed for each snapshot</param>
+/// <param name="writer">Writer thread that writes the output to stdout or to fileSink</param>
+/// <returns>0 if successful, negative value otherwise</returns>
+static int ListProcesses(const GuiObjectUseOptions_t& options, DWORD dwSessionID, ReplaceFileSink_t& fileSink, WriterThreadSink_t& writer)
+{
+    const ULONGLONG ullSnapshotStartTicks = GetTickCount64();
+    // Wall-clock start of the snapshot, recorded in the columnar format
+    FILETIME ftSnapshotStart;
+    GetSystemTimeAsFileTime(&ftSnapshotStart);
+    const ULONGLONG ullSnapshotStartTime = (ULONGLONG(ftSnapshotStart.dwHighDateTime) << 32) | ftSnapshotStart.dwLowDateTime;
+
+    // The service enumeration doesn't depend on the process enumeration; start it now so that it overlaps.
+    // Only repeated snapshots keep the cache up to date through service change notifications.
+    if (options.bShowServiceInfo)
+        EnableServiceConfigurationMetadata();
+    if (0 != options.dwWatchMilliseconds)
+        EnableServiceChangeNotifications();
+    StartServiceLookupPrefetch();
+
+    std::wstring sErrorInfo;
+    GuiCounters_t counters;
     DWORD dwTotalUserObjects = 0, dwTotalUserObjectsPeak = 0, dwTotalGdiObjects = 0, dwTotalGdiObjectsPeak = 0;
-    DWORD dwLevel = 0;
+    // Level 1 includes each process' handle count, used to prioritize probing.
+    DWORD dwLevel = 1;
+
+    // Read timestamps are reported relative to the start of the snapshot.
+    // The collection span is from the first to the last process whose counters were read.
+    LARGE_INTEGER liSnapshotStart;
+    QueryPerformanceCounter(&liSnapshotStart);
+    LONGLONG llFirstRead = 0, llLastRead = 0;
+
+    // PIDs and counters of the first dwDriftRows listed processes, to re-read at the end.
+    std::vector<std::pair<DWORD, GuiCounters_t>> driftBaseline;
 
     // Get information about all processes in the session.
-    WTS_PROCESS_INFOW* pProcessesInfo = nullptr;
+    WTS_PROCESS_INFO_EXW* pProcessesInfo = nullptr;
     DWORD dwProcessCount = 0;
 #pragma warning(push)
 #pragma warning (disable: 6387) // disable false positive about invalid parameter
@@ -119,142 +1182,564 @@ int GuiObjectUse(int argc, wchar_t** argv)
         return -2;
     }
 
-    const wchar_t* const szTab = L"\t";
+    // One system-wide handle table snapshot provides the WindowStation and Desktop handle counts for all processes.
+    HandleCountsByPID_t handleCounts;
+    if (options.bShowHandleCounts)
+    {
+        if (!GetWinStaDesktopHandleCounts(handleCounts, sErrorInfo))
+        {
+            std::wcerr << L"Unable to count WindowStation and Desktop handles: " << sErrorInfo << std::endl;
+        }
+    }
 
-    // Output tab-delimited headers to stdout. (If running as a service, stdout will be redirected.) 
-    std::wcout 
-        << L"Session" << szTab
-        << L"PID" << szTab
-        << L"Process name" << szTab
-        << L"PPID" << szTab
-        << L"Services" << szTab
-        << L"User SID" << szTab
-        << L"User name" << szTab
-        << L"USER objects" << szTab
-        << L"USER objects peak" << szTab
-        << L"GDI objects" << szTab
-        << L"GDI objects peak" << std::endl;
-    // Iterate through all of the processes in this session.
+    // Copy what's needed from the process enumeration, so that it doesn't need to outlive a probing
+    // thread that might be abandoned.
+    std::vector<ProcessRow_t> processes;
+    processes.reserve(dwProcessCount);
     for (size_t ix = 0; ix < dwProcessCount; ++ix)
     {
-        WTS_PROCESS_INFOW& wtsCurrProcess = pProcessesInfo[ix];
+        const WTS_PROCESS_INFO_EXW& wtsCurrProcess = pProcessesInfo[ix];
         // Always skip PID 0: not a real process.
         if (0 != wtsCurrProcess.ProcessId)
         {
-            // Identify any services running in that process
-            const ServiceList_t* pServiceList = nullptr;
-            std::wstring sServices;
-            if (LookupServicesByPID((ULONG_PTR)wtsCurrProcess.ProcessId, &pServiceList))
+            ProcessRow_t row;
+            row.ixEnum = ix;
+            row.dwSessionID = wtsCurrProcess.SessionId;
+            row.dwPID = wtsCurrProcess.ProcessId;
+            row.sProcessName = wtsCurrProcess.pProcessName;
+            // Get the SID of the account executing the process.
+            row.sid = CSid(wtsCurrProcess.pUserSid);
+            row.dwHandleCountHint = wtsCurrProcess.HandleCount;
+            // WindowStation and Desktop handle counts from the handle table snapshot (zero if none found)
+            HandleCountsByPID_t::const_iterator iterCounts = handleCounts.find(wtsCurrProcess.ProcessId);
+            if (iterCounts != handleCounts.end())
+                row.handleCounts = iterCounts->second;
+            processes.push_back(row);
+        }
+    }
+
+    WTSFreeMemoryExW(WTSTypeProcessInfoLevel1, pProcessesInfo, dwProcessCount);
+
+    // Start resolving account names now that the SIDs are known, so that it overlaps with probing.
+    // Names that need network lookups are resolved in the background, and waited for only until the deadline.
+    AccountNamePrefetch_t accountNames;
+    {
+        std::vector<CSid> sids;
+        sids.reserve(processes.size());
+        for (std::vector<ProcessRow_t>::const_iterator iterProc = processes.begin(); iterProc != processes.end(); ++iterProc)
+            sids.push_back(iterProc->sid);
+        accountNames.Start(sids, (INFINITE == options.dwNameWaitMilliseconds) ? 0 : ullSnapshotStartTicks + options.dwNameWaitMilliseconds);
+    }
+
+    // Probe the processes, within the time budget if one was specified.
+    ProbeResults_t probeResults;
+    ProbeProcesses(processes, options.dwBudgetMilliseconds, options.dCpuBudgetPercent, probeResults);
+
+    // Output to stdout or to the -outfile file, through the writer thread: tab-delimited with headers,
+    // or NDJSON. Rows are formatted as UTF-8 and handed to the writer thread a chunk at a time, so
+    // formatting continues while earlier rows are written. The columnar and OpenMetrics formats are
+    // collected in memory and written in one pass at the end. With -compress, the output is compressed
+    // on a background thread on its way to the writer thread.
+    const bool bToFile = !options.sOutputFile.empty();
+    if (bToFile && !fileSink.Open(options.sOutputFile.c_str(), sErrorInfo))
+    {
+        std::wcerr << sErrorInfo << std::endl;
+        return -4;
+    }
+    std::unique_ptr<CompressingSink_t> pCompressingSink;
+    if (options.bCompress)
+        pCompressingSink = std::make_unique<CompressingSink_t>(writer);
+    ByteSink_t& sink = pCompressingSink ? static_cast<ByteSink_t&>(*pCompressingSink) : static_cast<ByteSink_t&>(writer);
+    RowWriter_t out(sink, cbWriterChunk);
+    SnapshotColumnWriter_t columns;
+    columns.Header().timestamp = ullSnapshotStartTime;
+    columns.Header().sessionId = dwSessionID;
+    OpenMetricsSnapshot_t metrics(dwSessionID);
+    // FILETIME is in 100-nanosecond units since 1601-01-01; 11644473600 seconds before 1970-01-01.
+    metrics.SetTimestamp(double(ullSnapshotStartTime) / 10000000.0 - 11644473600.0);
+    if (OutputFormat_t::OpenMetrics == options.format)
+        out.SetLineEnding("\n");
+    OutputHeaderRow(out, options);
+    // Iterate through all of the processes that were probed, in enumeration order or sorted by the -sort column.
+    std::vector<uint32_t> rowOrder;
+    GetRowOrder(options, probeResults.rows, accountNames, rowOrder);
+    for (
+        std::vector<uint32_t>::const_iterator iterIx = rowOrder.begin();
+        iterIx != rowOrder.end();
+        iterIx++
+        )
+    {
+        const ProcessRow_t& row = probeResults.rows[*iterIx];
+        if (row.bOpened)
+        {
+            dwTotalUserObjects += row.counters.dwUserObjects;
+            dwTotalUserObjectsPeak += row.counters.dwUserObjectsPeak;
+            dwTotalGdiObjects += row.counters.dwGdiObjects;
+            dwTotalGdiObjectsPeak += row.counters.dwGdiObjectsPeak;
+            if (0 == llFirstRead || row.counters.llReadTime < llFirstRead)
+                llFirstRead = row.counters.llReadTime;
+            if (row.counters.llReadTime > llLastRead)
+                llLastRead = row.counters.llReadTime;
+
+            // Report info about the process if any of the numbers are non-zero, or the "show all" option is selected.
+            if (IsRowListed(options, row))
             {
-                std::wstringstream strServices;
-                for (
-                    ServiceList_t::const_iterator iterSvc = pServiceList->begin();
-                    iterSvc != pServiceList->end();
-                    iterSvc++
-                    )
-                {
-                    strServices << iterSvc->sServiceName << L" ";
-                }
-                sServices = strServices.str();
+                if (driftBaseline.size() < options.dwDriftRows)
+                    driftBaseline.push_back(std::pair<DWORD, GuiCounters_t>(row.dwPID, row.counters));
+
+                OutputProcessRow(out, columns, metrics, options, row, accountNames.GetName(row.sid), liSnapshotStart.QuadPart);
+            }
+        }
+        else
+        {
+            // Report processes that we couldn't get information about only if "show all" is selected.
+            if (IsRowListed(options, row))
+            {
+                OutputProcessRow(out, columns, metrics, options, row, accountNames.GetName(row.sid), liSnapshotStart.QuadPart);
             }
+        }
+    }
 
-            // Get the SID of the account executing the process.
-            CSid sid(wtsCurrProcess.pUserSid);
+    // Total from the enumerated processes
+    SummaryRow_t total;
+    total.kind = SummaryRow_t::Total;
+    total.ullUserObjects = dwTotalUserObjects;
+    total.ullUserObjectsPeak = dwTotalUserObjectsPeak;
+    total.ullGdiObjects = dwTotalGdiObjects;
+    total.ullGdiObjectsPeak = dwTotalGdiObjectsPeak;
+    // The TOTAL row's read time is the span of time over which the processes' counters were read.
+    total.llReadInterval = llLastRead - llFirstRead;
+    OutputSummaryRow(out, columns, metrics, options, dwSessionID, total);
+
+    // Session-wide usage (hProcess = GR_GLOBAL)
+    ReadGuiCounters(GR_GLOBAL, counters);
+    SummaryRow_t global;
+    global.kind = SummaryRow_t::Global;
+    global.ullUserObjects = counters.dwUserObjects;
+    global.ullUserObjectsPeak = counters.dwUserObjectsPeak;
+    global.ullGdiObjects = counters.dwGdiObjects;
+    global.ullGdiObjectsPeak = counters.dwGdiObjectsPeak;
+    global.llReadInterval = counters.llReadTime - liSnapshotStart.QuadPart;
+    OutputSummaryRow(out, columns, metrics, options, dwSessionID, global);
 
-            HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, wtsCurrProcess.ProcessId);
+    // Re-read the first listed processes to measure how much their counters changed while the
+    // snapshot was being collected. The DRIFT row reports the sums of the absolute changes, and
+    // the longest interval between the two reads.
+    if (driftBaseline.size() > 0)
+    {
+        SummaryRow_t drift;
+        drift.kind = SummaryRow_t::Drift;
+        drift.nDriftRows = driftBaseline.size();
+        for (
+            std::vector<std::pair<DWORD, GuiCounters_t>>::const_iterator iterBaseline = driftBaseline.begin();
+            iterBaseline != driftBaseline.end();
+            iterBaseline++
+            )
+        {
+            HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, iterBaseline->first);
             if (hProcess)
             {
-                // Get information about the process' User and GDI objects.
-                dwUserObjects = GetGuiResources(hProcess, GR_USEROBJECTS);
-                dwUserObjectsPeak = GetGuiResources(hProcess, GR_USEROBJECTS_PEAK);
-                dwGdiObjects = GetGuiResources(hProcess, GR_GDIOBJECTS);
-                dwGdiObjectsPeak = GetGuiResources(hProcess, GR_GDIOBJECTS_PEAK);
-                dwTotalUserObjects += dwUserObjects;
-                dwTotalUserObjectsPeak += dwUserObjectsPeak;
-                dwTotalGdiObjects += dwGdiObjects;
-                dwTotalGdiObjectsPeak += dwGdiObjectsPeak;
-                // Get the PID of the process' parent process
-                ULONG_PTR ppid = GetParentPID(hProcess, sErrorInfo);
-                std::wstringstream strPPID;
-                if (0 != ppid)
-                    strPPID << ppid;
-                else
-                    strPPID << sErrorInfo;
+                const GuiCounters_t& before = iterBaseline->second;
+                ReadGuiCounters(hProcess, counters);
                 CloseHandle(hProcess);
+                drift.ullUserObjects += (ULONGLONG)_abs64(LONGLONG(counters.dwUserObjects) - LONGLONG(before.dwUserObjects));
+                drift.ullUserObjectsPeak += (ULONGLONG)_abs64(LONGLONG(counters.dwUserObjectsPeak) - LONGLONG(before.dwUserObjectsPeak));
+                drift.ullGdiObjects += (ULONGLONG)_abs64(LONGLONG(counters.dwGdiObjects) - LONGLONG(before.dwGdiObjects));
+                drift.ullGdiObjectsPeak += (ULONGLONG)_abs64(LONGLONG(counters.dwGdiObjectsPeak) - LONGLONG(before.dwGdiObjectsPeak));
+                if (counters.llReadTime - before.llReadTime > drift.llReadInterval)
+                    drift.llReadInterval = counters.llReadTime - before.llReadTime;
+                ++drift.nReread;
+            }
+        }
+        OutputSummaryRow(out, columns, metrics, options, dwSessionID, drift);
+    }
+
+    // If the time budget ran out, report how many processes weren't probed. The totals above cover only the probed processes.
+    if (probeResults.nSkipped > 0)
+    {
+        if (OutputFormat_t::Columnar == options.format)
+        {
+            columns.Header().skippedCount = uint32_t(probeResults.nSkipped);
+        }
+        else if (OutputFormat_t::OpenMetrics == options.format)
+        {
+            metrics.SetSkippedCount(probeResults.nSkipped);
+        }
+        else if (OutputFormat_t::Ndjson == options.format)
+        {
+            out << "{\"type\":\"skipped\",\"session\":" << dwSessionID << ",\"count\":" << probeResults.nSkipped << "}";
+        }
+        else
+        {
+            out
+                << dwSessionID << L"\t"
+                << L"SKIPPED" << L"\t"
+                << L"[" << probeResults.nSkipped << L" processes not probed within the time budget]";
+        }
+        if (OutputFormat_t::Columnar != options.format && OutputFormat_t::OpenMetrics != options.format)
+            out.EndLine();
+    }
+
+    // End of the snapshot
+    if (OutputFormat_t::OpenMetrics == options.format)
+        metrics.Write(out);
+    bool bWritten = out.Flush();
+    if (OutputFormat_t::Columnar == options.format && !columns.Write(sink))
+    {
+        std::wcerr << L"Unable to write the columnar snapshot: " << SysErrorMessageWithCode() << std::endl;
+        bWritten = false;
+    }
+    if (pCompressingSink && !pCompressingSink->Finish())
+        bWritten = false;
+    // Replace the output file only with a complete snapshot, once the writer thread has written all of it.
+    // (Output to stdout isn't waited for; a failure to write it is reported at the end.)
+    if (bToFile)
+    {
+        if (!writer.Drain())
+            bWritten = false;
+        if (!bWritten)
+        {
+            std::wcerr << L"Unable to write " << options.sOutputFile << std::endl;
+        }
+        else if (!fileSink.Commit(sErrorInfo))
+        {
+            std::wcerr << sErrorInfo << std::endl;
+            bWritten = false;
+        }
+    }
+
+    if (accountNames.UnresolvedCount() > 0)
+    {
+        std::wcerr << accountNames.UnresolvedCount() << L" row(s) have account names that were not resolved within the time limit." << std::endl;
+    }
+
+    // In gentle mode, report how much pacing lengthened probing. (To stderr, so as not to disturb the tab-delimited output.)
+    if (options.dCpuBudgetPercent > 0)
+    {
+        std::wcerr
+            << L"Gentle mode: probing took " << probeResults.ullElapsedMs << L" ms, of which "
+            << probeResults.ullPacingDelayMs << L" ms was pacing delay to stay within " << options.dCpuBudgetPercent
+            << L"% of one core; probing thread CPU time " << probeResults.ullCpuMs << L" ms." << std::endl;
+    }
+
+    return bWritten ? 0 : -4;
+}
+
+
+/// <summary>
+/// Lists the desktops in each window station in the session, with each desktop's heap size
+/// and the processes that have threads attached to it, as tab-delimited text with headers.
+/// </summary>
+/// <param name="dwSessionID">The current process' session ID</param>
+/// <returns>0 if successful, negative value otherwise</returns>
+static int ListDesktops(DWORD dwSessionID)
+{
+    std::vector<DesktopHeapInfo_t> desktops;
+    std::wstring sErrorInfo;
+    if (!GetDesktopHeapInfo(dwSessionID, desktops, sErrorInfo))
+    {
+        std::wcerr << sErrorInfo << std::endl;
+        return -3;
+    }
+    // Non-fatal problem, such as being unable to inspect threads
+    if (sErrorInfo.length() > 0)
+    {
+        std::wcerr << sErrorInfo << std::endl;
+    }
+
+    const wchar_t* const szTab = L"\t";
+
+    std::wcout
+        << L"Session" << szTab
+        << L"Window station" << szTab
+        << L"Desktop" << szTab
+        << L"Heap size (KB)" << szTab
+        << L"Processes" << szTab
+        << L"Threads" << szTab
+        << L"Attached processes" << std::endl;
+    RecordFirstOutput(QpcNow());
+    for (
+        std::vector<DesktopHeapInfo_t>::const_iterator iterDesk = desktops.begin();
+        iterDesk != desktops.end();
+        iterDesk++
+        )
+    {
+        // List the attached processes as "name(PID)", separated by spaces.
+        DWORD dwThreads = 0;
+        std::wstringstream strProcesses;
+        for (
+            std::vector<DesktopProcess_t>::const_iterator iterProc = iterDesk->processes.begin();
+            iterProc != iterDesk->processes.end();
+            iterProc++
+            )
+        {
+            strProcesses << iterProc->sProcessName << L"(" << iterProc->dwPID << L") ";
+            dwThreads += iterProc->dwThreadCount;
+        }
+
+        std::wcout
+            << dwSessionID << szTab
+            << iterDesk->sWindowStation << szTab
+            << iterDesk->sDesktop << szTab;
+        if (iterDesk->bHeapSizeValid)
+            std::wcout << iterDesk->ulHeapSizeKB << szTab;
+        else
+            std::wcout << iterDesk->sErrorInfo << szTab;
+        std::wcout
+            << iterDesk->processes.size() << szTab
+            << dwThreads << szTab
+            << strProcesses.str() << std::endl;
+    }
+
+    return 0;
+}
+
+
+/// <summary>
+/// Maps a file into memory for reading. Errors are reported to stderr.
+/// </summary>
+/// <param name="szFilename">Input: path to the file</param>
+/// <param name="cbFile">Output: size of the file</param>
+/// <returns>Start of the mapped view, to be released with UnmapViewOfFile; nullptr on failure (including an empty file)</returns>
+static const void* MapInputFile(const wchar_t* szFilename, size_t& cbFile)
+{
+    cbFile = 0;
+    HANDLE hFile = CreateFileW(szFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        DWORD dwLastErr = GetLastError();
+        std::wcerr << L"Cannot open " << szFilename << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return nullptr;
+    }
+    LARGE_INTEGER liFileSize = { 0 };
+    HANDLE hMapping = NULL;
+    const void* pView = nullptr;
+    if (GetFileSizeEx(hFile, &liFileSize) && liFileSize.QuadPart > 0 && ULONGLONG(liFileSize.QuadPart) <= SIZE_MAX)
+    {
+        hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (NULL != hMapping)
+            pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    DWORD dwLastErr = GetLastError();
+    // The view keeps the mapping and file open.
+    if (NULL != hMapping)
+        CloseHandle(hMapping);
+    CloseHandle(hFile);
+    if (nullptr == pView)
+    {
+        std::wcerr << L"Cannot map " << szFilename << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return nullptr;
+    }
+    cbFile = size_t(liFileSize.QuadPart);
+    return pView;
+}
 
-                // Report info about the process if any of the numbers are non-zero, or the "show all" option is selected.
-                if (bShowAll || dwUserObjects > 0 || dwGdiObjects > 0 || dwUserObjectsPeak > 0 || dwGdiObjectsPeak > 0)
+/// <summary>
+/// Lists the contents of a columnar snapshot file (written with -format columnar) as tab-delimited
+/// text with headers. The file is memory-mapped and read in place, or if it was compressed with
+/// -compress, decompressed into memory.
+/// </summary>
+/// <param name="szFilename">Input: path to the snapshot file</param>
+/// <param name="options">Input: command-line options (for -sort)</param>
+/// <returns>0 if successful, negative value otherwise</returns>
+static int ReadSnapshotFile(const wchar_t* szFilename, const GuiObjectUseOptions_t& options)
+{
+    size_t cbFile = 0;
+    const void* pView = MapInputFile(szFilename, cbFile);
+    if (nullptr == pView)
+        return -4;
+
+    // A compressed snapshot file is decompressed into memory (which is suitably aligned) and read there.
+    int retval = 0;
+    std::wstring sErrorInfo;
+    MemorySink_t decompressed;
+    const void* pSnapshot = pView;
+    size_t cbSnapshot = cbFile;
+    if (IsLz4Frame(pView, cbFile))
+    {
+        if (!DecompressLz4Frames(pView, cbFile, decompressed, sErrorInfo))
+        {
+            std::wcerr << szFilename << L": " << sErrorInfo << std::endl;
+            UnmapViewOfFile(pView);
+            return -4;
+        }
+        pSnapshot = decompressed.Data().data();
+        cbSnapshot = decompressed.Data().size();
+    }
+
+    SnapshotColumnReader_t reader;
+    if (!reader.Open(pSnapshot, cbSnapshot, sErrorInfo))
+    {
+        std::wcerr << szFilename << L": " << sErrorInfo << std::endl;
+        retval = -4;
+    }
+    else
+    {
+        const SnapshotFileHeader_t& header = reader.Header();
+        const uint32_t* pSession = reader.Column(SnapshotColumn_t::Session);
+        const uint32_t* pPid = reader.Column(SnapshotColumn_t::Pid);
+        const uint32_t* pPpid = reader.Column(SnapshotColumn_t::Ppid);
+        const uint32_t* pFlags = reader.Column(SnapshotColumn_t::Flags);
+        const uint32_t* pOpenError = reader.Column(SnapshotColumn_t::OpenError);
+        const uint32_t* pUserObjects = reader.Column(SnapshotColumn_t::UserObjects);
+        const uint32_t* pUserObjectsPeak = reader.Column(SnapshotColumn_t::UserObjectsPeak);
+        const uint32_t* pGdiObjects = reader.Column(SnapshotColumn_t::GdiObjects);
+        const uint32_t* pGdiObjectsPeak = reader.Column(SnapshotColumn_t::GdiObjectsPeak);
+        const uint32_t* pReadTimeUs = reader.Column(SnapshotColumn_t::ReadTimeUs);
+        if (!pSession || !pPid || !pPpid || !pFlags || !pOpenError || !pUserObjects || !pUserObjectsPeak || !pGdiObjects || !pGdiObjectsPeak || !pReadTimeUs)
+        {
+            std::wcerr << szFilename << L": snapshot file is missing columns" << std::endl;
+            retval = -4;
+        }
+        else if (SortColumn_t::WindowStationHandles == options.sortColumn || SortColumn_t::DesktopHandles == options.sortColumn)
+        {
+            std::wcerr << szFilename << L": handle counts are not recorded in snapshot files; can't sort by them" << std::endl;
+            retval = -1;
+        }
+        else
+        {
+            // Listing order: as recorded, or by the -sort column.
+            std::vector<uint32_t> rowOrder(reader.RowCount());
+            for (uint32_t ixRow = 0; ixRow < reader.RowCount(); ++ixRow)
+                rowOrder[ixRow] = ixRow;
+            if (SortColumn_t::None != options.sortColumn)
+            {
+                std::vector<uint64_t> pidKeys(reader.RowCount()), columnKeys(reader.RowCount());
+                std::vector<std::string_view> strings;
+                for (uint32_t ixRow = 0; ixRow < reader.RowCount(); ++ixRow)
                 {
-                    std::wcout
-                        << wtsCurrProcess.SessionId << szTab
-                        << wtsCurrProcess.ProcessId << szTab
-                        << wtsCurrProcess.pProcessName << szTab
-                        << strPPID.str() << szTab
-                        << sServices << szTab
-                        << sid.toSidString() << szTab
-                        << sid.toDomainAndUsername() << szTab
-                        << dwUserObjects << szTab
-                        << dwUserObjectsPeak << szTab
-                        << dwGdiObjects << szTab
-                        << dwGdiObjectsPeak << std::endl;
+                    pidKeys[ixRow] = pPid[ixRow];
+                    switch (options.sortColumn)
+                    {
+                    case SortColumn_t::Session: columnKeys[ixRow] = pSession[ixRow]; break;
+                    case SortColumn_t::Ppid: columnKeys[ixRow] = pPpid[ixRow]; break;
+                    case SortColumn_t::UserObjects: columnKeys[ixRow] = pUserObjects[ixRow]; break;
+                    case SortColumn_t::UserObjectsPeak: columnKeys[ixRow] = pUserObjectsPeak[ixRow]; break;
+                    case SortColumn_t::GdiObjects: columnKeys[ixRow] = pGdiObjects[ixRow]; break;
+                    case SortColumn_t::GdiObjectsPeak: columnKeys[ixRow] = pGdiObjectsPeak[ixRow]; break;
+                    case SortColumn_t::ReadTime: columnKeys[ixRow] = pReadTimeUs[ixRow]; break;
+                    case SortColumn_t::Name: strings.push_back(reader.RowString(SnapshotColumn_t::ProcessName, ixRow)); break;
+                    case SortColumn_t::Services: strings.push_back(reader.RowString(SnapshotColumn_t::Services, ixRow)); break;
+                    case SortColumn_t::UserSid: strings.push_back(reader.RowString(SnapshotColumn_t::UserSid, ixRow)); break;
+                    case SortColumn_t::UserName: strings.push_back(reader.RowString(SnapshotColumn_t::UserName, ixRow)); break;
+                    default: break;
+                    }
                 }
+                // UTF-8 strings in ordinal byte order
+                if (!strings.empty())
+                    RankStrings(strings, columnKeys);
+                SortRowOrder(options, pidKeys, columnKeys, rowOrder);
             }
-            else
+
+            const wchar_t* const szTab = L"\t";
+            StdStreamSink_t stdoutSink(stdout);
+            RowWriter_t out(stdoutSink);
+            out
+                << L"Session" << szTab
+                << L"PID" << szTab
+                << L"Process name" << szTab
+                << L"PPID" << szTab
+                << L"Services" << szTab
+                << L"User SID" << szTab
+                << L"User name" << szTab
+                << L"USER objects" << szTab
+                << L"USER objects peak" << szTab
+                << L"GDI objects" << szTab
+                << L"GDI objects peak" << szTab
+                << L"Read time (ms)";
+            out.EndLine();
+            for (std::vector<uint32_t>::const_iterator iterRow = rowOrder.begin(); iterRow != rowOrder.end(); ++iterRow)
             {
-                // Report processes that we couldn't get information about only if "show all" is selected.
-                if (bShowAll)
+                const uint32_t ixRow = *iterRow;
+                out
+                    << pSession[ixRow] << szTab
+                    << pPid[ixRow] << szTab
+                    << reader.RowString(SnapshotColumn_t::ProcessName, ixRow) << szTab;
+                if (0 != pPpid[ixRow])
+                    out << pPpid[ixRow];
+                out
+                    << szTab
+                    << reader.RowString(SnapshotColumn_t::Services, ixRow) << szTab
+                    << reader.RowString(SnapshotColumn_t::UserSid, ixRow) << szTab
+                    << reader.RowString(SnapshotColumn_t::UserName, ixRow) << szTab;
+                if (0 != (pFlags[ixRow] & SnapshotRowOpened))
                 {
-                    DWORD dwLastErr = GetLastError();
-                    std::wcout
-                        << wtsCurrProcess.SessionId << szTab
-                        << wtsCurrProcess.ProcessId << szTab
-                        << wtsCurrProcess.pProcessName << szTab
-                        << szTab
-                        << sServices << szTab
-                        << sid.toSidString() << szTab
-                        << sid.toDomainAndUsername() << szTab
-                        << L"Error " << dwLastErr << szTab
-                        << SysErrorMessage(dwLastErr) << szTab
-                        << L"Error " << dwLastErr << szTab
-                        << SysErrorMessage(dwLastErr) << std::endl;
+                    out
+                        << pUserObjects[ixRow] << szTab
+                        << pUserObjectsPeak[ixRow] << szTab
+                        << pGdiObjects[ixRow] << szTab
+                        << pGdiObjectsPeak[ixRow] << szTab;
+                    out.AppendFixed(double(pReadTimeUs[ixRow]) / 1000.0, 3);
                 }
+                else
+                {
+                    const std::wstring sErrorMessage = SysErrorMessage(pOpenError[ixRow]);
+                    out
+                        << L"Error " << pOpenError[ixRow] << szTab
+                        << sErrorMessage << szTab
+                        << L"Error " << pOpenError[ixRow] << szTab
+                        << sErrorMessage << szTab;
+                }
+                out.EndLine();
             }
+
+            const uint64_t* const summaries[] = { header.totals, header.global, header.drift };
+            const wchar_t* const szLabels[] = { L"TOTAL\t[enumerated processes]", L"GR_GLOBAL\t[Session-wide usage]", L"DRIFT\t" };
+            for (size_t ixSummary = 0; ixSummary < 3; ++ixSummary)
+            {
+                // No DRIFT row unless drift was measured
+                if (2 == ixSummary && 0 == header.driftRows)
+                    continue;
+                out << header.sessionId << szTab << szLabels[ixSummary];
+                if (2 == ixSummary)
+                    out << L"[" << header.driftReread << L" of first " << header.driftRows << L" processes re-read]";
+                out << szTab << szTab << szTab << szTab << szTab;
+                out
+                    << summaries[ixSummary][0] << szTab
+                    << summaries[ixSummary][1] << szTab
+                    << summaries[ixSummary][2] << szTab
+                    << summaries[ixSummary][3];
+                out.EndLine();
+            }
+            if (header.skippedCount > 0)
+            {
+                out
+                    << header.sessionId << szTab
+                    << L"SKIPPED" << szTab
+                    << L"[" << header.skippedCount << L" processes not probed within the time budget]";
+                out.EndLine();
+            }
+            if (!out.Flush())
+                retval = -4;
         }
     }
 
-    WTSFreeMemoryExW(WTSTypeProcessInfoLevel0, pProcessesInfo, dwProcessCount);
+    UnmapViewOfFile(pView);
+    return retval;
+}
 
-    // Total from the enumerated processes
-    std::wcout
-        << dwSessionID << szTab
-        << L"TOTAL" << szTab
-        << L"[enumerated processes]" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << dwTotalUserObjects << szTab
-        << dwTotalUserObjectsPeak << szTab
-        << dwTotalGdiObjects << szTab
-        << dwTotalGdiObjectsPeak << std::endl;
 
-    // Session-wide usage (hProcess = GR_GLOBAL)
-    dwUserObjects = GetGuiResources(GR_GLOBAL, GR_USEROBJECTS);
-    dwUserObjectsPeak = GetGuiResources(GR_GLOBAL, GR_USEROBJECTS_PEAK);
-    dwGdiObjects = GetGuiResources(GR_GLOBAL, GR_GDIOBJECTS);
-    dwGdiObjectsPeak = GetGuiResources(GR_GLOBAL, GR_GDIOBJECTS_PEAK);
-    std::wcout
-        << dwSessionID << szTab
-        << L"GR_GLOBAL" << szTab
-        << L"[Session-wide usage]" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << L"" << szTab
-        << dwUserObjects << szTab
-        << dwUserObjectsPeak << szTab
-        << dwGdiObjects << szTab
-        << dwGdiObjectsPeak << std::endl;
+/// <summary>
+/// Writes the decompressed contents of a file compressed with -compress (or any LZ4 frame file) to stdout.
+/// </summary>
+/// <param name="szFilename">Input: path to the compressed file</param>
+/// <returns>0 if successful, negative value otherwise</returns>
+static int DecompressFile(const wchar_t* szFilename)
+{
+    size_t cbFile = 0;
+    const void* pView = MapInputFile(szFilename, cbFile);
+    if (nullptr == pView)
+        return -4;
 
-    return 0;
+    // Decompressed a block at a time, so the output needn't fit in memory.
+    int retval = 0;
+    std::wstring sErrorInfo;
+    StdStreamSink_t stdoutSink(stdout, true);
+    if (!DecompressLz4Frames(pView, cbFile, stdoutSink, sErrorInfo))
+    {
+        std::wcerr << szFilename << L": " << sErrorInfo << std::endl;
+        retval = -4;
+    }
+    UnmapViewOfFile(pView);
+    return retval;
 }
@@ -0,0 +1,131 @@
+// Bulk handle-table snapshot for counting WindowStation and Desktop handles per process.
+
+// Need to define WIN32_NO_STATUS temporarily when including both Windows.h and ntstatus.h
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <vector>
+#include "NtInternal.h"
+#include "SysErrorMessage.h"
+#include "HandleCounts.h"
+
+/// <summary>
+/// Buffer for the system handle table snapshot, retained between calls so that repeated
+/// snapshots don't need to rediscover the required size.
+/// </summary>
+static std::vector<BYTE> st_handleInfoBuffer;
+
+// Initial buffer size if no snapshot has been taken yet, and the upper limit for growing it.
+static const size_t cbInitialHandleInfoBuffer = 1024 * 1024;
+static const size_t cbMaxHandleInfoBuffer = 1024 * 1024 * 1024;
+
+/// <summary>
+/// Takes a snapshot of the system handle table into st_handleInfoBuffer, growing the buffer
+/// geometrically until it's large enough.
+/// </summary>
+static bool SnapshotHandleTable(pfn_NtQuerySystemInformation_t NtQuerySystemInformation, std::wstring& sErrorInfo)
+{
+	if (st_handleInfoBuffer.size() < cbInitialHandleInfoBuffer)
+		st_handleInfoBuffer.resize(cbInitialHandleInfoBuffer);
+
+	for (;;)
+	{
+		ULONG ulReturnLength = 0;
+		NTSTATUS ntStat = NtQuerySystemInformation(
+			SystemExtendedHandleInformation,
+			st_handleInfoBuffer.data(),
+			ULONG(st_handleInfoBuffer.size()),
+			&ulReturnLength);
+		if (STATUS_SUCCESS == ntStat)
+		{
+			return true;
+		}
+		if (STATUS_INFO_LENGTH_MISMATCH != ntStat)
+		{
+			sErrorInfo = SysErrorMessage(ntStat, true);
+			return false;
+		}
+		// Double the buffer size, and make sure it's bigger than the reported length, which can be
+		// out of date by the next call as handles are created.
+		size_t cbNewSize = st_handleInfoBuffer.size() * 2;
+		while (cbNewSize < ulReturnLength + ulReturnLength / 4)
+			cbNewSize *= 2;
+		if (cbNewSize > cbMaxHandleInfoBuffer)
+		{
+			sErrorInfo = L"System handle table snapshot too large";
+			return false;
+		}
+		st_handleInfoBuffer.resize(cbNewSize);
+	}
+}
+
+/// <summary>
+/// Counts every process' handles to WindowStation and Desktop objects, using a single
+/// system-wide handle table snapshot.
+/// </summary>
+bool GetWinStaDesktopHandleCounts(HandleCountsByPID_t& counts, std::wstring& sErrorInfo)
+{
+	counts.clear();
+	sErrorInfo.clear();
+
+	// Acquire pointers to ntdll interfaces
+	HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+	if (nullptr == ntdll)
+	{
+		sErrorInfo = SysErrorMessageWithCode();
+		return false;
+	}
+	pfn_NtQuerySystemInformation_t NtQuerySystemInformation = (pfn_NtQuerySystemInformation_t)GetProcAddress(ntdll, "NtQuerySystemInformation");
+	if (nullptr == NtQuerySystemInformation)
+	{
+		sErrorInfo = SysErrorMessageWithCode();
+		return false;
+	}
+
+	if (!SnapshotHandleTable(NtQuerySystemInformation, sErrorInfo))
+		return false;
+
+	const SYSTEM_HANDLE_INFORMATION_EX* pHandleInfo = (const SYSTEM_HANDLE_INFORMATION_EX*)st_handleInfoBuffer.data();
+
+	// Object type indexes vary across Windows versions. Identify the WindowStation and Desktop
+	// type indexes by finding this process' own handles to its window station and desktop.
+	const ULONG_PTR myPID = GetCurrentProcessId();
+	const ULONG_PTR hMyWinsta = (ULONG_PTR)GetProcessWindowStation();
+	const ULONG_PTR hMyDesktop = (ULONG_PTR)GetThreadDesktop(GetCurrentThreadId());
+	bool bWinstaTypeFound = false, bDesktopTypeFound = false;
+	USHORT winstaTypeIndex = 0, desktopTypeIndex = 0;
+	for (ULONG_PTR ix = 0; ix < pHandleInfo->NumberOfHandles && !(bWinstaTypeFound && bDesktopTypeFound); ++ix)
+	{
+		const SYSTEM_HANDLE_TABLE_ENTRY_INFO_EX& entry = pHandleInfo->Handles[ix];
+		if (myPID == entry.UniqueProcessId)
+		{
+			if (0 != hMyWinsta && hMyWinsta == entry.HandleValue)
+			{
+				winstaTypeIndex = entry.ObjectTypeIndex;
+				bWinstaTypeFound = true;
+			}
+			else if (0 != hMyDesktop && hMyDesktop == entry.HandleValue)
+			{
+				desktopTypeIndex = entry.ObjectTypeIndex;
+				bDesktopTypeFound = true;
+			}
+		}
+	}
+	if (!bWinstaTypeFound || !bDesktopTypeFound)
+	{
+		sErrorInfo = L"Unable to identify WindowStation and Desktop object types";
+		return false;
+	}
+
+	for (ULONG_PTR ix = 0; ix < pHandleInfo->NumberOfHandles; ++ix)
+	{
+		const SYSTEM_HANDLE_TABLE_ENTRY_INFO_EX& entry = pHandleInfo->Handles[ix];
+		if (winstaTypeIndex == entry.ObjectTypeIndex)
+			++counts[entry.UniqueProcessId].dwWindowStationHandles;
+		else if (desktopTypeIndex == entry.ObjectTypeIndex)
+			++counts[entry.UniqueProcessId].dwDesktopHandles;
+	}
+
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <unordered_map>
+
+/// <summary>
+/// Numbers of handles to WindowStation and Desktop objects held by one process.
+/// </summary>
+struct WinStaDesktopHandleCounts_t
+{
+	DWORD dwWindowStationHandles = 0;
+	DWORD dwDesktopHandles = 0;
+};
+
+/// <summary>
+/// Mapping of process ID to that process' WindowStation and Desktop handle counts.
+/// Processes that hold no such handles do not appear in the map.
+/// </summary>
+typedef std::unordered_map<ULONG_PTR, WinStaDesktopHandleCounts_t> HandleCountsByPID_t;
+
+/// <summary>
+/// Counts every process' handles to WindowStation and Desktop objects, using a single
+/// system-wide handle table snapshot (NtQuerySystemInformation with SystemExtendedHandleInformation).
+/// The snapshot buffer is retained and reused across calls, and grows geometrically as needed.
+/// </summary>
+/// <param name="counts">Output: handle counts per process ID</param>
+/// <param name="sErrorInfo">Output: error information on failure</param>
+/// <returns>true if successful; false otherwise</returns>
+bool GetWinStaDesktopHandleCounts(HandleCountsByPID_t& counts, std::wstring& sErrorInfo);
@@ -0,0 +1,487 @@
+// Compression in the LZ4 frame format.
+
+#include <cstring>
+#include "Lz4Frame.h"
+
+static const uint32_t Lz4FrameMagic = 0x184D2204;
+// Skippable frames have magic numbers 0x184D2A50 through 0x184D2A5F.
+static const uint32_t Lz4SkippableMagicMask = 0xFFFFFFF0, Lz4SkippableMagic = 0x184D2A50;
+// High bit of a block size: the block is stored uncompressed.
+static const uint32_t Lz4UncompressedBit = 0x80000000;
+
+// LZ4 block format limits: matches are at least 4 bytes long and at most 64KB back; the last match
+// must start at least 12 bytes before the end of the block, and the last 5 bytes are always literals.
+static const size_t cbMinMatch = 4, cbMaxOffset = 65535, cbMatchStartLimit = 12, cbLastLiterals = 5;
+// Content that a linked block may refer to
+static const size_t cbMaxHistory = 64 * 1024;
+// Size of the compressor's hash table, as a power of 2
+static const int nHashBits = 12;
+
+static const uint32_t Prime32_1 = 0x9E3779B1, Prime32_2 = 0x85EBCA77, Prime32_3 = 0xC2B2AE3D, Prime32_4 = 0x27D4EB2F, Prime32_5 = 0x165667B1;
+
+static inline uint32_t RotateLeft(uint32_t value, int nBits)
+{
+	return (value << nBits) | (value >> (32 - nBits));
+}
+
+static inline uint32_t ReadLE32(const uint8_t* p)
+{
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void WriteLE32(char* p, uint32_t value)
+{
+	p[0] = char(value & 0xFF);
+	p[1] = char((value >> 8) & 0xFF);
+	p[2] = char((value >> 16) & 0xFF);
+	p[3] = char((value >> 24) & 0xFF);
+}
+
+static inline void AppendLE32(std::vector<char>& output, uint32_t value)
+{
+	char bytes[4];
+	WriteLE32(bytes, value);
+	output.insert(output.end(), bytes, bytes + 4);
+}
+
+static inline uint32_t Xxh32Round(uint32_t acc, uint32_t input)
+{
+	return RotateLeft(acc + input * Prime32_2, 13) * Prime32_1;
+}
+
+Xxh32_t::Xxh32_t(uint32_t seed)
+	: m_seed(seed)
+{
+	m_acc[0] = seed + Prime32_1 + Prime32_2;
+	m_acc[1] = seed + Prime32_2;
+	m_acc[2] = seed;
+	m_acc[3] = seed - Prime32_1;
+}
+
+void Xxh32_t::Update(const void* pData, size_t cbData)
+{
+	const uint8_t* pIn = (const uint8_t*)pData;
+	m_cbTotal += cbData;
+	// Complete a partial stripe from a previous update first.
+	if (m_cbStripe > 0)
+	{
+		const size_t cbCopy = (cbData < 16 - m_cbStripe) ? cbData : (16 - m_cbStripe);
+		memcpy(m_stripe + m_cbStripe, pIn, cbCopy);
+		m_cbStripe += cbCopy;
+		pIn += cbCopy;
+		cbData -= cbCopy;
+		if (m_cbStripe < 16)
+			return;
+		for (int ix = 0; ix < 4; ++ix)
+			m_acc[ix] = Xxh32Round(m_acc[ix], ReadLE32(m_stripe + ix * 4));
+		m_cbStripe = 0;
+	}
+	for (; cbData >= 16; pIn += 16, cbData -= 16)
+	{
+		for (int ix = 0; ix < 4; ++ix)
+			m_acc[ix] = Xxh32Round(m_acc[ix], ReadLE32(pIn + ix * 4));
+	}
+	if (cbData > 0)
+	{
+		memcpy(m_stripe, pIn, cbData);
+		m_cbStripe = cbData;
+	}
+}
+
+uint32_t Xxh32_t::Digest() const
+{
+	uint32_t hash;
+	if (m_cbTotal >= 16)
+		hash = RotateLeft(m_acc[0], 1) + RotateLeft(m_acc[1], 7) + RotateLeft(m_acc[2], 12) + RotateLeft(m_acc[3], 18);
+	else
+		hash = m_seed + Prime32_5;
+	hash += uint32_t(m_cbTotal);
+
+	const uint8_t* pIn = m_stripe;
+	size_t cbLeft = m_cbStripe;
+	for (; cbLeft >= 4; pIn += 4, cbLeft -= 4)
+		hash = RotateLeft(hash + ReadLE32(pIn) * Prime32_3, 17) * Prime32_4;
+	for (; cbLeft > 0; ++pIn, --cbLeft)
+		hash = RotateLeft(hash + (*pIn) * Prime32_5, 11) * Prime32_1;
+
+	hash ^= hash >> 15;
+	hash *= Prime32_2;
+	hash ^= hash >> 13;
+	hash *= Prime32_3;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+uint32_t Xxh32_t::Hash(const void* pData, size_t cbData, uint32_t seed)
+{
+	Xxh32_t hash(seed);
+	hash.Update(pData, cbData);
+	return hash.Digest();
+}
+
+/// <summary>
+/// Writes a length that doesn't fit in a token nibble: 255s, then the remainder.
+/// </summary>
+static inline uint8_t* WriteLengthBytes(uint8_t* pOut, size_t cbLength)
+{
+	for (; cbLength >= 255; cbLength -= 255)
+		*pOut++ = 255;
+	*pOut++ = uint8_t(cbLength);
+	return pOut;
+}
+
+/// <summary>
+/// Writes one sequence: literals, then a match (unless cbMatch is 0, for the last sequence).
+/// </summary>
+static uint8_t* WriteSequence(uint8_t* pOut, const uint8_t* pLiterals, size_t cbLiterals, size_t offset, size_t cbMatch)
+{
+	uint8_t* pToken = pOut++;
+	*pToken = uint8_t(((cbLiterals >= 15) ? 15 : cbLiterals) << 4);
+	if (cbLiterals >= 15)
+		pOut = WriteLengthBytes(pOut, cbLiterals - 15);
+	memcpy(pOut, pLiterals, cbLiterals);
+	pOut += cbLiterals;
+	if (cbMatch > 0)
+	{
+		*pOut++ = uint8_t(offset & 0xFF);
+		*pOut++ = uint8_t(offset >> 8);
+		const size_t cbMatchCode = cbMatch - cbMinMatch;
+		*pToken |= uint8_t((cbMatchCode >= 15) ? 15 : cbMatchCode);
+		if (cbMatchCode >= 15)
+			pOut = WriteLengthBytes(pOut, cbMatchCode - 15);
+	}
+	return pOut;
+}
+
+/// <summary>
+/// Compresses a block in the LZ4 block format with a greedy matcher: each position's first four bytes are
+/// hashed to find the most recent earlier position with the same hash, and a match is taken if there is one.
+/// Positions are skipped at an increasing rate while no match is found, so incompressible data is fast.
+/// </summary>
+size_t Lz4CompressBlock(const char* pInput, size_t cbInput, char* pOutput)
+{
+	const uint8_t* const pIn = (const uint8_t*)pInput;
+	uint8_t* pOut = (uint8_t*)pOutput;
+	size_t ixAnchor = 0;
+
+	if (cbInput > cbMatchStartLimit)
+	{
+		// Positions + 1 of the most recent occurrence of each hash; 0 for none.
+		uint32_t hashTable[size_t(1) << nHashBits] = {};
+		const size_t ixMatchStartLimit = cbInput - cbMatchStartLimit;
+		const size_t ixMatchEndLimit = cbInput - cbLastLiterals;
+		size_t ix = 0;
+		while (ix <= ixMatchStartLimit)
+		{
+			const uint32_t sequence = ReadLE32(pIn + ix);
+			const uint32_t hash = (sequence * 2654435761U) >> (32 - nHashBits);
+			const size_t ixCandidate = size_t(hashTable[hash]);
+			hashTable[hash] = uint32_t(ix + 1);
+			if (0 == ixCandidate || ix - (ixCandidate - 1) > cbMaxOffset || ReadLE32(pIn + ixCandidate - 1) != sequence)
+			{
+				ix += 1 + ((ix - ixAnchor) >> 6);
+				continue;
+			}
+
+			// Extend the match backward into the pending literals, then forward.
+			size_t ixMatch = ixCandidate - 1;
+			while (ix > ixAnchor && ixMatch > 0 && pIn[ix - 1] == pIn[ixMatch - 1])
+			{
+				--ix;
+				--ixMatch;
+			}
+			size_t cbMatch = cbMinMatch;
+			while (ix + cbMatch < ixMatchEndLimit && pIn[ixMatch + cbMatch] == pIn[ix + cbMatch])
+				++cbMatch;
+
+			pOut = WriteSequence(pOut, pIn + ixAnchor, ix - ixAnchor, ix - ixMatch, cbMatch);
+			ix += cbMatch;
+			ixAnchor = ix;
+			// Index a position near the end of the match, which often starts the next one.
+			if (ix - 2 <= ixMatchStartLimit)
+				hashTable[(ReadLE32(pIn + ix - 2) * 2654435761U) >> (32 - nHashBits)] = uint32_t(ix - 2 + 1);
+		}
+	}
+
+	pOut = WriteSequence(pOut, pIn + ixAnchor, cbInput - ixAnchor, 0, 0);
+	return size_t(pOut - (uint8_t*)pOutput);
+}
+
+/// <summary>
+/// Reads a length continued in 255-terminated bytes. Returns false if the input ends first.
+/// </summary>
+static inline bool ReadLengthBytes(const uint8_t*& pIn, const uint8_t* pInEnd, size_t& cbLength)
+{
+	uint8_t byte;
+	do
+	{
+		if (pIn >= pInEnd)
+			return false;
+		byte = *pIn++;
+		cbLength += byte;
+	} while (255 == byte);
+	return true;
+}
+
+/// <summary>
+/// Decompresses a block in the LZ4 block format.
+/// </summary>
+bool Lz4DecompressBlock(const char* pInput, size_t cbInput, char* pOutput, size_t cbOutputMax, size_t& cbOutput, size_t cbHistory)
+{
+	const uint8_t* pIn = (const uint8_t*)pInput;
+	const uint8_t* const pInEnd = pIn + cbInput;
+	uint8_t* const pOutStart = (uint8_t*)pOutput;
+	const uint8_t* const pHistoryStart = pOutStart - cbHistory;
+	uint8_t* pOut = pOutStart;
+	uint8_t* const pOutEnd = pOutStart + cbOutputMax;
+	cbOutput = 0;
+
+	while (pIn < pInEnd)
+	{
+		const uint8_t token = *pIn++;
+		size_t cbLiterals = token >> 4;
+		if (15 == cbLiterals && !ReadLengthBytes(pIn, pInEnd, cbLiterals))
+			return false;
+		if (cbLiterals > size_t(pInEnd - pIn) || cbLiterals > size_t(pOutEnd - pOut))
+			return false;
+		memcpy(pOut, pIn, cbLiterals);
+		pIn += cbLiterals;
+		pOut += cbLiterals;
+		// The last sequence has only literals.
+		if (pIn == pInEnd)
+			break;
+
+		if (pInEnd - pIn < 2)
+			return false;
+		const size_t offset = size_t(pIn[0]) | (size_t(pIn[1]) << 8);
+		pIn += 2;
+		size_t cbMatch = token & 0xF;
+		if (15 == cbMatch && !ReadLengthBytes(pIn, pInEnd, cbMatch))
+			return false;
+		cbMatch += cbMinMatch;
+		if (0 == offset || offset > size_t(pOut - pHistoryStart) || cbMatch > size_t(pOutEnd - pOut))
+			return false;
+		// Byte by byte: the match may overlap the output it's copying.
+		const uint8_t* pMatch = pOut - offset;
+		for (size_t ix = 0; ix < cbMatch; ++ix)
+			pOut[ix] = pMatch[ix];
+		pOut += cbMatch;
+	}
+
+	cbOutput = size_t(pOut - pOutStart);
+	return true;
+}
+
+/// <summary>
+/// Appends the frame header: magic number and frame descriptor.
+/// </summary>
+void Lz4FrameEncoder_t::Begin(std::vector<char>& output)
+{
+	m_contentHash = Xxh32_t();
+	AppendLE32(output, Lz4FrameMagic);
+	// FLG: version 01, independent blocks, content checksum. BD: 256KB maximum block size.
+	const uint8_t descriptor[2] = { 0x64, 0x50 };
+	output.push_back(char(descriptor[0]));
+	output.push_back(char(descriptor[1]));
+	output.push_back(char((Xxh32_t::Hash(descriptor, sizeof(descriptor)) >> 8) & 0xFF));
+}
+
+/// <summary>
+/// Appends a block, compressed or (if it doesn't compress) stored as-is.
+/// </summary>
+void Lz4FrameEncoder_t::EncodeBlock(const char* pData, size_t cbData, std::vector<char>& output)
+{
+	if (0 == cbData)
+		return;
+	m_contentHash.Update(pData, cbData);
+	// Block size, then the block: compressed into the output directly, or replaced by the data as-is.
+	const size_t cbStart = output.size();
+	output.resize(cbStart + 4 + Lz4CompressBound(cbData));
+	char* const pBlock = output.data() + cbStart + 4;
+	size_t cbBlock = Lz4CompressBlock(pData, cbData, pBlock);
+	uint32_t blockSize = uint32_t(cbBlock);
+	if (cbBlock >= cbData)
+	{
+		memcpy(pBlock, pData, cbData);
+		cbBlock = cbData;
+		blockSize = uint32_t(cbData) | Lz4UncompressedBit;
+	}
+	WriteLE32(output.data() + cbStart, blockSize);
+	output.resize(cbStart + 4 + cbBlock);
+}
+
+/// <summary>
+/// Appends the end mark and the content checksum.
+/// </summary>
+void Lz4FrameEncoder_t::End(std::vector<char>& output)
+{
+	AppendLE32(output, 0);
+	AppendLE32(output, m_contentHash.Digest());
+}
+
+bool IsLz4Frame(const void* pData, size_t cbData)
+{
+	return cbData >= 4 && Lz4FrameMagic == ReadLE32((const uint8_t*)pData);
+}
+
+/// <summary>
+/// Decompresses one or more concatenated LZ4 frames, writing the content to a sink a block at a time.
+/// </summary>
+bool DecompressLz4Frames(const void* pData, size_t cbData, ByteSink_t& sink, std::wstring& sErrorInfo)
+{
+	sErrorInfo.clear();
+	const uint8_t* pIn = (const uint8_t*)pData;
+	const uint8_t* const pInEnd = pIn + cbData;
+	std::vector<char> block;
+
+	if (0 == cbData)
+	{
+		sErrorInfo = L"No LZ4 frame";
+		return false;
+	}
+	while (pIn < pInEnd)
+	{
+		if (pInEnd - pIn < 4)
+		{
+			sErrorInfo = L"Truncated LZ4 frame";
+			return false;
+		}
+		const uint32_t magic = ReadLE32(pIn);
+		pIn += 4;
+		if (Lz4SkippableMagic == (magic & Lz4SkippableMagicMask))
+		{
+			if (pInEnd - pIn < 4 || ReadLE32(pIn) > size_t(pInEnd - pIn - 4))
+			{
+				sErrorInfo = L"Truncated skippable frame";
+				return false;
+			}
+			pIn += 4 + size_t(ReadLE32(pIn));
+			continue;
+		}
+		if (Lz4FrameMagic != magic)
+		{
+			sErrorInfo = L"Not an LZ4 frame";
+			return false;
+		}
+
+		// Frame descriptor
+		const uint8_t* const pDescriptor = pIn;
+		if (pInEnd - pIn < 3)
+		{
+			sErrorInfo = L"Truncated LZ4 frame";
+			return false;
+		}
+		const uint8_t flags = pIn[0], blockDescriptor = pIn[1];
+		pIn += 2;
+		const bool bBlockChecksums = (0 != (flags & 0x10)), bContentSize = (0 != (flags & 0x08)), bContentChecksum = (0 != (flags & 0x04));
+		if (0x40 != (flags & 0xC2) || 0 != (blockDescriptor & 0x8F) || (blockDescriptor >> 4) < 4)
+		{
+			sErrorInfo = L"Unsupported LZ4 frame version or descriptor";
+			return false;
+		}
+		if (0 != (flags & 0x01))
+		{
+			sErrorInfo = L"LZ4 frames with dictionaries are not supported";
+			return false;
+		}
+		// Linked blocks may refer to the previous 64KB of content, which is kept ahead of each block.
+		const bool bLinkedBlocks = (0 == (flags & 0x20));
+		uint64_t cbContentSize = 0;
+		if (bContentSize)
+		{
+			if (pInEnd - pIn < 8)
+			{
+				sErrorInfo = L"Truncated LZ4 frame";
+				return false;
+			}
+			cbContentSize = uint64_t(ReadLE32(pIn)) | (uint64_t(ReadLE32(pIn + 4)) << 32);
+			pIn += 8;
+		}
+		if (pIn >= pInEnd || *pIn != uint8_t((Xxh32_t::Hash(pDescriptor, size_t(pIn - pDescriptor)) >> 8) & 0xFF))
+		{
+			sErrorInfo = L"LZ4 frame descriptor checksum mismatch";
+			return false;
+		}
+		++pIn;
+
+		// Blocks, up to the end mark
+		const size_t cbBlockMax = size_t(64 * 1024) << (2 * ((blockDescriptor >> 4) - 4));
+		if (block.size() < cbMaxHistory + cbBlockMax)
+			block.resize(cbMaxHistory + cbBlockMax);
+		size_t cbHistory = 0;
+		Xxh32_t contentHash;
+		uint64_t cbContent = 0;
+		for (;;)
+		{
+			if (pInEnd - pIn < 4)
+			{
+				sErrorInfo = L"Truncated LZ4 frame";
+				return false;
+			}
+			const uint32_t blockSize = ReadLE32(pIn);
+			pIn += 4;
+			if (0 == blockSize)
+				break;
+			const size_t cbBlock = size_t(blockSize & ~Lz4UncompressedBit);
+			if (cbBlock > cbBlockMax || cbBlock > size_t(pInEnd - pIn) || (bBlockChecksums && size_t(pInEnd - pIn) - cbBlock < 4))
+			{
+				sErrorInfo = L"LZ4 block is too large or truncated";
+				return false;
+			}
+			if (bBlockChecksums && ReadLE32(pIn + cbBlock) != Xxh32_t::Hash(pIn, cbBlock))
+			{
+				sErrorInfo = L"LZ4 block checksum mismatch";
+				return false;
+			}
+			const char* pContent = (const char*)pIn;
+			size_t cbBlockContent = cbBlock;
+			if (0 == (blockSize & Lz4UncompressedBit))
+			{
+				if (!Lz4DecompressBlock((const char*)pIn, cbBlock, block.data() + cbHistory, cbBlockMax, cbBlockContent, cbHistory))
+				{
+					sErrorInfo = L"Malformed LZ4 block";
+					return false;
+				}
+				pContent = block.data() + cbHistory;
+			}
+			else if (bLinkedBlocks)
+			{
+				memcpy(block.data() + cbHistory, pIn, cbBlock);
+				pContent = block.data() + cbHistory;
+			}
+			pIn += cbBlock + (bBlockChecksums ? 4 : 0);
+			if (bContentChecksum)
+				contentHash.Update(pContent, cbBlockContent);
+			cbContent += cbBlockContent;
+			if (cbBlockContent > 0 && !sink.Write(pContent, cbBlockContent))
+			{
+				sErrorInfo = L"Unable to write the decompressed data";
+				return false;
+			}
+			if (bLinkedBlocks)
+			{
+				// Keep the last 64KB of content for the next block.
+				const size_t cbAvailable = cbHistory + cbBlockContent;
+				const size_t cbKeep = (cbAvailable < cbMaxHistory) ? cbAvailable : cbMaxHistory;
+				memmove(block.data(), block.data() + cbAvailable - cbKeep, cbKeep);
+				cbHistory = cbKeep;
+			}
+		}
+
+		if (bContentChecksum)
+		{
+			if (pInEnd - pIn < 4 || ReadLE32(pIn) != contentHash.Digest())
+			{
+				sErrorInfo = L"LZ4 content checksum mismatch";
+				return false;
+			}
+			pIn += 4;
+		}
+		if (bContentSize && cbContent != cbContentSize)
+		{
+			sErrorInfo = L"LZ4 content size mismatch";
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+// Compression in the LZ4 frame format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md),
+// readable by the standard lz4 tools. Self-contained and platform-independent (no Windows.h).
+//
+// Frames written here use independent 256KB blocks and a content checksum, and no block checksums,
+// content size or dictionary. The block compressor is a simple greedy matcher, tuned for speed over ratio;
+// the decompressor accepts any valid frame (including concatenated frames, skippable frames and linked
+// blocks), except for frames that use a dictionary.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "RowWriter.h"
+
+// Maximum uncompressed size of a block in the frames written here.
+const size_t cbLz4BlockMax = 256 * 1024;
+
+/// <summary>
+/// Incremental xxHash32, as used for LZ4 frame checksums.
+/// </summary>
+class Xxh32_t
+{
+public:
+	explicit Xxh32_t(uint32_t seed = 0);
+	void Update(const void* pData, size_t cbData);
+	uint32_t Digest() const;
+
+	/// <summary>
+	/// Returns the hash of a block of data.
+	/// </summary>
+	static uint32_t Hash(const void* pData, size_t cbData, uint32_t seed = 0);
+
+private:
+	uint32_t m_acc[4];
+	uint32_t m_seed;
+	uint64_t m_cbTotal = 0;
+	// Input not yet consumed in 16-byte stripes
+	uint8_t m_stripe[16] = {};
+	size_t m_cbStripe = 0;
+};
+
+/// <summary>
+/// Returns the largest possible compressed size of a block of the given size.
+/// </summary>
+inline size_t Lz4CompressBound(size_t cbInput) { return cbInput + cbInput / 255 + 16; }
+
+/// <summary>
+/// Compresses a block in the LZ4 block format.
+/// </summary>
+/// <param name="pInput">Input: data to compress</param>
+/// <param name="cbInput">Input: size of the data; at most cbLz4BlockMax</param>
+/// <param name="pOutput">Output: buffer with room for at least Lz4CompressBound(cbInput) bytes</param>
+/// <returns>Size of the compressed block</returns>
+size_t Lz4CompressBlock(const char* pInput, size_t cbInput, char* pOutput);
+
+/// <summary>
+/// Decompresses a block in the LZ4 block format, checking every length and offset against the buffers.
+/// </summary>
+/// <param name="pInput">Input: compressed block</param>
+/// <param name="cbInput">Input: size of the compressed block</param>
+/// <param name="pOutput">Output: buffer for the decompressed data</param>
+/// <param name="cbOutputMax">Input: size of the output buffer</param>
+/// <param name="cbOutput">Output: size of the decompressed data</param>
+/// <param name="cbHistory">Input: number of bytes of earlier content immediately before pOutput that matches may refer to (for linked blocks)</param>
+/// <returns>true if successful; false if the block is malformed or doesn't fit</returns>
+bool Lz4DecompressBlock(const char* pInput, size_t cbInput, char* pOutput, size_t cbOutputMax, size_t& cbOutput, size_t cbHistory = 0);
+
+/// <summary>
+/// Encodes an LZ4 frame a block at a time. Blocks must be encoded in order; the content checksum covers all of them.
+/// </summary>
+class Lz4FrameEncoder_t
+{
+public:
+	/// <summary>
+	/// Appends the frame header.
+	/// </summary>
+	void Begin(std::vector<char>& output);
+
+	/// <summary>
+	/// Appends a block of at most cbLz4BlockMax bytes, compressed (or stored as-is, if it doesn't compress).
+	/// </summary>
+	void EncodeBlock(const char* pData, size_t cbData, std::vector<char>& output);
+
+	/// <summary>
+	/// Appends the end mark and the content checksum.
+	/// </summary>
+	void End(std::vector<char>& output);
+
+private:
+	Xxh32_t m_contentHash;
+};
+
+/// <summary>
+/// Returns true if the data starts with an LZ4 frame's magic number.
+/// </summary>
+bool IsLz4Frame(const void* pData, size_t cbData);
+
+/// <summary>
+/// Decompresses one or more concatenated LZ4 frames, writing the content to a sink a block at a time.
+/// </summary>
+/// <param name="pData">Input: the compressed data (e.g., a mapped view of a file)</param>
+/// <param name="cbData">Input: size of the compressed data</param>
+/// <param name="sink">Output: destination for the decompressed content</param>
+/// <param name="sErrorInfo">Output: error information on failure</param>
+/// <returns>true if successful; false if the data is malformed, a checksum doesn't match, or a write fails</returns>
+bool DecompressLz4Frames(const void* pData, size_t cbData, ByteSink_t& sink, std::wstring& sErrorInfo);
@@ -0,0 +1,158 @@
+// Snapshot output in the OpenMetrics text format.
+
+#include <unordered_map>
+#include "OpenMetricsOutput.h"
+
+/// <summary>
+/// A process' label set, with the values it was built from to detect changes (including PID reuse).
+/// </summary>
+struct SeriesLabels_t
+{
+	uint32_t session = 0;
+	std::wstring sProcessName, sUserName, sServices;
+	// Formatted labels, without the braces: session="...",pid="...",name="...",user="...",service="..."
+	std::string sLabels;
+	// Generation of the last snapshot that used this label set.
+	uint64_t generation = 0;
+};
+
+/// <summary>
+/// Label sets by PID, from snapshots taken by this process. Accessed only by the thread collecting the snapshot.
+/// (Node-based, so pointers to the label sets remain valid as entries are added.)
+/// </summary>
+static std::unordered_map<uint32_t, SeriesLabels_t> st_seriesLabels;
+static uint64_t st_lastGeneration = 0;
+
+// Per-process and session-wide family name suffixes and help text, in sample value order.
+static const char* const szFamilySuffixes[4] = { "user_objects", "user_objects_peak", "gdi_objects", "gdi_objects_peak" };
+static const char* const szFamilyHelp[4] = { "USER objects in use", "Peak USER objects in use", "GDI objects in use", "Peak GDI objects in use" };
+static const char* const szScopes[3] = { "total", "global", "drift" };
+
+/// <summary>
+/// Appends a label value, transcoded to UTF-8, escaping backslashes, quotes and line feeds.
+/// </summary>
+static void AppendLabelValue(std::string& sLabels, std::wstring_view sValue)
+{
+	std::string sEncoded(sValue.size() * cbMaxUtf8PerUtf16, '\0');
+	sEncoded.resize(EncodeUtf8(sValue, sEncoded.data()));
+	for (std::string::const_iterator iterCh = sEncoded.begin(); iterCh != sEncoded.end(); ++iterCh)
+	{
+		switch (*iterCh)
+		{
+		case '\\': sLabels += "\\\\"; break;
+		case '"': sLabels += "\\\""; break;
+		case '\n': sLabels += "\\n"; break;
+		default: sLabels += *iterCh; break;
+		}
+	}
+}
+
+OpenMetricsSnapshot_t::OpenMetricsSnapshot_t(uint32_t sessionId)
+	: m_sessionId(sessionId), m_generation(++st_lastGeneration)
+{
+}
+
+/// <summary>
+/// Adds a process' samples, reusing its label set from a previous snapshot if nothing in it has changed.
+/// </summary>
+void OpenMetricsSnapshot_t::AddProcess(const OpenMetricsProcess_t& process)
+{
+	SeriesLabels_t& labels = st_seriesLabels[process.pid];
+	if (labels.sLabels.empty() || labels.session != process.session ||
+		labels.sProcessName != process.processName || labels.sUserName != process.userName || labels.sServices != process.services)
+	{
+		labels.session = process.session;
+		labels.sProcessName = process.processName;
+		labels.sUserName = process.userName;
+		labels.sServices = process.services;
+		labels.sLabels = "session=\"" + std::to_string(process.session) + "\",pid=\"" + std::to_string(process.pid) + "\",name=\"";
+		AppendLabelValue(labels.sLabels, process.processName);
+		labels.sLabels += "\",user=\"";
+		AppendLabelValue(labels.sLabels, process.userName);
+		labels.sLabels += "\",service=\"";
+		AppendLabelValue(labels.sLabels, process.services);
+		labels.sLabels += "\"";
+	}
+	labels.generation = m_generation;
+
+	Sample_t sample = { &labels.sLabels, { process.userObjects, process.userObjectsPeak, process.gdiObjects, process.gdiObjectsPeak } };
+	m_samples.push_back(sample);
+}
+
+/// <summary>
+/// Sets a session-wide family's samples for one scope.
+/// </summary>
+void OpenMetricsSnapshot_t::SetSessionCounters(OpenMetricsScope_t scope, uint64_t userObjects, uint64_t userObjectsPeak, uint64_t gdiObjects, uint64_t gdiObjectsPeak)
+{
+	const size_t ixScope = size_t(scope);
+	m_sessionCounters[ixScope][0] = userObjects;
+	m_sessionCounters[ixScope][1] = userObjectsPeak;
+	m_sessionCounters[ixScope][2] = gdiObjects;
+	m_sessionCounters[ixScope][3] = gdiObjectsPeak;
+	m_bSessionCountersSet[ixScope] = true;
+}
+
+/// <summary>
+/// Writes a metric family's HELP and TYPE lines.
+/// </summary>
+static void WriteFamilyHeader(RowWriter_t& out, std::string_view sName, std::string_view sHelp)
+{
+	out << "# HELP " << sName << " " << sHelp;
+	out.EndLine();
+	out << "# TYPE " << sName << " gauge";
+	out.EndLine();
+}
+
+/// <summary>
+/// Writes the snapshot, then discards the label sets of processes that weren't in it.
+/// </summary>
+void OpenMetricsSnapshot_t::Write(RowWriter_t& out)
+{
+	std::string sName;
+	for (size_t ixValue = 0; ixValue < 4; ++ixValue)
+	{
+		sName = "guiobjectuse_process_";
+		sName += szFamilySuffixes[ixValue];
+		WriteFamilyHeader(out, sName, std::string(szFamilyHelp[ixValue]) + " by the process.");
+		for (std::vector<Sample_t>::const_iterator iterSample = m_samples.begin(); iterSample != m_samples.end(); ++iterSample)
+		{
+			out << sName << "{" << *iterSample->pLabels << "} " << iterSample->values[ixValue];
+			out.EndLine();
+		}
+	}
+
+	for (size_t ixValue = 0; ixValue < 4; ++ixValue)
+	{
+		sName = "guiobjectuse_session_";
+		sName += szFamilySuffixes[ixValue];
+		WriteFamilyHeader(out, sName, std::string(szFamilyHelp[ixValue]) + " in the session: total of the listed processes, session-wide (global), or drift.");
+		for (size_t ixScope = 0; ixScope < 3; ++ixScope)
+		{
+			if (m_bSessionCountersSet[ixScope])
+			{
+				out << sName << "{session=\"" << m_sessionId << "\",scope=\"" << szScopes[ixScope] << "\"} " << m_sessionCounters[ixScope][ixValue];
+				out.EndLine();
+			}
+		}
+	}
+
+	WriteFamilyHeader(out, "guiobjectuse_skipped_processes", "Processes not probed within the time budget.");
+	out << "guiobjectuse_skipped_processes{session=\"" << m_sessionId << "\"} " << m_skippedCount;
+	out.EndLine();
+	WriteFamilyHeader(out, "guiobjectuse_snapshot_timestamp_seconds", "When the snapshot was taken.");
+	out << "guiobjectuse_snapshot_timestamp_seconds{session=\"" << m_sessionId << "\"} ";
+	out.AppendFixed(m_dTimestamp, 3);
+	out.EndLine();
+	out << "# EOF";
+	out.EndLine();
+
+	// The samples refer to the label sets, so they're discarded first.
+	m_samples.clear();
+	for (std::unordered_map<uint32_t, SeriesLabels_t>::iterator iterLabels = st_seriesLabels.begin(); iterLabels != st_seriesLabels.end(); )
+	{
+		if (iterLabels->second.generation != m_generation)
+			iterLabels = st_seriesLabels.erase(iterLabels);
+		else
+			++iterLabels;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// Snapshot output in the OpenMetrics text format, e.g., for the node_exporter textfile collector.
+// Platform-independent (no Windows.h).
+//
+// Each process listed gets one sample in each of four gauge families, labelled with its session, PID,
+// name, user and services:
+//   guiobjectuse_process_user_objects, guiobjectuse_process_user_objects_peak,
+//   guiobjectuse_process_gdi_objects, guiobjectuse_process_gdi_objects_peak
+// The summary rows are in the corresponding guiobjectuse_session_* families, labelled with the session
+// and a scope of total, global or drift. guiobjectuse_skipped_processes reports processes not probed
+// within the time budget, and guiobjectuse_snapshot_timestamp_seconds when the snapshot was taken.
+// Samples carry no timestamps, which the textfile collector doesn't accept.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "RowWriter.h"
+
+/// <summary>
+/// One process to add to the OpenMetrics output. The strings only need to remain valid for the AddProcess call.
+/// </summary>
+struct OpenMetricsProcess_t
+{
+	uint32_t session = 0, pid = 0;
+	std::wstring_view processName, userName, services;
+	uint32_t userObjects = 0, userObjectsPeak = 0, gdiObjects = 0, gdiObjectsPeak = 0;
+};
+
+/// <summary>
+/// Scope label values for the session-wide families.
+/// </summary>
+enum class OpenMetricsScope_t
+{
+	// Sums over the enumerated processes (TOTAL)
+	Total,
+	// Session-wide usage (GR_GLOBAL)
+	Global,
+	// Sums of the absolute changes in re-read processes (DRIFT)
+	Drift
+};
+
+/// <summary>
+/// Collects one snapshot's samples, then writes them grouped into metric families, as OpenMetrics requires.
+///
+/// The label set of each process' series is formatted once and reused by later snapshots taken by this
+/// process (e.g., in watch mode) for as long as the PID keeps the same name, user and services. Label sets
+/// of processes that aren't in a snapshot are discarded when it is written. Only one snapshot may be
+/// collected at a time, and only by one thread.
+/// </summary>
+class OpenMetricsSnapshot_t
+{
+public:
+	explicit OpenMetricsSnapshot_t(uint32_t sessionId);
+
+	/// <summary>
+	/// Adds a process' samples.
+	/// </summary>
+	void AddProcess(const OpenMetricsProcess_t& process);
+
+	/// <summary>
+	/// Sets a session-wide family's samples for one scope: USER objects, USER objects peak, GDI objects, GDI objects peak.
+	/// </summary>
+	void SetSessionCounters(OpenMetricsScope_t scope, uint64_t userObjects, uint64_t userObjectsPeak, uint64_t gdiObjects, uint64_t gdiObjectsPeak);
+
+	/// <summary>
+	/// Sets the number of processes not probed within the time budget.
+	/// </summary>
+	void SetSkippedCount(uint64_t skippedCount) { m_skippedCount = skippedCount; }
+
+	/// <summary>
+	/// Sets when the snapshot was taken, in seconds since 1970-01-01 UTC.
+	/// </summary>
+	void SetTimestamp(double dUnixSeconds) { m_dTimestamp = dUnixSeconds; }
+
+	/// <summary>
+	/// Writes the snapshot, ending with the "# EOF" line. The writer must end lines with a single LF.
+	/// </summary>
+	void Write(RowWriter_t& out);
+
+private:
+	// A process' samples, referring to its cached label set.
+	struct Sample_t
+	{
+		const std::string* pLabels;
+		uint32_t values[4];
+	};
+
+private:
+	const uint32_t m_sessionId;
+	// Identifies the label sets used by this snapshot.
+	const uint64_t m_generation;
+	std::vector<Sample_t> m_samples;
+	// Session-wide samples, indexed by OpenMetricsScope_t; only those set are written.
+	uint64_t m_sessionCounters[3][4] = {};
+	bool m_bSessionCountersSet[3] = {};
+	uint64_t m_skippedCount = 0;
+	double m_dTimestamp = 0;
+
+private:
+	OpenMetricsSnapshot_t(const OpenMetricsSnapshot_t&) = delete;
+	OpenMetricsSnapshot_t& operator = (const OpenMetricsSnapshot_t&) = delete;
+};
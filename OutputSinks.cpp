@@ -0,0 +1,487 @@
+// Destinations for RowWriter_t output.
+
+#include <Windows.h>
+#include <io.h>
+#include "SysErrorMessage.h"
+#include "OutputSinks.h"
+
+StdStreamSink_t::StdStreamSink_t(FILE* pStream, bool bBinary)
+	: m_pStream(pStream), m_hOutput(INVALID_HANDLE_VALUE), m_bConsole(false)
+{
+	m_hOutput = (HANDLE)_get_osfhandle(_fileno(pStream));
+	DWORD dwMode = 0;
+	m_bConsole = !bBinary && (INVALID_HANDLE_VALUE != m_hOutput) && (0 != GetConsoleMode(m_hOutput, &dwMode));
+}
+
+bool StdStreamSink_t::Write(const char* pData, size_t cbData)
+{
+	if (INVALID_HANDLE_VALUE == m_hOutput)
+		return false;
+
+	// Anything written through the CRT (e.g., std::wcout) goes first.
+	fflush(m_pStream);
+
+	if (m_bConsole)
+	{
+		// Convert in chunks that fit an int, splitting only at UTF-8 character boundaries.
+		while (cbData > 0)
+		{
+			size_t cbChunk = (cbData > 0x10000000) ? 0x10000000 : cbData;
+			while (cbChunk < cbData && 0x80 == (pData[cbChunk] & 0xC0))
+				--cbChunk;
+			if (m_wideBuffer.size() < cbChunk)
+				m_wideBuffer.resize(cbChunk);
+			int cchWide = MultiByteToWideChar(CP_UTF8, 0, pData, int(cbChunk), m_wideBuffer.data(), int(m_wideBuffer.size()));
+			if (0 == cchWide)
+				return false;
+			const wchar_t* pWide = m_wideBuffer.data();
+			while (cchWide > 0)
+			{
+				DWORD dwWritten = 0;
+				if (!WriteConsoleW(m_hOutput, pWide, DWORD(cchWide), &dwWritten, nullptr) || 0 == dwWritten)
+					return false;
+				pWide += dwWritten;
+				cchWide -= int(dwWritten);
+			}
+			pData += cbChunk;
+			cbData -= cbChunk;
+		}
+		return true;
+	}
+
+	while (cbData > 0)
+	{
+		DWORD dwToWrite = (cbData > 0x40000000) ? 0x40000000 : DWORD(cbData);
+		DWORD dwWritten = 0;
+		if (!WriteFile(m_hOutput, pData, dwToWrite, &dwWritten, nullptr) || 0 == dwWritten)
+			return false;
+		pData += dwWritten;
+		cbData -= dwWritten;
+	}
+	return true;
+}
+
+ReplaceFileSink_t::~ReplaceFileSink_t()
+{
+	Discard();
+}
+
+/// <summary>
+/// Closes and deletes the temporary file, if any.
+/// </summary>
+void ReplaceFileSink_t::Discard()
+{
+	if (INVALID_HANDLE_VALUE != m_hFile)
+	{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		DeleteFileW(m_sTempFilename.c_str());
+	}
+}
+
+/// <summary>
+/// Creates the temporary file for a new version of the target file.
+/// </summary>
+bool ReplaceFileSink_t::Open(const wchar_t* szFilename, std::wstring& sErrorInfo)
+{
+	Discard();
+	m_sFilename = szFilename;
+	// Same directory, so that the rename doesn't become a copy; a name that collectors looking for
+	// the target's extension (e.g., *.prom) ignore; and the PID, in case of concurrent instances.
+	m_sTempFilename = m_sFilename + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+	m_hFile = CreateFileW(m_sTempFilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == m_hFile)
+	{
+		DWORD dwLastErr = GetLastError();
+		sErrorInfo = L"Cannot create " + m_sTempFilename + L": " + SysErrorMessageWithCode(dwLastErr);
+		return false;
+	}
+	return true;
+}
+
+bool ReplaceFileSink_t::Write(const char* pData, size_t cbData)
+{
+	if (INVALID_HANDLE_VALUE == m_hFile)
+		return false;
+	while (cbData > 0)
+	{
+		DWORD dwToWrite = (cbData > 0x40000000) ? 0x40000000 : DWORD(cbData);
+		DWORD dwWritten = 0;
+		if (!WriteFile(m_hFile, pData, dwToWrite, &dwWritten, nullptr) || 0 == dwWritten)
+			return false;
+		pData += dwWritten;
+		cbData -= dwWritten;
+	}
+	return true;
+}
+
+/// <summary>
+/// Flushes and closes the temporary file, then renames it over the target file.
+/// </summary>
+bool ReplaceFileSink_t::Commit(std::wstring& sErrorInfo)
+{
+	if (INVALID_HANDLE_VALUE == m_hFile)
+	{
+		sErrorInfo = L"No output file is open";
+		return false;
+	}
+	if (!FlushFileBuffers(m_hFile))
+	{
+		DWORD dwLastErr = GetLastError();
+		sErrorInfo = L"Cannot write " + m_sTempFilename + L": " + SysErrorMessageWithCode(dwLastErr);
+		Discard();
+		return false;
+	}
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+	if (!MoveFileExW(m_sTempFilename.c_str(), m_sFilename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DWORD dwLastErr = GetLastError();
+		sErrorInfo = L"Cannot replace " + m_sFilename + L": " + SysErrorMessageWithCode(dwLastErr);
+		DeleteFileW(m_sTempFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Number of filled blocks that can wait for the compression thread before Write waits.
+static const size_t nMaxPendingBlocks = 4;
+
+CompressingSink_t::CompressingSink_t(ByteSink_t& downstream)
+	: m_downstream(downstream)
+{
+	InitializeCriticalSection(&m_critsec);
+	InitializeConditionVariable(&m_cvBlockPending);
+	InitializeConditionVariable(&m_cvBlockTaken);
+	m_current.reserve(cbLz4BlockMax);
+
+	// The frame header is written before the compression thread starts.
+	m_encoder.Begin(m_compressed);
+	m_bFailed = !m_downstream.Write(m_compressed.data(), m_compressed.size());
+	m_compressed.clear();
+
+	// If the thread can't be created, blocks are compressed as they're filled.
+	m_hThread = CreateThread(nullptr, 0, CompressThread, this, 0, nullptr);
+}
+
+CompressingSink_t::~CompressingSink_t()
+{
+	Finish();
+	DeleteCriticalSection(&m_critsec);
+}
+
+/// <summary>
+/// Compresses a block and writes it downstream.
+/// </summary>
+bool CompressingSink_t::CompressBlock(const std::vector<char>& block)
+{
+	m_compressed.clear();
+	m_encoder.EncodeBlock(block.data(), block.size(), m_compressed);
+	return m_downstream.Write(m_compressed.data(), m_compressed.size());
+}
+
+DWORD WINAPI CompressingSink_t::CompressThread(LPVOID lpvThreadParameter)
+{
+	CompressingSink_t* pThis = (CompressingSink_t*)lpvThreadParameter;
+	std::vector<char> block;
+	EnterCriticalSection(&pThis->m_critsec);
+	for (;;)
+	{
+		while (pThis->m_pending.empty() && !pThis->m_bEnd)
+			SleepConditionVariableCS(&pThis->m_cvBlockPending, &pThis->m_critsec, INFINITE);
+		if (pThis->m_pending.empty())
+			break;
+		block.swap(pThis->m_pending.front());
+		pThis->m_pending.pop_front();
+		// After a failed write, the remaining blocks are discarded.
+		const bool bFailed = pThis->m_bFailed;
+		WakeConditionVariable(&pThis->m_cvBlockTaken);
+		LeaveCriticalSection(&pThis->m_critsec);
+
+		const bool bWritten = !bFailed && pThis->CompressBlock(block);
+
+		EnterCriticalSection(&pThis->m_critsec);
+		if (!bWritten)
+			pThis->m_bFailed = true;
+		block.clear();
+		pThis->m_spare.push_back(std::vector<char>());
+		pThis->m_spare.back().swap(block);
+	}
+	LeaveCriticalSection(&pThis->m_critsec);
+	return 0;
+}
+
+/// <summary>
+/// Hands the current block to the compression thread, waiting while the maximum number of blocks are pending.
+/// </summary>
+bool CompressingSink_t::SubmitBlock()
+{
+	if (m_current.empty())
+		return true;
+
+	if (NULL == m_hThread)
+	{
+		if (!m_bFailed && !CompressBlock(m_current))
+			m_bFailed = true;
+		m_current.clear();
+		return !m_bFailed;
+	}
+
+	EnterCriticalSection(&m_critsec);
+	while (m_pending.size() >= nMaxPendingBlocks && !m_bFailed)
+		SleepConditionVariableCS(&m_cvBlockTaken, &m_critsec, INFINITE);
+	const bool bOK = !m_bFailed;
+	if (bOK)
+	{
+		m_pending.push_back(std::vector<char>());
+		m_pending.back().swap(m_current);
+		if (!m_spare.empty())
+		{
+			m_current.swap(m_spare.back());
+			m_spare.pop_back();
+		}
+		WakeConditionVariable(&m_cvBlockPending);
+	}
+	LeaveCriticalSection(&m_critsec);
+
+	m_current.clear();
+	m_current.reserve(cbLz4BlockMax);
+	return bOK;
+}
+
+bool CompressingSink_t::Write(const char* pData, size_t cbData)
+{
+	if (m_bFinished)
+		return false;
+	while (cbData > 0)
+	{
+		const size_t cbCopy = (cbData < cbLz4BlockMax - m_current.size()) ? cbData : (cbLz4BlockMax - m_current.size());
+		m_current.insert(m_current.end(), pData, pData + cbCopy);
+		pData += cbCopy;
+		cbData -= cbCopy;
+		if (cbLz4BlockMax == m_current.size() && !SubmitBlock())
+			return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Compresses any remaining input, ends the frame, and waits until all output has been written.
+/// </summary>
+bool CompressingSink_t::Finish()
+{
+	if (m_bFinished)
+		return !m_bFailed;
+
+	SubmitBlock();
+	if (NULL != m_hThread)
+	{
+		EnterCriticalSection(&m_critsec);
+		m_bEnd = true;
+		WakeConditionVariable(&m_cvBlockPending);
+		LeaveCriticalSection(&m_critsec);
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+	}
+	m_bFinished = true;
+
+	if (!m_bFailed)
+	{
+		m_compressed.clear();
+		m_encoder.End(m_compressed);
+		m_bFailed = !m_downstream.Write(m_compressed.data(), m_compressed.size());
+	}
+	return !m_bFailed;
+}
+
+// Number of chunks in a WriterThreadSink_t's queue; with cbWriterChunk, bounds the memory it uses.
+static const size_t nWriterQueueChunks = 16;
+
+WriterThreadSink_t::WriterThreadSink_t(ByteSink_t& downstream)
+	: m_downstream(downstream), m_chunks(nWriterQueueChunks)
+{
+	InitializeCriticalSection(&m_critsec);
+	InitializeConditionVariable(&m_cvChunkQueued);
+	InitializeConditionVariable(&m_cvChunkWritten);
+	QueryPerformanceFrequency(&m_liFrequency);
+	m_stats.nCapacity = nWriterQueueChunks;
+
+	// If the thread can't be created, Write writes downstream directly.
+	m_hThread = CreateThread(nullptr, 0, WriterThread, this, 0, nullptr);
+}
+
+WriterThreadSink_t::~WriterThreadSink_t()
+{
+	Finish();
+	DeleteCriticalSection(&m_critsec);
+}
+
+/// <summary>
+/// Writes a chunk downstream, timing the write.
+/// </summary>
+bool WriterThreadSink_t::WriteChunk(const std::vector<char>& chunk)
+{
+	LARGE_INTEGER liStart, liEnd;
+	QueryPerformanceCounter(&liStart);
+	const bool bWritten = m_downstream.Write(chunk.data(), chunk.size());
+	QueryPerformanceCounter(&liEnd);
+
+	EnterCriticalSection(&m_critsec);
+	m_stats.ullWriteUs += uint64_t(liEnd.QuadPart - liStart.QuadPart) * 1000000 / uint64_t(m_liFrequency.QuadPart);
+	if (bWritten)
+		m_stats.cbWritten += chunk.size();
+	if (bWritten && 0 == m_stats.llFirstWriteQpc)
+		m_stats.llFirstWriteQpc = liEnd.QuadPart;
+	LeaveCriticalSection(&m_critsec);
+	return bWritten;
+}
+
+DWORD WINAPI WriterThreadSink_t::WriterThread(LPVOID lpvThreadParameter)
+{
+	WriterThreadSink_t* pThis = (WriterThreadSink_t*)lpvThreadParameter;
+	EnterCriticalSection(&pThis->m_critsec);
+	for (;;)
+	{
+		while (pThis->m_nWritten == pThis->m_nQueued && !pThis->m_bEnd)
+			SleepConditionVariableCS(&pThis->m_cvChunkQueued, &pThis->m_critsec, INFINITE);
+		if (pThis->m_nWritten == pThis->m_nQueued)
+			break;
+		std::vector<char>& chunk = pThis->m_chunks[size_t(pThis->m_nWritten % nWriterQueueChunks)];
+		// After a failed write, queued output is discarded until the failure has been reported by Drain.
+		const bool bFailed = pThis->m_bFailed;
+		LeaveCriticalSection(&pThis->m_critsec);
+
+		const bool bWritten = !bFailed && pThis->WriteChunk(chunk);
+
+		EnterCriticalSection(&pThis->m_critsec);
+		if (!bWritten)
+			pThis->m_bFailed = true;
+		++pThis->m_nWritten;
+		WakeConditionVariable(&pThis->m_cvChunkWritten);
+	}
+	LeaveCriticalSection(&pThis->m_critsec);
+	return 0;
+}
+
+bool WriterThreadSink_t::Write(const char* pData, size_t cbData)
+{
+	if (m_bFinished)
+		return false;
+
+	while (cbData > 0)
+	{
+		const size_t cbChunk = (cbData < cbWriterChunk) ? cbData : cbWriterChunk;
+		// Without a writer thread, there's no queue and no other thread to synchronize with.
+		if (NULL == m_hThread)
+		{
+			++m_stats.nChunks;
+			if (m_bFailed || !m_downstream.Write(pData, cbChunk))
+			{
+				m_bFailed = true;
+				return false;
+			}
+			if (0 == m_stats.llFirstWriteQpc)
+			{
+				LARGE_INTEGER liNow;
+				QueryPerformanceCounter(&liNow);
+				m_stats.llFirstWriteQpc = liNow.QuadPart;
+			}
+			m_stats.cbWritten += cbChunk;
+			pData += cbChunk;
+			cbData -= cbChunk;
+			continue;
+		}
+
+		// Wait for a free chunk if the queue is full.
+		EnterCriticalSection(&m_critsec);
+		if (m_nQueued - m_nWritten >= nWriterQueueChunks)
+		{
+			LARGE_INTEGER liStart, liEnd;
+			QueryPerformanceCounter(&liStart);
+			while (m_nQueued - m_nWritten >= nWriterQueueChunks)
+				SleepConditionVariableCS(&m_cvChunkWritten, &m_critsec, INFINITE);
+			QueryPerformanceCounter(&liEnd);
+			++m_stats.nProducerWaits;
+			m_stats.ullProducerWaitUs += uint64_t(liEnd.QuadPart - liStart.QuadPart) * 1000000 / uint64_t(m_liFrequency.QuadPart);
+		}
+		const bool bFailed = m_bFailed;
+		std::vector<char>& chunk = m_chunks[size_t(m_nQueued % nWriterQueueChunks)];
+		LeaveCriticalSection(&m_critsec);
+		if (bFailed)
+			return false;
+
+		// The chunk isn't the writer thread's until it has been counted as queued.
+		chunk.assign(pData, pData + cbChunk);
+		pData += cbChunk;
+		cbData -= cbChunk;
+
+		EnterCriticalSection(&m_critsec);
+		++m_nQueued;
+		++m_stats.nChunks;
+		if (m_nQueued - m_nWritten > m_stats.nMaxQueued)
+			m_stats.nMaxQueued = size_t(m_nQueued - m_nWritten);
+		WakeConditionVariable(&m_cvChunkQueued);
+		LeaveCriticalSection(&m_critsec);
+	}
+	return true;
+}
+
+/// <summary>
+/// Waits until all queued output has been written downstream, and reports (and clears) any failure.
+/// </summary>
+bool WriterThreadSink_t::Drain()
+{
+	EnterCriticalSection(&m_critsec);
+	while (m_nWritten != m_nQueued)
+		SleepConditionVariableCS(&m_cvChunkWritten, &m_critsec, INFINITE);
+	const bool bOK = !m_bFailed;
+	m_bFailed = false;
+	LeaveCriticalSection(&m_critsec);
+	return bOK;
+}
+
+/// <summary>
+/// Writes any remaining output and ends the writer thread.
+/// </summary>
+bool WriterThreadSink_t::Finish()
+{
+	if (m_bFinished)
+		return true;
+
+	const bool bOK = Drain();
+	if (NULL != m_hThread)
+	{
+		EnterCriticalSection(&m_critsec);
+		m_bEnd = true;
+		WakeConditionVariable(&m_cvChunkQueued);
+		LeaveCriticalSection(&m_critsec);
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+	}
+	m_bFinished = true;
+	return bOK;
+}
+
+/// <summary>
+/// Returns whether a write has failed since the previous Drain.
+/// </summary>
+bool WriterThreadSink_t::Failed()
+{
+	EnterCriticalSection(&m_critsec);
+	const bool bFailed = m_bFailed;
+	LeaveCriticalSection(&m_critsec);
+	return bFailed;
+}
+
+/// <summary>
+/// Returns the statistics so far.
+/// </summary>
+WriterQueueStats_t WriterThreadSink_t::Stats()
+{
+	EnterCriticalSection(&m_critsec);
+	const WriterQueueStats_t stats = m_stats;
+	LeaveCriticalSection(&m_critsec);
+	return stats;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+// Destinations for RowWriter_t output.
+
+#include <Windows.h>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+#include "RowWriter.h"
+#include "Lz4Frame.h"
+
+/// <summary>
+/// Writes UTF-8 output directly to the OS handle underlying a CRT stream such as stdout, bypassing
+/// the CRT's per-insertion conversion. If the handle is a console, the output is converted back to
+/// UTF-16 and written with WriteConsoleW so that it displays correctly regardless of the console code page.
+/// Pending CRT output on the stream is flushed before each write so that the two stay in order.
+/// Binary output is always written as-is, even to a console.
+/// </summary>
+class StdStreamSink_t : public ByteSink_t
+{
+public:
+	/// <param name="pStream">CRT stream to write to; e.g., stdout (which might have been redirected)</param>
+	/// <param name="bBinary">true if the output is binary rather than UTF-8 text</param>
+	explicit StdStreamSink_t(FILE* pStream, bool bBinary = false);
+
+	bool Write(const char* pData, size_t cbData) override;
+
+private:
+	FILE* m_pStream;
+	HANDLE m_hOutput;
+	bool m_bConsole;
+	// Reused for conversion to UTF-16 when writing to a console
+	std::vector<wchar_t> m_wideBuffer;
+
+private:
+	StdStreamSink_t(const StdStreamSink_t&) = delete;
+	StdStreamSink_t& operator = (const StdStreamSink_t&) = delete;
+};
+
+/// <summary>
+/// Writes a file that replaces its previous version atomically: the output is written to a temporary file
+/// in the same directory, which is renamed over the target file by Commit. Readers of the target (e.g.,
+/// the node_exporter textfile collector) see either the previous version or the complete new one.
+/// If the sink is destroyed without a successful Commit, the temporary file is deleted.
+/// </summary>
+class ReplaceFileSink_t : public ByteSink_t
+{
+public:
+	ReplaceFileSink_t() = default;
+	~ReplaceFileSink_t();
+
+	/// <summary>
+	/// Creates the temporary file for a new version of the target file.
+	/// </summary>
+	/// <param name="szFilename">Input: path to the target file</param>
+	/// <param name="sErrorInfo">Output: error information on failure</param>
+	/// <returns>true if successful; false otherwise</returns>
+	bool Open(const wchar_t* szFilename, std::wstring& sErrorInfo);
+
+	bool Write(const char* pData, size_t cbData) override;
+
+	/// <summary>
+	/// Flushes and closes the temporary file, then renames it over the target file.
+	/// </summary>
+	/// <param name="sErrorInfo">Output: error information on failure</param>
+	/// <returns>true if successful; false otherwise</returns>
+	bool Commit(std::wstring& sErrorInfo);
+
+private:
+	// Closes and deletes the temporary file, if any.
+	void Discard();
+
+private:
+	std::wstring m_sFilename, m_sTempFilename;
+	HANDLE m_hFile = INVALID_HANDLE_VALUE;
+
+private:
+	ReplaceFileSink_t(const ReplaceFileSink_t&) = delete;
+	ReplaceFileSink_t& operator = (const ReplaceFileSink_t&) = delete;
+};
+
+/// <summary>
+/// Compresses its input as one LZ4 frame (see Lz4Frame.h) on a background thread, and writes the
+/// compressed output to another sink. Input is split into blocks; at most a few blocks are waiting
+/// for compression at a time, and Write waits for the compression thread when that many are pending,
+/// so memory use stays bounded however much output there is.
+/// The frame is complete once Finish has been called (or the sink has been destroyed).
+/// </summary>
+class CompressingSink_t : public ByteSink_t
+{
+public:
+	/// <param name="downstream">Destination for the compressed output; must outlive this object</param>
+	explicit CompressingSink_t(ByteSink_t& downstream);
+	// Finishes the frame if Finish hasn't been called.
+	~CompressingSink_t();
+
+	bool Write(const char* pData, size_t cbData) override;
+
+	/// <summary>
+	/// Compresses any remaining input, ends the frame, and waits until all output has been written.
+	/// </summary>
+	/// <returns>true if all output has been written successfully; false otherwise</returns>
+	bool Finish();
+
+private:
+	static DWORD WINAPI CompressThread(LPVOID lpvThreadParameter);
+	// Hands the current block to the compression thread (or, if there's no thread, compresses it here).
+	bool SubmitBlock();
+	// Compresses a block and writes it downstream.
+	bool CompressBlock(const std::vector<char>& block);
+
+private:
+	ByteSink_t& m_downstream;
+	// Used by the compression thread while it runs, otherwise by the caller's thread.
+	Lz4FrameEncoder_t m_encoder;
+	std::vector<char> m_compressed;
+	// Block being filled by Write
+	std::vector<char> m_current;
+	// Protected by m_critsec: blocks waiting for compression, emptied buffers to reuse, and status.
+	std::deque<std::vector<char>> m_pending;
+	std::vector<std::vector<char>> m_spare;
+	bool m_bEnd = false, m_bFailed = false;
+	CRITICAL_SECTION m_critsec;
+	// Signaled when a block is pending or the input has ended, and when a pending block has been taken.
+	CONDITION_VARIABLE m_cvBlockPending, m_cvBlockTaken;
+	HANDLE m_hThread = NULL;
+	bool m_bFinished = false;
+
+private:
+	CompressingSink_t(const CompressingSink_t&) = delete;
+	CompressingSink_t& operator = (const CompressingSink_t&) = delete;
+};
+
+// Largest amount of output in one chunk of a WriterThreadSink_t's queue; also a suitable amount
+// for RowWriter_t to buffer before writing, so that output is queued as it's formatted.
+const size_t cbWriterChunk = 64 * 1024;
+
+/// <summary>
+/// Statistics from a WriterThreadSink_t. Waits by Write are backpressure: the writer thread couldn't keep up
+/// with the output (e.g., a slow pipe or console), so formatting was held up until it caught up.
+/// </summary>
+struct WriterQueueStats_t
+{
+	// Output written downstream, and the number of chunks it was queued in
+	uint64_t cbWritten = 0, nChunks = 0;
+	// Most chunks queued at one time, out of the queue's capacity
+	size_t nMaxQueued = 0, nCapacity = 0;
+	// Number of times, and total time, Write waited for room in the queue
+	uint64_t nProducerWaits = 0, ullProducerWaitUs = 0;
+	// Time the writer thread spent in downstream writes
+	uint64_t ullWriteUs = 0;
+	// QueryPerformanceCounter value when the first write downstream completed; 0 if there hasn't been one
+	LONGLONG llFirstWriteQpc = 0;
+};
+
+/// <summary>
+/// Writes its input to another sink on a dedicated writer thread, through a bounded single-producer,
+/// single-consumer queue of chunks, so that the thread producing the output continues while the output is
+/// written. Write copies its input into free chunks and waits only when the queue is full. Output can be
+/// written across any number of snapshots; Drain waits until everything queued so far has been written.
+/// The sink must be written to by one thread at a time.
+/// </summary>
+class WriterThreadSink_t : public ByteSink_t
+{
+public:
+	/// <param name="downstream">Destination for the output; must outlive this object</param>
+	explicit WriterThreadSink_t(ByteSink_t& downstream);
+	// Finishes writing if Finish hasn't been called.
+	~WriterThreadSink_t();
+
+	bool Write(const char* pData, size_t cbData) override;
+
+	/// <summary>
+	/// Waits until all queued output has been written downstream.
+	/// </summary>
+	/// <returns>true if all output since the previous Drain has been written successfully; false otherwise</returns>
+	bool Drain();
+
+	/// <summary>
+	/// Writes any remaining output and ends the writer thread. Write fails afterwards.
+	/// </summary>
+	/// <returns>true if all output since the previous Drain has been written successfully; false otherwise</returns>
+	bool Finish();
+
+	/// <summary>
+	/// Returns whether a write has failed since the previous Drain, without waiting for queued output.
+	/// </summary>
+	bool Failed();
+
+	/// <summary>
+	/// Returns the statistics so far.
+	/// </summary>
+	WriterQueueStats_t Stats();
+
+private:
+	static DWORD WINAPI WriterThread(LPVOID lpvThreadParameter);
+	// Writes a chunk downstream, timing the write.
+	bool WriteChunk(const std::vector<char>& chunk);
+
+private:
+	ByteSink_t& m_downstream;
+	// Ring of chunks. The producer fills m_chunks[m_nQueued % size] and the writer thread empties
+	// m_chunks[m_nWritten % size]; each owns its chunk without the lock, which protects only the counts.
+	std::vector<std::vector<char>> m_chunks;
+	// Protected by m_critsec: numbers of chunks queued and written, status, and statistics.
+	uint64_t m_nQueued = 0, m_nWritten = 0;
+	bool m_bEnd = false, m_bFailed = false;
+	WriterQueueStats_t m_stats;
+	CRITICAL_SECTION m_critsec;
+	// Signaled when a chunk has been queued or the input has ended, and when a chunk has been written.
+	CONDITION_VARIABLE m_cvChunkQueued, m_cvChunkWritten;
+	HANDLE m_hThread = NULL;
+	bool m_bFinished = false;
+	LARGE_INTEGER m_liFrequency;
+
+private:
+	WriterThreadSink_t(const WriterThreadSink_t&) = delete;
+	WriterThreadSink_t& operator = (const WriterThreadSink_t&) = delete;
+};
+
+/// <summary>
+/// Collects output in memory.
+/// </summary>
+class MemorySink_t : public ByteSink_t
+{
+public:
+	bool Write(const char* pData, size_t cbData) override { m_data.insert(m_data.end(), pData, pData + cbData); return true; }
+	const std::vector<char>& Data() const { return m_data; }
+
+private:
+	std::vector<char> m_data;
+};
@@ -0,0 +1,245 @@
+// Probing processes for their USER and GDI object counts, within a time budget.
+
+#include <Windows.h>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include "Utilities.h"
+#include "ServiceLookupByPID.h"
+#include "ProcessProbe.h"
+
+/// <summary>
+/// Reads a process' USER and GDI object counts, and records when they were read.
+/// </summary>
+void ReadGuiCounters(HANDLE hProcess, GuiCounters_t& counters)
+{
+	counters.dwUserObjects = GetGuiResources(hProcess, GR_USEROBJECTS);
+	counters.dwUserObjectsPeak = GetGuiResources(hProcess, GR_USEROBJECTS_PEAK);
+	counters.dwGdiObjects = GetGuiResources(hProcess, GR_GDIOBJECTS);
+	counters.dwGdiObjectsPeak = GetGuiResources(hProcess, GR_GDIOBJECTS_PEAK);
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	counters.llReadTime = liNow.QuadPart;
+}
+
+/// <summary>
+/// USER+GDI count of a process from a previous snapshot, along with its name to detect PID reuse.
+/// </summary>
+struct LastKnownSize_t
+{
+	std::wstring sProcessName;
+	DWORD dwSize = 0;
+};
+
+/// <summary>
+/// Last-known sizes of processes, from previous snapshots taken by this process.
+/// Accessed only by ProbeProcesses' calling thread (never by a worker thread, which might be abandoned).
+/// </summary>
+static std::unordered_map<DWORD, LastKnownSize_t> st_lastKnownSizes;
+
+/// <summary>
+/// State shared between ProbeProcesses and its worker thread. Reference-counted so that the worker
+/// thread can be abandoned if it doesn't finish within the time budget. Everything the worker thread
+/// uses is reachable from here, including its own reference to the service lookup, so an abandoned
+/// worker doesn't depend on global state that a later snapshot or the process' exit might change.
+/// </summary>
+struct ProbeState_t
+{
+	ProbeState_t() { InitializeCriticalSection(&critsec); }
+	~ProbeState_t() { DeleteCriticalSection(&critsec); }
+
+	// Input: processes to probe, in priority order
+	std::vector<ProcessRow_t> pending;
+	// Output: rows for the processes probed so far. Protected by critsec.
+	std::vector<ProcessRow_t> rows;
+	// Set when ProbeProcesses stops waiting for the worker thread. Protected by critsec.
+	bool bAbandoned = false;
+	// Pacing: fraction of one core that probing may use (0 for no pacing).
+	double dCpuBudgetFraction = 0;
+	// The worker thread's reference to the PID-to-service lookup
+	std::shared_ptr<ServiceLookup_t> pServiceLookup;
+	// Timing information, updated after each probe. Protected by critsec.
+	ULONGLONG ullElapsedMs = 0, ullPacingDelayMs = 0, ullCpuMs = 0;
+	CRITICAL_SECTION critsec;
+
+private:
+	ProbeState_t(const ProbeState_t&) = delete;
+	ProbeState_t& operator = (const ProbeState_t&) = delete;
+};
+
+/// <summary>
+/// Probes one process: services hosted, USER/GDI counters, parent PID.
+/// </summary>
+static void ProbeProcess(ServiceLookup_t& serviceLookup, ProcessRow_t& row)
+{
+	// Identify any services running in that process. (The joined label is precomputed by the lookup table.)
+	LookupServicesByPID(serviceLookup, (ULONG_PTR)row.dwPID, row.services);
+
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, row.dwPID);
+	if (hProcess)
+	{
+		row.bOpened = true;
+		// Get information about the process' User and GDI objects.
+		ReadGuiCounters(hProcess, row.counters);
+		// Get the PID of the process' parent process
+		row.ppid = GetParentPID(hProcess, row.sPPIDError);
+		CloseHandle(hProcess);
+	}
+	else
+	{
+		row.dwOpenError = GetLastError();
+	}
+}
+
+/// <summary>
+/// Returns the CPU time (user + kernel) consumed by the current thread so far, in milliseconds; 0 on failure.
+/// </summary>
+static ULONGLONG CurrentThreadCpuMs()
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser))
+		return 0;
+	ULARGE_INTEGER ulKernel, ulUser;
+	ulKernel.LowPart = ftKernel.dwLowDateTime;
+	ulKernel.HighPart = ftKernel.dwHighDateTime;
+	ulUser.LowPart = ftUser.dwLowDateTime;
+	ulUser.HighPart = ftUser.dwHighDateTime;
+	// FILETIME units are 100 nanoseconds
+	return (ulKernel.QuadPart + ulUser.QuadPart) / 10000;
+}
+
+/// <summary>
+/// Worker thread that probes the pending processes in order until done or abandoned.
+/// </summary>
+/// <param name="lpvThreadParameter">Heap-allocated std::shared_ptr to the ProbeState_t; the thread deletes it.</param>
+/// <returns>Always returns 0</returns>
+static DWORD WINAPI ProbeThread(LPVOID lpvThreadParameter)
+{
+	std::shared_ptr<ProbeState_t>* pStateRef = (std::shared_ptr<ProbeState_t>*)lpvThreadParameter;
+	std::shared_ptr<ProbeState_t> state = *pStateRef;
+	delete pStateRef;
+
+	// (If there's no worker thread, this runs on the calling thread, so measure CPU time from here.)
+	const ULONGLONG ullStart = GetTickCount64();
+	const ULONGLONG ullCpuStartMs = CurrentThreadCpuMs();
+	ULONGLONG ullPacingDelayMs = 0;
+	for (size_t ix = 0; ix < state->pending.size(); ++ix)
+	{
+		ProcessRow_t row = state->pending[ix];
+		ProbeProcess(*state->pServiceLookup, row);
+
+		// CPU time consumed by probing so far
+		const ULONGLONG ullCpuMs = CurrentThreadCpuMs() - ullCpuStartMs;
+
+		// Pacing: if the CPU time spent probing so far exceeds the CPU budget's share of the total elapsed
+		// time, sleep until it doesn't. No need to sleep after the last probe.
+		ULONGLONG ullElapsedMs = GetTickCount64() - ullStart;
+		if (state->dCpuBudgetFraction > 0 && ix + 1 < state->pending.size())
+		{
+			// (Thread CPU times are updated at clock-tick granularity, so individual probes can measure as 0
+			// or as a whole tick; over a run of probes the pacing converges on the budget.)
+			ULONGLONG ullTargetElapsedMs = ULONGLONG(double(ullCpuMs) / state->dCpuBudgetFraction);
+			if (ullTargetElapsedMs > ullElapsedMs)
+			{
+				DWORD dwSleepMs = DWORD(ullTargetElapsedMs - ullElapsedMs);
+				Sleep(dwSleepMs);
+				ullPacingDelayMs += dwSleepMs;
+				ullElapsedMs = GetTickCount64() - ullStart;
+			}
+		}
+
+		EnterCriticalSection(&state->critsec);
+		bool bAbandoned = state->bAbandoned;
+		if (!bAbandoned)
+		{
+			state->rows.push_back(row);
+			state->ullElapsedMs = ullElapsedMs;
+			state->ullPacingDelayMs = ullPacingDelayMs;
+			state->ullCpuMs = ullCpuMs;
+		}
+		LeaveCriticalSection(&state->critsec);
+		if (bAbandoned)
+			break;
+	}
+	return 0;
+}
+
+/// <summary>
+/// Priority with which to probe a process; higher values are probed first.
+/// </summary>
+static ULONGLONG ProbePriority(const ProcessRow_t& row)
+{
+	std::unordered_map<DWORD, LastKnownSize_t>::const_iterator iterLastKnown = st_lastKnownSizes.find(row.dwPID);
+	if (iterLastKnown != st_lastKnownSizes.end() && iterLastKnown->second.sProcessName == row.sProcessName)
+	{
+		// Seen before: largest first if it had USER/GDI objects; last of all if it had none.
+		if (iterLastKnown->second.dwSize > 0)
+			return (1ULL << 32) + iterLastKnown->second.dwSize;
+		else
+			return 0;
+	}
+	// Not seen before: use the handle count as a rough proxy for size.
+	return 1ULL + row.dwHandleCountHint;
+}
+
+/// <summary>
+/// Probes the input processes on a worker thread in priority order, within a time budget.
+/// </summary>
+void ProbeProcesses(const std::vector<ProcessRow_t>& processes, DWORD dwBudgetMilliseconds, double dCpuBudgetPercent, ProbeResults_t& results)
+{
+	results.rows.clear();
+	results.nSkipped = 0;
+
+	std::shared_ptr<ProbeState_t> state = std::make_shared<ProbeState_t>();
+	state->pending = processes;
+	state->dCpuBudgetFraction = dCpuBudgetPercent / 100.0;
+	state->pServiceLookup = ServiceLookupReference();
+	std::stable_sort(state->pending.begin(), state->pending.end(),
+		[](const ProcessRow_t& a, const ProcessRow_t& b) { return ProbePriority(a) > ProbePriority(b); });
+
+	std::shared_ptr<ProbeState_t>* pStateRef = new std::shared_ptr<ProbeState_t>(state);
+	HANDLE hThread = CreateThread(nullptr, 0, ProbeThread, pStateRef, 0, nullptr);
+	if (NULL != hThread)
+	{
+		WaitForSingleObject(hThread, dwBudgetMilliseconds);
+		CloseHandle(hThread);
+	}
+	else
+	{
+		// Couldn't start a thread; probe on this thread without a time limit.
+		ProbeThread(pStateRef);
+	}
+
+	// Take the rows collected so far. If the worker thread is still running, it stops at its next check.
+	EnterCriticalSection(&state->critsec);
+	state->bAbandoned = true;
+	results.rows.swap(state->rows);
+	results.ullElapsedMs = state->ullElapsedMs;
+	results.ullPacingDelayMs = state->ullPacingDelayMs;
+	results.ullCpuMs = state->ullCpuMs;
+	LeaveCriticalSection(&state->critsec);
+
+	results.nSkipped = state->pending.size() - results.rows.size();
+	std::sort(results.rows.begin(), results.rows.end(),
+		[](const ProcessRow_t& a, const ProcessRow_t& b) { return a.ixEnum < b.ixEnum; });
+
+	// Remember the sizes for prioritizing the next snapshot. Processes that weren't probed this time
+	// keep their previous sizes; processes that no longer exist are forgotten.
+	std::unordered_map<DWORD, LastKnownSize_t> lastKnownSizes;
+	for (std::vector<ProcessRow_t>::const_iterator iterProc = processes.begin(); iterProc != processes.end(); ++iterProc)
+	{
+		std::unordered_map<DWORD, LastKnownSize_t>::const_iterator iterLastKnown = st_lastKnownSizes.find(iterProc->dwPID);
+		if (iterLastKnown != st_lastKnownSizes.end() && iterLastKnown->second.sProcessName == iterProc->sProcessName)
+			lastKnownSizes[iterProc->dwPID] = iterLastKnown->second;
+	}
+	for (std::vector<ProcessRow_t>::const_iterator iterRow = results.rows.begin(); iterRow != results.rows.end(); ++iterRow)
+	{
+		if (iterRow->bOpened)
+		{
+			LastKnownSize_t& lastKnown = lastKnownSizes[iterRow->dwPID];
+			lastKnown.sProcessName = iterRow->sProcessName;
+			lastKnown.dwSize = iterRow->counters.dwUserObjects + iterRow->counters.dwGdiObjects;
+		}
+	}
+	st_lastKnownSizes.swap(lastKnownSizes);
+}
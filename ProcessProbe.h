@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include "CSid.h"
+#include "HandleCounts.h"
+#include "ServiceLookupCache.h"
+
+/// <summary>
+/// USER and GDI object counts for a process (or for the whole session, with GR_GLOBAL), and the
+/// high-resolution timestamp (QueryPerformanceCounter value) of when they were read.
+/// </summary>
+struct GuiCounters_t
+{
+	DWORD dwUserObjects = 0, dwUserObjectsPeak = 0, dwGdiObjects = 0, dwGdiObjectsPeak = 0;
+	LONGLONG llReadTime = 0;
+};
+
+/// <summary>
+/// Reads a process' USER and GDI object counts, and records when they were read.
+/// </summary>
+/// <param name="hProcess">Input: process handle, or GR_GLOBAL for session-wide usage</param>
+/// <param name="counters">Output: counts and timestamp</param>
+void ReadGuiCounters(HANDLE hProcess, GuiCounters_t& counters);
+
+/// <summary>
+/// Information collected about one process in the snapshot.
+/// The fields through dwHandleCountHint are filled in from the process enumeration before probing;
+/// the remaining fields are filled in by probing the process.
+/// </summary>
+struct ProcessRow_t
+{
+	// Position of the process in the enumeration; rows are reported in this order.
+	size_t ixEnum = 0;
+	DWORD dwSessionID = 0, dwPID = 0;
+	std::wstring sProcessName;
+	// The account executing the process.
+	CSid sid;
+	// WindowStation and Desktop handle counts from the handle table snapshot, if requested.
+	WinStaDesktopHandleCounts_t handleCounts;
+	// Handle count from the process enumeration, used to prioritize processes not seen before.
+	DWORD dwHandleCountHint = 0;
+
+	// Services hosted in the process; services.labels has their names, etc., joined for display.
+	ServiceList_t services;
+	// Whether the process could be opened and its counters read; if not, the error code.
+	bool bOpened = false;
+	DWORD dwOpenError = 0;
+	GuiCounters_t counters;
+	// The process' parent PID; if 0, sPPIDError has error information.
+	ULONG_PTR ppid = 0;
+	std::wstring sPPIDError;
+};
+
+/// <summary>
+/// Results from probing the processes in a snapshot.
+/// </summary>
+struct ProbeResults_t
+{
+	// Rows for the processes that were probed, in enumeration order.
+	std::vector<ProcessRow_t> rows;
+	// Number of processes that were not probed because the time budget ran out.
+	size_t nSkipped = 0;
+	// Time from start to end of probing, and how much of it was pacing delay (if pacing was requested).
+	ULONGLONG ullElapsedMs = 0, ullPacingDelayMs = 0;
+	// CPU time (user + kernel) consumed by the probing thread.
+	ULONGLONG ullCpuMs = 0;
+};
+
+/// <summary>
+/// Probes the input processes -- services hosted, USER/GDI counters, parent PID -- on a worker thread,
+/// in priority order: processes with the largest last-known USER+GDI counts first, then processes not
+/// seen in a previous snapshot in order of handle count, then processes last seen with no USER/GDI objects.
+/// If the time budget runs out, returns the rows probed so far and abandons the worker thread, so that
+/// a hung call against a single process can't cost the whole snapshot.
+/// If a CPU budget is specified, the worker thread sleeps between probes so that the CPU time it has
+/// consumed (as measured by GetThreadTimes) stays within that percentage of one core over the elapsed
+/// time. Time spent blocked in a probe doesn't count as CPU time. Pacing delays count against the time budget.
+/// </summary>
+/// <param name="processes">Input: processes to probe, with the enumeration fields filled in</param>
+/// <param name="dwBudgetMilliseconds">Input: maximum time to spend probing; INFINITE for no limit</param>
+/// <param name="dCpuBudgetPercent">Input: percentage of one core to pace probing to; 0 for no pacing</param>
+/// <param name="results">Output: probed rows, number of skipped processes, timing information</param>
+void ProbeProcesses(const std::vector<ProcessRow_t>& processes, DWORD dwBudgetMilliseconds, double dCpuBudgetPercent, ProbeResults_t& results);
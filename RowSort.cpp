@@ -0,0 +1,84 @@
+// Sorting output rows by a column, with stable LSD radix sorts.
+
+#include <algorithm>
+#include "RowSort.h"
+
+/// <summary>
+/// A row's key and index, kept together so that each pass reads and writes them sequentially.
+/// </summary>
+struct KeyedRow_t
+{
+	uint64_t key;
+	uint32_t ixRow;
+};
+
+/// <summary>
+/// Stable LSD radix sort of row indexes by their keys, a byte at a time.
+/// </summary>
+void StableRadixSort(std::vector<uint32_t>& order, const std::vector<uint64_t>& keys, bool bDescending)
+{
+	const size_t nRows = order.size();
+	if (nRows < 2)
+		return;
+
+	// Descending order is ascending order of the complemented keys, which keeps equal keys in order.
+	const uint64_t keyMask = bDescending ? ~uint64_t(0) : 0;
+	std::vector<KeyedRow_t> rows(nRows), sorted(nRows);
+	// Histograms of all eight bytes, collected in one pass.
+	std::vector<size_t> counts(8 * 256, 0);
+	for (size_t ix = 0; ix < nRows; ++ix)
+	{
+		const uint64_t key = keys[order[ix]] ^ keyMask;
+		rows[ix].key = key;
+		rows[ix].ixRow = order[ix];
+		for (size_t ixByte = 0; ixByte < 8; ++ixByte)
+			++counts[ixByte * 256 + size_t((key >> (ixByte * 8)) & 0xFF)];
+	}
+
+	for (size_t ixByte = 0; ixByte < 8; ++ixByte)
+	{
+		size_t* const pCounts = counts.data() + ixByte * 256;
+		const int nShift = int(ixByte * 8);
+		// A pass over a byte in which every key has the same value wouldn't change the order.
+		if (nRows == pCounts[size_t((rows[0].key >> nShift) & 0xFF)])
+			continue;
+		// Counts become the starting positions of each byte value's rows.
+		size_t ixStart = 0;
+		for (size_t ixValue = 0; ixValue < 256; ++ixValue)
+		{
+			const size_t nCount = pCounts[ixValue];
+			pCounts[ixValue] = ixStart;
+			ixStart += nCount;
+		}
+		for (std::vector<KeyedRow_t>::const_iterator iterRow = rows.begin(); iterRow != rows.end(); ++iterRow)
+			sorted[pCounts[size_t((iterRow->key >> nShift) & 0xFF)]++] = *iterRow;
+		rows.swap(sorted);
+	}
+
+	for (size_t ix = 0; ix < nRows; ++ix)
+		order[ix] = rows[ix].ixRow;
+}
+
+/// <summary>
+/// Replaces strings by their ranks in ordinal order: the distinct values are sorted once, then each row's rank is looked up.
+/// </summary>
+template <typename View_t>
+static void RankStringViews(const std::vector<View_t>& values, std::vector<uint64_t>& ranks)
+{
+	std::vector<View_t> distinct(values);
+	std::sort(distinct.begin(), distinct.end());
+	distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+	ranks.resize(values.size());
+	for (size_t ix = 0; ix < values.size(); ++ix)
+		ranks[ix] = uint64_t(std::lower_bound(distinct.begin(), distinct.end(), values[ix]) - distinct.begin());
+}
+
+void RankStrings(const std::vector<std::wstring_view>& values, std::vector<uint64_t>& ranks)
+{
+	RankStringViews(values, ranks);
+}
+
+void RankStrings(const std::vector<std::string_view>& values, std::vector<uint64_t>& ranks)
+{
+	RankStringViews(values, ranks);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// Sorting output rows by a column, with stable LSD radix sorts over an array of row indexes.
+// Platform-independent (no Windows.h).
+//
+// Each column is turned into one 64-bit key per row: numbers are used as-is, and strings are replaced
+// by their rank among the column's distinct values. Sorting by several columns is done by sorting by
+// each one in turn, least significant first; because every sort is stable, rows with equal keys keep
+// the order the previous sort gave them.
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// Stable LSD radix sort of row indexes by their keys, a byte at a time. Bytes in which all keys
+/// are the same are skipped, so small keys (e.g., PIDs or string ranks) take only a few passes.
+/// </summary>
+/// <param name="order">Input/output: row indexes, in the order to preserve among equal keys; re-sorted by key</param>
+/// <param name="keys">Input: sort key of each row, indexed by row index</param>
+/// <param name="bDescending">Input: true to sort largest first (equal keys still keep their order)</param>
+void StableRadixSort(std::vector<uint32_t>& order, const std::vector<uint64_t>& keys, bool bDescending);
+
+/// <summary>
+/// Replaces strings by their ranks in ordinal (code unit) order, for use as sort keys. Equal strings get equal ranks.
+/// </summary>
+/// <param name="values">Input: each row's string</param>
+/// <param name="ranks">Output: each row's rank</param>
+void RankStrings(const std::vector<std::wstring_view>& values, std::vector<uint64_t>& ranks);
+void RankStrings(const std::vector<std::string_view>& values, std::vector<uint64_t>& ranks);
@@ -0,0 +1,188 @@
+// Buffered UTF-8 writer for tab-delimited output rows.
+
+#include <charconv>
+#include "RowWriter.h"
+
+// Default line ending: CR+LF, as written by the CRT's text-mode output that this replaces.
+static const char szLineEnding[] = "\r\n";
+
+RowWriter_t::RowWriter_t(ByteSink_t& sink, size_t cbMaxBuffered)
+	: m_sink(sink), m_cbMaxBuffered(cbMaxBuffered), m_sLineEnding(szLineEnding, sizeof(szLineEnding) - 1)
+{
+	m_buffer.resize(64 * 1024);
+}
+
+RowWriter_t::~RowWriter_t()
+{
+	Flush();
+}
+
+/// <summary>
+/// Ensures that at least cbNeeded more bytes can be appended, returning where to append them.
+/// </summary>
+char* RowWriter_t::Reserve(size_t cbNeeded)
+{
+	if (m_buffer.size() - m_cbUsed < cbNeeded)
+	{
+		size_t cbNewSize = m_buffer.size() * 2;
+		if (cbNewSize < m_cbUsed + cbNeeded)
+			cbNewSize = m_cbUsed + cbNeeded;
+		m_buffer.resize(cbNewSize);
+	}
+	return m_buffer.data() + m_cbUsed;
+}
+
+/// <summary>
+/// Transcodes UTF-16 text to UTF-8.
+/// </summary>
+size_t EncodeUtf8(std::wstring_view sText, char* pOut)
+{
+	char* const pStart = pOut;
+	const wchar_t* pIn = sText.data();
+	const wchar_t* const pEnd = pIn + sText.size();
+	while (pIn < pEnd)
+	{
+		uint32_t ch = uint32_t(*pIn++);
+		if (ch < 0x80)
+		{
+			*pOut++ = char(ch);
+			continue;
+		}
+		if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			// Combine a high surrogate with the following low surrogate; anything else is unpaired.
+			if (ch <= 0xDBFF && pIn < pEnd && uint32_t(*pIn) >= 0xDC00 && uint32_t(*pIn) <= 0xDFFF)
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (uint32_t(*pIn++) - 0xDC00);
+			else
+				ch = 0xFFFD;
+		}
+		if (ch < 0x800)
+		{
+			*pOut++ = char(0xC0 | (ch >> 6));
+			*pOut++ = char(0x80 | (ch & 0x3F));
+		}
+		else if (ch < 0x10000)
+		{
+			*pOut++ = char(0xE0 | (ch >> 12));
+			*pOut++ = char(0x80 | ((ch >> 6) & 0x3F));
+			*pOut++ = char(0x80 | (ch & 0x3F));
+		}
+		else
+		{
+			*pOut++ = char(0xF0 | (ch >> 18));
+			*pOut++ = char(0x80 | ((ch >> 12) & 0x3F));
+			*pOut++ = char(0x80 | ((ch >> 6) & 0x3F));
+			*pOut++ = char(0x80 | (ch & 0x3F));
+		}
+	}
+	return size_t(pOut - pStart);
+}
+
+RowWriter_t& RowWriter_t::operator << (std::wstring_view sText)
+{
+	char* pOut = Reserve(sText.size() * cbMaxUtf8PerUtf16);
+	m_cbUsed += EncodeUtf8(sText, pOut);
+	return *this;
+}
+
+/// <summary>
+/// Appends bytes that are already UTF-8 (or ASCII), without transcoding.
+/// </summary>
+void RowWriter_t::AppendUtf8(const char* pData, size_t cbData)
+{
+	char* pOut = Reserve(cbData);
+	for (size_t ix = 0; ix < cbData; ++ix)
+		pOut[ix] = pData[ix];
+	m_cbUsed += cbData;
+}
+
+void RowWriter_t::AppendUnsigned(uint64_t value)
+{
+	// 20 digits is enough for any 64-bit value
+	char* pOut = Reserve(20);
+	std::to_chars_result result = std::to_chars(pOut, pOut + 20, value);
+	m_cbUsed += size_t(result.ptr - pOut);
+}
+
+void RowWriter_t::AppendSigned(int64_t value)
+{
+	// Sign plus 19 digits
+	char* pOut = Reserve(20);
+	std::to_chars_result result = std::to_chars(pOut, pOut + 20, value);
+	m_cbUsed += size_t(result.ptr - pOut);
+}
+
+/// <summary>
+/// Appends a number in fixed-point notation with the given number of decimal places.
+/// </summary>
+void RowWriter_t::AppendFixed(double value, int nDecimals)
+{
+	// Large enough for any value this program reports; to_chars fails rather than overflow if not.
+	const size_t cbMax = 64;
+	char* pOut = Reserve(cbMax);
+	std::to_chars_result result = std::to_chars(pOut, pOut + cbMax, value, std::chars_format::fixed, nDecimals);
+	if (std::errc() == result.ec)
+		m_cbUsed += size_t(result.ptr - pOut);
+}
+
+/// <summary>
+/// Appends UTF-16 text as a quoted JSON string, transcoded to UTF-8.
+/// </summary>
+void RowWriter_t::AppendJsonString(std::wstring_view sText)
+{
+	static const char szHexDigits[] = "0123456789abcdef";
+	AppendUtf8("\"", 1);
+	// Escape runs are written a character at a time; everything else is transcoded in runs.
+	const wchar_t* pRun = sText.data();
+	const wchar_t* const pEnd = pRun + sText.size();
+	for (const wchar_t* pCurr = pRun; pCurr < pEnd; ++pCurr)
+	{
+		const wchar_t ch = *pCurr;
+		if (ch >= 0x20 && L'"' != ch && L'\\' != ch)
+			continue;
+		*this << std::wstring_view(pRun, size_t(pCurr - pRun));
+		pRun = pCurr + 1;
+		switch (ch)
+		{
+		case L'"': AppendUtf8("\\\"", 2); break;
+		case L'\\': AppendUtf8("\\\\", 2); break;
+		case L'\n': AppendUtf8("\\n", 2); break;
+		case L'\r': AppendUtf8("\\r", 2); break;
+		case L'\t': AppendUtf8("\\t", 2); break;
+		case L'\b': AppendUtf8("\\b", 2); break;
+		case L'\f': AppendUtf8("\\f", 2); break;
+		default:
+			{
+				char szEscape[6] = { '\\', 'u', '0', '0', szHexDigits[(ch >> 4) & 0xF], szHexDigits[ch & 0xF] };
+				AppendUtf8(szEscape, sizeof(szEscape));
+			}
+			break;
+		}
+	}
+	*this << std::wstring_view(pRun, size_t(pEnd - pRun));
+	AppendUtf8("\"", 1);
+}
+
+/// <summary>
+/// Ends the current line. Writes the buffered output if it exceeds the size limit.
+/// </summary>
+void RowWriter_t::EndLine()
+{
+	AppendUtf8(m_sLineEnding.data(), m_sLineEnding.size());
+	if (m_cbUsed >= m_cbMaxBuffered)
+		Flush();
+}
+
+/// <summary>
+/// Writes all buffered output to the sink.
+/// </summary>
+bool RowWriter_t::Flush()
+{
+	if (m_cbUsed > 0)
+	{
+		if (!m_sink.Write(m_buffer.data(), m_cbUsed))
+			m_bWriteFailed = true;
+		m_cbUsed = 0;
+	}
+	return !m_bWriteFailed;
+}
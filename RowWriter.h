@@ -0,0 +1,142 @@
+#pragma once
+
+// Buffered UTF-8 writer for tab-delimited output rows.
+// Platform-independent (no Windows.h): the destination is supplied through ByteSink_t, so formatting
+// can be exercised and benchmarked with a stand-in sink on any platform.
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Each UTF-16 code unit becomes at most three bytes of UTF-8 (a surrogate pair, four bytes for two units).
+const size_t cbMaxUtf8PerUtf16 = 3;
+
+/// <summary>
+/// Transcodes UTF-16 text to UTF-8. (Unpaired surrogates are written as U+FFFD.)
+/// </summary>
+/// <param name="sText">Input: text to transcode</param>
+/// <param name="pOut">Output: buffer with room for at least sText.size() * cbMaxUtf8PerUtf16 bytes</param>
+/// <returns>Number of bytes written</returns>
+size_t EncodeUtf8(std::wstring_view sText, char* pOut);
+
+/// <summary>
+/// Destination for a RowWriter_t's encoded output.
+/// </summary>
+class ByteSink_t
+{
+public:
+	virtual ~ByteSink_t() = default;
+	/// <summary>
+	/// Writes a block of bytes.
+	/// </summary>
+	/// <returns>true if all the bytes were written; false otherwise</returns>
+	virtual bool Write(const char* pData, size_t cbData) = 0;
+};
+
+/// <summary>
+/// Formats text and integers directly into a reusable UTF-8 buffer and writes it to a sink in large blocks.
+/// Strings are transcoded from UTF-16 once, as they're appended; integers are formatted with std::to_chars.
+/// Nothing is written to the sink until Flush() is called (e.g., at the end of a snapshot), unless the
+/// buffered output exceeds the size limit given to the constructor.
+///
+/// Example usage:
+///     RowWriter_t out(sink);
+///     out << L"PID" << L'\t' << dwPID;
+///     out.EndLine();
+///     out.Flush();
+/// </summary>
+class RowWriter_t
+{
+public:
+	/// <param name="sink">Destination for the output; must outlive this object</param>
+	/// <param name="cbMaxBuffered">Amount of output to buffer before writing it without waiting for Flush()</param>
+	explicit RowWriter_t(ByteSink_t& sink, size_t cbMaxBuffered = 4 * 1024 * 1024);
+	// Writes any output not yet written.
+	~RowWriter_t();
+
+	/// <summary>
+	/// Appends UTF-16 text, transcoded to UTF-8. (Unpaired surrogates are written as U+FFFD.)
+	/// </summary>
+	RowWriter_t& operator << (std::wstring_view sText);
+	RowWriter_t& operator << (wchar_t ch) { return *this << std::wstring_view(&ch, 1); }
+
+	/// <summary>
+	/// Appends text that is already UTF-8 (or ASCII), without transcoding.
+	/// </summary>
+	RowWriter_t& operator << (std::string_view sText) { AppendUtf8(sText.data(), sText.size()); return *this; }
+
+	/// <summary>
+	/// Appends an integer in decimal.
+	/// </summary>
+	template <typename Integer_t, typename = std::enable_if_t<
+		std::is_integral_v<Integer_t> && !std::is_same_v<Integer_t, bool> && !std::is_same_v<Integer_t, wchar_t> && !std::is_same_v<Integer_t, char>>>
+	RowWriter_t& operator << (Integer_t value)
+	{
+		if constexpr (std::is_signed_v<Integer_t>)
+			AppendSigned(int64_t(value));
+		else
+			AppendUnsigned(uint64_t(value));
+		return *this;
+	}
+
+	/// <summary>
+	/// Appends bytes that are already UTF-8 (or ASCII), without transcoding.
+	/// </summary>
+	void AppendUtf8(const char* pData, size_t cbData);
+	void AppendUnsigned(uint64_t value);
+	void AppendSigned(int64_t value);
+
+	/// <summary>
+	/// Appends a number in fixed-point notation with the given number of decimal places.
+	/// </summary>
+	void AppendFixed(double value, int nDecimals);
+
+	/// <summary>
+	/// Appends UTF-16 text as a quoted JSON string, transcoded to UTF-8. Quotes, backslashes and control
+	/// characters are escaped; other characters are written as-is. (Unpaired surrogates are written as U+FFFD.)
+	/// </summary>
+	void AppendJsonString(std::wstring_view sText);
+
+	/// <summary>
+	/// Ends the current line. Writes the buffered output if it exceeds the size limit.
+	/// </summary>
+	void EndLine();
+
+	/// <summary>
+	/// Sets the line ending written by EndLine (CR+LF by default); e.g., "\n" for formats that require LF.
+	/// </summary>
+	/// <param name="sLineEnding">Line ending; must remain valid for the writer's lifetime (e.g., a literal)</param>
+	void SetLineEnding(std::string_view sLineEnding) { m_sLineEnding = sLineEnding; }
+
+	/// <summary>
+	/// Writes all buffered output to the sink.
+	/// </summary>
+	/// <returns>true if all output written so far has been written successfully; false otherwise</returns>
+	bool Flush();
+
+	/// <summary>
+	/// Number of bytes currently buffered.
+	/// </summary>
+	size_t BufferedBytes() const { return m_cbUsed; }
+
+private:
+	// Ensures that at least cbNeeded more bytes can be appended, returning where to append them.
+	char* Reserve(size_t cbNeeded);
+
+private:
+	ByteSink_t& m_sink;
+	const size_t m_cbMaxBuffered;
+	// Output buffer; only the first m_cbUsed bytes are in use. Grows as needed and is reused after each write.
+	std::vector<char> m_buffer;
+	size_t m_cbUsed = 0;
+	// Written by EndLine
+	std::string_view m_sLineEnding;
+	// Set if any write to the sink has failed.
+	bool m_bWriteFailed = false;
+
+private:
+	RowWriter_t(const RowWriter_t&) = delete;
+	RowWriter_t& operator = (const RowWriter_t&) = delete;
+};
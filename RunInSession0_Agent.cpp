@@ -0,0 +1,379 @@
+// RunInSession0_Agent.cpp
+//
+// The portion of the RunInSession0_Framework that installs and removes the optional persistent session-0
+// agent, and the definitions the agent and the session-X side share.
+// The agent itself runs in RunInSession0_Session0Side.cpp; the session-X side uses it from RunInSession0_SessionXSide.cpp.
+//
+
+#include <Windows.h>
+#include <AclAPI.h>
+#include <sddl.h>
+#include <iostream>
+#include <sstream>
+
+#include "DbgOut.h"
+#include "SysErrorMessage.h"
+#include "StringUtils.h"
+#include "RunInSession0_Framework_InternalDecls.h"
+
+/// <summary>
+/// Gets the full path to the current executable.
+/// </summary>
+static bool GetExePath(std::wstring& sExePath)
+{
+    wchar_t szPath[MAX_PATH];
+    if (!GetModuleFileNameW(NULL, szPath, MAX_PATH))
+        return false;
+    sExePath = szPath;
+    return true;
+}
+
+/// <summary>
+/// Returns the name of the agent service for this executable (e.g., RunInSession0Agent_GuiObjectUse).
+/// </summary>
+std::wstring AgentServiceName()
+{
+    std::wstring sExePath;
+    if (!GetExePath(sExePath))
+        sExePath = L"RunInSession0";
+    std::wstring sExeName = GetFileNameFromFilePath(sExePath);
+    // Without the extension
+    const size_t ixDot = sExeName.find_last_of(L'.');
+    if (std::wstring::npos != ixDot && ixDot > 0)
+        sExeName.resize(ixDot);
+    return std::wstring(L"RunInSession0Agent_") + sExeName;
+}
+
+/// <summary>
+/// Returns the full path of the agent's control pipe.
+/// </summary>
+std::wstring AgentPipeName(const std::wstring& sServiceName)
+{
+    return std::wstring(L"\\\\.\\pipe\\") + sServiceName;
+}
+
+/// <summary>
+/// Reads or writes one message on an agent control pipe opened for overlapped I/O, waiting at most the given time.
+/// </summary>
+bool TransferAgentMessage(HANDLE hPipe, bool bWrite, void* pBuffer, DWORD cbBuffer, DWORD& cbTransferred, DWORD dwMilliseconds, HANDLE hCancelEvent)
+{
+    cbTransferred = 0;
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (NULL == ov.hEvent)
+        return false;
+
+    bool bTransferred = false;
+    BOOL ret = bWrite ? WriteFile(hPipe, pBuffer, cbBuffer, nullptr, &ov) : ReadFile(hPipe, pBuffer, cbBuffer, nullptr, &ov);
+    if (ret || ERROR_IO_PENDING == GetLastError())
+    {
+        const HANDLE handles[2] = { ov.hEvent, hCancelEvent };
+        DWORD dwWait = WaitForMultipleObjects(hCancelEvent ? 2 : 1, handles, FALSE, dwMilliseconds);
+        if (WAIT_OBJECT_0 != dwWait)
+        {
+            // Timed out or canceled. The I/O must be complete before ov goes out of scope.
+            dbgOut.locked() << L"TransferAgentMessage: canceling I/O, wait result " << dwWait << std::endl;
+            CancelIoEx(hPipe, &ov);
+        }
+        // A message longer than the buffer fails with ERROR_MORE_DATA.
+        bTransferred = GetOverlappedResult(hPipe, &ov, &cbTransferred, TRUE) && (!bWrite || cbTransferred == cbBuffer);
+    }
+    if (!bTransferred)
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"TransferAgentMessage " << (bWrite ? L"write" : L"read") << L" failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+    }
+    CloseHandle(ov.hEvent);
+    return bTransferred;
+}
+
+/// <summary>
+/// Stops the agent service if it's running, waiting up to 30 seconds for it to stop.
+/// </summary>
+/// <returns>true if the service is stopped; false otherwise</returns>
+static bool StopAgentService(SC_HANDLE hService)
+{
+    SERVICE_STATUS serviceStatus = { 0 };
+    if (!ControlService(hService, SERVICE_CONTROL_STOP, &serviceStatus))
+    {
+        DWORD dwLastErr = GetLastError();
+        if (ERROR_SERVICE_NOT_ACTIVE == dwLastErr)
+            return true;
+        dbgOut.locked() << L"ControlService (stop) failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return false;
+    }
+    const ULONGLONG ullDeadline = GetTickCount64() + 30000;
+    SERVICE_STATUS_PROCESS ssp = { 0 };
+    DWORD cbSSP = sizeof(ssp);
+    while (QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, cbSSP, &cbSSP))
+    {
+        if (SERVICE_STOPPED == ssp.dwCurrentState)
+            return true;
+        if (GetTickCount64() > ullDeadline)
+            break;
+        Sleep(100);
+    }
+    return false;
+}
+
+/// <summary>
+/// Determines whether a SID is one that may be able to modify the agent's executable: Administrators,
+/// System, or TrustedInstaller.
+/// </summary>
+static bool IsTrustedWriterSid(PSID pSid)
+{
+    if (IsWellKnownSid(pSid, WinBuiltinAdministratorsSid) || IsWellKnownSid(pSid, WinLocalSystemSid))
+        return true;
+    // NT SERVICE\TrustedInstaller
+    PSID pTrustedInstaller = nullptr;
+    if (!ConvertStringSidToSidW(L"S-1-5-80-956008885-3418522649-1831038044-1853292631-2271478464", &pTrustedInstaller))
+        return false;
+    const bool bTrusted = (FALSE != EqualSid(pSid, pTrustedInstaller));
+    LocalFree(pTrustedInstaller);
+    return bTrusted;
+}
+
+/// <summary>
+/// Checks that only Administrators, System, and TrustedInstaller can modify a file or directory: that one of
+/// them owns it, and that its DACL doesn't allow anyone else to write, delete, or change the permissions of
+/// it (or, for a directory, to add or remove files in it).
+/// </summary>
+/// <param name="sPath">Input: the file or directory</param>
+/// <param name="sErrorInfo">Output: why it isn't protected, or why it can't be checked</param>
+/// <returns>true if only the trusted accounts can modify it; false otherwise</returns>
+static bool IsWritableOnlyByAdmins(const std::wstring& sPath, std::wstring& sErrorInfo)
+{
+    PSID pOwner = nullptr;
+    PACL pDacl = nullptr;
+    PSECURITY_DESCRIPTOR pSD = nullptr;
+    DWORD dwRet = GetNamedSecurityInfoW(sPath.c_str(), SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, &pOwner, nullptr, &pDacl, nullptr, &pSD);
+    if (ERROR_SUCCESS != dwRet)
+    {
+        sErrorInfo = L"Cannot read the permissions of " + sPath + L": " + SysErrorMessageWithCode(dwRet);
+        return false;
+    }
+
+    // Access that would let another account change what the agent runs
+    const ACCESS_MASK writeAccess =
+        FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_EA | FILE_WRITE_ATTRIBUTES | FILE_DELETE_CHILD |
+        DELETE | WRITE_DAC | WRITE_OWNER | GENERIC_WRITE | GENERIC_ALL;
+    bool bProtected = true;
+    if (NULL == pOwner || !IsTrustedWriterSid(pOwner))
+    {
+        sErrorInfo = sPath + L" is not owned by Administrators, System, or TrustedInstaller";
+        bProtected = false;
+    }
+    else if (NULL == pDacl)
+    {
+        sErrorInfo = sPath + L" has no DACL; everyone can modify it";
+        bProtected = false;
+    }
+    for (WORD ixAce = 0; bProtected && ixAce < pDacl->AceCount; ++ixAce)
+    {
+        PACE_HEADER pAceHeader = nullptr;
+        if (!GetAce(pDacl, ixAce, (LPVOID*)&pAceHeader))
+        {
+            DWORD dwLastErr = GetLastError();
+            sErrorInfo = L"Cannot read the permissions of " + sPath + L": " + SysErrorMessageWithCode(dwLastErr);
+            bProtected = false;
+        }
+        // Inherit-only entries apply to child objects, not to this one; deny entries only take access away.
+        else if (0 != (pAceHeader->AceFlags & INHERIT_ONLY_ACE) || ACCESS_DENIED_ACE_TYPE == pAceHeader->AceType)
+        {
+            continue;
+        }
+        else if (ACCESS_ALLOWED_ACE_TYPE != pAceHeader->AceType)
+        {
+            // (E.g., a conditional or object entry, whose effect isn't evaluated here.)
+            sErrorInfo = sPath + L" has a permission entry of a type that can't be checked";
+            bProtected = false;
+        }
+        else
+        {
+            ACCESS_ALLOWED_ACE* pAce = (ACCESS_ALLOWED_ACE*)pAceHeader;
+            if (0 != (pAce->Mask & writeAccess) && !IsTrustedWriterSid(&pAce->SidStart))
+            {
+                sErrorInfo = sPath + L" can be modified by accounts other than Administrators, System, and TrustedInstaller";
+                bProtected = false;
+            }
+        }
+    }
+    LocalFree(pSD);
+    return bProtected;
+}
+
+/// <summary>
+/// Installs (or reinstalls) the agent for this executable as an automatic-start service, and starts it.
+/// </summary>
+/// <returns>0 if successful, non-zero otherwise</returns>
+int InstallAgent()
+{
+    SC_HANDLE hSCManager = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT | SC_MANAGER_CREATE_SERVICE);
+    if (NULL == hSCManager)
+    {
+        DWORD dwLastErr = GetLastError();
+        if (ERROR_ACCESS_DENIED == dwLastErr)
+            std::wcerr << L"This program requires administrative rights." << std::endl;
+        else
+            std::wcerr << L"Cannot open service control manager: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return -1;
+    }
+
+    std::wstring sExePath;
+    if (!GetExePath(sExePath))
+    {
+        DWORD dwLastErr = GetLastError();
+        std::wcerr << L"GetModuleFileNameW failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        CloseServiceHandle(hSCManager);
+        return -2;
+    }
+
+    // The agent runs this executable as System whenever it's asked to, so anyone who could replace it
+    // (or add files next to it that it loads) could run code as System. Refuse to install it otherwise.
+    // (The directory of C:\x.exe is C:\, not C:.)
+    const size_t ixLastBackslash = sExePath.find_last_of(L'\\');
+    const std::wstring sExeDirectory = sExePath.substr(0, (2 == ixLastBackslash) ? 3 : ixLastBackslash);
+    std::wstring sErrorInfo;
+    if (!IsWritableOnlyByAdmins(sExePath, sErrorInfo) || !IsWritableOnlyByAdmins(sExeDirectory, sErrorInfo))
+    {
+        std::wcerr
+            << sErrorInfo << std::endl
+            << L"The agent was not installed. Install it from a directory that only administrators can modify." << std::endl;
+        CloseServiceHandle(hSCManager);
+        return -6;
+    }
+
+    // The service runs this executable where it is now, with the agent switch and the service name (both quoted
+    // in case they contain space characters).
+    const std::wstring sServiceName = AgentServiceName();
+    const std::wstring sDisplayName = L"RunInSession0 agent for " + GetFileNameFromFilePath(sExePath);
+    std::wstringstream strBinaryPathPlusParams;
+    strBinaryPathPlusParams << L"\"" << sExePath << L"\" " << szAgentSwitch << L" \"" << sServiceName << L"\"";
+
+    int retval = 0;
+    const DWORD dwAccess = SERVICE_CHANGE_CONFIG | SERVICE_START | SERVICE_STOP | SERVICE_QUERY_STATUS;
+    SC_HANDLE hService = CreateServiceW(
+        hSCManager,                // SCM database
+        sServiceName.c_str(),      // name of service
+        sDisplayName.c_str(),      // service name to display
+        dwAccess,                  // desired access
+        SERVICE_WIN32_OWN_PROCESS, // service type
+        SERVICE_AUTO_START,        // start type
+        SERVICE_ERROR_NORMAL,      // error control type
+        strBinaryPathPlusParams.str().c_str(),     // path to service's binary (full command line)
+        NULL,                      // no load ordering group
+        NULL,                      // no tag identifier
+        NULL,                      // No dependencies
+        NULL,                      // LocalSystem account
+        NULL);                     // no password
+    if (NULL == hService && ERROR_SERVICE_EXISTS == GetLastError())
+    {
+        // Reinstall: update the existing service's configuration, and restart it if it's running so that
+        // it runs the executable as it is now.
+        dbgOut.locked() << L"Service " << sServiceName << L" exists; updating it" << std::endl;
+        hService = OpenServiceW(hSCManager, sServiceName.c_str(), dwAccess);
+        if (NULL != hService)
+        {
+            if (!ChangeServiceConfigW(
+                hService,
+                SERVICE_NO_CHANGE,
+                SERVICE_AUTO_START,
+                SERVICE_NO_CHANGE,
+                strBinaryPathPlusParams.str().c_str(),
+                NULL, NULL, NULL, NULL, NULL,
+                sDisplayName.c_str()))
+            {
+                DWORD dwLastErr = GetLastError();
+                std::wcerr << L"Cannot update service " << sServiceName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+                retval = -3;
+            }
+            else if (!StopAgentService(hService))
+            {
+                std::wcerr << L"Cannot stop the running agent " << sServiceName << std::endl;
+                retval = -4;
+            }
+        }
+    }
+    if (NULL == hService)
+    {
+        DWORD dwLastErr = GetLastError();
+        std::wcerr << L"Cannot create service " << sServiceName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        CloseServiceHandle(hSCManager);
+        return -3;
+    }
+
+    if (0 == retval)
+    {
+        SERVICE_DESCRIPTIONW description = { const_cast<wchar_t*>(L"Runs requests from this program's command line in session 0, without creating a service for each one. Remove with -uninstallagent.") };
+        ChangeServiceConfig2W(hService, SERVICE_CONFIG_DESCRIPTION, &description);
+
+        if (StartServiceW(hService, 0, nullptr) || ERROR_SERVICE_ALREADY_RUNNING == GetLastError())
+        {
+            std::wcout << L"Agent service " << sServiceName << L" installed and started; it runs " << sExePath << std::endl;
+        }
+        else
+        {
+            DWORD dwLastErr = GetLastError();
+            std::wcerr << L"Agent service " << sServiceName << L" installed, but cannot be started: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+            retval = -5;
+        }
+    }
+
+    CloseServiceHandle(hService);
+    CloseServiceHandle(hSCManager);
+    return retval;
+}
+
+/// <summary>
+/// Stops and deletes the agent for this executable.
+/// </summary>
+/// <returns>0 if successful, non-zero otherwise</returns>
+int UninstallAgent()
+{
+    SC_HANDLE hSCManager = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (NULL == hSCManager)
+    {
+        DWORD dwLastErr = GetLastError();
+        std::wcerr << L"Cannot open service control manager: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return -1;
+    }
+
+    int retval = 0;
+    const std::wstring sServiceName = AgentServiceName();
+    SC_HANDLE hService = OpenServiceW(hSCManager, sServiceName.c_str(), SERVICE_STOP | SERVICE_QUERY_STATUS | DELETE);
+    if (NULL == hService)
+    {
+        DWORD dwLastErr = GetLastError();
+        if (ERROR_SERVICE_DOES_NOT_EXIST == dwLastErr)
+        {
+            std::wcout << L"Agent service " << sServiceName << L" is not installed." << std::endl;
+        }
+        else
+        {
+            if (ERROR_ACCESS_DENIED == dwLastErr)
+                std::wcerr << L"This program requires administrative rights." << std::endl;
+            else
+                std::wcerr << L"Cannot open service " << sServiceName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+            retval = -2;
+        }
+    }
+    else
+    {
+        // Deleting a running service doesn't take effect until it stops.
+        if (!StopAgentService(hService))
+            std::wcerr << L"Agent service " << sServiceName << L" has not stopped; it will be deleted when it does." << std::endl;
+        if (DeleteService(hService))
+        {
+            std::wcout << L"Agent service " << sServiceName << L" uninstalled." << std::endl;
+        }
+        else
+        {
+            DWORD dwLastErr = GetLastError();
+            std::wcerr << L"Cannot delete service " << sServiceName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+            retval = -3;
+        }
+        CloseServiceHandle(hService);
+    }
+    CloseServiceHandle(hSCManager);
+    return retval;
+}
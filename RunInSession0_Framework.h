@@ -9,9 +9,14 @@
 // executable as System in session 0 and to capture its output, without involving 
 // Sysinternals PsExec.
 // 
+// By default, each run creates, starts, and deletes a service. Alternatively, a persistent agent service can
+// be installed for the executable (-installagent); runs then ask the agent to execute the code instead, and
+// fall back to creating a service if the agent isn't installed or won't take the request.
+// 
 // Components of the framework include:
 //     RunInSession0_Framework.h (this header file)
 //     RunInSession0_Framework_InternalDecls.h
+//     RunInSession0_Agent.cpp
 //     RunInSession0_Session0Side.cpp
 //     RunInSession0_SessionXSide.cpp
 //     RunInSession0_wmainCommandProcessor.cpp.
@@ -48,6 +53,13 @@ int wmainCommandProcessor(
 );
 
 
+/// <summary>
+/// Returns true if this process was started by the session-0 agent (see -installagent) to run the code for
+/// one request, rather than by a service of the requester's own or from a command line.
+/// </summary>
+bool RunningAsAgentRequest();
+
+
 /// <summary>
 /// For debugging purposes
 /// </summary>
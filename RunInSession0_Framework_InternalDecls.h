@@ -7,6 +7,7 @@
 
 // Include the public declarations first.
 #include "RunInSession0_Framework.h"
+#include <string>
 
 
 /// <summary>
@@ -63,3 +64,121 @@ int ServiceExeSide(
     const wchar_t* szEvent_ReadyToWrite,
     const wchar_t* szEvent_ServiceDone
 );
+
+// ----------------------------------------------------------------------------------------------------
+// Optional persistent session-0 agent: a long-lived service that runs the code for each request received
+// on its named pipe, so that the session-X side doesn't have to create, start, and delete a service each time.
+// ----------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// The agent service runs this executable with this switch and the agent's service name.
+/// </summary>
+static const int nRequiredAgentExeParams = 3;
+static const wchar_t* szAgentSwitch = L"-agent_4e4450eda4cd";
+
+/// <summary>
+/// Determines whether the command line params are intended for the session-0 agent service instance.
+/// </summary>
+/// <param name="argc">wmain's argc</param>
+/// <param name="argv">wmain's argv</param>
+/// <returns>true if the command line params appear to be for the agent service instance</returns>
+inline bool AreAgentExeParams(int argc, wchar_t** argv)
+{
+    return (nRequiredAgentExeParams == argc && 0 == wcscmp(szAgentSwitch, argv[1]));
+}
+
+/// <summary>
+/// The agent runs the code for each request in a child process: this executable, with this switch followed
+/// by the request's arguments, and with its stdout and stderr connected to the requester's pipes.
+/// </summary>
+static const wchar_t* szAgentRequestSwitch = L"-agentrequest_4e4450eda4cd";
+
+/// <summary>
+/// Determines whether the command line params are for a child process running an agent request.
+/// </summary>
+/// <param name="argc">wmain's argc</param>
+/// <param name="argv">wmain's argv</param>
+/// <returns>true if the command line params appear to be for an agent request process</returns>
+inline bool AreAgentRequestExeParams(int argc, wchar_t** argv)
+{
+    return (argc >= 2 && 0 == wcscmp(szAgentRequestSwitch, argv[1]));
+}
+
+/// <summary>
+/// Messages on the agent's control pipe, which is in message mode.
+/// A request from the session-X side is an AgentRequestHeader_t followed by null-terminated UTF-16 strings:
+/// the path of the requesting executable (informational; the agent identifies the requester from its
+/// process), the names of the pipes to redirect stdout and stderr to, and argc arguments for the code.
+/// The agent replies with an AgentReply_t with status ReadyToWrite once it has started the code connected
+/// to the two pipes, then Done (with the code's exit code) once the code has completed and the pipes have
+/// been closed, or TimedOut if the code was ended for exceeding the time limit. Rejected means the agent
+/// didn't connect to the pipes (e.g., it runs a different executable), so the session-X side can fall back
+/// to a service of its own; Failed means the request failed after the agent might have connected to them.
+/// </summary>
+static const DWORD dwAgentRequestSignature = 0x31304752; // "RG01"
+static const DWORD cbAgentMaxRequest = 64 * 1024;
+struct AgentRequestHeader_t
+{
+    DWORD dwSignature;
+    DWORD dwMaxMilliseconds;
+    DWORD dwArgc;
+};
+enum class AgentStatus_t : DWORD
+{
+    ReadyToWrite = 1,
+    Done,
+    Rejected,
+    Failed,
+    TimedOut
+};
+struct AgentReply_t
+{
+    AgentStatus_t status;
+    DWORD dwExitCode;
+};
+
+/// <summary>
+/// Returns the name of the agent service for this executable (e.g., RunInSession0Agent_GuiObjectUse).
+/// The agent's control pipe has the same name.
+/// </summary>
+std::wstring AgentServiceName();
+
+/// <summary>
+/// Returns the full path of the agent's control pipe.
+/// </summary>
+std::wstring AgentPipeName(const std::wstring& sServiceName);
+
+/// <summary>
+/// Reads or writes one message on an agent control pipe opened for overlapped I/O, waiting at most the given time.
+/// </summary>
+/// <param name="hPipe">Input: the pipe</param>
+/// <param name="bWrite">Input: true to write, false to read</param>
+/// <param name="pBuffer">Input/output: data to write, or buffer for the message read</param>
+/// <param name="cbBuffer">Input: size of the data or buffer</param>
+/// <param name="cbTransferred">Output: number of bytes transferred</param>
+/// <param name="dwMilliseconds">Input: maximum time to wait</param>
+/// <param name="hCancelEvent">Input: optional event that cancels the wait when signaled</param>
+/// <returns>true if a complete message was transferred; false on error, timeout, or cancellation</returns>
+bool TransferAgentMessage(HANDLE hPipe, bool bWrite, void* pBuffer, DWORD cbBuffer, DWORD& cbTransferred, DWORD dwMilliseconds, HANDLE hCancelEvent = nullptr);
+
+/// <summary>
+/// Installs (or reinstalls) the agent for this executable as an automatic-start service, and starts it.
+/// </summary>
+/// <returns>0 if successful, non-zero otherwise</returns>
+int InstallAgent();
+
+/// <summary>
+/// Stops and deletes the agent for this executable.
+/// </summary>
+/// <returns>0 if successful, non-zero otherwise</returns>
+int UninstallAgent();
+
+/// <summary>
+/// For running as the agent service, with this process started by the Service Control Manager.
+/// The code for each request runs in a child process (see AreAgentRequestExeParams).
+/// </summary>
+/// <param name="szServiceName">The name of this service</param>
+/// <returns>0 on success; error code from StartServiceCtrlDispatcherW otherwise.</returns>
+int AgentExeSide(
+    const wchar_t* szServiceName
+);
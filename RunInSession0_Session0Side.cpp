@@ -7,6 +7,7 @@
 #include <sddl.h>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "DbgOut.h"
 #include "SysErrorMessage.h"
@@ -24,9 +25,16 @@ static pfn_CodeToRunInSession0_t st_CodeToRunInSession0 = nullptr;
 /// </summary>
 static SERVICE_STATUS_HANDLE hServiceStatus = nullptr;
 
+/// <summary>
+/// For the agent service: its name, and an event signaled when the SCM asks it to stop
+/// </summary>
+static std::wstring st_sAgentServiceName;
+static HANDLE st_hAgentStopEvent = nullptr;
+
 // Forward declarations
 // Standard entry points expected by the SCM:
 static void WINAPI ServiceMain(DWORD dwArgc, wchar_t** lpszArgv);
+static void WINAPI AgentServiceMain(DWORD dwArgc, wchar_t** lpszArgv);
 static void WINAPI ServiceControlHandler(DWORD);
 
 // Forward declarations of functions to report status to the SCM:
@@ -196,6 +204,442 @@ static void WINAPI ServiceMain(DWORD dwArgc, wchar_t** lpszArgv)
 }
 
 
+// ----------------------------------------------------------------------------------------------------
+// ----------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// For running as the agent service, with this process started by the Service Control Manager.
+/// The code for each request runs in a child process (see AreAgentRequestExeParams).
+/// </summary>
+/// <param name="szServiceName">The name of this service</param>
+/// <returns>0 on success; error code from StartServiceCtrlDispatcherW otherwise.</returns>
+int AgentExeSide(
+    const wchar_t* szServiceName)
+{
+    dbgOut.locked() << L"AgentExeSide(" << szServiceName << L")" << std::endl;
+
+    // Set the agent's state
+    st_sAgentServiceName = szServiceName;
+    st_hAgentStopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (NULL == st_hAgentStopEvent)
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"Can't create event object: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return int(dwLastErr);
+    }
+
+    DWORD dwRetval = 0;
+    SERVICE_TABLE_ENTRYW DispatchTable[] =
+    {
+        { const_cast<wchar_t*>(szServiceName), AgentServiceMain},
+        { NULL, NULL }
+    };
+    // Doesn't return until the agent has stopped.
+    if (!StartServiceCtrlDispatcherW(DispatchTable))
+    {
+        dwRetval = GetLastError();
+        dbgOut.locked() << L"StartServiceCtrlDispatcherW failed: " << SysErrorMessageWithCode(dwRetval) << std::endl;
+    }
+    return int(dwRetval);
+}
+
+/// <summary>
+/// Appends an argument to a command line, quoted so that CommandLineToArgvW and the CRT parse it back unchanged.
+/// </summary>
+static void AppendCommandLineArg(std::wstring& sCommandLine, const std::wstring& sArg)
+{
+    if (!sCommandLine.empty())
+        sCommandLine += L' ';
+    sCommandLine += L'"';
+    size_t nBackslashes = 0;
+    for (std::wstring::const_iterator iterChar = sArg.begin(); iterChar != sArg.end(); ++iterChar)
+    {
+        if (L'\\' == *iterChar)
+        {
+            ++nBackslashes;
+            continue;
+        }
+        // Backslashes are literal except before a quote, where each one must be escaped, as must the quote.
+        if (L'"' == *iterChar)
+            sCommandLine.append(nBackslashes * 2 + 1, L'\\');
+        else
+            sCommandLine.append(nBackslashes, L'\\');
+        nBackslashes = 0;
+        sCommandLine += *iterChar;
+    }
+    // Backslashes before the closing quote must be escaped too.
+    sCommandLine.append(nBackslashes * 2, L'\\');
+    sCommandLine += L'"';
+}
+
+/// <summary>
+/// Gets the full path of a process' executable.
+/// </summary>
+static bool GetProcessImagePath(HANDLE hProcess, std::wstring& sImagePath)
+{
+    std::vector<wchar_t> path(32768);
+    DWORD cchPath = DWORD(path.size());
+    if (!QueryFullProcessImageNameW(hProcess, 0, path.data(), &cchPath))
+        return false;
+    sImagePath.assign(path.data(), cchPath);
+    return true;
+}
+
+/// <summary>
+/// Gets the full path of the executable of the process connected to the control pipe. (The requester's
+/// own account of its path isn't trusted.)
+/// </summary>
+static bool GetPipeClientImagePath(HANDLE hPipe, std::wstring& sImagePath)
+{
+    ULONG ulClientPID = 0;
+    if (!GetNamedPipeClientProcessId(hPipe, &ulClientPID))
+        return false;
+    HANDLE hClient = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, ulClientPID);
+    if (NULL == hClient)
+        return false;
+    const bool bOK = GetProcessImagePath(hClient, sImagePath);
+    CloseHandle(hClient);
+    return bOK;
+}
+
+/// <summary>
+/// Opens one of the requester's pipes for the code's output, as an inheritable handle for the child process.
+/// The name must be a plain pipe name, and the object opened must be a pipe: this process runs as System,
+/// and must not be usable to write any other file. The pipe's server can identify this process, but can't impersonate it.
+/// </summary>
+/// <returns>The handle, or INVALID_HANDLE_VALUE</returns>
+static HANDLE OpenRequesterPipe(const std::wstring& sPipeName)
+{
+    const std::wstring sPipePrefix = L"\\\\.\\pipe\\";
+    if (sPipeName.size() <= sPipePrefix.size() || 0 != sPipeName.compare(0, sPipePrefix.size(), sPipePrefix) ||
+        std::wstring::npos != sPipeName.find_first_of(L"\\/", sPipePrefix.size()) || std::wstring::npos != sPipeName.find(L".."))
+    {
+        dbgOut.locked() << L"Invalid pipe name " << sPipeName << std::endl;
+        return INVALID_HANDLE_VALUE;
+    }
+    SECURITY_ATTRIBUTES sa = { 0 };
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+    HANDLE hPipe = CreateFileW(sPipeName.c_str(), GENERIC_WRITE, 0, &sa, OPEN_EXISTING, SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr);
+    if (INVALID_HANDLE_VALUE == hPipe)
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"Can't open " << sPipeName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return INVALID_HANDLE_VALUE;
+    }
+    if (FILE_TYPE_PIPE != GetFileType(hPipe))
+    {
+        dbgOut.locked() << sPipeName << L" is not a pipe" << std::endl;
+        CloseHandle(hPipe);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hPipe;
+}
+
+/// <summary>
+/// Starts this executable in a child process to run the code for a request, with its stdout and stderr
+/// connected to the requester's pipes. Only those two handles are inherited.
+/// </summary>
+/// <returns>The child's process handle, or NULL</returns>
+static HANDLE StartAgentRequestProcess(const std::wstring& sExePath, const std::vector<std::wstring>& args, HANDLE hOutput, HANDLE hError)
+{
+    std::wstring sCommandLine;
+    AppendCommandLineArg(sCommandLine, sExePath);
+    AppendCommandLineArg(sCommandLine, szAgentRequestSwitch);
+    for (std::vector<std::wstring>::const_iterator iterArg = args.begin(); iterArg != args.end(); ++iterArg)
+        AppendCommandLineArg(sCommandLine, *iterArg);
+
+    SIZE_T cbAttributeList = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &cbAttributeList);
+    std::vector<BYTE> attributeList(cbAttributeList);
+    LPPROC_THREAD_ATTRIBUTE_LIST pAttributeList = (LPPROC_THREAD_ATTRIBUTE_LIST)attributeList.data();
+    if (!InitializeProcThreadAttributeList(pAttributeList, 1, 0, &cbAttributeList))
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"InitializeProcThreadAttributeList failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return NULL;
+    }
+    HANDLE inheritedHandles[2] = { hOutput, hError };
+    PROCESS_INFORMATION pi = { 0 };
+    BOOL ret = UpdateProcThreadAttribute(pAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inheritedHandles, sizeof(inheritedHandles), nullptr, nullptr);
+    if (ret)
+    {
+        STARTUPINFOEXW si = { 0 };
+        si.StartupInfo.cb = sizeof(si);
+        si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+        si.StartupInfo.hStdInput = NULL;
+        si.StartupInfo.hStdOutput = hOutput;
+        si.StartupInfo.hStdError = hError;
+        si.lpAttributeList = pAttributeList;
+        ret = CreateProcessW(sExePath.c_str(), &sCommandLine[0], nullptr, nullptr, TRUE,
+            CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT, nullptr, nullptr, &si.StartupInfo, &pi);
+    }
+    DWORD dwLastErr = GetLastError();
+    DeleteProcThreadAttributeList(pAttributeList);
+    if (!ret)
+    {
+        dbgOut.locked() << L"Can't start the request process: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return NULL;
+    }
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+/// <summary>
+/// Sends a reply to the requester on the agent's control pipe.
+/// </summary>
+static void SendAgentReply(HANDLE hPipe, AgentStatus_t status, DWORD dwExitCode)
+{
+    AgentReply_t reply = { status, dwExitCode };
+    DWORD cbWritten = 0;
+    TransferAgentMessage(hPipe, true, &reply, sizeof(reply), cbWritten, 10000, st_hAgentStopEvent);
+}
+
+/// <summary>
+/// Reads a request from a connected session-X process, runs the code in a child process with its stdout and
+/// stderr connected to the requester's pipes, and replies with the code's exit code.
+/// Each request gets a fresh process, so the code's process-wide state (statics, the CRT's streams, threads
+/// it leaves behind) doesn't carry over to the next request, and code that doesn't complete within the
+/// request's time limit can be ended without ending the agent.
+/// </summary>
+/// <param name="hPipe">Input: the connected control pipe</param>
+/// <param name="sExePath">Input: the full path to this executable</param>
+static void HandleAgentRequest(HANDLE hPipe, const std::wstring& sExePath)
+{
+    // Request: header, followed by null-terminated strings
+    std::vector<BYTE> request(cbAgentMaxRequest);
+    DWORD cbRequest = 0;
+    if (!TransferAgentMessage(hPipe, false, request.data(), DWORD(request.size()), cbRequest, 10000, st_hAgentStopEvent))
+        return;
+    AgentRequestHeader_t header = { 0 };
+    std::vector<std::wstring> strings;
+    if (cbRequest >= sizeof(header))
+    {
+        memcpy(&header, request.data(), sizeof(header));
+        const wchar_t* pStrings = (const wchar_t*)(request.data() + sizeof(header));
+        const size_t cchStrings = (cbRequest - sizeof(header)) / sizeof(wchar_t);
+        size_t ixStart = 0;
+        for (size_t ixChar = 0; ixChar < cchStrings; ++ixChar)
+        {
+            if (L'\0' == pStrings[ixChar])
+            {
+                strings.push_back(std::wstring(pStrings + ixStart, ixChar - ixStart));
+                ixStart = ixChar + 1;
+            }
+        }
+    }
+    // The executable path, two pipe names, and the arguments.
+    if (dwAgentRequestSignature != header.dwSignature || strings.size() != size_t(header.dwArgc) + 3)
+    {
+        dbgOut.locked() << L"Invalid agent request" << std::endl;
+        SendAgentReply(hPipe, AgentStatus_t::Rejected, 0);
+        return;
+    }
+    // The code to run is this executable's. A request from a different executable (e.g., a newer
+    // version elsewhere) is rejected, and the requester runs its own code in a service of its own.
+    // The requester's executable is identified from its process, not from the path in the request.
+    std::wstring sClientPath;
+    if (!GetPipeClientImagePath(hPipe, sClientPath))
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"Can't identify the requesting process: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        SendAgentReply(hPipe, AgentStatus_t::Rejected, 0);
+        return;
+    }
+    if (0 != _wcsicmp(sClientPath.c_str(), sExePath.c_str()))
+    {
+        dbgOut.locked() << L"Rejecting request from " << sClientPath << L"; this agent runs " << sExePath << std::endl;
+        SendAgentReply(hPipe, AgentStatus_t::Rejected, 0);
+        return;
+    }
+
+    // Connect to the requester's named pipes
+    HANDLE hOutput = OpenRequesterPipe(strings[1]);
+    HANDLE hError = (INVALID_HANDLE_VALUE != hOutput) ? OpenRequesterPipe(strings[2]) : INVALID_HANDLE_VALUE;
+    if (INVALID_HANDLE_VALUE == hError)
+    {
+        if (INVALID_HANDLE_VALUE != hOutput)
+            CloseHandle(hOutput);
+        SendAgentReply(hPipe, AgentStatus_t::Failed, 0);
+        return;
+    }
+
+    const std::vector<std::wstring> args(strings.begin() + 3, strings.end());
+    HANDLE hProcess = StartAgentRequestProcess(sExePath, args, hOutput, hError);
+    // The child has its own copies; the requester's reads end when the child exits.
+    CloseHandle(hOutput);
+    CloseHandle(hError);
+    if (NULL == hProcess)
+    {
+        SendAgentReply(hPipe, AgentStatus_t::Failed, 0);
+        return;
+    }
+    SendAgentReply(hPipe, AgentStatus_t::ReadyToWrite, 0);
+
+    const HANDLE handles[2] = { hProcess, st_hAgentStopEvent };
+    DWORD dwWait = WaitForMultipleObjects(2, handles, FALSE, header.dwMaxMilliseconds);
+    DWORD dwExitCode = 0;
+    AgentStatus_t status = AgentStatus_t::Done;
+    if (WAIT_OBJECT_0 == dwWait)
+    {
+        if (!GetExitCodeProcess(hProcess, &dwExitCode))
+            status = AgentStatus_t::Failed;
+        dbgOut.locked() << L"Agent: requested code completed, exit code " << dwExitCode << std::endl;
+    }
+    else
+    {
+        // Timed out, or the agent is stopping.
+        dbgOut.locked() << L"Requested code did not complete (wait result " << dwWait << L"); ending its process" << std::endl;
+        TerminateProcess(hProcess, ERROR_TIMEOUT);
+        WaitForSingleObject(hProcess, 5000);
+        status = (WAIT_TIMEOUT == dwWait) ? AgentStatus_t::TimedOut : AgentStatus_t::Failed;
+    }
+    CloseHandle(hProcess);
+    SendAgentReply(hPipe, status, dwExitCode);
+}
+
+/// <summary>
+/// Serves requests on the agent's control pipe, one at a time, until the SCM asks the agent to stop.
+/// </summary>
+/// <returns>The agent's exit code: 0, or a Win32 error code</returns>
+static DWORD ServeAgentRequests()
+{
+    // (In the same form as requesters' paths are obtained.)
+    std::wstring sExePath;
+    if (!GetProcessImagePath(GetCurrentProcess(), sExePath))
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"QueryFullProcessImageNameW failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return dwLastErr;
+    }
+
+    // Security attributes for the control pipe: full control for BA and SY, no other access; not inheritable
+    PSECURITY_DESCRIPTOR pSD = nullptr;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(L"D:P(A;;FA;;;BA)(A;;FA;;;SY)", SDDL_REVISION_1, &pSD, NULL))
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"ConvertStringSecurityDescriptorToSecurityDescriptorW failed; error " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return dwLastErr;
+    }
+    SECURITY_ATTRIBUTES sa = { 0 };
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = FALSE;
+    sa.lpSecurityDescriptor = pSD;
+
+    // A single instance, so requests are served one at a time (others wait for the pipe), created as the first
+    // instance so that no other process can own the name; local clients only.
+    const std::wstring sPipeName = AgentPipeName(st_sAgentServiceName);
+    HANDLE hPipe = CreateNamedPipeW(
+        sPipeName.c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1,
+        cbAgentMaxRequest,
+        cbAgentMaxRequest,
+        0,
+        &sa);
+    DWORD dwLastErr = GetLastError();
+    LocalFree(pSD);
+    if (INVALID_HANDLE_VALUE == hPipe)
+    {
+        dbgOut.locked() << L"Can't create named pipe " << sPipeName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return dwLastErr;
+    }
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (NULL == ov.hEvent)
+    {
+        dwLastErr = GetLastError();
+        CloseHandle(hPipe);
+        return dwLastErr;
+    }
+
+    // Ready for requests
+    NotifySCM(SERVICE_RUNNING);
+    DWORD dwExitCode = 0;
+    for (;;)
+    {
+        // Wait for a connection, or for the SCM to ask the agent to stop.
+        bool bConnected = false;
+        ResetEvent(ov.hEvent);
+        if (ConnectNamedPipe(hPipe, &ov))
+        {
+            bConnected = true;
+        }
+        else
+        {
+            dwLastErr = GetLastError();
+            if (ERROR_PIPE_CONNECTED == dwLastErr)
+            {
+                bConnected = true;
+            }
+            else if (ERROR_IO_PENDING == dwLastErr)
+            {
+                const HANDLE handles[2] = { ov.hEvent, st_hAgentStopEvent };
+                DWORD cbUnused = 0;
+                if (WAIT_OBJECT_0 == WaitForMultipleObjects(2, handles, FALSE, INFINITE))
+                {
+                    bConnected = (FALSE != GetOverlappedResult(hPipe, &ov, &cbUnused, FALSE));
+                }
+                else
+                {
+                    CancelIoEx(hPipe, &ov);
+                    GetOverlappedResult(hPipe, &ov, &cbUnused, TRUE);
+                    break;
+                }
+            }
+            else
+            {
+                dbgOut.locked() << L"ConnectNamedPipe failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+                dwExitCode = dwLastErr;
+                break;
+            }
+        }
+
+        if (bConnected)
+        {
+            HandleAgentRequest(hPipe, sExePath);
+            // Disconnecting discards replies that haven't been read, so give the requester a few seconds to
+            // read them and close its end (which ends this read).
+            BYTE unused = 0;
+            DWORD cbUnused = 0;
+            TransferAgentMessage(hPipe, false, &unused, sizeof(unused), cbUnused, 5000, st_hAgentStopEvent);
+        }
+        DisconnectNamedPipe(hPipe);
+        if (WAIT_OBJECT_0 == WaitForSingleObject(st_hAgentStopEvent, 0))
+            break;
+    }
+
+    CloseHandle(ov.hEvent);
+    CloseHandle(hPipe);
+    return dwExitCode;
+}
+
+/// <summary>
+/// Entry point for the agent service
+/// </summary>
+static void WINAPI AgentServiceMain(DWORD dwArgc, wchar_t** lpszArgv)
+{
+    DbgOutArgcArgv(L"AgentServiceMain", dwArgc, lpszArgv);
+
+    // Register the service's control handling function
+    hServiceStatus = RegisterServiceCtrlHandlerW(
+        lpszArgv[0],
+        ServiceControlHandler);
+    if (!hServiceStatus)
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"RegisterServiceCtrlHandlerW failed: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return;
+    }
+
+    // Reports SERVICE_RUNNING once the control pipe is ready.
+    NotifySCM(SERVICE_START_PENDING);
+    DWORD dwExitCode = ServeAgentRequests();
+    NotifySCM(SERVICE_STOPPED, dwExitCode);
+}
+
+
 /// <summary>
 /// ServiceControlHandler: handle control codes sent to the service by the SCM.
 /// </summary>
@@ -209,8 +653,9 @@ static void WINAPI ServiceControlHandler(DWORD dwControlCode)
     case SERVICE_CONTROL_STOP:
     case SERVICE_CONTROL_SHUTDOWN:
         NotifySCM(SERVICE_STOP_PENDING);
-        // Signal the service to stop.
-        //SetEvent(hServiceStopEvent);
+        // Signal the agent service to stop. (The single-use service stops when its code completes.)
+        if (st_hAgentStopEvent)
+            SetEvent(st_hAgentStopEvent);
         break;
 
         // Answer when asked
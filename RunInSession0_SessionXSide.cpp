@@ -2,7 +2,8 @@
 // 
 // The portion of the RunInSession0_Framework that executes code in the current interactive desktop session.
 // It configures a Windows service that runs an instance of this executable with specific parameters so that it can
-// communicate back to this process.
+// communicate back to this process, or, if the persistent agent for this executable is installed, asks the agent
+// to run the code instead.
 //
 
 #include <Windows.h>
@@ -31,6 +32,162 @@ static DWORD WINAPI PipeMonitorThread(LPVOID lpvThreadParameter);
 // ----------------------------------------------------------------------------------------------------
 // ----------------------------------------------------------------------------------------------------
 
+/// <summary>
+/// Connects to the control pipe of the persistent session-0 agent for this executable, if it's installed,
+/// starting the agent if it isn't running (e.g., after a request that didn't complete in time).
+/// </summary>
+/// <param name="hSCManager">Input: handle to the service control manager</param>
+/// <returns>Handle to the control pipe, opened for overlapped I/O in message mode; INVALID_HANDLE_VALUE if the agent isn't available</returns>
+static HANDLE ConnectToAgent(SC_HANDLE hSCManager)
+{
+    const std::wstring sServiceName = AgentServiceName();
+    SC_HANDLE hAgent = OpenServiceW(hSCManager, sServiceName.c_str(), SERVICE_QUERY_STATUS | SERVICE_START);
+    if (NULL == hAgent)
+    {
+        DWORD dwLastErr = GetLastError();
+        dbgOut.locked() << L"Agent " << sServiceName << L" not available: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+        return INVALID_HANDLE_VALUE;
+    }
+
+    HANDLE hPipe = INVALID_HANDLE_VALUE;
+    const std::wstring sPipeName = AgentPipeName(sServiceName);
+    const ULONGLONG ullDeadline = GetTickCount64() + 10000;
+    bool bStartRequested = false;
+    SERVICE_STATUS_PROCESS ssp = { 0 };
+    DWORD cbSSP = sizeof(ssp);
+    while (GetTickCount64() < ullDeadline && QueryServiceStatusEx(hAgent, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, cbSSP, &cbSSP))
+    {
+        if (SERVICE_RUNNING == ssp.dwCurrentState)
+        {
+            // Identification-level impersonation only: the agent has no need to act as this process.
+            hPipe = CreateFileW(
+                sPipeName.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION,
+                NULL);
+            if (INVALID_HANDLE_VALUE != hPipe)
+                break;
+            DWORD dwLastErr = GetLastError();
+            if (ERROR_PIPE_BUSY == dwLastErr)
+            {
+                // Serving another request
+                WaitNamedPipeW(sPipeName.c_str(), 1000);
+            }
+            else if (ERROR_FILE_NOT_FOUND == dwLastErr)
+            {
+                // Between requests, or stopping
+                Sleep(50);
+            }
+            else
+            {
+                dbgOut.locked() << L"Can't connect to agent pipe " << sPipeName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+                break;
+            }
+        }
+        else if (SERVICE_STOPPED == ssp.dwCurrentState)
+        {
+            // If it was started and has stopped again, it failed to start.
+            if (bStartRequested)
+            {
+                dbgOut.locked() << L"Agent stopped; exit code " << ssp.dwWin32ExitCode << std::endl;
+                break;
+            }
+            bStartRequested = true;
+            if (!StartServiceW(hAgent, 0, nullptr) && ERROR_SERVICE_ALREADY_RUNNING != GetLastError())
+            {
+                DWORD dwLastErr = GetLastError();
+                dbgOut.locked() << L"Can't start agent: " << SysErrorMessageWithCode(dwLastErr) << std::endl;
+                break;
+            }
+        }
+        else
+        {
+            Sleep(50);
+        }
+    }
+
+    if (INVALID_HANDLE_VALUE != hPipe)
+    {
+        // Make sure the pipe belongs to the agent, and not to some other process that created a pipe with its name.
+        ULONG ulServerPID = 0;
+        DWORD dwReadMode = PIPE_READMODE_MESSAGE;
+        if (!GetNamedPipeServerProcessId(hPipe, &ulServerPID) || ulServerPID != ssp.dwProcessId ||
+            !SetNamedPipeHandleState(hPipe, &dwReadMode, nullptr, nullptr))
+        {
+            dbgOut.locked() << L"Agent pipe server is PID " << ulServerPID << L", agent is PID " << ssp.dwProcessId << L"; not using it" << std::endl;
+            CloseHandle(hPipe);
+            hPipe = INVALID_HANDLE_VALUE;
+        }
+    }
+    CloseServiceHandle(hAgent);
+    return hPipe;
+}
+
+/// <summary>
+/// Appends a null-terminated string to an agent request.
+/// </summary>
+static void AppendRequestString(std::vector<BYTE>& request, const wchar_t* szString)
+{
+    const BYTE* pString = (const BYTE*)szString;
+    request.insert(request.end(), pString, pString + (wcslen(szString) + 1) * sizeof(wchar_t));
+}
+
+/// <summary>
+/// Asks the agent to run the code with its stdout and stderr redirected to the named pipes, and waits
+/// until it has connected to them.
+/// </summary>
+/// <param name="hAgentPipe">Input: the agent's control pipe</param>
+/// <param name="argc">Number of app-specific arguments to pass to the code</param>
+/// <param name="argv">App-specific arguments to pass to the code</param>
+/// <param name="dwMaxMilliseconds">Maximum time the code should need to run</param>
+/// <param name="sNamedPipe_Output">Name of the pipe for the code's stdout</param>
+/// <param name="sNamedPipe_Error">Name of the pipe for the code's stderr</param>
+/// <returns>
+/// ReadyToWrite if the agent is running the code; Rejected if the agent didn't take the request (so a service of
+/// our own can run the code instead); Failed if the agent took the request but didn't get ready.
+/// </returns>
+static AgentStatus_t SendAgentRequest(
+    HANDLE hAgentPipe,
+    int argc,
+    wchar_t** argv,
+    DWORD dwMaxMilliseconds,
+    const std::wstring& sNamedPipe_Output,
+    const std::wstring& sNamedPipe_Error)
+{
+    wchar_t szExePath[MAX_PATH];
+    if (!GetModuleFileNameW(NULL, szExePath, MAX_PATH))
+        return AgentStatus_t::Rejected;
+
+    const AgentRequestHeader_t header = { dwAgentRequestSignature, dwMaxMilliseconds, DWORD(argc) };
+    std::vector<BYTE> request((const BYTE*)&header, (const BYTE*)&header + sizeof(header));
+    AppendRequestString(request, szExePath);
+    AppendRequestString(request, sNamedPipe_Output.c_str());
+    AppendRequestString(request, sNamedPipe_Error.c_str());
+    for (int ixArg = 0; ixArg < argc; ++ixArg)
+        AppendRequestString(request, argv[ixArg]);
+    if (request.size() > cbAgentMaxRequest)
+    {
+        dbgOut.locked() << L"Command line too long for the agent" << std::endl;
+        return AgentStatus_t::Rejected;
+    }
+
+    DWORD cbTransferred = 0;
+    if (!TransferAgentMessage(hAgentPipe, true, request.data(), DWORD(request.size()), cbTransferred, 10000))
+        return AgentStatus_t::Rejected;
+    AgentReply_t reply = { AgentStatus_t::Failed, 0 };
+    if (!TransferAgentMessage(hAgentPipe, false, &reply, sizeof(reply), cbTransferred, 10000) || sizeof(reply) != cbTransferred)
+        return AgentStatus_t::Failed;
+    if (AgentStatus_t::ReadyToWrite != reply.status && AgentStatus_t::Rejected != reply.status)
+        return AgentStatus_t::Failed;
+    return reply.status;
+}
+
+// ----------------------------------------------------------------------------------------------------
+// ----------------------------------------------------------------------------------------------------
+
 /// <summary>
 /// Code to execute in session X (> 0) to prepare the execution of code in session 0, start the session
 /// 0 code, capture its output, then clean up.
@@ -69,7 +226,10 @@ int SessionXSide(
         // Thread that reads from hOutput
         hThreadOutput = nullptr,
         // Thread that reads from hError
-        hThreadError = nullptr;
+        hThreadError = nullptr,
+        // Control pipe of the persistent session-0 agent, if it's running the code
+        hAgentPipe = INVALID_HANDLE_VALUE;
+    bool bUsingAgent = false;
     // Set security descriptor on named pipes
     PSECURITY_DESCRIPTOR 
         pSD = nullptr;
@@ -186,6 +346,31 @@ int SessionXSide(
         goto SessionXCleanup;
     }
 
+    // If the persistent session-0 agent for this executable is installed, ask it to run the code: much faster than
+    // creating, starting, and deleting a service. If it isn't installed or won't take the request, create a service.
+    hAgentPipe = ConnectToAgent(hSCManager);
+    if (INVALID_HANDLE_VALUE != hAgentPipe)
+    {
+        switch (SendAgentRequest(hAgentPipe, argc, argv, dwMaxMilliseconds, sNamedPipe_Output, sNamedPipe_Error))
+        {
+        case AgentStatus_t::ReadyToWrite:
+            dbgOut.locked() << L"Agent indicates it is ready to write." << std::endl;
+            bUsingAgent = true;
+            goto SessionXReadyToRead;
+
+        case AgentStatus_t::Rejected:
+            dbgOut.locked() << L"Agent did not take the request; creating a service instead" << std::endl;
+            CloseHandle(hAgentPipe);
+            hAgentPipe = INVALID_HANDLE_VALUE;
+            break;
+
+        default:
+            dbgOut.locked() << L"Agent did not get ready to write" << std::endl;
+            retval = -8;
+            goto SessionXCleanup;
+        }
+    }
+
     // Scope the variables in this bit
     {
         // Construct the full command line for the service
@@ -280,6 +465,8 @@ int SessionXSide(
         goto SessionXCleanup;
     }
 
+SessionXReadyToRead:
+
     // Scope for variables
     {
         // Start threads to read and redirect data from session-0's stdout and stderr.
@@ -298,14 +485,36 @@ int SessionXSide(
         hThreadError = CreateThread(nullptr, 0, PipeMonitorThread, &SourceDest_Error, 0, nullptr);
 
         // Wait for signal that the service is done and that both stdout and stderr monitoring threads are done.
-        const HANDLE handles[3] = { hEventServiceDone, hThreadOutput, hThreadError };
-        const DWORD nHandles = sizeof(handles) / sizeof(handles[0]);
+        // (The agent reports that it's done on its control pipe instead, after closing its ends of the pipes.)
+        const HANDLE handles[3] = { hThreadOutput, hThreadError, hEventServiceDone };
+        const DWORD nHandles = bUsingAgent ? 2 : 3;
         // Configurable timeout (30 seconds by default)
         dwWait = WaitForMultipleObjects(nHandles, handles, TRUE, dwMaxMilliseconds);
         if (WAIT_OBJECT_0 <= dwWait && dwWait < WAIT_OBJECT_0 + nHandles)
         {
             dbgOut.locked() << L"Session 0 code done, and its output consumed" << std::endl;
             retval = 0;
+            if (bUsingAgent)
+            {
+                AgentReply_t reply = { AgentStatus_t::Failed, 0 };
+                DWORD cbReply = 0;
+                if (TransferAgentMessage(hAgentPipe, false, &reply, sizeof(reply), cbReply, 10000) &&
+                    sizeof(reply) == cbReply && AgentStatus_t::Done == reply.status)
+                {
+                    dbgOut.locked() << L"Agent reports exit code " << reply.dwExitCode << std::endl;
+                }
+                else if (sizeof(reply) == cbReply && AgentStatus_t::TimedOut == reply.status)
+                {
+                    // The agent ended the code's process when the time limit passed, which closed the pipes.
+                    dbgOut.locked() << L"Agent reports that the code timed out" << std::endl;
+                    retval = -10;
+                }
+                else
+                {
+                    dbgOut.locked() << L"No completion reply from the agent" << std::endl;
+                    retval = -12;
+                }
+            }
         }
         else if (WAIT_TIMEOUT == dwWait)
         {
@@ -362,6 +571,8 @@ SessionXCleanup:
     }
     if (hOutput) { dbgOut.locked() << L"CloseHandle hOutput" << std::endl; CloseHandle(hOutput); }
     if (hError) { dbgOut.locked() << L"CloseHandle hError" << std::endl; CloseHandle(hError); }
+    // The agent stops the code itself if it runs too long, and is started again when it's next needed.
+    if (INVALID_HANDLE_VALUE != hAgentPipe) { dbgOut.locked() << L"CloseHandle hAgentPipe" << std::endl; CloseHandle(hAgentPipe); }
 
     if (hService)
     {
@@ -425,8 +636,8 @@ SessionXCleanup:
             dbgOut.locked() << L"Cannot delete service " << sServiceName << L": " << SysErrorMessageWithCode(dwLastErr) << std::endl;
         }
         CloseServiceHandle(hService);
-        CloseServiceHandle(hSCManager);
     }
+    CloseServiceHandle(hSCManager);
 
     return retval;
 }
@@ -11,6 +11,19 @@
 #include "StringUtils.h"
 #include "RunInSession0_Framework_InternalDecls.h"
 
+/// <summary>
+/// Whether this process was started by the agent to run the code for one request
+/// </summary>
+static bool st_bRunningAsAgentRequest = false;
+
+/// <summary>
+/// Returns true if this process was started by the session-0 agent to run the code for a request.
+/// </summary>
+bool RunningAsAgentRequest()
+{
+    return st_bRunningAsAgentRequest;
+}
+
 /// <summary>
 /// Output usage and error information to stderr and exit the process.
 /// </summary>
@@ -39,10 +52,14 @@ static void Usage(const wchar_t* argv0, const wchar_t* szUsageDescription, const
         << std::endl
         << L"    " << sExe << L" [-here] [additional params]" << std::endl
         << L"    " << sExe << L" [-t timeout] [-o outfile] [additional params]" << std::endl
+        << L"    " << sExe << L" -installagent | -uninstallagent" << std::endl
         << std::endl
         << L"  -here : run the code in the current session rather than in session 0" << std::endl
         << L"  -t    : max time in seconds for the session-0 service code to complete (default 30 seconds)" << std::endl
         << L"  -o    : redirect stdout from the session-0 code to named file" << std::endl
+        << L"  -installagent   : install a persistent session-0 agent service that runs the session-0 code" << std::endl
+        << L"                    for each run, instead of creating and deleting a service each time" << std::endl
+        << L"  -uninstallagent : stop and remove the agent service" << std::endl
         << std::endl
         << L"additional params (these must come last):" << std::endl
         << (szParamsForFunction ? szParamsForFunction : L"(none)") << std::endl
@@ -93,8 +110,26 @@ int wmainCommandProcessor(
         );
     }
 
+    // If in session 0 and with the agent parameters, this program was started by the Service Control
+    // Manager as the persistent agent, to run the code for each request from a session X process.
+    if (bInSession0 && AreAgentExeParams(argc, argv))
+    {
+        return AgentExeSide(
+            argv[2] // service name
+        );
+    }
+
+    // If in session 0 and with the agent request switch, the agent started this process to run the code
+    // for one request, with stdout and stderr already connected to the requester's pipes.
+    if (bInSession0 && AreAgentRequestExeParams(argc, argv))
+    {
+        st_bRunningAsAgentRequest = true;
+        return pfn_CodeToRunInSession0(argc - 2, &argv[2]);
+    }
+
     // Not running as a service. Handle other command line parameters.
     bool bStayInThisSession = false, bTimeoutOverride = false;
+    bool bInstallAgent = false, bUninstallAgent = false;
     const wchar_t* szRedirectToFile = nullptr;
     DWORD dwMaxSeconds = 30;
     int ixArg = 1, argcExtra = 0;
@@ -128,6 +163,14 @@ int wmainCommandProcessor(
                 Usage(argv[0], szUsageDescription, szParamsForFunction, L"Missing arg for -o");
             szRedirectToFile = argv[ixArg];
         }
+        else if (0 == wcscmp(L"-installagent", argv[ixArg]))
+        {
+            bInstallAgent = true;
+        }
+        else if (0 == wcscmp(L"-uninstallagent", argv[ixArg]))
+        {
+            bUninstallAgent = true;
+        }
         else
         {
             // argcExtra -- app-specific arguments to be processed by app-specific code.
@@ -142,6 +185,13 @@ int wmainCommandProcessor(
     {
         Usage(argv[0], szUsageDescription, szParamsForFunction, L"Invalid combination of options");
     }
+    // Installing or removing the agent doesn't run the code.
+    if (bInstallAgent || bUninstallAgent)
+    {
+        if ((bInstallAgent && bUninstallAgent) || bStayInThisSession || nullptr != szRedirectToFile || bTimeoutOverride || argcExtra > 0)
+            Usage(argv[0], szUsageDescription, szParamsForFunction, L"Invalid combination of options");
+        return bInstallAgent ? InstallAgent() : UninstallAgent();
+    }
 
     dbgOut.locked() << L"bStayInThisSession = " << bStayInThisSession << std::endl;
     dbgOut.locked() << L"dwMaxSeconds = " << dwMaxSeconds << std::endl;
@@ -1,4 +1,7 @@
-#include <map>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cwctype>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -6,110 +9,734 @@
 #include "FileOutput.h"
 #include "ServiceLookupByPID.h"
 
-typedef std::map<ULONG_PTR, ServiceList_t> ServiceLookupByPID_t;
+/// <summary>
+/// Service source that enumerates running services through the Service Control Manager,
+/// one page at a time.
+/// </summary>
+class ScmServiceSource_t : public ServiceSource_t
+{
+public:
+	bool EnumerateServices(std::vector<ServiceRecord_t>& records) override;
+	bool QueryService(const wchar_t* szServiceName, ServiceRecord_t& record, bool& bActive) override;
+	uint64_t TickCountMs() override { return GetTickCount64(); }
+
+	ServiceEnumerationStats_t GetStats() const;
+
+	/// <summary>
+	/// Requests that each service's configuration metadata be read from the registry during enumeration.
+	/// </summary>
+	/// <returns>true if it had already been requested</returns>
+	bool EnableReadConfiguration() { return m_bReadConfiguration.exchange(true); }
+
+private:
+	// Enumerates all pages once. Returns ERROR_SUCCESS, or the error that stopped the enumeration.
+	DWORD EnumerateAllPages(SC_HANDLE hSCM);
+	// Reads start types and svchost groups for all the enumerated services in one pass over the registry.
+	void ReadConfiguration();
+
+private:
+	// Buffer for one page of results; reused for each page and each enumeration.
+	std::vector<BYTE> m_pageBuffer;
+	// Names copied out of each page, null-terminated; reused for each enumeration.
+	std::vector<wchar_t> m_names;
+	// Offsets into m_names for each service found; converted to records once all pages are in.
+	struct NameOffsets_t
+	{
+		uint64_t pid;
+		size_t ixServiceName, ixDisplayName;
+		DWORD dwServiceType;
+		// Filled in by ReadConfiguration, if requested; ixSvchostGroup is SIZE_MAX if none.
+		DWORD dwStartType;
+		bool bDelayedAutoStart;
+		size_t ixSvchostGroup;
+	};
+	std::vector<NameOffsets_t> m_offsets;
+	// Strings for the most recent QueryService result
+	std::wstring m_sQueryServiceName, m_sQueryDisplayName, m_sQuerySvchostGroup;
+
+	// Whether to read each service's configuration metadata from the registry during enumeration.
+	std::atomic<bool> m_bReadConfiguration{ false };
+	std::atomic<uint64_t> m_nEnumerations{ 0 }, m_nPages{ 0 }, m_nRetries{ 0 }, m_nFailures{ 0 };
+	std::atomic<DWORD> m_dwLastError{ 0 };
+};
 
-static ServiceLookupByPID_t ServiceLookupByPID;
-static bool bInitialized = false;
+// EnumServicesStatusExW returns at most 256KB per call; start smaller and grow only if a single entry doesn't fit.
+static const DWORD cbInitialPageBuffer = 64 * 1024;
+static const DWORD cbMaxPageBuffer = 256 * 1024;
+// Number of times to restart an enumeration that fails partway through
+static const DWORD nMaxEnumerationRetries = 3;
 
 /// <summary>
-/// Initialize the lookup object.
-/// If it fails, it fails silently.
+/// Enumerates all pages once, using the resume handle to continue where the previous page ended.
 /// </summary>
-static void InitializeServiceLookup()
+/// <returns>ERROR_SUCCESS, or the error that stopped the enumeration</returns>
+DWORD ScmServiceSource_t::EnumerateAllPages(SC_HANDLE hSCM)
 {
-	if (bInitialized)
-		return;
+	m_names.clear();
+	m_offsets.clear();
+	if (m_pageBuffer.size() < cbInitialPageBuffer)
+		m_pageBuffer.resize(cbInitialPageBuffer);
+
+	DWORD dwResumeHandle = 0;
+	for (;;)
+	{
+		DWORD cbBytesNeeded = 0, dwServicesReturned = 0;
+		BOOL ret = EnumServicesStatusExW(hSCM, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_ACTIVE, m_pageBuffer.data(), DWORD(m_pageBuffer.size()), &cbBytesNeeded, &dwServicesReturned, &dwResumeHandle, nullptr);
+		DWORD dwLastErr = ret ? ERROR_SUCCESS : GetLastError();
+		if (!ret && ERROR_MORE_DATA != dwLastErr)
+			return dwLastErr;
+		++m_nPages;
+
+		if (!ret && 0 == dwServicesReturned)
+		{
+			// The next entry doesn't fit in the buffer at all; grow it and retry the page.
+			if (cbBytesNeeded <= m_pageBuffer.size() || m_pageBuffer.size() >= cbMaxPageBuffer)
+				return dwLastErr;
+			m_pageBuffer.resize(cbBytesNeeded < cbMaxPageBuffer ? cbMaxPageBuffer : cbBytesNeeded);
+			continue;
+		}
+
+		// Copy the names out of the page so the buffer can be reused for the next one.
+		const ENUM_SERVICE_STATUS_PROCESSW* pServiceInfo = (const ENUM_SERVICE_STATUS_PROCESSW*)m_pageBuffer.data();
+		for (DWORD ix = 0; ix < dwServicesReturned; ++ix)
+		{
+#pragma warning(push)
+#pragma warning(disable:6385) // False positive: "Reading invalid data from 'pServiceInfo'"
+			const ENUM_SERVICE_STATUS_PROCESSW& svc = pServiceInfo[ix];
+#pragma warning(pop)
+			NameOffsets_t offsets;
+			offsets.pid = svc.ServiceStatusProcess.dwProcessId;
+			offsets.dwServiceType = svc.ServiceStatusProcess.dwServiceType;
+			offsets.dwStartType = ServiceStartTypeUnknown;
+			offsets.bDelayedAutoStart = false;
+			offsets.ixSvchostGroup = SIZE_MAX;
+			offsets.ixServiceName = m_names.size();
+			m_names.insert(m_names.end(), svc.lpServiceName, svc.lpServiceName + wcslen(svc.lpServiceName) + 1);
+			offsets.ixDisplayName = m_names.size();
+			m_names.insert(m_names.end(), svc.lpDisplayName, svc.lpDisplayName + wcslen(svc.lpDisplayName) + 1);
+			m_offsets.push_back(offsets);
+		}
+
+		// Success means that was the last page.
+		if (ret)
+			return ERROR_SUCCESS;
+	}
+}
 
-	bInitialized = true;
+/// <summary>
+/// Enumerates running services through the Service Control Manager. If the enumeration fails partway
+/// through (e.g., because services are starting and stopping), it is restarted from the beginning.
+/// </summary>
+bool ScmServiceSource_t::EnumerateServices(std::vector<ServiceRecord_t>& records)
+{
+	records.clear();
+	++m_nEnumerations;
 
-	BOOL ret;
-	DWORD dwLastErr;
-	SC_HANDLE hSCM = NULL;
-	LPENUM_SERVICE_STATUS_PROCESSW pServiceInfoBuffer = nullptr;
-	DWORD cbBytesNeeded = 0, dwServicesReturned = 0, dwResumeHandle = 0;
-	hSCM = OpenSCManagerW(NULL, NULL, SC_MANAGER_ENUMERATE_SERVICE);
+	SC_HANDLE hSCM = OpenSCManagerW(NULL, NULL, SC_MANAGER_ENUMERATE_SERVICE);
 	if (NULL == hSCM)
 	{
-		//dwLastErr = GetLastError();
-		//std::wcerr << L"OpenSCManagerW failed; error " << dwLastErr << std::endl;
-		//retval = -1;
-		goto cleanup;
+		m_dwLastError = GetLastError();
+		++m_nFailures;
+		return false;
 	}
-#pragma warning(push)
-#pragma warning(disable:6031) // False positive: "Return value ignored: 'EnumServicesStatusExW'"
-	/*ret =*/ EnumServicesStatusExW(hSCM, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_ACTIVE, nullptr, 0, &cbBytesNeeded, &dwServicesReturned, &dwResumeHandle, nullptr);
-#pragma warning(pop)
-	dwLastErr = GetLastError();
-	if (ERROR_MORE_DATA != dwLastErr)
+
+	DWORD dwErr = EnumerateAllPages(hSCM);
+	for (DWORD nRetries = 0; ERROR_SUCCESS != dwErr && nRetries < nMaxEnumerationRetries; ++nRetries)
 	{
-		//std::wcerr << L"EnumServicesStatusExW (first call) failed; error " << dwLastErr << std::endl;
-		//retval = -2;
-		goto cleanup;
+		++m_nRetries;
+		dwErr = EnumerateAllPages(hSCM);
 	}
-	// Add 50% in case other services have become active in between calls.
-	cbBytesNeeded = cbBytesNeeded + cbBytesNeeded / 2;
-	pServiceInfoBuffer = LPENUM_SERVICE_STATUS_PROCESSW(new BYTE[cbBytesNeeded]);
-	ret = EnumServicesStatusExW(hSCM, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_ACTIVE, (LPBYTE)pServiceInfoBuffer, cbBytesNeeded, &cbBytesNeeded, &dwServicesReturned, &dwResumeHandle, nullptr);
-	if (!ret)
+	CloseServiceHandle(hSCM);
+
+	if (ERROR_SUCCESS != dwErr)
 	{
-		//std::wcerr << L"EnumServicesStatusExW (second call) failed; error " << dwLastErr << std::endl;
-		//retval = -3;
-		goto cleanup;
+		m_dwLastError = dwErr;
+		++m_nFailures;
+		return false;
 	}
 
-	for (DWORD ix = 0; ix < dwServicesReturned; ++ix)
+	if (m_bReadConfiguration)
+		ReadConfiguration();
+
+	// All pages are in, so m_names won't be reallocated again until the next enumeration.
+	records.reserve(m_offsets.size());
+	for (std::vector<NameOffsets_t>::const_iterator iterOffsets = m_offsets.begin(); iterOffsets != m_offsets.end(); ++iterOffsets)
 	{
-#pragma warning(push)
-#pragma warning(disable:6385) // False positive: "Reading invalid data from 'pServiceInfoBuffer'"
-		const ENUM_SERVICE_STATUS_PROCESSW& svc = pServiceInfoBuffer[ix];
-#pragma warning(pop)
-		ServiceNames_t names;
-		names.sDisplayName = svc.lpDisplayName;
-		names.sServiceName = svc.lpServiceName;
-		ServiceLookupByPID_t::iterator iSvc = ServiceLookupByPID.find(svc.ServiceStatusProcess.dwProcessId);
-		if (iSvc == ServiceLookupByPID.end())
+		ServiceRecord_t record;
+		record.pid = iterOffsets->pid;
+		record.szServiceName = m_names.data() + iterOffsets->ixServiceName;
+		record.szDisplayName = m_names.data() + iterOffsets->ixDisplayName;
+		record.dwServiceType = iterOffsets->dwServiceType;
+		record.dwStartType = iterOffsets->dwStartType;
+		record.bDelayedAutoStart = iterOffsets->bDelayedAutoStart;
+		if (SIZE_MAX != iterOffsets->ixSvchostGroup)
+			record.szSvchostGroup = m_names.data() + iterOffsets->ixSvchostGroup;
+		records.push_back(record);
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns the svchost group from a service's command line: the argument following "-k".
+/// </summary>
+static std::wstring SvchostGroupFromImagePath(const std::wstring& sImagePath)
+{
+	// Only svchost-hosted services have a group.
+	std::wstring sLower = sImagePath;
+	for (std::wstring::iterator iterCh = sLower.begin(); iterCh != sLower.end(); ++iterCh)
+		*iterCh = towlower(*iterCh);
+	if (std::wstring::npos == sLower.find(L"svchost.exe"))
+		return std::wstring();
+	size_t ixK = sLower.find(L" -k ");
+	if (std::wstring::npos == ixK)
+		return std::wstring();
+	size_t ixStart = sImagePath.find_first_not_of(L' ', ixK + 4);
+	if (std::wstring::npos == ixStart)
+		return std::wstring();
+	size_t ixEnd = sImagePath.find(L' ', ixStart);
+	return sImagePath.substr(ixStart, (std::wstring::npos == ixEnd) ? std::wstring::npos : ixEnd - ixStart);
+}
+
+/// <summary>
+/// Reads a service's start type, delayed auto-start setting, and svchost group from its registry key.
+/// Values that can't be read are left unchanged.
+/// </summary>
+/// <param name="hServicesKey">Input: the services registry key</param>
+/// <param name="szServiceName">Input: the service's key name</param>
+/// <param name="imagePathBuffer">Input/output: buffer for the image path, reused across calls</param>
+static void ReadServiceConfiguration(HKEY hServicesKey, const wchar_t* szServiceName, std::vector<wchar_t>& imagePathBuffer, DWORD& dwStartType, bool& bDelayedAutoStart, std::wstring& sSvchostGroup)
+{
+	HKEY hSvcKey = NULL;
+	if (ERROR_SUCCESS != RegOpenKeyExW(hServicesKey, szServiceName, 0, KEY_QUERY_VALUE, &hSvcKey))
+		return;
+
+	DWORD dwValue = 0, cbValue = sizeof(dwValue);
+	if (ERROR_SUCCESS == RegGetValueW(hSvcKey, nullptr, L"Start", RRF_RT_REG_DWORD, nullptr, &dwValue, &cbValue))
+		dwStartType = dwValue;
+	dwValue = 0;
+	cbValue = sizeof(dwValue);
+	if (ERROR_SUCCESS == RegGetValueW(hSvcKey, nullptr, L"DelayedAutostart", RRF_RT_REG_DWORD, nullptr, &dwValue, &cbValue))
+		bDelayedAutoStart = (0 != dwValue);
+
+	DWORD cbImagePath = DWORD(imagePathBuffer.size() * sizeof(wchar_t));
+	LSTATUS status = RegGetValueW(hSvcKey, nullptr, L"ImagePath", RRF_RT_REG_SZ | RRF_RT_REG_EXPAND_SZ | RRF_NOEXPAND, nullptr, imagePathBuffer.data(), &cbImagePath);
+	if (ERROR_MORE_DATA == status)
+	{
+		imagePathBuffer.resize(cbImagePath / sizeof(wchar_t) + 1);
+		cbImagePath = DWORD(imagePathBuffer.size() * sizeof(wchar_t));
+		status = RegGetValueW(hSvcKey, nullptr, L"ImagePath", RRF_RT_REG_SZ | RRF_RT_REG_EXPAND_SZ | RRF_NOEXPAND, nullptr, imagePathBuffer.data(), &cbImagePath);
+	}
+	if (ERROR_SUCCESS == status)
+		sSvchostGroup = SvchostGroupFromImagePath(imagePathBuffer.data());
+	RegCloseKey(hSvcKey);
+}
+
+/// <summary>
+/// Reads start types and svchost groups for all the enumerated services in one pass over the
+/// services registry key, rather than a QueryServiceConfig call (an SCM round trip) per service.
+/// Services whose configuration can't be read keep an unknown start type.
+/// </summary>
+void ScmServiceSource_t::ReadConfiguration()
+{
+	HKEY hServicesKey = NULL;
+	if (ERROR_SUCCESS != RegOpenKeyExW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Services", 0, KEY_READ, &hServicesKey))
+		return;
+
+	std::vector<wchar_t> imagePathBuffer(MAX_PATH * 2);
+	std::wstring sGroup;
+	for (std::vector<NameOffsets_t>::iterator iterOffsets = m_offsets.begin(); iterOffsets != m_offsets.end(); ++iterOffsets)
+	{
+		sGroup.clear();
+		ReadServiceConfiguration(hServicesKey, m_names.data() + iterOffsets->ixServiceName, imagePathBuffer, iterOffsets->dwStartType, iterOffsets->bDelayedAutoStart, sGroup);
+		if (!sGroup.empty())
 		{
-			ServiceList_t list;
-			list.push_back(names);
-			ServiceLookupByPID[svc.ServiceStatusProcess.dwProcessId] = list;
+			iterOffsets->ixSvchostGroup = m_names.size();
+			m_names.insert(m_names.end(), sGroup.c_str(), sGroup.c_str() + sGroup.length() + 1);
+		}
+	}
+	RegCloseKey(hServicesKey);
+}
+
+/// <summary>
+/// Queries one service's status, display name, and (if requested) configuration metadata, for an
+/// incremental refresh. A service that doesn't exist any longer is reported as not active.
+/// </summary>
+bool ScmServiceSource_t::QueryService(const wchar_t* szServiceName, ServiceRecord_t& record, bool& bActive)
+{
+	record = ServiceRecord_t();
+	bActive = false;
+
+	SC_HANDLE hSCM = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+	if (NULL == hSCM)
+	{
+		m_dwLastError = GetLastError();
+		return false;
+	}
+
+	bool bSuccess = false;
+	SC_HANDLE hService = OpenServiceW(hSCM, szServiceName, SERVICE_QUERY_STATUS);
+	if (NULL == hService)
+	{
+		DWORD dwErr = GetLastError();
+		bSuccess = (ERROR_SERVICE_DOES_NOT_EXIST == dwErr);
+		if (!bSuccess)
+			m_dwLastError = dwErr;
+	}
+	else
+	{
+		SERVICE_STATUS_PROCESS ssp = { 0 };
+		DWORD cbNeeded = 0;
+		wchar_t szDisplayName[MAX_PATH] = { 0 };
+		DWORD cchDisplayName = _countof(szDisplayName);
+		if (!QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, sizeof(ssp), &cbNeeded) ||
+			!GetServiceDisplayNameW(hSCM, szServiceName, szDisplayName, &cchDisplayName))
+		{
+			m_dwLastError = GetLastError();
 		}
 		else
 		{
-			iSvc->second.push_back(names);
+			bSuccess = true;
+			// The same services that a SERVICE_ACTIVE enumeration reports
+			bActive = (SERVICE_STOPPED != ssp.dwCurrentState);
+			m_sQueryServiceName = szServiceName;
+			m_sQueryDisplayName = szDisplayName;
+			m_sQuerySvchostGroup.clear();
+			record.pid = ssp.dwProcessId;
+			record.szServiceName = m_sQueryServiceName.c_str();
+			record.szDisplayName = m_sQueryDisplayName.c_str();
+			record.dwServiceType = ssp.dwServiceType;
+			if (m_bReadConfiguration)
+			{
+				HKEY hServicesKey = NULL;
+				if (ERROR_SUCCESS == RegOpenKeyExW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Services", 0, KEY_READ, &hServicesKey))
+				{
+					std::vector<wchar_t> imagePathBuffer(MAX_PATH * 2);
+					DWORD dwStartType = ServiceStartTypeUnknown;
+					ReadServiceConfiguration(hServicesKey, szServiceName, imagePathBuffer, dwStartType, record.bDelayedAutoStart, m_sQuerySvchostGroup);
+					record.dwStartType = dwStartType;
+					RegCloseKey(hServicesKey);
+				}
+				if (!m_sQuerySvchostGroup.empty())
+					record.szSvchostGroup = m_sQuerySvchostGroup.c_str();
+			}
 		}
+		CloseServiceHandle(hService);
 	}
+	CloseServiceHandle(hSCM);
+	return bSuccess;
+}
+
+/// <summary>
+/// Returns the enumeration counters.
+/// </summary>
+ServiceEnumerationStats_t ScmServiceSource_t::GetStats() const
+{
+	ServiceEnumerationStats_t stats;
+	stats.nEnumerations = m_nEnumerations;
+	stats.nPages = m_nPages;
+	stats.nRetries = m_nRetries;
+	stats.nFailures = m_nFailures;
+	stats.dwLastError = m_dwLastError;
+	return stats;
+}
+
+/// <summary>
+/// The process-wide SCM service source and the lookup cache built on it.
+/// </summary>
+struct ServiceLookup_t
+{
+	ServiceLookup_t() : cache(scmServiceSource) {}
+
+	ScmServiceSource_t scmServiceSource;
+	ServiceLookupCache_t cache;
 
-cleanup:
-	delete[](LPBYTE)pServiceInfoBuffer;
-	if (NULL != hSCM)
-		CloseServiceHandle(hSCM);
-	//return retval;
+private:
+	ServiceLookup_t(const ServiceLookup_t&) = delete;
+	ServiceLookup_t& operator = (const ServiceLookup_t&) = delete;
+};
+
+/// <summary>
+/// Returns a reference to the process-wide lookup, creating it on first use. Background threads hold
+/// their own references, so the lookup outlives this static reference if they're still running at exit.
+/// </summary>
+std::shared_ptr<ServiceLookup_t> ServiceLookupReference()
+{
+	static std::shared_ptr<ServiceLookup_t> st_pServiceLookup = std::make_shared<ServiceLookup_t>();
+	return st_pServiceLookup;
 }
 
 /// <summary>
-/// If the input process ID is a service process, return the service and display names of those services.
+/// One NotifyServiceStatusChangeW registration: for SCM-level service creation and deletion, or for one
+/// service's state changes. The callback only records what it was told; the notification thread acts on
+/// it after its alertable wait returns.
 /// </summary>
-/// <param name="dwPID">Input: process ID</param>
-/// <param name="pServiceList">Output: if the process is a service process, returns a pointer information about the services it hosts; NULL otherwise.</param>
-/// <returns>true if the process is a service process; false otherwise</returns>
-bool LookupServicesByPID(ULONG_PTR pid, const ServiceList_t** ppServiceList)
+struct ServiceWatch_t
 {
-	// Make sure the lookup object has been initialized
-	InitializeServiceLookup();
+	SERVICE_NOTIFYW notify = {};
+	// Service handle, or the SCM handle for the SCM-level registration
+	SC_HANDLE hService = NULL;
+	// Service key name; empty for the SCM-level registration
+	std::wstring sServiceName;
+	// Set by the callback
+	bool bFired = false;
+	// SCM-level registration: names of created services ("/" prefix) and deleted services ("\" prefix)
+	std::vector<std::wstring> changedNames;
+};
 
-	ServiceLookupByPID_t::const_iterator iter = ServiceLookupByPID.find(pid);
-	if (iter == ServiceLookupByPID.end())
+/// <summary>
+/// Callback from NotifyServiceStatusChangeW. Runs as an APC on the notification thread.
+/// </summary>
+static VOID CALLBACK ServiceWatchCallback(PVOID pParameter)
+{
+	PSERVICE_NOTIFYW pNotify = (PSERVICE_NOTIFYW)pParameter;
+	ServiceWatch_t* pWatch = (ServiceWatch_t*)pNotify->pContext;
+	// The names of the created/deleted services are allocated by the system on the caller's behalf.
+	if (nullptr != pNotify->pszServiceNames)
 	{
-		*ppServiceList = nullptr;
+		for (const wchar_t* szName = pNotify->pszServiceNames; L'\0' != *szName; szName += wcslen(szName) + 1)
+			pWatch->changedNames.push_back(szName);
+		LocalFree(pNotify->pszServiceNames);
+		pNotify->pszServiceNames = nullptr;
+	}
+	pWatch->bFired = true;
+}
+
+// Service state changes that can change the PID a service runs in.
+static const DWORD dwPidChangeNotifyMask = SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_START_PENDING | SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_DELETE_PENDING;
+
+/// <summary>
+/// Notification mask for a service in the given state: the PID-changing states other than the current
+/// one. (Registering for the state the service is already in delivers a notification immediately.)
+/// </summary>
+static DWORD NotifyMaskForState(DWORD dwCurrentState)
+{
+	// The SERVICE_NOTIFY_* bit for each state is 1 << (state - 1).
+	DWORD dwCurrentStateBit = (dwCurrentState >= SERVICE_STOPPED && dwCurrentState <= SERVICE_PAUSED) ? (1UL << (dwCurrentState - 1)) : 0;
+	return dwPidChangeNotifyMask & ~dwCurrentStateBit;
+}
+
+/// <summary>
+/// Registers for service creation/deletion and for each service's start/stop notifications, and invalidates
+/// the affected services in the lookup cache as notifications arrive, so that the cache is refreshed
+/// incrementally. Used only on the notification thread.
+/// </summary>
+class ScmWatcher_t
+{
+public:
+	explicit ScmWatcher_t(ServiceLookupCache_t& cache) : m_cache(cache) {}
+	~ScmWatcher_t();
+
+	/// <summary>
+	/// Registers for SCM-level notifications, then for the state changes of each existing service.
+	/// Services that can't be opened aren't watched; the cache relies on lookups of unknown PIDs for them.
+	/// </summary>
+	/// <returns>true if successful; false if the SCM-level notifications can't be registered</returns>
+	bool Start();
+
+	/// <summary>
+	/// Waits for notifications and acts on them.
+	/// </summary>
+	/// <returns>true if notifications were missed (start over with a new watcher); false if registration failed</returns>
+	bool Run();
+
+private:
+	// Sets up a watch's SERVICE_NOTIFYW and registers it. Returns the NotifyServiceStatusChangeW result.
+	DWORD Register(ServiceWatch_t& watch, DWORD dwNotifyMask);
+	// Opens a service and registers for its state changes.
+	void WatchService(const std::wstring& sServiceName, DWORD dwCurrentState);
+
+private:
+	ServiceLookupCache_t& m_cache;
+	ServiceWatch_t m_scmWatch;
+	// Per-service watches, keyed by service name. (Held by pointer so the SERVICE_NOTIFYW structures don't move.)
+	std::unordered_map<std::wstring, std::unique_ptr<ServiceWatch_t>> m_serviceWatches;
+	// Set when the SCM reports that this client missed notifications
+	bool m_bLagging = false;
+
+private:
+	ScmWatcher_t(const ScmWatcher_t&) = delete;
+	ScmWatcher_t& operator = (const ScmWatcher_t&) = delete;
+};
+
+/// <summary>
+/// Closes the handles, which cancels the pending notifications, then runs any callbacks that were already
+/// queued while the watches they refer to still exist.
+/// </summary>
+ScmWatcher_t::~ScmWatcher_t()
+{
+	for (std::unordered_map<std::wstring, std::unique_ptr<ServiceWatch_t>>::const_iterator iterWatch = m_serviceWatches.begin(); iterWatch != m_serviceWatches.end(); ++iterWatch)
+	{
+		CloseServiceHandle(iterWatch->second->hService);
+	}
+	if (NULL != m_scmWatch.hService)
+		CloseServiceHandle(m_scmWatch.hService);
+	SleepEx(0, TRUE);
+}
+
+/// <summary>
+/// Sets up a watch's SERVICE_NOTIFYW and registers it.
+/// </summary>
+DWORD ScmWatcher_t::Register(ServiceWatch_t& watch, DWORD dwNotifyMask)
+{
+	watch.bFired = false;
+	watch.notify = SERVICE_NOTIFYW();
+	watch.notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+	watch.notify.pfnNotifyCallback = ServiceWatchCallback;
+	watch.notify.pContext = &watch;
+	return NotifyServiceStatusChangeW(watch.hService, dwNotifyMask, &watch.notify);
+}
+
+/// <summary>
+/// Opens a service and registers for its state changes.
+/// </summary>
+/// <param name="sServiceName">Input: the service's key name</param>
+/// <param name="dwCurrentState">Input: the service's last-known state. If it has changed since, the
+/// new state is (or leads to) one that's registered for, and so is reported right away.</param>
+void ScmWatcher_t::WatchService(const std::wstring& sServiceName, DWORD dwCurrentState)
+{
+	std::unique_ptr<ServiceWatch_t> pWatch(new ServiceWatch_t);
+	pWatch->sServiceName = sServiceName;
+	pWatch->hService = OpenServiceW(m_scmWatch.hService, sServiceName.c_str(), SERVICE_QUERY_STATUS);
+	if (NULL == pWatch->hService)
+		return;
+	DWORD dwErr = Register(*pWatch, NotifyMaskForState(dwCurrentState));
+	if (ERROR_SUCCESS != dwErr)
+	{
+		// (ERROR_SERVICE_MARKED_FOR_DELETE, for example, needs no watch.)
+		if (ERROR_SERVICE_NOTIFY_CLIENT_LAGGING == dwErr)
+			m_bLagging = true;
+		CloseServiceHandle(pWatch->hService);
+		return;
+	}
+	m_serviceWatches[sServiceName] = std::move(pWatch);
+}
+
+/// <summary>
+/// Registers for SCM-level notifications, then for the state changes of each existing service.
+/// </summary>
+bool ScmWatcher_t::Start()
+{
+	m_scmWatch.hService = OpenSCManagerW(NULL, NULL, SC_MANAGER_ENUMERATE_SERVICE);
+	if (NULL == m_scmWatch.hService)
 		return false;
+	// Register for creations first so that no service is missed between the enumeration and its registration.
+	if (ERROR_SUCCESS != Register(m_scmWatch, SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED))
+		return false;
+
+	// All Win32 services, in any state. (A change between the cache's first load and the registration
+	// for a service isn't reported, but the service's new PID is unknown to the cache, so a lookup of it
+	// refreshes the cache.)
+	std::vector<BYTE> pageBuffer(cbInitialPageBuffer);
+	DWORD dwResumeHandle = 0;
+	for (;;)
+	{
+		DWORD cbBytesNeeded = 0, dwServicesReturned = 0;
+		BOOL ret = EnumServicesStatusExW(m_scmWatch.hService, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_STATE_ALL, pageBuffer.data(), DWORD(pageBuffer.size()), &cbBytesNeeded, &dwServicesReturned, &dwResumeHandle, nullptr);
+		if (!ret && ERROR_MORE_DATA != GetLastError())
+			break;
+		if (!ret && 0 == dwServicesReturned)
+		{
+			// The next entry doesn't fit in the buffer at all; grow it and retry the page.
+			if (cbBytesNeeded <= pageBuffer.size())
+				break;
+			pageBuffer.resize(cbBytesNeeded);
+			continue;
+		}
+		const ENUM_SERVICE_STATUS_PROCESSW* pServiceInfo = (const ENUM_SERVICE_STATUS_PROCESSW*)pageBuffer.data();
+		for (DWORD ix = 0; ix < dwServicesReturned; ++ix)
+		{
+#pragma warning(push)
+#pragma warning(disable:6385) // False positive: "Reading invalid data from 'pServiceInfo'"
+			const ENUM_SERVICE_STATUS_PROCESSW& svc = pServiceInfo[ix];
+#pragma warning(pop)
+			WatchService(svc.lpServiceName, svc.ServiceStatusProcess.dwCurrentState);
+		}
+		// Success means that was the last page.
+		if (ret)
+			break;
+	}
+	return true;
+}
+
+/// <summary>
+/// Waits for notifications and acts on them: each service that was created, deleted, started, or stopped
+/// is invalidated in the cache, and the registrations are renewed.
+/// </summary>
+bool ScmWatcher_t::Run()
+{
+	while (!m_bLagging)
+	{
+		// The callbacks are delivered as APCs during the alertable wait.
+		SleepEx(INFINITE, TRUE);
+
+		if (m_scmWatch.bFired)
+		{
+			if (ERROR_SUCCESS != m_scmWatch.notify.dwNotificationStatus)
+				return false;
+			std::vector<std::wstring> changedNames;
+			changedNames.swap(m_scmWatch.changedNames);
+			for (std::vector<std::wstring>::const_iterator iterName = changedNames.begin(); iterName != changedNames.end(); ++iterName)
+			{
+				if (iterName->length() < 2)
+					continue;
+				const std::wstring sServiceName = iterName->substr(1);
+				m_cache.InvalidateService(sServiceName.c_str());
+				// A new service starts out stopped; watch for it to start.
+				if (L'/' == (*iterName)[0] && m_serviceWatches.end() == m_serviceWatches.find(sServiceName))
+					WatchService(sServiceName, SERVICE_STOPPED);
+			}
+			DWORD dwErr = Register(m_scmWatch, SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED);
+			if (ERROR_SERVICE_NOTIFY_CLIENT_LAGGING == dwErr)
+				m_bLagging = true;
+			else if (ERROR_SUCCESS != dwErr)
+				return false;
+		}
+
+		std::unordered_map<std::wstring, std::unique_ptr<ServiceWatch_t>>::iterator iterWatch = m_serviceWatches.begin();
+		while (iterWatch != m_serviceWatches.end())
+		{
+			ServiceWatch_t& watch = *iterWatch->second;
+			if (!watch.bFired)
+			{
+				++iterWatch;
+				continue;
+			}
+			m_cache.InvalidateService(watch.sServiceName.c_str());
+			// Watch for the service's next state change, unless it's being deleted.
+			DWORD dwErr = ERROR_SERVICE_MARKED_FOR_DELETE;
+			if (ERROR_SUCCESS == watch.notify.dwNotificationStatus && 0 == (watch.notify.dwNotificationTriggered & SERVICE_NOTIFY_DELETE_PENDING))
+				dwErr = Register(watch, NotifyMaskForState(watch.notify.ServiceStatus.dwCurrentState));
+			if (ERROR_SUCCESS == dwErr)
+			{
+				++iterWatch;
+				continue;
+			}
+			if (ERROR_SERVICE_NOTIFY_CLIENT_LAGGING == dwErr)
+				m_bLagging = true;
+			// Closing the handle lets a service that's marked for deletion be deleted.
+			CloseServiceHandle(watch.hService);
+			iterWatch = m_serviceWatches.erase(iterWatch);
+		}
 	}
+	return true;
+}
+
+/// <summary>
+/// Thread that watches for service changes and invalidates the affected services in the lookup cache.
+/// Runs for the life of the process. If notifications are missed, the whole cache is invalidated and
+/// the registrations are made again. If notifications can't be registered, the thread exits and the
+/// cache relies on lookups of unknown PIDs.
+/// </summary>
+/// <param name="lpvThreadParameter">Heap-allocated std::shared_ptr to the ServiceLookup_t; the thread deletes it.</param>
+static DWORD WINAPI ScmNotificationThread(LPVOID lpvThreadParameter)
+{
+	std::shared_ptr<ServiceLookup_t>* pLookupRef = (std::shared_ptr<ServiceLookup_t>*)lpvThreadParameter;
+	std::shared_ptr<ServiceLookup_t> pServiceLookup = *pLookupRef;
+	delete pLookupRef;
+
+	for (;;)
+	{
+		ScmWatcher_t watcher(pServiceLookup->cache);
+		if (!watcher.Start() || !watcher.Run())
+			break;
+		// Missed notifications: invalidate everything, and register again with new handles.
+		pServiceLookup->cache.Invalidate();
+	}
+	return 0;
+}
+
+/// <summary>
+/// One-time start of the notification thread.
+/// </summary>
+static BOOL CALLBACK StartScmNotificationThread(PINIT_ONCE, PVOID, PVOID*)
+{
+	std::shared_ptr<ServiceLookup_t>* pLookupRef = new std::shared_ptr<ServiceLookup_t>(ServiceLookupReference());
+	HANDLE hThread = CreateThread(nullptr, 0, ScmNotificationThread, pLookupRef, 0, nullptr);
+	if (NULL != hThread)
+		CloseHandle(hThread);
 	else
+		delete pLookupRef;
+	return TRUE;
+}
+
+/// <summary>
+/// Starts the lookup object's change notifications, the first time it's called.
+/// If it fails, it fails silently, and the cache is refreshed only by full enumerations.
+/// </summary>
+void EnableServiceChangeNotifications()
+{
+	static INIT_ONCE initOnce = INIT_ONCE_STATIC_INIT;
+	InitOnceExecuteOnce(&initOnce, StartScmNotificationThread, nullptr, nullptr);
+}
+
+/// <summary>
+/// Requests that service start types, process types, and svchost groups be collected.
+/// </summary>
+void EnableServiceConfigurationMetadata()
+{
+	std::shared_ptr<ServiceLookup_t> pServiceLookup = ServiceLookupReference();
+	if (!pServiceLookup->scmServiceSource.EnableReadConfiguration())
 	{
-		*ppServiceList = &iter->second;
-		return true;
+		// Data loaded before now doesn't have the metadata.
+		pServiceLookup->cache.Invalidate();
 	}
 }
 
+/// <summary>
+/// Background thread that loads the lookup table.
+/// </summary>
+/// <param name="lpvThreadParameter">Heap-allocated std::shared_ptr to the ServiceLookup_t; the thread deletes it.</param>
+static DWORD WINAPI ServiceLookupPrefetchThread(LPVOID lpvThreadParameter)
+{
+	std::shared_ptr<ServiceLookup_t>* pLookupRef = (std::shared_ptr<ServiceLookup_t>*)lpvThreadParameter;
+	std::shared_ptr<ServiceLookup_t> pServiceLookup = *pLookupRef;
+	delete pLookupRef;
+
+	pServiceLookup->cache.GetTable();
+	return 0;
+}
+
+/// <summary>
+/// Starts loading the PID-to-service information on a background thread.
+/// </summary>
+void StartServiceLookupPrefetch()
+{
+	std::shared_ptr<ServiceLookup_t>* pLookupRef = new std::shared_ptr<ServiceLookup_t>(ServiceLookupReference());
+	HANDLE hThread = CreateThread(nullptr, 0, ServiceLookupPrefetchThread, pLookupRef, 0, nullptr);
+	if (NULL != hThread)
+		CloseHandle(hThread);
+	else
+		delete pLookupRef;
+}
+
+/// <summary>
+/// If the input process ID is a service process, return the service and display names of those services.
+/// </summary>
+/// <param name="pid">Input: process ID</param>
+/// <param name="serviceList">Output: if the process is a service process, information about the services it hosts; empty otherwise.</param>
+/// <returns>true if the process is a service process; false otherwise</returns>
+bool LookupServicesByPID(ULONG_PTR pid, ServiceList_t& serviceList)
+{
+	return LookupServicesByPID(*ServiceLookupReference(), pid, serviceList);
+}
+
+/// <summary>
+/// If the input process ID is a service process, return the service and display names of those services,
+/// using a lookup reference held by the caller.
+/// </summary>
+bool LookupServicesByPID(ServiceLookup_t& serviceLookup, ULONG_PTR pid, ServiceList_t& serviceList)
+{
+	return serviceLookup.cache.Lookup(pid, serviceList);
+}
+
+/// <summary>
+/// Returns counters describing the service enumerations performed so far.
+/// </summary>
+ServiceEnumerationStats_t GetServiceEnumerationStats()
+{
+	return ServiceLookupReference()->scmServiceSource.GetStats();
+}
+
 /// <summary>
 /// For diagnostic purposes, dump the PID to services information to an ostream in human-readable form.
 /// </summary>
@@ -129,19 +756,19 @@ bool DumpPIDtoServiceLookupInfo(const wchar_t* szOutFile, bool bAppend, std::wst
 		return false;
 	}
 
-	// Make sure the lookup object has been initialized
-	InitializeServiceLookup();
+	std::shared_ptr<ServiceLookup_t> pServiceLookup = ServiceLookupReference();
+	std::shared_ptr<const ServiceLookupTable_t> pTable = pServiceLookup->cache.GetTable();
 
 	// Determine longest service name, for formatting.
 	size_t nSvcNameFieldWidth = 0;
 	for (
-		ServiceLookupByPID_t::const_iterator iterLookup = ServiceLookupByPID.begin();
-		iterLookup != ServiceLookupByPID.end();
+		std::vector<PidServices_t>::const_iterator iterLookup = pTable->pids.begin();
+		iterLookup != pTable->pids.end();
 		iterLookup++
 		)
 	{
-		for (ServiceList_t::const_iterator iterSvc = iterLookup->second.begin();
-			iterSvc != iterLookup->second.end();
+		for (ServiceList_t::const_iterator iterSvc = iterLookup->pBegin;
+			iterSvc != iterLookup->pEnd;
 			iterSvc++
 			)
 		{
@@ -153,14 +780,14 @@ bool DumpPIDtoServiceLookupInfo(const wchar_t* szOutFile, bool bAppend, std::wst
 	nSvcNameFieldWidth += 3;
 
 	for (
-		ServiceLookupByPID_t::const_iterator iterLookup = ServiceLookupByPID.begin();
-		iterLookup != ServiceLookupByPID.end();
+		std::vector<PidServices_t>::const_iterator iterLookup = pTable->pids.begin();
+		iterLookup != pTable->pids.end();
 		iterLookup++
 		)
 	{
-		fs << L"PID: " << iterLookup->first << std::endl;
-		for (ServiceList_t::const_iterator iterSvc = iterLookup->second.begin();
-			iterSvc != iterLookup->second.end();
+		fs << L"PID: " << iterLookup->pid << std::endl;
+		for (ServiceList_t::const_iterator iterSvc = iterLookup->pBegin;
+			iterSvc != iterLookup->pEnd;
 			iterSvc++
 			)
 		{
@@ -169,6 +796,22 @@ bool DumpPIDtoServiceLookupInfo(const wchar_t* szOutFile, bool bAppend, std::wst
 		fs << std::endl;
 	}
 
+	ServiceEnumerationStats_t enumStats = GetServiceEnumerationStats();
+	ServiceLookupCacheStats_t cacheStats = pServiceLookup->cache.GetStats();
+	fs
+		<< L"Enumerations: " << enumStats.nEnumerations
+		<< L"; pages: " << enumStats.nPages
+		<< L"; retries: " << enumStats.nRetries
+		<< L"; failures: " << enumStats.nFailures
+		<< L"; last error: " << enumStats.dwLastError << std::endl
+		<< L"Refreshes: " << cacheStats.nRefreshes
+		<< L" (unknown PID: " << cacheStats.nUnknownPidRefreshes
+		<< L"); incremental refreshes: " << cacheStats.nIncrementalRefreshes
+		<< L" (services queried: " << cacheStats.nServiceQueries
+		<< L"); invalidations: " << cacheStats.nInvalidations
+		<< L"; service invalidations: " << cacheStats.nServiceInvalidations
+		<< L"; negative hits: " << cacheStats.nNegativeHits << std::endl;
+
 	fs.close();
 
 	return true;
@@ -2,27 +2,81 @@
 
 #include <Windows.h>
 #include <string>
-#include <list>
+#include <memory>
+#include "ServiceLookupCache.h"
 
 /// <summary>
-/// Structure that contains a service's key name and display name
+/// If the input process ID is a service process, return the service and display names of those services.
+/// The PID-to-service information is cached. With EnableServiceChangeNotifications, services that the SCM
+/// reports as started, stopped, created, or deleted are queried again individually, and the whole table is
+/// reloaded if notifications are missed. The table is also reloaded when a PID that isn't in the cache is
+/// looked up (rate-limited).
 /// </summary>
-struct ServiceNames_t
-{
-	std::wstring sServiceName, sDisplayName;
-};
+/// <param name="pid">Input: process ID</param>
+/// <param name="serviceList">Output: if the process is a service process, information about the services it hosts; empty otherwise.</param>
+/// <returns>true if the process is a service process; false otherwise</returns>
+bool LookupServicesByPID(ULONG_PTR pid, ServiceList_t& serviceList);
+
 /// <summary>
-/// List of structures containing service information.
+/// The process-wide PID-to-service lookup (opaque).
 /// </summary>
-typedef std::list<ServiceNames_t> ServiceList_t;
+struct ServiceLookup_t;
 
 /// <summary>
-/// If the input process ID is a service process, return the service and display names of those services.
+/// Returns a reference to the process-wide PID-to-service lookup. A thread that its caller might abandon
+/// holds a reference and passes it to LookupServicesByPID, so that the lookup remains valid while the thread
+/// uses it, even if the thread is still running when the process' static objects are destroyed.
+/// </summary>
+std::shared_ptr<ServiceLookup_t> ServiceLookupReference();
+
+/// <summary>
+/// LookupServicesByPID using a lookup reference held by the caller.
 /// </summary>
-/// <param name="dwPID">Input: process ID</param>
-/// <param name="pServiceList">Output: if the process is a service process, returns a pointer information about the services it hosts; NULL otherwise.</param>
+/// <param name="serviceLookup">Input: the lookup, from ServiceLookupReference</param>
+/// <param name="pid">Input: process ID</param>
+/// <param name="serviceList">Output: if the process is a service process, information about the services it hosts; empty otherwise.</param>
 /// <returns>true if the process is a service process; false otherwise</returns>
-bool LookupServicesByPID(ULONG_PTR pid, const ServiceList_t** ppServiceList);
+bool LookupServicesByPID(ServiceLookup_t& serviceLookup, ULONG_PTR pid, ServiceList_t& serviceList);
+
+/// <summary>
+/// Requests that each service's start type, own/shared process type, and svchost group be collected
+/// (available through ServiceList_t's labels). They're read in one pass over the services' registry
+/// configuration each time the table is loaded, and cached with the table. Call before the first lookup.
+/// </summary>
+void EnableServiceConfigurationMetadata();
+
+/// <summary>
+/// Starts a background thread that registers for status notifications from every service, to keep the
+/// cache up to date incrementally. Worthwhile only when lookups are repeated over time (e.g., a snapshot
+/// at each interval): registering takes a round trip to the SCM per service, which a single pass of
+/// lookups, served by one full enumeration, doesn't need. Calls after the first have no effect.
+/// </summary>
+void EnableServiceChangeNotifications();
+
+/// <summary>
+/// Starts loading the PID-to-service information on a background thread, so that it's ready (or
+/// closer to ready) when the first lookup happens. Lookups made while it's loading wait for it.
+/// </summary>
+void StartServiceLookupPrefetch();
+
+/// <summary>
+/// Counters describing the paged service enumerations that feed the lookup cache.
+/// </summary>
+struct ServiceEnumerationStats_t
+{
+	// Number of enumerations requested, and pages retrieved across all of them.
+	uint64_t nEnumerations = 0, nPages = 0;
+	// Number of times an enumeration was restarted after failing partway through, and the number
+	// that failed even after retrying (the cache keeps its previous data in that case).
+	uint64_t nRetries = 0, nFailures = 0;
+	// Error code from the most recent failure
+	DWORD dwLastError = 0;
+};
+
+/// <summary>
+/// Returns counters describing the service enumerations performed so far.
+/// </summary>
+ServiceEnumerationStats_t GetServiceEnumerationStats();
 
 /// <summary>
 /// For diagnostic purposes, dump the PID to services information to an ostream in human-readable form.
@@ -32,4 +86,3 @@ bool LookupServicesByPID(ULONG_PTR pid, const ServiceList_t** ppServiceList);
 /// <param name="sErrorInfo">Output: Information about any errors on failure</param>
 /// <returns>true if successful</returns>
 bool DumpPIDtoServiceLookupInfo(const wchar_t* szOutFile, bool bAppend, std::wstring& sErrorInfo);
-
@@ -0,0 +1,370 @@
+// Refreshable PID-to-services lookup table.
+
+#include <algorithm>
+#include <cwchar>
+#include <cwctype>
+#include "ServiceLookupCache.h"
+
+/// <summary>
+/// Returns the entry for the PID, or nullptr if the PID isn't in the table.
+/// </summary>
+const PidServices_t* ServiceLookupTable_t::Find(uint64_t pid) const
+{
+	std::vector<PidServices_t>::const_iterator iter = std::lower_bound(
+		pids.begin(), pids.end(), pid,
+		[](const PidServices_t& entry, uint64_t pidToFind) { return entry.pid < pidToFind; });
+	if (iter == pids.end() || iter->pid != pid)
+		return nullptr;
+	return &*iter;
+}
+
+/// <summary>
+/// Display name for a service start type.
+/// </summary>
+const wchar_t* ServiceStartTypeName(uint32_t dwStartType, bool bDelayedAutoStart)
+{
+	// Values of SERVICE_BOOT_START through SERVICE_DISABLED
+	switch (dwStartType)
+	{
+	case 0: return L"Boot";
+	case 1: return L"System";
+	case 2: return bDelayedAutoStart ? L"Auto(delayed)" : L"Auto";
+	case 3: return L"Manual";
+	case 4: return L"Disabled";
+	default: return L"Unknown";
+	}
+}
+
+// Service type bits for own-process and shared-process services (SERVICE_WIN32_OWN_PROCESS, SERVICE_WIN32_SHARE_PROCESS)
+static const uint32_t ServiceTypeOwnProcess = 0x10;
+static const uint32_t ServiceTypeShareProcess = 0x20;
+
+// Longest start type name plus a space
+static const size_t cchMaxStartTypeLabel = 14;
+
+/// <summary>
+/// Appends a string and a null terminator to the arena, returning a view of the string.
+/// </summary>
+static std::wstring_view AppendToArena(std::wstring& arena, const wchar_t* sz)
+{
+	size_t ixStart = arena.size();
+	arena.append(sz).push_back(L'\0');
+	return std::wstring_view(arena.data() + ixStart, arena.size() - ixStart - 1);
+}
+
+/// <summary>
+/// Builds a lookup table from a set of service records.
+/// </summary>
+void BuildServiceLookupTable(const std::vector<ServiceRecord_t>& records, ServiceLookupTable_t& table)
+{
+	// Order the services by PID, keeping enumeration order within each process.
+	const size_t nServices = records.size();
+	std::vector<size_t> order(nServices);
+	size_t nArenaChars = 0;
+	for (size_t ix = 0; ix < nServices; ++ix)
+	{
+		order[ix] = ix;
+		// Service name, display name, and svchost group, each null-terminated; plus the service name,
+		// start type, and svchost group each followed by a space in its process' labels; plus at most
+		// three terminators per process' labels.
+		size_t cchServiceName = wcslen(records[ix].szServiceName);
+		size_t cchGroup = (nullptr != records[ix].szSvchostGroup) ? wcslen(records[ix].szSvchostGroup) : 0;
+		nArenaChars += cchServiceName + wcslen(records[ix].szDisplayName) + cchGroup + 3;
+		nArenaChars += cchServiceName + cchMaxStartTypeLabel + cchGroup + 2 + 3;
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[&records](size_t a, size_t b) { return records[a].pid < records[b].pid; });
+
+	// Reserve all the storage up front so that the views into the arena remain valid.
+	table.pids.clear();
+	table.services.clear();
+	table.arena.clear();
+	table.services.reserve(nServices);
+	table.arena.reserve(nArenaChars);
+
+	for (std::vector<size_t>::const_iterator iterOrder = order.begin(); iterOrder != order.end(); ++iterOrder)
+	{
+		const ServiceRecord_t& svc = records[*iterOrder];
+		ServiceNames_t names;
+		names.sServiceName = AppendToArena(table.arena, svc.szServiceName);
+		names.sDisplayName = AppendToArena(table.arena, svc.szDisplayName);
+		names.dwServiceType = svc.dwServiceType;
+		names.dwStartType = svc.dwStartType;
+		names.bDelayedAutoStart = svc.bDelayedAutoStart;
+		if (nullptr != svc.szSvchostGroup)
+			names.sSvchostGroup = AppendToArena(table.arena, svc.szSvchostGroup);
+		table.services.push_back(names);
+	}
+
+	// One entry per distinct PID, referring to its range of services, with its joined labels.
+	const ServiceNames_t* pServices = table.services.data();
+	for (size_t ix = 0; ix < nServices; )
+	{
+		PidServices_t entry;
+		entry.pid = records[order[ix]].pid;
+		entry.pBegin = pServices + ix;
+		while (ix < nServices && records[order[ix]].pid == entry.pid)
+			++ix;
+		entry.pEnd = pServices + ix;
+
+		bool bShared = false;
+		size_t ixLabel = table.arena.size();
+		for (const ServiceNames_t* pSvc = entry.pBegin; pSvc != entry.pEnd; ++pSvc)
+		{
+			table.arena.append(pSvc->sServiceName).push_back(L' ');
+			if (0 != (pSvc->dwServiceType & ServiceTypeShareProcess))
+				bShared = true;
+		}
+		entry.labels.sNames = std::wstring_view(table.arena.data() + ixLabel, table.arena.size() - ixLabel);
+		table.arena.push_back(L'\0');
+
+		ixLabel = table.arena.size();
+		for (const ServiceNames_t* pSvc = entry.pBegin; pSvc != entry.pEnd; ++pSvc)
+		{
+			table.arena.append(ServiceStartTypeName(pSvc->dwStartType, pSvc->bDelayedAutoStart)).push_back(L' ');
+		}
+		entry.labels.sStartTypes = std::wstring_view(table.arena.data() + ixLabel, table.arena.size() - ixLabel);
+		table.arena.push_back(L'\0');
+
+		// Distinct groups only; a shared svchost process normally has just one.
+		ixLabel = table.arena.size();
+		for (const ServiceNames_t* pSvc = entry.pBegin; pSvc != entry.pEnd; ++pSvc)
+		{
+			if (pSvc->sSvchostGroup.empty())
+				continue;
+			bool bSeen = false;
+			for (const ServiceNames_t* pPrev = entry.pBegin; pPrev != pSvc && !bSeen; ++pPrev)
+				bSeen = (pPrev->sSvchostGroup == pSvc->sSvchostGroup);
+			if (!bSeen)
+				table.arena.append(pSvc->sSvchostGroup).push_back(L' ');
+		}
+		entry.labels.sSvchostGroups = std::wstring_view(table.arena.data() + ixLabel, table.arena.size() - ixLabel);
+		table.arena.push_back(L'\0');
+
+		if (bShared)
+			entry.labels.sProcessType = L"Shared";
+		else if (0 != (entry.pBegin->dwServiceType & ServiceTypeOwnProcess))
+			entry.labels.sProcessType = L"Own";
+
+		table.pids.push_back(entry);
+	}
+}
+
+ServiceLookupCache_t::ServiceLookupCache_t(ServiceSource_t& source, uint64_t msMinRefreshInterval, uint64_t msNegativeTTL)
+	: m_source(source), m_msMinRefreshInterval(msMinRefreshInterval), m_msNegativeTTL(msNegativeTTL), m_bStale(true)
+{
+}
+
+/// <summary>
+/// Service name as a key for m_services and m_changedServices: service names are case-insensitive.
+/// </summary>
+static std::wstring ServiceNameKey(const wchar_t* szServiceName)
+{
+	std::wstring sKey(szServiceName);
+	for (std::wstring::iterator iterCh = sKey.begin(); iterCh != sKey.end(); ++iterCh)
+		*iterCh = wchar_t(towlower(*iterCh));
+	return sKey;
+}
+
+/// <summary>
+/// Copies a record from the source into m_services. Caller must hold m_mutex.
+/// </summary>
+void ServiceLookupCache_t::StoreRecord(const ServiceRecord_t& record)
+{
+	ServiceEntry_t& entry = m_services[ServiceNameKey(record.szServiceName)];
+	entry.pid = record.pid;
+	entry.sServiceName = record.szServiceName;
+	entry.sDisplayName = record.szDisplayName;
+	entry.dwServiceType = record.dwServiceType;
+	entry.dwStartType = record.dwStartType;
+	entry.bDelayedAutoStart = record.bDelayedAutoStart;
+	entry.bHasSvchostGroup = (nullptr != record.szSvchostGroup);
+	entry.sSvchostGroup = entry.bHasSvchostGroup ? record.szSvchostGroup : L"";
+}
+
+/// <summary>
+/// Builds a new table from m_services. Caller must hold m_mutex.
+/// Lists that refer to the previous table keep it alive.
+/// </summary>
+void ServiceLookupCache_t::RebuildTable()
+{
+	m_records.clear();
+	m_records.reserve(m_services.size());
+	for (std::map<std::wstring, ServiceEntry_t>::const_iterator iterSvc = m_services.begin(); iterSvc != m_services.end(); ++iterSvc)
+	{
+		const ServiceEntry_t& entry = iterSvc->second;
+		ServiceRecord_t record;
+		record.pid = entry.pid;
+		record.szServiceName = entry.sServiceName.c_str();
+		record.szDisplayName = entry.sDisplayName.c_str();
+		record.dwServiceType = entry.dwServiceType;
+		record.dwStartType = entry.dwStartType;
+		record.bDelayedAutoStart = entry.bDelayedAutoStart;
+		if (entry.bHasSvchostGroup)
+			record.szSvchostGroup = entry.sSvchostGroup.c_str();
+		m_records.push_back(record);
+	}
+	std::shared_ptr<ServiceLookupTable_t> pTable = std::make_shared<ServiceLookupTable_t>();
+	BuildServiceLookupTable(m_records, *pTable);
+	m_pTable = pTable;
+}
+
+/// <summary>
+/// Rebuilds the service entries and the table from a full enumeration. Caller must hold m_mutex.
+/// </summary>
+void ServiceLookupCache_t::Refresh(uint64_t now)
+{
+	m_lastRefresh = now;
+	++m_stats.nRefreshes;
+	// A full enumeration covers any services that were marked as changed.
+	m_changedServices.clear();
+	if (!m_source.EnumerateServices(m_records))
+	{
+		++m_stats.nFailedRefreshes;
+		// Keep the previous table, if any.
+		if (!m_pTable)
+			m_pTable = std::make_shared<const ServiceLookupTable_t>();
+		return;
+	}
+	// The records' strings belong to the source, so copy them before rebuilding the table from the copies.
+	m_services.clear();
+	for (std::vector<ServiceRecord_t>::const_iterator iterRecord = m_records.begin(); iterRecord != m_records.end(); ++iterRecord)
+	{
+		StoreRecord(*iterRecord);
+	}
+	RebuildTable();
+}
+
+/// <summary>
+/// Queries the changed services again and rebuilds the table. Caller must hold m_mutex.
+/// </summary>
+/// <returns>true if successful; false if a query failed, leaving the table unchanged</returns>
+bool ServiceLookupCache_t::RefreshChangedServices()
+{
+	++m_stats.nIncrementalRefreshes;
+	for (std::unordered_set<std::wstring>::const_iterator iterName = m_changedServices.begin(); iterName != m_changedServices.end(); ++iterName)
+	{
+		ServiceRecord_t record;
+		bool bActive = false;
+		++m_stats.nServiceQueries;
+		if (!m_source.QueryService(iterName->c_str(), record, bActive))
+			return false;
+		if (bActive)
+		{
+			StoreRecord(record);
+			// The service's process might have been recorded as not hosting services.
+			m_negativeEntries.erase(record.pid);
+		}
+		else
+		{
+			m_services.erase(*iterName);
+		}
+	}
+	m_changedServices.clear();
+	RebuildTable();
+	return true;
+}
+
+/// <summary>
+/// Refreshes the table if it hasn't been loaded or has been invalidated. Caller must hold m_mutex.
+/// </summary>
+void ServiceLookupCache_t::RefreshIfStale(uint64_t now)
+{
+	if (m_bStale.exchange(false) || !m_pTable)
+	{
+		// Notifications were missed; earlier negative results might no longer hold.
+		m_negativeEntries.clear();
+		Refresh(now);
+	}
+	else if (!m_changedServices.empty() && !RefreshChangedServices())
+	{
+		++m_stats.nFailedRefreshes;
+		m_negativeEntries.clear();
+		Refresh(now);
+	}
+}
+
+/// <summary>
+/// If the input process ID is a service process, returns the services it hosts.
+/// </summary>
+bool ServiceLookupCache_t::Lookup(uint64_t pid, ServiceList_t& serviceList)
+{
+	serviceList = ServiceList_t();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const uint64_t now = m_source.TickCountMs();
+	RefreshIfStale(now);
+
+	const PidServices_t* pEntry = m_pTable->Find(pid);
+	if (nullptr == pEntry)
+	{
+		// Recently confirmed not to be a service process?
+		std::unordered_map<uint64_t, uint64_t>::iterator iterNegative = m_negativeEntries.find(pid);
+		if (iterNegative != m_negativeEntries.end())
+		{
+			if (now - iterNegative->second < m_msNegativeTTL)
+			{
+				++m_stats.nNegativeHits;
+				return false;
+			}
+			m_negativeEntries.erase(iterNegative);
+		}
+
+		// The process might have started hosting a service since the last refresh. Refresh, but not too often;
+		// if rate-limited, don't record a negative entry so that the PID is retried later.
+		if (now - m_lastRefresh < m_msMinRefreshInterval)
+			return false;
+		++m_stats.nUnknownPidRefreshes;
+		Refresh(now);
+		pEntry = m_pTable->Find(pid);
+		if (nullptr == pEntry)
+		{
+			m_negativeEntries[pid] = now;
+			return false;
+		}
+	}
+
+	serviceList.pBegin = pEntry->pBegin;
+	serviceList.pEnd = pEntry->pEnd;
+	serviceList.labels = pEntry->labels;
+	serviceList.pTable = m_pTable;
+	return true;
+}
+
+/// <summary>
+/// Marks the table as stale; the next lookup refreshes it from a full enumeration. Can be called from any thread.
+/// </summary>
+void ServiceLookupCache_t::Invalidate()
+{
+	m_bStale = true;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_stats.nInvalidations;
+}
+
+/// <summary>
+/// Marks one service as changed; the next lookup queries it again. Can be called from any thread.
+/// </summary>
+void ServiceLookupCache_t::InvalidateService(const wchar_t* szServiceName)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_stats.nServiceInvalidations;
+	m_changedServices.insert(ServiceNameKey(szServiceName));
+}
+
+/// <summary>
+/// Returns the current table, loading it if necessary.
+/// </summary>
+std::shared_ptr<const ServiceLookupTable_t> ServiceLookupCache_t::GetTable()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	RefreshIfStale(m_source.TickCountMs());
+	return m_pTable;
+}
+
+/// <summary>
+/// Returns a copy of the cache's activity counters.
+/// </summary>
+ServiceLookupCacheStats_t ServiceLookupCache_t::GetStats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
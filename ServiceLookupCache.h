@@ -0,0 +1,267 @@
+#pragma once
+
+// Refreshable PID-to-services lookup table.
+// Platform-independent (no Windows.h): the service enumeration and the clock are supplied through
+// ServiceSource_t, so the refresh logic can be exercised with a stand-in source on any platform.
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+// Start type value when the service's configuration wasn't read. (Other values are the SERVICE_*_START values.)
+const uint32_t ServiceStartTypeUnknown = 0xFFFFFFFF;
+
+/// <summary>
+/// Structure that contains a service's key name and display name, and optional configuration metadata.
+/// The names refer to the lookup table's string storage.
+/// </summary>
+struct ServiceNames_t
+{
+	std::wstring_view sServiceName, sDisplayName;
+	// SERVICE_WIN32_OWN_PROCESS or SERVICE_WIN32_SHARE_PROCESS (possibly combined with other type bits)
+	uint32_t dwServiceType = 0;
+	// SERVICE_*_START value, or ServiceStartTypeUnknown
+	uint32_t dwStartType = ServiceStartTypeUnknown;
+	bool bDelayedAutoStart = false;
+	// svchost group (the "-k" argument in the service's command line); empty if not an svchost service
+	std::wstring_view sSvchostGroup;
+};
+
+/// <summary>
+/// Display labels for a process' services, built once when the lookup table is built.
+/// </summary>
+struct ServiceLabels_t
+{
+	// The service names, each followed by a space.
+	std::wstring_view sNames;
+	// The services' start types, in the same order as the names, each followed by a space.
+	std::wstring_view sStartTypes;
+	// "Own" if the process hosts a single own-process service, "Shared" if it hosts shared-process services.
+	std::wstring_view sProcessType;
+	// The distinct svchost groups of the services, each followed by a space.
+	std::wstring_view sSvchostGroups;
+};
+
+/// <summary>
+/// Display name for a service start type: "Boot", "System", "Auto", "Auto(delayed)", "Manual", "Disabled", or "Unknown".
+/// </summary>
+const wchar_t* ServiceStartTypeName(uint32_t dwStartType, bool bDelayedAutoStart);
+
+struct ServiceLookupTable_t;
+
+/// <summary>
+/// The services hosted in one process: a range within a lookup table's contiguous service array.
+/// Holds a reference to the table, so the range and the names remain valid even if the cache is
+/// refreshed while the list is in use.
+/// </summary>
+struct ServiceList_t
+{
+	typedef const ServiceNames_t* const_iterator;
+	const_iterator begin() const { return pBegin; }
+	const_iterator end() const { return pEnd; }
+	size_t size() const { return size_t(pEnd - pBegin); }
+
+	const ServiceNames_t* pBegin = nullptr;
+	const ServiceNames_t* pEnd = nullptr;
+	// Joined labels for display
+	ServiceLabels_t labels;
+	std::shared_ptr<const ServiceLookupTable_t> pTable;
+};
+
+/// <summary>
+/// Services hosted in one process, as an entry in the lookup table.
+/// </summary>
+struct PidServices_t
+{
+	uint64_t pid = 0;
+	const ServiceNames_t* pBegin = nullptr;
+	const ServiceNames_t* pEnd = nullptr;
+	// Joined labels for display; built once when the table is built.
+	ServiceLabels_t labels;
+};
+
+/// <summary>
+/// Flat PID-to-services lookup table: PIDs in a sorted vector, each referring to a range in one
+/// contiguous array of services, with all the names in a single string arena. Building it takes a
+/// handful of allocations regardless of the number of services. Immutable once built.
+/// </summary>
+struct ServiceLookupTable_t
+{
+	// Sorted by PID
+	std::vector<PidServices_t> pids;
+	// Grouped by PID, in the same order as pids
+	std::vector<ServiceNames_t> services;
+	// Null-terminated names and labels, referenced by the entries in services and pids
+	std::wstring arena;
+
+	/// <summary>
+	/// Returns the entry for the PID, or nullptr if the PID isn't in the table.
+	/// </summary>
+	const PidServices_t* Find(uint64_t pid) const;
+};
+
+/// <summary>
+/// One running service as reported by a ServiceSource_t. The strings belong to the source and
+/// need to remain valid only until the source's next EnumerateServices or QueryService call.
+/// </summary>
+struct ServiceRecord_t
+{
+	uint64_t pid = 0;
+	const wchar_t* szServiceName = nullptr;
+	const wchar_t* szDisplayName = nullptr;
+	// Configuration metadata (see ServiceNames_t); szSvchostGroup can be nullptr.
+	uint32_t dwServiceType = 0;
+	uint32_t dwStartType = ServiceStartTypeUnknown;
+	bool bDelayedAutoStart = false;
+	const wchar_t* szSvchostGroup = nullptr;
+};
+
+/// <summary>
+/// Builds a lookup table from a set of service records.
+/// </summary>
+/// <param name="records">Input: running services, in any order</param>
+/// <param name="table">Output: the lookup table</param>
+void BuildServiceLookupTable(const std::vector<ServiceRecord_t>& records, ServiceLookupTable_t& table);
+
+/// <summary>
+/// Source of service information and time for a ServiceLookupCache_t: the Service Control Manager
+/// in production, or a stand-in.
+/// </summary>
+class ServiceSource_t
+{
+public:
+	virtual ~ServiceSource_t() = default;
+	/// <summary>
+	/// Enumerates the running services, replacing the contents of records.
+	/// </summary>
+	/// <returns>true if successful; false if enumeration failed</returns>
+	virtual bool EnumerateServices(std::vector<ServiceRecord_t>& records) = 0;
+	/// <summary>
+	/// Queries one service by name, for an incremental refresh.
+	/// </summary>
+	/// <param name="szServiceName">Input: the service's key name</param>
+	/// <param name="record">Output: the service's information, if it's active</param>
+	/// <param name="bActive">Output: true if the service is running (or starting, etc.); false if it's stopped or doesn't exist</param>
+	/// <returns>true if successful; false if the query failed (the cache then falls back to a full enumeration)</returns>
+	virtual bool QueryService(const wchar_t* szServiceName, ServiceRecord_t& record, bool& bActive) = 0;
+	/// <summary>
+	/// Returns a millisecond tick count, used to rate-limit refreshes and expire negative entries.
+	/// </summary>
+	virtual uint64_t TickCountMs() = 0;
+};
+
+/// <summary>
+/// Counters describing the cache's activity.
+/// </summary>
+struct ServiceLookupCacheStats_t
+{
+	// Number of times the table was rebuilt from a full enumeration, and how many of those were triggered by an unknown PID.
+	uint64_t nRefreshes = 0, nUnknownPidRefreshes = 0;
+	// Number of incremental refreshes, and the services queried for them.
+	uint64_t nIncrementalRefreshes = 0, nServiceQueries = 0;
+	// Number of whole-table invalidations (e.g., after missed notifications), and of single-service
+	// invalidations (e.g., from SCM notifications that a service started or stopped).
+	uint64_t nInvalidations = 0, nServiceInvalidations = 0;
+	// Number of failed enumerations and incremental refreshes; the previous table is kept when an enumeration fails,
+	// and a full enumeration is tried when an incremental refresh fails.
+	uint64_t nFailedRefreshes = 0;
+	// Lookups answered from negative entries (PIDs recently confirmed not to be hosting services).
+	uint64_t nNegativeHits = 0;
+};
+
+/// <summary>
+/// Thread-safe PID-to-services cache. The cache keeps its own copy of each active service's information
+/// and builds the flat lookup table from it. The table is refreshed:
+/// * from a full enumeration on first use;
+/// * incrementally on the next lookup after InvalidateService() is called (e.g., when the SCM reports
+///   that a service started, stopped, or was created or deleted): only those services are queried again;
+/// * from a full enumeration on the next lookup after Invalidate() is called (e.g., after missed
+///   notifications), or if a query for an incremental refresh fails;
+/// * from a full enumeration when a lookup asks for a PID the table doesn't know, no more often than the
+///   minimum refresh interval. (A process that has started hosting a service since the last refresh is unknown.)
+/// A PID that's still unknown after such a refresh gets a negative entry so that lookups for
+/// non-service processes don't cause further refreshes until the entry expires.
+/// </summary>
+class ServiceLookupCache_t
+{
+public:
+	ServiceLookupCache_t(ServiceSource_t& source, uint64_t msMinRefreshInterval = 1000, uint64_t msNegativeTTL = 60000);
+
+	/// <summary>
+	/// If the input process ID is a service process, returns the services it hosts.
+	/// </summary>
+	/// <returns>true if the process is a service process; false otherwise</returns>
+	bool Lookup(uint64_t pid, ServiceList_t& serviceList);
+
+	/// <summary>
+	/// Marks the table as stale; the next lookup refreshes it from a full enumeration. Can be called from any thread.
+	/// </summary>
+	void Invalidate();
+
+	/// <summary>
+	/// Marks one service as changed; the next lookup queries it again and updates the table.
+	/// Can be called from any thread.
+	/// </summary>
+	/// <param name="szServiceName">Input: the service's key name (case-insensitive)</param>
+	void InvalidateService(const wchar_t* szServiceName);
+
+	/// <summary>
+	/// Returns the current table, loading it if necessary.
+	/// </summary>
+	std::shared_ptr<const ServiceLookupTable_t> GetTable();
+
+	/// <summary>
+	/// Returns a copy of the cache's activity counters.
+	/// </summary>
+	ServiceLookupCacheStats_t GetStats();
+
+private:
+	// The cache's copy of an active service's information.
+	struct ServiceEntry_t
+	{
+		uint64_t pid = 0;
+		std::wstring sServiceName, sDisplayName, sSvchostGroup;
+		uint32_t dwServiceType = 0, dwStartType = ServiceStartTypeUnknown;
+		bool bDelayedAutoStart = false, bHasSvchostGroup = false;
+	};
+
+	// Rebuilds the service entries and the table from a full enumeration. Caller must hold m_mutex.
+	void Refresh(uint64_t now);
+	// Queries the changed services again and rebuilds the table. Returns false if a query failed. Caller must hold m_mutex.
+	bool RefreshChangedServices();
+	// Refreshes the table if it hasn't been loaded or has been invalidated. Caller must hold m_mutex.
+	void RefreshIfStale(uint64_t now);
+	// Copies a record from the source into m_services. Caller must hold m_mutex.
+	void StoreRecord(const ServiceRecord_t& record);
+	// Builds a new table from m_services. Caller must hold m_mutex.
+	void RebuildTable();
+
+private:
+	ServiceSource_t& m_source;
+	const uint64_t m_msMinRefreshInterval, m_msNegativeTTL;
+	std::mutex m_mutex;
+	std::atomic<bool> m_bStale;
+	// The following are protected by m_mutex.
+	std::shared_ptr<const ServiceLookupTable_t> m_pTable;
+	uint64_t m_lastRefresh = 0;
+	// PIDs confirmed not to be hosting services, and when
+	std::unordered_map<uint64_t, uint64_t> m_negativeEntries;
+	// Active services, keyed by lowercased service name (so that they're in the SCM's enumeration order)
+	std::map<std::wstring, ServiceEntry_t> m_services;
+	// Lowercased names of services to query again at the next lookup
+	std::unordered_set<std::wstring> m_changedServices;
+	// Reused for each enumeration and table build
+	std::vector<ServiceRecord_t> m_records;
+	ServiceLookupCacheStats_t m_stats;
+
+private:
+	ServiceLookupCache_t(const ServiceLookupCache_t&) = delete;
+	ServiceLookupCache_t& operator = (const ServiceLookupCache_t&) = delete;
+};
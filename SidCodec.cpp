@@ -0,0 +1,156 @@
+// Conversion between binary SIDs and their "S-1-..." string form, without allocation.
+
+#include <cstring>
+#include "SidCodec.h"
+
+// Binary layout: revision (1 byte), subauthority count (1 byte), identifier authority (6 bytes,
+// big-endian), then the subauthorities (4 bytes each, in native byte order).
+static const size_t cbSidHeader = 8;
+static const uint8_t nMaxSubAuthorities = 15;
+
+/// <summary>
+/// Writes the decimal digits of a value at pOut, returning the number of characters written.
+/// </summary>
+static size_t FormatDecimal(uint64_t value, wchar_t* pOut)
+{
+	wchar_t digits[20];
+	size_t nDigits = 0;
+	do
+	{
+		digits[nDigits++] = wchar_t(L'0' + (value % 10));
+		value /= 10;
+	} while (value > 0);
+	for (size_t ix = 0; ix < nDigits; ++ix)
+		pOut[ix] = digits[nDigits - 1 - ix];
+	return nDigits;
+}
+
+/// <summary>
+/// Formats a binary SID as a null-terminated "S-1-..." string.
+/// </summary>
+size_t FormatSidString(const void* pSid, size_t cbSid, wchar_t* szBuf, size_t cchBuf)
+{
+	const uint8_t* pBytes = (const uint8_t*)pSid;
+	if (nullptr == pBytes || cbSid < cbSidHeader || nullptr == szBuf)
+		return 0;
+	const uint8_t nSubAuthorities = pBytes[1];
+	if (1 != pBytes[0] || nSubAuthorities > nMaxSubAuthorities || cbSid < cbSidHeader + size_t(nSubAuthorities) * 4)
+		return 0;
+
+	// Format into a local buffer that's always big enough, then copy if it fits.
+	wchar_t buf[cchMaxSidString];
+	size_t ixOut = 0;
+	buf[ixOut++] = L'S';
+	buf[ixOut++] = L'-';
+	ixOut += FormatDecimal(pBytes[0], buf + ixOut);
+	buf[ixOut++] = L'-';
+
+	// Identifier authority: decimal if it fits in 32 bits, otherwise 0x and 12 hex digits (as ConvertSidToStringSidW does).
+	uint64_t authority = 0;
+	for (size_t ix = 2; ix < 8; ++ix)
+		authority = (authority << 8) | pBytes[ix];
+	if (authority <= 0xFFFFFFFFULL)
+	{
+		ixOut += FormatDecimal(authority, buf + ixOut);
+	}
+	else
+	{
+		static const wchar_t szHexDigits[] = L"0123456789ABCDEF";
+		buf[ixOut++] = L'0';
+		buf[ixOut++] = L'x';
+		for (int shift = 44; shift >= 0; shift -= 4)
+			buf[ixOut++] = szHexDigits[(authority >> shift) & 0xF];
+	}
+
+	for (uint8_t ixSub = 0; ixSub < nSubAuthorities; ++ixSub)
+	{
+		uint32_t subAuthority;
+		memcpy(&subAuthority, pBytes + cbSidHeader + size_t(ixSub) * 4, sizeof(subAuthority));
+		buf[ixOut++] = L'-';
+		ixOut += FormatDecimal(subAuthority, buf + ixOut);
+	}
+
+	if (ixOut + 1 > cchBuf)
+		return 0;
+	memcpy(szBuf, buf, ixOut * sizeof(wchar_t));
+	szBuf[ixOut] = L'\0';
+	return ixOut;
+}
+
+/// <summary>
+/// Parses an unsigned number (decimal, or hex with a 0x prefix if bAllowHex) at psz, advancing psz.
+/// </summary>
+/// <returns>true if at least one digit was parsed and the value doesn't exceed maxValue</returns>
+static bool ParseNumber(const wchar_t*& psz, uint64_t maxValue, bool bAllowHex, uint64_t& value)
+{
+	value = 0;
+	unsigned base = 10;
+	if (bAllowHex && L'0' == psz[0] && (L'x' == psz[1] || L'X' == psz[1]))
+	{
+		base = 16;
+		psz += 2;
+	}
+	const wchar_t* pStart = psz;
+	for (;; ++psz)
+	{
+		unsigned digit;
+		if (*psz >= L'0' && *psz <= L'9')
+			digit = unsigned(*psz - L'0');
+		else if (16 == base && *psz >= L'a' && *psz <= L'f')
+			digit = unsigned(*psz - L'a' + 10);
+		else if (16 == base && *psz >= L'A' && *psz <= L'F')
+			digit = unsigned(*psz - L'A' + 10);
+		else
+			break;
+		if (value > (maxValue - digit) / base)
+			return false;
+		value = value * base + digit;
+	}
+	return psz != pStart;
+}
+
+/// <summary>
+/// Parses an "S-1-..." string into a binary SID.
+/// </summary>
+size_t ParseSidString(const wchar_t* szSid, void* pSid, size_t cbSidBuf)
+{
+	if (nullptr == szSid || nullptr == pSid)
+		return 0;
+	const wchar_t* psz = szSid;
+	if ((L'S' != psz[0] && L's' != psz[0]) || L'-' != psz[1])
+		return 0;
+	psz += 2;
+
+	uint64_t revision = 0, authority = 0;
+	if (!ParseNumber(psz, 0xFF, false, revision) || 1 != revision || L'-' != *psz)
+		return 0;
+	++psz;
+	if (!ParseNumber(psz, 0xFFFFFFFFFFFFULL, true, authority))
+		return 0;
+
+	uint8_t header[cbSidHeader];
+	uint32_t subAuthorities[nMaxSubAuthorities];
+	uint8_t nSubAuthorities = 0;
+	while (L'-' == *psz)
+	{
+		++psz;
+		uint64_t subAuthority = 0;
+		if (nSubAuthorities >= nMaxSubAuthorities || !ParseNumber(psz, 0xFFFFFFFFULL, false, subAuthority))
+			return 0;
+		subAuthorities[nSubAuthorities++] = uint32_t(subAuthority);
+	}
+	if (L'\0' != *psz)
+		return 0;
+
+	const size_t cbSid = cbSidHeader + size_t(nSubAuthorities) * 4;
+	if (cbSid > cbSidBuf)
+		return 0;
+	header[0] = uint8_t(revision);
+	header[1] = nSubAuthorities;
+	for (size_t ix = 0; ix < 6; ++ix)
+		header[2 + ix] = uint8_t(authority >> (8 * (5 - ix)));
+	memcpy(pSid, header, cbSidHeader);
+	if (nSubAuthorities > 0)
+		memcpy((uint8_t*)pSid + cbSidHeader, subAuthorities, size_t(nSubAuthorities) * 4);
+	return cbSid;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// Conversion between binary SIDs and their "S-1-..." string form, without allocation.
+// Platform-independent (no Windows.h), so it can be tested and benchmarked on any platform.
+// Handles only the "S-R-I-S-S..." form; SDDL abbreviations such as "BA" or "SY" are not recognized.
+
+#include <cstddef>
+#include <cstdint>
+
+// Longest possible SID string, including the null terminator:
+// "S-" + revision (3 digits) + "-" + authority ("0x" + 12 hex digits) + 15 x ("-" + 10 digits) + null
+const size_t cchMaxSidString = 2 + 3 + 1 + 14 + 15 * 11 + 1;
+
+// Largest binary SID: 8-byte header plus 15 subauthorities (same as SECURITY_MAX_SID_SIZE)
+const size_t cbMaxBinarySid = 8 + 15 * 4;
+
+/// <summary>
+/// Formats a binary SID as a null-terminated "S-1-..." string, in the same format as ConvertSidToStringSidW.
+/// </summary>
+/// <param name="pSid">Input: binary SID</param>
+/// <param name="cbSid">Input: number of bytes available at pSid</param>
+/// <param name="szBuf">Output: buffer for the string</param>
+/// <param name="cchBuf">Input: size of szBuf in characters; cchMaxSidString is always enough</param>
+/// <returns>Number of characters written, not counting the null terminator; 0 if the SID is invalid or the buffer is too small</returns>
+size_t FormatSidString(const void* pSid, size_t cbSid, wchar_t* szBuf, size_t cchBuf);
+
+/// <summary>
+/// Parses an "S-1-..." string into a binary SID.
+/// </summary>
+/// <param name="szSid">Input: string to parse (null-terminated)</param>
+/// <param name="pSid">Output: buffer for the binary SID</param>
+/// <param name="cbSidBuf">Input: size of the output buffer in bytes; cbMaxBinarySid is always enough</param>
+/// <returns>Length of the binary SID in bytes; 0 if the string isn't in S-R-I-S... form or the buffer is too small</returns>
+size_t ParseSidString(const wchar_t* szSid, void* pSid, size_t cbSidBuf);
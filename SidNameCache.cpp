@@ -0,0 +1,111 @@
+// Process-wide cache of SID-to-account-name lookups.
+
+#include <mutex>
+#include "SidNameCache.h"
+
+SidNameCache_t::SidNameCache_t(pfn_SidNameResolver_t pfnResolver, pfn_TickCountMs_t pfnTickCountMs, uint64_t msPositiveTTL, uint64_t msNegativeTTL)
+	: m_pfnResolver(pfnResolver), m_pfnTickCountMs(pfnTickCountMs), m_msPositiveTTL(msPositiveTTL), m_msNegativeTTL(msNegativeTTL),
+	m_nHits(0), m_nNegativeHits(0), m_nMisses(0), m_nInserted(0)
+{
+}
+
+/// <summary>
+/// Returns the cached result for a SID without calling the resolver.
+/// </summary>
+bool SidNameCache_t::Peek(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName, bool& bResolved)
+{
+	const std::string key((const char*)pSid, cbSid);
+	const uint64_t now = m_pfnTickCountMs();
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	Entries_t::const_iterator iter = m_entries.find(key);
+	if (iter == m_entries.end() || now >= iter->second.expires)
+		return false;
+	bResolved = iter->second.bResolved;
+	sDomainName = iter->second.sDomainName;
+	sUserName = iter->second.sUserName;
+	return true;
+}
+
+/// <summary>
+/// Returns the domain and account name for a SID, from the cache if possible, otherwise from the resolver.
+/// </summary>
+bool SidNameCache_t::Lookup(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName)
+{
+	sDomainName.clear();
+	sUserName.clear();
+	if (nullptr == pSid || 0 == cbSid)
+		return false;
+
+	bool bResolved = false;
+	if (Peek(pSid, cbSid, sDomainName, sUserName, bResolved))
+	{
+		if (bResolved)
+			++m_nHits;
+		else
+			++m_nNegativeHits;
+		return bResolved;
+	}
+
+	// Not cached or expired. Resolve without holding the lock; concurrent misses on the same SID
+	// might each call the resolver, and the last one wins.
+	++m_nMisses;
+	pfn_SidNameResolver_t pfnResolver = m_pfnResolver;
+	bResolved = pfnResolver(pSid, cbSid, sDomainName, sUserName);
+	if (!bResolved)
+	{
+		sDomainName.clear();
+		sUserName.clear();
+	}
+
+	Entry_t entry;
+	entry.bResolved = bResolved;
+	entry.sDomainName = sDomainName;
+	entry.sUserName = sUserName;
+	entry.expires = m_pfnTickCountMs() + (bResolved ? m_msPositiveTTL : m_msNegativeTTL);
+	const std::string key((const char*)pSid, cbSid);
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_entries[key] = entry;
+	return bResolved;
+}
+
+/// <summary>
+/// Adds or replaces an entry with a result obtained elsewhere (e.g., a bulk lookup).
+/// </summary>
+void SidNameCache_t::Insert(const void* pSid, size_t cbSid, bool bResolved, const std::wstring& sDomainName, const std::wstring& sUserName)
+{
+	if (nullptr == pSid || 0 == cbSid)
+		return;
+	Entry_t entry;
+	entry.bResolved = bResolved;
+	if (bResolved)
+	{
+		entry.sDomainName = sDomainName;
+		entry.sUserName = sUserName;
+	}
+	entry.expires = m_pfnTickCountMs() + (bResolved ? m_msPositiveTTL : m_msNegativeTTL);
+	const std::string key((const char*)pSid, cbSid);
+	++m_nInserted;
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_entries[key] = entry;
+}
+
+/// <summary>
+/// Replaces the resolver; for example, to substitute a stand-in.
+/// </summary>
+void SidNameCache_t::SetResolver(pfn_SidNameResolver_t pfnResolver)
+{
+	m_pfnResolver = pfnResolver;
+}
+
+/// <summary>
+/// Returns a copy of the cache's activity counters.
+/// </summary>
+SidNameCacheStats_t SidNameCache_t::GetStats() const
+{
+	SidNameCacheStats_t stats;
+	stats.nHits = m_nHits;
+	stats.nNegativeHits = m_nNegativeHits;
+	stats.nMisses = m_nMisses;
+	stats.nInserted = m_nInserted;
+	return stats;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// Process-wide cache of SID-to-account-name lookups, with positive and negative entries.
+// Platform-independent (no Windows.h): the resolver and the clock are supplied as function pointers,
+// so the cache can be exercised with a stand-in resolver on any platform.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <shared_mutex>
+#include <atomic>
+
+/// <summary>
+/// Resolves a binary SID to its domain and account name.
+/// </summary>
+/// <param name="pSid">Input: binary SID</param>
+/// <param name="cbSid">Input: length of the binary SID in bytes</param>
+/// <param name="sDomainName">Output: domain name on success</param>
+/// <param name="sUserName">Output: account name on success</param>
+/// <returns>true if the SID was resolved; false otherwise</returns>
+typedef bool (*pfn_SidNameResolver_t)(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName);
+
+/// <summary>
+/// Returns a millisecond tick count.
+/// </summary>
+typedef uint64_t(*pfn_TickCountMs_t)();
+
+/// <summary>
+/// Counters describing the cache's activity.
+/// </summary>
+struct SidNameCacheStats_t
+{
+	// Lookups answered from positive and negative entries
+	uint64_t nHits = 0, nNegativeHits = 0;
+	// Lookups that called the resolver (no entry, or an expired one)
+	uint64_t nMisses = 0;
+	// Entries added by Insert (e.g., from a bulk lookup) rather than by the resolver
+	uint64_t nInserted = 0;
+};
+
+/// <summary>
+/// Thread-safe cache of SID-to-name lookups, keyed by SID bytes.
+/// Successful lookups are kept for the positive TTL; failures (deleted accounts, unreachable domains)
+/// are kept for the shorter negative TTL so they aren't retried on every use.
+/// The resolver is called without holding the cache's lock.
+/// </summary>
+class SidNameCache_t
+{
+public:
+	SidNameCache_t(pfn_SidNameResolver_t pfnResolver, pfn_TickCountMs_t pfnTickCountMs, uint64_t msPositiveTTL = 10 * 60 * 1000, uint64_t msNegativeTTL = 60 * 1000);
+
+	/// <summary>
+	/// Returns the domain and account name for a SID, from the cache if possible, otherwise from the resolver.
+	/// </summary>
+	/// <returns>true if the SID has a name; false if it couldn't be resolved (now or recently)</returns>
+	bool Lookup(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName);
+
+	/// <summary>
+	/// Returns the cached result for a SID without calling the resolver.
+	/// </summary>
+	/// <param name="bResolved">Output: if an unexpired entry was found, whether it's a positive entry</param>
+	/// <returns>true if an unexpired entry was found</returns>
+	bool Peek(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName, bool& bResolved);
+
+	/// <summary>
+	/// Adds or replaces an entry with a result obtained elsewhere (e.g., a bulk lookup).
+	/// </summary>
+	/// <param name="bResolved">Input: true for a positive entry; false for a negative entry</param>
+	void Insert(const void* pSid, size_t cbSid, bool bResolved, const std::wstring& sDomainName, const std::wstring& sUserName);
+
+	/// <summary>
+	/// Replaces the resolver; for example, to substitute a stand-in.
+	/// </summary>
+	void SetResolver(pfn_SidNameResolver_t pfnResolver);
+
+	/// <summary>
+	/// Returns a copy of the cache's activity counters.
+	/// </summary>
+	SidNameCacheStats_t GetStats() const;
+
+private:
+	struct Entry_t
+	{
+		bool bResolved = false;
+		std::wstring sDomainName, sUserName;
+		uint64_t expires = 0;
+	};
+	// Key: the SID's bytes
+	typedef std::unordered_map<std::string, Entry_t> Entries_t;
+
+	std::atomic<pfn_SidNameResolver_t> m_pfnResolver;
+	const pfn_TickCountMs_t m_pfnTickCountMs;
+	const uint64_t m_msPositiveTTL, m_msNegativeTTL;
+	mutable std::shared_mutex m_mutex;
+	Entries_t m_entries;
+	std::atomic<uint64_t> m_nHits, m_nNegativeHits, m_nMisses, m_nInserted;
+
+private:
+	SidNameCache_t(const SidNameCache_t&) = delete;
+	SidNameCache_t& operator = (const SidNameCache_t&) = delete;
+};
@@ -0,0 +1,235 @@
+// Compact columnar file format for process snapshots.
+
+#include <cstring>
+#include "SnapshotColumns.h"
+
+static const char szHeaderMagic[8] = { 'G', 'O', 'U', 'S', 'N', 'A', 'P', '1' };
+static const char szTrailerMagic[8] = { 'G', 'O', 'U', 'I', 'N', 'D', 'E', 'X' };
+
+// Zero bytes for padding blocks to 8-byte boundaries
+static const char zeroPadding[8] = { 0 };
+
+SnapshotColumnWriter_t::SnapshotColumnWriter_t()
+{
+	memset(&m_header, 0, sizeof(m_header));
+	m_stringOffsets.push_back(0);
+}
+
+/// <summary>
+/// Returns the string table index for the string, adding it if it's not already there.
+/// </summary>
+uint32_t SnapshotColumnWriter_t::Intern(std::wstring_view sText)
+{
+	// Reuse the lookup key's storage, so that finding a string that's already in the table doesn't allocate.
+	m_sLookupKey.assign(sText);
+	std::unordered_map<std::wstring, uint32_t>::const_iterator iterIndex = m_stringIndex.find(m_sLookupKey);
+	if (iterIndex != m_stringIndex.end())
+		return iterIndex->second;
+
+	const uint32_t ixString = uint32_t(m_stringOffsets.size() - 1);
+	const size_t cbStart = m_stringBytes.size();
+	m_stringBytes.resize(cbStart + sText.size() * cbMaxUtf8PerUtf16);
+	m_stringBytes.resize(cbStart + EncodeUtf8(sText, m_stringBytes.data() + cbStart));
+	m_stringOffsets.push_back(uint32_t(m_stringBytes.size()));
+	m_stringIndex.emplace(m_sLookupKey, ixString);
+	return ixString;
+}
+
+/// <summary>
+/// Appends a row.
+/// </summary>
+void SnapshotColumnWriter_t::AddRow(const SnapshotColumnRow_t& row)
+{
+	const uint32_t values[nSnapshotRowColumns] = {
+		row.session, row.pid, row.ppid, row.flags, row.openError,
+		row.userObjects, row.userObjectsPeak, row.gdiObjects, row.gdiObjectsPeak, row.readTimeUs,
+		Intern(row.processName), Intern(row.services), Intern(row.userSid), Intern(row.userName)
+	};
+	for (size_t ixColumn = 0; ixColumn < nSnapshotRowColumns; ++ixColumn)
+		m_columns[ixColumn].push_back(values[ixColumn]);
+}
+
+/// <summary>
+/// Writes a block padded to an 8-byte boundary, and adds its entry to the index.
+/// </summary>
+static bool WriteBlock(ByteSink_t& sink, uint64_t& offset, std::vector<SnapshotColumnEntry_t>& index,
+	SnapshotColumn_t column, uint32_t elementSize, const void* pData, size_t count)
+{
+	SnapshotColumnEntry_t entry;
+	entry.columnId = uint32_t(column);
+	entry.elementSize = elementSize;
+	entry.offset = offset;
+	entry.count = count;
+	index.push_back(entry);
+
+	const size_t cbData = size_t(elementSize) * count;
+	const size_t cbPadding = (8 - (cbData % 8)) % 8;
+	if ((cbData > 0 && !sink.Write((const char*)pData, cbData)) || (cbPadding > 0 && !sink.Write(zeroPadding, cbPadding)))
+		return false;
+	offset += cbData + cbPadding;
+	return true;
+}
+
+/// <summary>
+/// Writes the complete file to the sink.
+/// </summary>
+bool SnapshotColumnWriter_t::Write(ByteSink_t& sink)
+{
+	memcpy(m_header.magic, szHeaderMagic, sizeof(m_header.magic));
+	m_header.version = SnapshotFileVersion;
+	m_header.headerSize = sizeof(SnapshotFileHeader_t);
+	m_header.rowCount = uint32_t(m_columns[0].size());
+	if (!sink.Write((const char*)&m_header, sizeof(m_header)))
+		return false;
+
+	uint64_t offset = sizeof(m_header);
+	std::vector<SnapshotColumnEntry_t> index;
+	for (size_t ixColumn = 0; ixColumn < nSnapshotRowColumns; ++ixColumn)
+	{
+		if (!WriteBlock(sink, offset, index, SnapshotColumn_t(ixColumn + 1), sizeof(uint32_t), m_columns[ixColumn].data(), m_columns[ixColumn].size()))
+			return false;
+	}
+	if (!WriteBlock(sink, offset, index, SnapshotColumn_t::StringOffsets, sizeof(uint32_t), m_stringOffsets.data(), m_stringOffsets.size()) ||
+		!WriteBlock(sink, offset, index, SnapshotColumn_t::StringBytes, 1, m_stringBytes.data(), m_stringBytes.size()))
+		return false;
+
+	SnapshotFileTrailer_t trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.indexOffset = offset;
+	trailer.columnCount = uint32_t(index.size());
+	memcpy(trailer.magic, szTrailerMagic, sizeof(trailer.magic));
+	return
+		sink.Write((const char*)index.data(), index.size() * sizeof(SnapshotColumnEntry_t)) &&
+		sink.Write((const char*)&trailer, sizeof(trailer));
+}
+
+/// <summary>
+/// Validates the file's structure and locates its columns.
+/// </summary>
+bool SnapshotColumnReader_t::Open(const void* pData, size_t cbData, std::wstring& sErrorInfo)
+{
+	sErrorInfo.clear();
+	m_pHeader = nullptr;
+	const char* pFile = (const char*)pData;
+
+	if (0 != ((uintptr_t)pFile % 8))
+	{
+		sErrorInfo = L"Snapshot data is not 8-byte aligned";
+		return false;
+	}
+	// Every part of the file is a multiple of 8 bytes long.
+	if (cbData < sizeof(SnapshotFileHeader_t) + sizeof(SnapshotFileTrailer_t) || 0 != (cbData % 8))
+	{
+		sErrorInfo = L"File is too small to be a snapshot file";
+		return false;
+	}
+	const SnapshotFileHeader_t* pHeader = (const SnapshotFileHeader_t*)pFile;
+	const SnapshotFileTrailer_t* pTrailer = (const SnapshotFileTrailer_t*)(pFile + cbData - sizeof(SnapshotFileTrailer_t));
+	if (0 != memcmp(pHeader->magic, szHeaderMagic, sizeof(szHeaderMagic)) || 0 != memcmp(pTrailer->magic, szTrailerMagic, sizeof(szTrailerMagic)))
+	{
+		sErrorInfo = L"Not a snapshot file";
+		return false;
+	}
+	if (SnapshotFileVersion != pHeader->version || sizeof(SnapshotFileHeader_t) != pHeader->headerSize)
+	{
+		sErrorInfo = L"Unsupported snapshot file version";
+		return false;
+	}
+	const uint64_t cbIndexSpace = uint64_t(cbData - sizeof(SnapshotFileTrailer_t));
+	if (pTrailer->indexOffset > cbIndexSpace || 0 != (pTrailer->indexOffset % 8) ||
+		uint64_t(pTrailer->columnCount) * sizeof(SnapshotColumnEntry_t) > cbIndexSpace - pTrailer->indexOffset)
+	{
+		sErrorInfo = L"Snapshot file's index is out of bounds";
+		return false;
+	}
+	// The index is followed directly by the trailer. Anything else means the data isn't a single snapshot
+	// (e.g., several snapshots written one after another to the same stream).
+	if (pTrailer->indexOffset + uint64_t(pTrailer->columnCount) * sizeof(SnapshotColumnEntry_t) != cbIndexSpace)
+	{
+		sErrorInfo = L"Data is not a single snapshot (snapshots written one after another can't be read)";
+		return false;
+	}
+
+	for (size_t ixColumn = 0; ixColumn < nSnapshotRowColumns; ++ixColumn)
+		m_columns[ixColumn] = nullptr;
+	m_pStringOffsets = nullptr;
+	m_pStringBytes = nullptr;
+	m_nStrings = m_cbStringBytes = 0;
+
+	const SnapshotColumnEntry_t* pEntries = (const SnapshotColumnEntry_t*)(pFile + pTrailer->indexOffset);
+	for (uint32_t ixEntry = 0; ixEntry < pTrailer->columnCount; ++ixEntry)
+	{
+		const SnapshotColumnEntry_t& entry = pEntries[ixEntry];
+		// Blocks must lie between the header and the index.
+		if (0 == entry.elementSize || entry.offset < sizeof(SnapshotFileHeader_t) || entry.offset > pTrailer->indexOffset ||
+			entry.count > (pTrailer->indexOffset - entry.offset) / entry.elementSize || 0 != (entry.offset % 8))
+		{
+			sErrorInfo = L"Snapshot file's column is out of bounds";
+			return false;
+		}
+		const char* pBlock = pFile + entry.offset;
+		if (entry.columnId >= uint32_t(SnapshotColumn_t::Session) && entry.columnId <= uint32_t(SnapshotColumn_t::UserName))
+		{
+			if (sizeof(uint32_t) != entry.elementSize || entry.count != pHeader->rowCount)
+			{
+				sErrorInfo = L"Snapshot file's column has the wrong size";
+				return false;
+			}
+			m_columns[entry.columnId - 1] = (const uint32_t*)pBlock;
+		}
+		else if (uint32_t(SnapshotColumn_t::StringOffsets) == entry.columnId)
+		{
+			if (sizeof(uint32_t) != entry.elementSize || 0 == entry.count)
+			{
+				sErrorInfo = L"Snapshot file's string table is invalid";
+				return false;
+			}
+			m_pStringOffsets = (const uint32_t*)pBlock;
+			m_nStrings = size_t(entry.count - 1);
+		}
+		else if (uint32_t(SnapshotColumn_t::StringBytes) == entry.columnId)
+		{
+			m_pStringBytes = pBlock;
+			m_cbStringBytes = size_t(entry.count * entry.elementSize);
+		}
+		// Other blocks (e.g., from a later minor version) are ignored.
+	}
+
+	m_pHeader = pHeader;
+	return true;
+}
+
+/// <summary>
+/// Returns a row column, or nullptr if the file doesn't have it.
+/// </summary>
+const uint32_t* SnapshotColumnReader_t::Column(SnapshotColumn_t column) const
+{
+	const uint32_t ixColumn = uint32_t(column);
+	if (ixColumn < 1 || ixColumn > nSnapshotRowColumns)
+		return nullptr;
+	return m_columns[ixColumn - 1];
+}
+
+/// <summary>
+/// Returns a string from the string table as UTF-8; empty if the index is invalid.
+/// </summary>
+std::string_view SnapshotColumnReader_t::String(uint32_t ixString) const
+{
+	if (nullptr == m_pStringOffsets || nullptr == m_pStringBytes || ixString >= m_nStrings)
+		return std::string_view();
+	const uint32_t ixStart = m_pStringOffsets[ixString], ixEnd = m_pStringOffsets[ixString + 1];
+	if (ixStart > ixEnd || ixEnd > m_cbStringBytes)
+		return std::string_view();
+	return std::string_view(m_pStringBytes + ixStart, ixEnd - ixStart);
+}
+
+/// <summary>
+/// The string referenced by a string column in a row.
+/// </summary>
+std::string_view SnapshotColumnReader_t::RowString(SnapshotColumn_t column, uint32_t ixRow) const
+{
+	const uint32_t* pColumn = Column(column);
+	if (nullptr == pColumn || ixRow >= RowCount())
+		return std::string_view();
+	return String(pColumn[ixRow]);
+}
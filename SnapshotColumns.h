@@ -0,0 +1,212 @@
+#pragma once
+
+// Compact columnar file format for process snapshots, designed to be memory-mapped and scanned.
+// Platform-independent (no Windows.h), so files can be written and read on any platform.
+//
+// File layout (all integers little-endian; every block starts on an 8-byte boundary):
+//   SnapshotFileHeader_t
+//   Column blocks: one fixed-width uint32_t array per row column, with one element per row, plus the
+//     string table as two blocks: StringOffsets (uint32_t, one per string plus one) and StringBytes (UTF-8).
+//     String columns (process name, services, SID, user name) hold indexes into the string table, in
+//     which each distinct string appears once.
+//   Footer index: one SnapshotColumnEntry_t per block
+//   SnapshotFileTrailer_t, locating the footer index
+// Readers locate the trailer at the end of the file, then the index, then any columns they need.
+// A file holds exactly one snapshot; concatenated snapshots are rejected.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include "RowWriter.h"
+
+/// <summary>
+/// Column identifiers used in the footer index.
+/// </summary>
+enum class SnapshotColumn_t : uint32_t
+{
+	Session = 1,
+	Pid,
+	// Parent PID; 0 if not known
+	Ppid,
+	// SnapshotRowFlags_t bits
+	Flags,
+	// Error code if the process couldn't be opened
+	OpenError,
+	UserObjects,
+	UserObjectsPeak,
+	GdiObjects,
+	GdiObjectsPeak,
+	// Time the counters were read, in microseconds since the start of the snapshot
+	ReadTimeUs,
+	// String table indexes
+	ProcessName,
+	Services,
+	UserSid,
+	UserName,
+	// The string table
+	StringOffsets = 100,
+	StringBytes = 101
+};
+
+// Number of row columns (Session through UserName)
+const size_t nSnapshotRowColumns = size_t(SnapshotColumn_t::UserName);
+
+/// <summary>
+/// Bits in the Flags column.
+/// </summary>
+enum SnapshotRowFlags_t : uint32_t
+{
+	// The process was opened and its counters read
+	SnapshotRowOpened = 0x1
+};
+
+#pragma pack(push, 8)
+/// <summary>
+/// Fixed header at the start of the file, including the snapshot's summary rows.
+/// </summary>
+struct SnapshotFileHeader_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	// When the snapshot was taken (FILETIME, UTC)
+	uint64_t timestamp;
+	uint32_t sessionId;
+	uint32_t rowCount;
+	// Processes not probed within the time budget
+	uint32_t skippedCount;
+	// DRIFT: processes re-read, and listed processes that were to be re-read (0 if not requested)
+	uint32_t driftReread, driftRows;
+	uint32_t reserved;
+	// USER objects, USER objects peak, GDI objects, GDI objects peak for TOTAL, GR_GLOBAL, and DRIFT
+	uint64_t totals[4];
+	uint64_t global[4];
+	uint64_t drift[4];
+};
+
+/// <summary>
+/// Footer index entry describing one block.
+/// </summary>
+struct SnapshotColumnEntry_t
+{
+	uint32_t columnId;
+	uint32_t elementSize;
+	// Offset of the block from the start of the file, and number of elements
+	uint64_t offset;
+	uint64_t count;
+};
+
+/// <summary>
+/// Fixed trailer at the end of the file.
+/// </summary>
+struct SnapshotFileTrailer_t
+{
+	uint64_t indexOffset;
+	uint32_t columnCount;
+	uint32_t reserved;
+	char magic[8];
+};
+#pragma pack(pop)
+
+const uint32_t SnapshotFileVersion = 1;
+
+/// <summary>
+/// One process row to add to a snapshot file. The strings only need to remain valid for the AddRow call.
+/// </summary>
+struct SnapshotColumnRow_t
+{
+	uint32_t session = 0, pid = 0, ppid = 0, flags = 0, openError = 0;
+	uint32_t userObjects = 0, userObjectsPeak = 0, gdiObjects = 0, gdiObjectsPeak = 0;
+	uint32_t readTimeUs = 0;
+	std::wstring_view processName, services, userSid, userName;
+};
+
+/// <summary>
+/// Collects a snapshot's rows into columns, then writes them as a snapshot file.
+/// </summary>
+class SnapshotColumnWriter_t
+{
+public:
+	SnapshotColumnWriter_t();
+
+	/// <summary>
+	/// Header fields to fill in before Write: timestamp, session, and summary rows.
+	/// (The magic, version, sizes, and row count are set by Write.)
+	/// </summary>
+	SnapshotFileHeader_t& Header() { return m_header; }
+
+	/// <summary>
+	/// Appends a row.
+	/// </summary>
+	void AddRow(const SnapshotColumnRow_t& row);
+
+	/// <summary>
+	/// Writes the complete file to the sink.
+	/// </summary>
+	/// <returns>true if successful; false if a write failed</returns>
+	bool Write(ByteSink_t& sink);
+
+private:
+	// Returns the string table index for the string, adding it if it's not already there.
+	uint32_t Intern(std::wstring_view sText);
+
+private:
+	SnapshotFileHeader_t m_header;
+	// Row columns, indexed by SnapshotColumn_t value - 1
+	std::vector<uint32_t> m_columns[nSnapshotRowColumns];
+	// String table: offsets of each string in m_stringBytes (plus the end), and an index to find existing strings.
+	std::vector<uint32_t> m_stringOffsets;
+	std::vector<char> m_stringBytes;
+	std::unordered_map<std::wstring, uint32_t> m_stringIndex;
+	std::wstring m_sLookupKey;
+
+private:
+	SnapshotColumnWriter_t(const SnapshotColumnWriter_t&) = delete;
+	SnapshotColumnWriter_t& operator = (const SnapshotColumnWriter_t&) = delete;
+};
+
+/// <summary>
+/// Reads a snapshot file in memory (e.g., a mapped view of the file) without copying it.
+/// </summary>
+class SnapshotColumnReader_t
+{
+public:
+	/// <summary>
+	/// Validates the file's structure and locates its columns. The data must remain valid while the reader is used.
+	/// </summary>
+	/// <param name="pData">Input: the file's contents; must be 8-byte aligned</param>
+	/// <param name="cbData">Input: size of the file</param>
+	/// <param name="sErrorInfo">Output: error information on failure</param>
+	/// <returns>true if the file is a valid snapshot file; false otherwise</returns>
+	bool Open(const void* pData, size_t cbData, std::wstring& sErrorInfo);
+
+	// The following can be used after Open has succeeded.
+	const SnapshotFileHeader_t& Header() const { return *m_pHeader; }
+	uint32_t RowCount() const { return m_pHeader->rowCount; }
+
+	/// <summary>
+	/// Returns a row column (RowCount() elements), or nullptr if the file doesn't have it.
+	/// </summary>
+	const uint32_t* Column(SnapshotColumn_t column) const;
+
+	/// <summary>
+	/// Returns a string from the string table as UTF-8; empty if the index is invalid.
+	/// </summary>
+	std::string_view String(uint32_t ixString) const;
+
+	/// <summary>
+	/// Convenience accessor: the string referenced by a string column in a row.
+	/// </summary>
+	std::string_view RowString(SnapshotColumn_t column, uint32_t ixRow) const;
+
+private:
+	const SnapshotFileHeader_t* m_pHeader = nullptr;
+	const uint32_t* m_columns[nSnapshotRowColumns] = {};
+	const uint32_t* m_pStringOffsets = nullptr;
+	size_t m_nStrings = 0;
+	const char* m_pStringBytes = nullptr;
+	size_t m_cbStringBytes = 0;
+};
@@ -0,0 +1,377 @@
+// Tests the LZ4 block and frame codec and the xxHash32 checksum, including the decoder's rejection of malformed input.
+// Build and run (from this directory):
+//   g++ -std=c++17 -I.. Lz4FrameTest.cpp ../Lz4Frame.cpp ../RowWriter.cpp -o Lz4FrameTest && ./Lz4FrameTest
+// (Run it with -fsanitize=address to check that malformed input is never read out of bounds.)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "TestCheck.h"
+#include "Lz4Frame.h"
+
+/// <summary>
+/// Collects written bytes in memory.
+/// </summary>
+class VectorSink_t : public ByteSink_t
+{
+public:
+	bool Write(const char* pData, size_t cbData) override
+	{
+		data.insert(data.end(), pData, pData + cbData);
+		return true;
+	}
+	std::vector<char> data;
+};
+
+/// <summary>
+/// Decompresses frames; copies the input to its own allocation first, so that reading past its end is caught
+/// by the address sanitizer. A failure is always explained.
+/// </summary>
+static bool Decompress(const std::vector<char>& input, std::vector<char>& output)
+{
+	std::unique_ptr<char[]> pCopy(new char[input.size()]);
+	if (!input.empty())
+		memcpy(pCopy.get(), input.data(), input.size());
+	VectorSink_t sink;
+	std::wstring sErrorInfo;
+	const bool bDecompressed = DecompressLz4Frames(pCopy.get(), input.size(), sink, sErrorInfo);
+	CHECK(bDecompressed == sErrorInfo.empty());
+	output.swap(sink.data);
+	return bDecompressed;
+}
+
+/// <summary>
+/// Encodes data as one frame, a block of at most cbLz4BlockMax bytes at a time.
+/// </summary>
+static std::vector<char> EncodeFrame(const std::vector<char>& content)
+{
+	std::vector<char> frame;
+	Lz4FrameEncoder_t encoder;
+	encoder.Begin(frame);
+	for (size_t ixStart = 0; ixStart < content.size(); ixStart += cbLz4BlockMax)
+	{
+		const size_t cbBlock = (content.size() - ixStart < cbLz4BlockMax) ? (content.size() - ixStart) : cbLz4BlockMax;
+		encoder.EncodeBlock(content.data() + ixStart, cbBlock, frame);
+	}
+	encoder.End(frame);
+	return frame;
+}
+
+/// <summary>
+/// Returns text that compresses well: snapshot-like rows.
+/// </summary>
+static std::vector<char> CompressibleData(size_t cbData)
+{
+	std::string sText;
+	for (unsigned int nRow = 0; sText.size() < cbData; ++nRow)
+		sText += "row " + std::to_string(nRow) + "\tsvchost.exe\tNT AUTHORITY\\SYSTEM\n";
+	return std::vector<char>(sText.begin(), sText.begin() + cbData);
+}
+
+/// <summary>
+/// Returns bytes that don't compress: a pseudo-random sequence.
+/// </summary>
+static std::vector<char> IncompressibleData(size_t cbData)
+{
+	std::vector<char> data(cbData);
+	uint32_t state = 2463534242u;
+	for (size_t ix = 0; ix < cbData; ++ix)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		data[ix] = char(state >> 24);
+	}
+	return data;
+}
+
+static void AppendLE32(std::vector<char>& output, uint32_t value)
+{
+	for (int ix = 0; ix < 4; ++ix)
+		output.push_back(char((value >> (8 * ix)) & 0xFF));
+}
+
+/// <summary>
+/// Appends a frame header with the given descriptor flags and block size code, and its checksum.
+/// </summary>
+static void AppendFrameHeader(std::vector<char>& output, uint8_t flags, uint8_t blockDescriptor)
+{
+	const uint8_t descriptor[2] = { flags, blockDescriptor };
+	AppendLE32(output, 0x184D2204);
+	output.push_back(char(flags));
+	output.push_back(char(blockDescriptor));
+	output.push_back(char((Xxh32_t::Hash(descriptor, sizeof(descriptor)) >> 8) & 0xFF));
+}
+
+/// <summary>
+/// Returns a frame with one compressed block, given as raw block data, and the content checksum it's expected to have.
+/// </summary>
+static std::vector<char> FrameWithBlock(const std::vector<char>& block, uint32_t contentChecksum)
+{
+	std::vector<char> frame;
+	AppendFrameHeader(frame, 0x64, 0x50);
+	AppendLE32(frame, uint32_t(block.size()));
+	frame.insert(frame.end(), block.begin(), block.end());
+	AppendLE32(frame, 0);
+	AppendLE32(frame, contentChecksum);
+	return frame;
+}
+
+static void TestXxh32()
+{
+	// Published test vectors
+	CHECK(0x02CC5D05 == Xxh32_t::Hash("", 0));
+	CHECK(0x36B78AE7 == Xxh32_t::Hash("", 0, 0x9E3779B1));
+	CHECK(0x550D7456 == Xxh32_t::Hash("a", 1));
+	CHECK(0x32D153FF == Xxh32_t::Hash("abc", 3));
+	const char szLong[] = "Nobody inspects the spammish repetition";
+	CHECK(0xE2293B2F == Xxh32_t::Hash(szLong, strlen(szLong)));
+	CHECK(0xC9E89E68 == Xxh32_t::Hash(szLong, strlen(szLong), 0x9E3779B1));
+
+	// Updates in pieces of every size, which split the 16-byte stripes in every way, match one update.
+	const std::vector<char> data = IncompressibleData(1000);
+	const uint32_t expected = Xxh32_t::Hash(data.data(), data.size());
+	for (size_t cbPiece = 1; cbPiece <= 40; ++cbPiece)
+	{
+		Xxh32_t hash;
+		for (size_t ixStart = 0; ixStart < data.size(); ixStart += cbPiece)
+			hash.Update(data.data() + ixStart, (data.size() - ixStart < cbPiece) ? (data.size() - ixStart) : cbPiece);
+		CHECK(expected == hash.Digest());
+	}
+	Xxh32_t emptyUpdates;
+	emptyUpdates.Update("", 0);
+	emptyUpdates.Update("abc", 3);
+	emptyUpdates.Update("", 0);
+	CHECK(0x32D153FF == emptyUpdates.Digest());
+}
+
+static void TestBlockRoundTrip()
+{
+	const size_t sizes[] = { 0, 1, 5, 12, 13, 14, 100, 65535, 65536, 65537, 200000, cbLz4BlockMax };
+	for (const size_t cbData : sizes)
+	{
+		for (int nKind = 0; nKind < 3; ++nKind)
+		{
+			std::vector<char> data = (0 == nKind) ? CompressibleData(cbData) : (1 == nKind) ? std::vector<char>(cbData, '\0') : IncompressibleData(cbData);
+			// (Reserved so that an empty block is still given a valid pointer.)
+			data.reserve(1);
+			std::vector<char> compressed(Lz4CompressBound(cbData));
+			const size_t cbCompressed = Lz4CompressBlock(data.data(), cbData, compressed.data());
+			CHECK(cbCompressed <= Lz4CompressBound(cbData));
+			if (nKind < 2 && cbData >= 1000)
+				CHECK(cbCompressed < cbData / 4);
+
+			// Into an output of exactly the right size, then one byte too small
+			std::unique_ptr<char[]> pCompressed(new char[cbCompressed]);
+			memcpy(pCompressed.get(), compressed.data(), cbCompressed);
+			std::vector<char> output(cbData + 1, '#');
+			size_t cbOutput = 0;
+			CHECK(Lz4DecompressBlock(pCompressed.get(), cbCompressed, output.data(), cbData, cbOutput));
+			CHECK(cbOutput == cbData && 0 == memcmp(output.data(), data.data(), cbData));
+			CHECK('#' == output[cbData]);
+			if (cbData > 0)
+				CHECK(!Lz4DecompressBlock(pCompressed.get(), cbCompressed, output.data(), cbData - 1, cbOutput));
+		}
+	}
+}
+
+static void TestFrameRoundTrip()
+{
+	// Up to several blocks, including exact multiples of the block size, and compressible and incompressible blocks together
+	const size_t sizes[] = { 0, 1, 1000, cbLz4BlockMax - 1, cbLz4BlockMax, cbLz4BlockMax + 1, 2 * cbLz4BlockMax, 3 * cbLz4BlockMax + 12345 };
+	for (const size_t cbData : sizes)
+	{
+		std::vector<char> data = CompressibleData(cbData);
+		const std::vector<char> random = IncompressibleData(cbData / 2);
+		std::copy(random.begin(), random.end(), data.begin() + cbData / 4);
+		const std::vector<char> frame = EncodeFrame(data);
+		CHECK(IsLz4Frame(frame.data(), frame.size()));
+		CHECK(frame.size() < cbData * 3 / 4 + 64);
+		std::vector<char> output;
+		CHECK(Decompress(frame, output));
+		CHECK(output == data);
+	}
+	CHECK(!IsLz4Frame("\x04\x22\x4D", 3));
+	CHECK(!IsLz4Frame("\x04\x22\x4D\x19", 4));
+}
+
+static void TestConcatenatedAndSkippableFrames()
+{
+	const std::vector<char> first = CompressibleData(300000), second = IncompressibleData(5000);
+	std::vector<char> skippable;
+	AppendLE32(skippable, 0x184D2A50);
+	AppendLE32(skippable, 3);
+	skippable.insert(skippable.end(), { 'x', 'y', 'z' });
+	std::vector<char> emptySkippable;
+	AppendLE32(emptySkippable, 0x184D2A5F);
+	AppendLE32(emptySkippable, 0);
+
+	// Skippable frames before, between, and after the frames are ignored.
+	std::vector<char> input = skippable;
+	const std::vector<char> firstFrame = EncodeFrame(first), secondFrame = EncodeFrame(second), emptyFrame = EncodeFrame(std::vector<char>());
+	input.insert(input.end(), firstFrame.begin(), firstFrame.end());
+	input.insert(input.end(), emptySkippable.begin(), emptySkippable.end());
+	input.insert(input.end(), emptyFrame.begin(), emptyFrame.end());
+	input.insert(input.end(), secondFrame.begin(), secondFrame.end());
+	input.insert(input.end(), skippable.begin(), skippable.end());
+	std::vector<char> expected = first, output;
+	expected.insert(expected.end(), second.begin(), second.end());
+	CHECK(Decompress(input, output));
+	CHECK(output == expected);
+
+	// Only skippable frames: no content
+	CHECK(Decompress(skippable, output));
+	CHECK(output.empty());
+	// A skippable frame whose size is past the end of the input
+	std::vector<char> truncated = skippable;
+	truncated.pop_back();
+	CHECK(!Decompress(truncated, output));
+}
+
+static void TestReferenceFrame()
+{
+	// Written by the reference lz4 command-line tool (lz4 -B4 -BX): a frame with a block checksum.
+	const unsigned char reference[] = {
+		0x04, 0x22, 0x4d, 0x18, 0x74, 0x40, 0xbd, 0x53, 0x00, 0x00, 0x00, 0xf0,
+		0x17, 0x72, 0x6f, 0x77, 0x20, 0x30, 0x09, 0x73, 0x76, 0x63, 0x68, 0x6f,
+		0x73, 0x74, 0x2e, 0x65, 0x78, 0x65, 0x09, 0x4e, 0x54, 0x20, 0x41, 0x55,
+		0x54, 0x48, 0x4f, 0x52, 0x49, 0x54, 0x59, 0x5c, 0x53, 0x59, 0x53, 0x54,
+		0x45, 0x4d, 0x0a, 0x26, 0x00, 0x1f, 0x31, 0x26, 0x00, 0x12, 0x1f, 0x32,
+		0x26, 0x00, 0x12, 0x1f, 0x33, 0x26, 0x00, 0x12, 0x1f, 0x34, 0x26, 0x00,
+		0x12, 0x1f, 0x35, 0x26, 0x00, 0x12, 0x1f, 0x36, 0x26, 0x00, 0x12, 0x1f,
+		0x37, 0x26, 0x00, 0x09, 0x50, 0x53, 0x54, 0x45, 0x4d, 0x0a, 0x44, 0x9c,
+		0xd9, 0x18, 0x00, 0x00, 0x00, 0x00, 0x97, 0x44, 0x28, 0x2b
+	};
+	const std::vector<char> frame(reference, reference + sizeof(reference));
+	std::vector<char> output;
+	CHECK(Decompress(frame, output));
+	CHECK(output == CompressibleData(304));
+
+	// A corrupted block fails its block checksum.
+	std::vector<char> corrupted = frame;
+	corrupted[20] ^= 1;
+	CHECK(!Decompress(corrupted, output));
+}
+
+static void TestLinkedBlocks()
+{
+	// A frame with linked blocks: the second block is a match into the first block's content, then no literals.
+	std::vector<char> frame;
+	AppendFrameHeader(frame, 0x44, 0x40);
+	AppendLE32(frame, 16 | 0x80000000);
+	const char szFirst[] = "0123456789abcdef";
+	frame.insert(frame.end(), szFirst, szFirst + 16);
+	const char secondBlock[] = { 0x04, 12, 0, 0x00 };
+	AppendLE32(frame, sizeof(secondBlock));
+	frame.insert(frame.end(), secondBlock, secondBlock + sizeof(secondBlock));
+	AppendLE32(frame, 0);
+	const std::string sExpected = "0123456789abcdef456789ab";
+	AppendLE32(frame, Xxh32_t::Hash(sExpected.data(), sExpected.size()));
+	std::vector<char> output;
+	CHECK(Decompress(frame, output));
+	CHECK(std::string(output.begin(), output.end()) == sExpected);
+
+	// The same blocks in a frame with independent blocks: the match refers to content before the block.
+	frame[4] = 0x64;
+	const uint8_t descriptor[2] = { 0x64, 0x40 };
+	frame[6] = char((Xxh32_t::Hash(descriptor, sizeof(descriptor)) >> 8) & 0xFF);
+	CHECK(!Decompress(frame, output));
+}
+
+static void TestRejectsMalformedFrames()
+{
+	const std::vector<char> content = CompressibleData(cbLz4BlockMax + 5000);
+	const std::vector<char> frame = EncodeFrame(content);
+	std::vector<char> output;
+
+	// Empty input, and a frame truncated at every length
+	CHECK(!Decompress(std::vector<char>(), output));
+	for (size_t cbTruncated = 1; cbTruncated < frame.size(); ++cbTruncated)
+		CHECK(!Decompress(std::vector<char>(frame.begin(), frame.begin() + cbTruncated), output));
+	// Trailing bytes that aren't a frame
+	std::vector<char> trailing = frame;
+	trailing.insert(trailing.end(), { 1, 2, 3, 4, 5 });
+	CHECK(!Decompress(trailing, output));
+
+	// Bad magic number, descriptor checksum, and content checksum
+	std::vector<char> corrupted = frame;
+	corrupted[0] ^= 1;
+	CHECK(!Decompress(corrupted, output));
+	corrupted = frame;
+	corrupted[6] ^= 1;
+	CHECK(!Decompress(corrupted, output));
+	corrupted = frame;
+	corrupted.back() ^= 1;
+	CHECK(!Decompress(corrupted, output));
+	// Corrupted content: a changed literal in the first block
+	corrupted = frame;
+	corrupted[12] ^= 1;
+	CHECK(!Decompress(corrupted, output));
+
+	// Unsupported descriptors: version 0, and a dictionary ID
+	std::vector<char> header;
+	AppendFrameHeader(header, 0x24, 0x50);
+	CHECK(!Decompress(header, output));
+	header.clear();
+	AppendFrameHeader(header, 0x65, 0x50);
+	CHECK(!Decompress(header, output));
+
+	// A block size larger than the frame's maximum block size (64KB here), stored uncompressed
+	std::vector<char> oversized;
+	AppendFrameHeader(oversized, 0x60, 0x40);
+	AppendLE32(oversized, (64 * 1024 + 1) | 0x80000000);
+	oversized.resize(oversized.size() + 64 * 1024 + 1, 'x');
+	AppendLE32(oversized, 0);
+	CHECK(!Decompress(oversized, output));
+	// A block size past the end of the input
+	std::vector<char> pastEnd;
+	AppendFrameHeader(pastEnd, 0x60, 0x40);
+	AppendLE32(pastEnd, 100 | 0x80000000);
+	pastEnd.resize(pastEnd.size() + 50, 'x');
+	CHECK(!Decompress(pastEnd, output));
+
+	// Malformed compressed blocks, each in a frame whose content checksum would otherwise match
+	const uint32_t emptyChecksum = Xxh32_t::Hash("", 0);
+	// Match offset 0
+	CHECK(!Decompress(FrameWithBlock({ 0x10, 'a', 0, 0, 0x00 }, emptyChecksum), output));
+	// Match offset before the start of the output
+	CHECK(!Decompress(FrameWithBlock({ 0x10, 'a', 2, 0, 0x00 }, emptyChecksum), output));
+	// Literal length past the end of the block, with and without extra length bytes
+	CHECK(!Decompress(FrameWithBlock({ 0x50, 'a', 'b' }, emptyChecksum), output));
+	CHECK(!Decompress(FrameWithBlock({ char(0xF0), 10, 'a' }, emptyChecksum), output));
+	CHECK(!Decompress(FrameWithBlock({ char(0xF0), char(255) }, emptyChecksum), output));
+	// Match offset cut off, and match length cut off
+	CHECK(!Decompress(FrameWithBlock({ 0x10, 'a', 1 }, emptyChecksum), output));
+	CHECK(!Decompress(FrameWithBlock({ 0x1F, 'a', 1, 0 }, emptyChecksum), output));
+	// Match length past the end of the output (a 64KB block)
+	std::vector<char> longMatch = { 0x1F, 'a', 1, 0 };
+	longMatch.insert(longMatch.end(), 257, char(255));
+	longMatch.insert(longMatch.end(), { 0, 0x00 });
+	std::vector<char> longMatchFrame;
+	AppendFrameHeader(longMatchFrame, 0x60, 0x40);
+	AppendLE32(longMatchFrame, uint32_t(longMatch.size()));
+	longMatchFrame.insert(longMatchFrame.end(), longMatch.begin(), longMatch.end());
+	AppendLE32(longMatchFrame, 0);
+	CHECK(!Decompress(longMatchFrame, output));
+	// The same match, shortened to fit, is valid: an overlapping copy of one byte.
+	longMatch.resize(4);
+	longMatch.insert(longMatch.end(), { 10, 0x00 });
+	const std::string sRepeated(1 + 4 + 15 + 10, 'a');
+	CHECK(Decompress(FrameWithBlock(longMatch, Xxh32_t::Hash(sRepeated.data(), sRepeated.size())), output));
+	CHECK(std::string(output.begin(), output.end()) == sRepeated);
+}
+
+int main()
+{
+	TestXxh32();
+	TestBlockRoundTrip();
+	TestFrameRoundTrip();
+	TestConcatenatedAndSkippableFrames();
+	TestReferenceFrame();
+	TestLinkedBlocks();
+	TestRejectsMalformedFrames();
+	return CheckResults("Lz4FrameTest");
+}
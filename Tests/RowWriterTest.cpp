@@ -0,0 +1,159 @@
+// Tests UTF-16 to UTF-8 transcoding, JSON string escaping, and buffering in the row writer.
+// Build and run (from this directory):
+//   g++ -std=c++17 -I.. RowWriterTest.cpp ../RowWriter.cpp -o RowWriterTest && ./RowWriterTest
+// (The strings are written as UTF-16 code units, so the tests mean the same with a 32-bit wchar_t.)
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "TestCheck.h"
+#include "RowWriter.h"
+
+/// <summary>
+/// Collects written bytes in memory, and counts the writes; can be made to fail.
+/// </summary>
+class StringSink_t : public ByteSink_t
+{
+public:
+	bool Write(const char* pData, size_t cbData) override
+	{
+		++nWrites;
+		if (bFail)
+			return false;
+		data.append(pData, cbData);
+		return true;
+	}
+	std::string data;
+	size_t nWrites = 0;
+	bool bFail = false;
+};
+
+/// <summary>
+/// Transcodes with EncodeUtf8, checking that it stays within the documented bound.
+/// </summary>
+static std::string Utf8(std::wstring_view sText)
+{
+	std::vector<char> buffer(sText.size() * cbMaxUtf8PerUtf16 + 1, '#');
+	const size_t cbWritten = EncodeUtf8(sText, buffer.data());
+	CHECK(cbWritten <= sText.size() * cbMaxUtf8PerUtf16);
+	CHECK('#' == buffer[sText.size() * cbMaxUtf8PerUtf16]);
+	return std::string(buffer.data(), cbWritten);
+}
+
+/// <summary>
+/// Formats text with AppendJsonString.
+/// </summary>
+static std::string Json(std::wstring_view sText)
+{
+	StringSink_t sink;
+	{
+		RowWriter_t out(sink);
+		out.AppendJsonString(sText);
+	}
+	return sink.data;
+}
+
+static void TestEncodeUtf8()
+{
+	CHECK(Utf8(L"").empty());
+	CHECK(Utf8(L"abc\t") == "abc\t");
+	// One-, two-, and three-byte encodings, at the boundaries
+	CHECK(Utf8(std::wstring_view(L"\0", 1)) == std::string("\0", 1));
+	CHECK(Utf8(L"\x007F") == "\x7F");
+	CHECK(Utf8(L"\x0080") == "\xC2\x80");
+	CHECK(Utf8(L"\x00E9") == "\xC3\xA9");
+	CHECK(Utf8(L"\x07FF") == "\xDF\xBF");
+	CHECK(Utf8(L"\x0800") == "\xE0\xA0\x80");
+	CHECK(Utf8(L"\x20AC") == "\xE2\x82\xAC");
+	CHECK(Utf8(L"\xFFFF") == "\xEF\xBF\xBF");
+	// Surrogate pairs: U+10000, U+1F600, U+10FFFF
+	CHECK(Utf8(L"\xD800\xDC00") == "\xF0\x90\x80\x80");
+	CHECK(Utf8(L"\xD83D\xDE00") == "\xF0\x9F\x98\x80");
+	CHECK(Utf8(L"\xDBFF\xDFFF") == "\xF4\x8F\xBF\xBF");
+	CHECK(Utf8(L"a\xD83D\xDE00z") == "a\xF0\x9F\x98\x80z");
+	// Unpaired surrogates become U+FFFD: a high surrogate at the end or before a non-surrogate, a lone low
+	// surrogate, a pair in the wrong order, and two high surrogates (the second of which then pairs).
+	CHECK(Utf8(L"\xD83D") == "\xEF\xBF\xBD");
+	CHECK(Utf8(L"\xD83Dx") == "\xEF\xBF\xBDx");
+	CHECK(Utf8(L"\xDE00") == "\xEF\xBF\xBD");
+	CHECK(Utf8(L"\xDE00\xD83D") == "\xEF\xBF\xBD\xEF\xBF\xBD");
+	CHECK(Utf8(L"\xD83D\xD83D\xDE00") == "\xEF\xBF\xBD\xF0\x9F\x98\x80");
+}
+
+static void TestJsonString()
+{
+	CHECK(Json(L"") == "\"\"");
+	CHECK(Json(L"svchost.exe") == "\"svchost.exe\"");
+	CHECK(Json(L"say \"hi\"") == "\"say \\\"hi\\\"\"");
+	CHECK(Json(L"NT AUTHORITY\\SYSTEM") == "\"NT AUTHORITY\\\\SYSTEM\"");
+	CHECK(Json(L"\\\"") == "\"\\\\\\\"\"");
+	CHECK(Json(L"a\nb\rc\td\be\ff") == "\"a\\nb\\rc\\td\\be\\ff\"");
+	// Other control characters as \u00XX; DEL and the slash aren't escaped.
+	CHECK(Json(std::wstring_view(L"\0", 1)) == "\"\\u0000\"");
+	CHECK(Json(L"\x0001\x001F") == "\"\\u0001\\u001f\"");
+	CHECK(Json(L"\x007F/") == "\"\x7F/\"");
+	// Non-ASCII text is written as UTF-8, including surrogate pairs next to escapes; unpaired surrogates become U+FFFD.
+	CHECK(Json(L"caf\x00E9") == "\"caf\xC3\xA9\"");
+	CHECK(Json(L"\"\xD83D\xDE00\"") == "\"\\\"\xF0\x9F\x98\x80\\\"\"");
+	CHECK(Json(L"\xD83D\n") == "\"\xEF\xBF\xBD\\n\"");
+	CHECK(Json(L"\xDE00") == "\"\xEF\xBF\xBD\"");
+}
+
+static void TestFormatting()
+{
+	StringSink_t sink;
+	RowWriter_t out(sink);
+	out << L"PID" << L'\t' << uint32_t(4294967295u) << L'\t' << int64_t(-9223372036854775807LL - 1) << L'\t' << std::string_view("x");
+	out.EndLine();
+	out.AppendFixed(1.5, 3);
+	out << L'\t';
+	out.AppendFixed(0.0004, 3);
+	out.SetLineEnding("\n");
+	out.EndLine();
+	// Nothing is written until Flush.
+	CHECK(0 == sink.nWrites);
+	CHECK(out.BufferedBytes() > 0);
+	CHECK(out.Flush());
+	CHECK(sink.data == "PID\t4294967295\t-9223372036854775808\tx\r\n1.500\t0.000\n");
+	CHECK(0 == out.BufferedBytes());
+}
+
+static void TestBuffering()
+{
+	// Output past the size limit is written at the end of a line, in one block.
+	StringSink_t sink;
+	RowWriter_t out(sink, 16);
+	out << L"0123456789";
+	out.EndLine();
+	CHECK(0 == sink.nWrites);
+	out << L"0123456789";
+	CHECK(0 == sink.nWrites);
+	out.EndLine();
+	CHECK(1 == sink.nWrites && sink.data == "0123456789\r\n0123456789\r\n");
+
+	// Text much larger than the initial buffer
+	const std::wstring sLarge(200000, L'\x20AC');
+	out << sLarge;
+	CHECK(out.Flush());
+	CHECK(sink.data.size() == 24 + 3 * sLarge.size());
+
+	// A failed write is reported by Flush, and by every Flush after it.
+	StringSink_t failingSink;
+	failingSink.bFail = true;
+	RowWriter_t failing(failingSink);
+	failing << L"x";
+	CHECK(!failing.Flush());
+	failingSink.bFail = false;
+	failing << L"y";
+	CHECK(!failing.Flush());
+	CHECK(failingSink.data == "y");
+}
+
+int main()
+{
+	TestEncodeUtf8();
+	TestJsonString();
+	TestFormatting();
+	TestBuffering();
+	return CheckResults("RowWriterTest");
+}
@@ -0,0 +1,193 @@
+// Tests ServiceLookupCache_t's refresh logic against a stand-in for the Service Control Manager.
+// Build and run (from this directory):
+//   g++ -std=c++17 -I.. ServiceLookupCacheTest.cpp ../ServiceLookupCache.cpp -o ServiceLookupCacheTest && ./ServiceLookupCacheTest
+
+#include <string>
+#include <vector>
+#include "TestCheck.h"
+#include "ServiceLookupCache.h"
+
+/// <summary>
+/// Stand-in SCM: a list of services that the test starts, stops, and deletes, and a clock the test sets.
+/// </summary>
+class FakeServiceSource_t : public ServiceSource_t
+{
+public:
+	struct Service_t
+	{
+		std::wstring sServiceName, sDisplayName;
+		// 0 if the service is stopped
+		uint64_t pid;
+	};
+	std::vector<Service_t> services;
+	uint64_t now = 0;
+	// Counts of calls, and whether to fail them
+	size_t nEnumerations = 0, nQueries = 0;
+	bool bFailEnumerations = false, bFailQueries = false;
+
+	bool EnumerateServices(std::vector<ServiceRecord_t>& records) override
+	{
+		++nEnumerations;
+		records.clear();
+		if (bFailEnumerations)
+			return false;
+		for (std::vector<Service_t>::const_iterator iterSvc = services.begin(); iterSvc != services.end(); ++iterSvc)
+		{
+			if (0 != iterSvc->pid)
+				records.push_back(Record(*iterSvc));
+		}
+		return true;
+	}
+
+	bool QueryService(const wchar_t* szServiceName, ServiceRecord_t& record, bool& bActive) override
+	{
+		++nQueries;
+		bActive = false;
+		if (bFailQueries)
+			return false;
+		for (std::vector<Service_t>::const_iterator iterSvc = services.begin(); iterSvc != services.end(); ++iterSvc)
+		{
+			// (The cache passes names lowercased; the test's names are all lowercase.)
+			if (iterSvc->sServiceName == szServiceName)
+			{
+				bActive = (0 != iterSvc->pid);
+				record = Record(*iterSvc);
+				return true;
+			}
+		}
+		// Deleted
+		return true;
+	}
+
+	uint64_t TickCountMs() override { return now; }
+
+	Service_t* Find(const wchar_t* szServiceName)
+	{
+		for (std::vector<Service_t>::iterator iterSvc = services.begin(); iterSvc != services.end(); ++iterSvc)
+		{
+			if (iterSvc->sServiceName == szServiceName)
+				return &*iterSvc;
+		}
+		return nullptr;
+	}
+
+private:
+	static ServiceRecord_t Record(const Service_t& svc)
+	{
+		ServiceRecord_t record;
+		record.pid = svc.pid;
+		record.szServiceName = svc.sServiceName.c_str();
+		record.szDisplayName = svc.sDisplayName.c_str();
+		record.dwServiceType = 0x20;
+		return record;
+	}
+};
+
+/// <summary>
+/// Returns the services' names as joined by the cache's label, or "(none)" if the PID isn't a service process.
+/// </summary>
+static std::wstring Lookup(ServiceLookupCache_t& cache, uint64_t pid)
+{
+	ServiceList_t serviceList;
+	if (!cache.Lookup(pid, serviceList))
+		return L"(none)";
+	return std::wstring(serviceList.labels.sNames);
+}
+
+int main()
+{
+	const uint64_t msMinRefreshInterval = 1000, msNegativeTTL = 60000;
+	FakeServiceSource_t source;
+	source.services.push_back({ L"alpha", L"Alpha Service", 100 });
+	source.services.push_back({ L"beta", L"Beta Service", 100 });
+	source.services.push_back({ L"gamma", L"Gamma Service", 200 });
+	source.services.push_back({ L"delta", L"Delta Service", 0 });
+	source.now = 10000;
+	ServiceLookupCache_t cache(source, msMinRefreshInterval, msNegativeTTL);
+
+	// First use loads the table with one enumeration.
+	CHECK(Lookup(cache, 100) == L"alpha beta ");
+	CHECK(Lookup(cache, 200) == L"gamma ");
+	CHECK(1 == source.nEnumerations);
+
+	// A list keeps its table, and so its names, across refreshes.
+	ServiceList_t heldList;
+	CHECK(cache.Lookup(200, heldList));
+
+	// Service restarted in a new process: only that service is queried again.
+	source.Find(L"gamma")->pid = 300;
+	cache.InvalidateService(L"Gamma");
+	CHECK(Lookup(cache, 300) == L"gamma ");
+	CHECK(1 == source.nEnumerations);
+	CHECK(1 == source.nQueries);
+	// The old PID is unknown now, but within the minimum refresh interval it doesn't cause an enumeration.
+	CHECK(Lookup(cache, 200) == L"(none)");
+	CHECK(1 == source.nEnumerations);
+	CHECK(1 == heldList.size() && heldList.begin()->sServiceName == L"gamma");
+
+	// Service stopped: it's removed from its process, and the process' other services remain.
+	source.Find(L"beta")->pid = 0;
+	cache.InvalidateService(L"beta");
+	CHECK(Lookup(cache, 100) == L"alpha ");
+	CHECK(2 == source.nQueries);
+
+	// Several changes are handled in one incremental refresh, and repeated invalidations are queried once.
+	source.Find(L"delta")->pid = 100;
+	cache.InvalidateService(L"delta");
+	cache.InvalidateService(L"delta");
+	source.services.push_back({ L"epsilon", L"Epsilon Service", 400 });
+	cache.InvalidateService(L"epsilon");
+	CHECK(Lookup(cache, 100) == L"alpha delta ");
+	CHECK(Lookup(cache, 400) == L"epsilon ");
+	CHECK(4 == source.nQueries);
+	CHECK(1 == source.nEnumerations);
+
+	// Deleted service
+	source.services.pop_back();
+	cache.InvalidateService(L"epsilon");
+	CHECK(Lookup(cache, 400) == L"(none)");
+	CHECK(5 == source.nQueries);
+
+	// An unknown PID causes an enumeration once the minimum interval has passed, then gets a negative entry.
+	source.now += msMinRefreshInterval;
+	CHECK(Lookup(cache, 500) == L"(none)");
+	CHECK(2 == source.nEnumerations);
+	source.now += msMinRefreshInterval;
+	CHECK(Lookup(cache, 500) == L"(none)");
+	CHECK(2 == source.nEnumerations);
+	CHECK(1 == cache.GetStats().nNegativeHits);
+
+	// A service starting in a process with a negative entry clears the entry.
+	source.services.push_back({ L"zeta", L"Zeta Service", 500 });
+	cache.InvalidateService(L"zeta");
+	CHECK(Lookup(cache, 500) == L"zeta ");
+	CHECK(2 == source.nEnumerations);
+
+	// A failed query falls back to a full enumeration.
+	source.Find(L"alpha")->pid = 600;
+	source.bFailQueries = true;
+	cache.InvalidateService(L"alpha");
+	CHECK(Lookup(cache, 600) == L"alpha ");
+	CHECK(3 == source.nEnumerations);
+	source.bFailQueries = false;
+
+	// Invalidating the whole cache causes a full enumeration; if it fails, the previous table is kept.
+	source.bFailEnumerations = true;
+	cache.Invalidate();
+	CHECK(Lookup(cache, 600) == L"alpha ");
+	CHECK(4 == source.nEnumerations);
+	source.bFailEnumerations = false;
+	source.Find(L"zeta")->pid = 700;
+	cache.Invalidate();
+	CHECK(Lookup(cache, 700) == L"zeta ");
+	CHECK(5 == source.nEnumerations);
+
+	ServiceLookupCacheStats_t stats = cache.GetStats();
+	CHECK(5 == stats.nRefreshes);
+	CHECK(1 == stats.nUnknownPidRefreshes);
+	CHECK(2 == stats.nFailedRefreshes);
+	CHECK(8 == stats.nServiceInvalidations);
+	CHECK(2 == stats.nInvalidations);
+
+	return CheckResults("ServiceLookupCacheTest");
+}
@@ -0,0 +1,128 @@
+// Tests the SID binary/string codec, and optionally times it.
+// Build and run (from this directory):
+//   g++ -std=c++17 -O2 -I.. SidCodecTest.cpp ../SidCodec.cpp -o SidCodecTest && ./SidCodecTest
+// Run with "bench" as the argument to also report the time per conversion.
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "TestCheck.h"
+#include "SidCodec.h"
+
+/// <summary>
+/// Builds a binary SID: revision 1, a 48-bit identifier authority, and subauthorities in native byte order.
+/// </summary>
+static std::vector<uint8_t> MakeSid(uint64_t authority, const std::vector<uint32_t>& subAuthorities)
+{
+	std::vector<uint8_t> sid(8 + subAuthorities.size() * 4);
+	sid[0] = 1;
+	sid[1] = uint8_t(subAuthorities.size());
+	for (size_t ix = 0; ix < 6; ++ix)
+		sid[2 + ix] = uint8_t(authority >> (8 * (5 - ix)));
+	if (!subAuthorities.empty())
+		memcpy(sid.data() + 8, subAuthorities.data(), subAuthorities.size() * 4);
+	return sid;
+}
+
+/// <summary>
+/// Formats a binary SID; returns an empty string if FormatSidString fails.
+/// </summary>
+static std::wstring Format(const std::vector<uint8_t>& sid)
+{
+	wchar_t szBuf[cchMaxSidString];
+	size_t cch = FormatSidString(sid.data(), sid.size(), szBuf, cchMaxSidString);
+	CHECK(cch < cchMaxSidString);
+	return std::wstring(szBuf, cch);
+}
+
+/// <summary>
+/// Parses a SID string; returns an empty vector if ParseSidString fails.
+/// </summary>
+static std::vector<uint8_t> Parse(const wchar_t* szSid)
+{
+	uint8_t buf[cbMaxBinarySid];
+	size_t cb = ParseSidString(szSid, buf, sizeof(buf));
+	return std::vector<uint8_t>(buf, buf + cb);
+}
+
+int main(int argc, char** argv)
+{
+	// Well-known and typical SIDs, formatted as ConvertSidToStringSidW formats them, and parsed back.
+	const std::vector<uint8_t> sidSystem = MakeSid(5, { 18 });
+	CHECK(Format(sidSystem) == L"S-1-5-18");
+	CHECK(Parse(L"S-1-5-18") == sidSystem);
+
+	const std::vector<uint8_t> sidAdmins = MakeSid(5, { 32, 544 });
+	CHECK(Format(sidAdmins) == L"S-1-5-32-544");
+	CHECK(Parse(L"S-1-5-32-544") == sidAdmins);
+
+	const std::vector<uint8_t> sidUser = MakeSid(5, { 21, 3623811015, 3361044348, 30300820, 1013 });
+	CHECK(Format(sidUser) == L"S-1-5-21-3623811015-3361044348-30300820-1013");
+	CHECK(Parse(L"S-1-5-21-3623811015-3361044348-30300820-1013") == sidUser);
+
+	// No subauthorities; the null authority
+	CHECK(Format(MakeSid(0, {})) == L"S-1-0");
+	CHECK(Parse(L"S-1-0") == MakeSid(0, {}));
+
+	// Authorities that don't fit in 32 bits are formatted in hex; either form parses.
+	const std::vector<uint8_t> sidBigAuthority = MakeSid(0x123456789ABCULL, { 1 });
+	CHECK(Format(sidBigAuthority) == L"S-1-0x123456789ABC-1");
+	CHECK(Parse(L"S-1-0x123456789ABC-1") == sidBigAuthority);
+	CHECK(Parse(L"s-1-0x123456789abc-1") == sidBigAuthority);
+	CHECK(Format(MakeSid(0xFFFFFFFFULL, { 0 })) == L"S-1-4294967295-0");
+
+	// Largest values and the largest SID
+	std::vector<uint32_t> maxSubAuthorities(15, 0xFFFFFFFF);
+	const std::vector<uint8_t> sidMax = MakeSid(0xFFFFFFFFFFFFULL, maxSubAuthorities);
+	const std::wstring sMax = Format(sidMax);
+	CHECK(!sMax.empty() && sMax.length() < cchMaxSidString);
+	CHECK(Parse(sMax.c_str()) == sidMax);
+	CHECK(sidMax.size() == cbMaxBinarySid);
+
+	// Invalid binary SIDs and buffers
+	wchar_t szSmall[8];
+	CHECK(0 == FormatSidString(sidUser.data(), sidUser.size(), szSmall, sizeof(szSmall) / sizeof(szSmall[0])));
+	CHECK(0 == FormatSidString(sidUser.data(), sidUser.size() - 1, szSmall, sizeof(szSmall) / sizeof(szSmall[0])));
+	std::vector<uint8_t> sidBadRevision = sidSystem;
+	sidBadRevision[0] = 2;
+	CHECK(Format(sidBadRevision).empty());
+	CHECK(0 == FormatSidString(nullptr, 0, szSmall, 8));
+
+	// Invalid strings
+	const wchar_t* rgszInvalid[] = {
+		L"", L"S", L"S-", L"S-1", L"S-1-", L"S-1-5-", L"S-1-5--18", L"S-2-5-18", L"X-1-5-18", L"S-1-5-18-",
+		L"S-1-5-18x", L"S-1-5-4294967296", L"S-1-0x1000000000000", L"S-1-0x", L"BA",
+		L"S-1-5-1-2-3-4-5-6-7-8-9-10-11-12-13-14-15-16"
+	};
+	for (size_t ix = 0; ix < sizeof(rgszInvalid) / sizeof(rgszInvalid[0]); ++ix)
+	{
+		CHECK(Parse(rgszInvalid[ix]).empty());
+	}
+	// Output buffer too small
+	uint8_t bufSmall[8];
+	CHECK(0 == ParseSidString(L"S-1-5-18", bufSmall, sizeof(bufSmall)));
+	CHECK(8 == ParseSidString(L"S-1-5", bufSmall, sizeof(bufSmall)));
+
+	// Optional timing
+	if (argc > 1 && 0 == strcmp(argv[1], "bench"))
+	{
+		const int nIterations = 1000000;
+		wchar_t szBuf[cchMaxSidString];
+		uint8_t sidBuf[cbMaxBinarySid];
+		size_t nTotal = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int ix = 0; ix < nIterations; ++ix)
+			nTotal += FormatSidString(sidUser.data(), sidUser.size(), szBuf, cchMaxSidString);
+		std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+		for (int ix = 0; ix < nIterations; ++ix)
+			nTotal += ParseSidString(szBuf, sidBuf, sizeof(sidBuf));
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		std::cout
+			<< "FormatSidString: " << std::chrono::duration<double, std::nano>(middle - start).count() / nIterations << " ns; "
+			<< "ParseSidString: " << std::chrono::duration<double, std::nano>(end - middle).count() / nIterations << " ns"
+			<< " (" << nTotal << ")" << std::endl;
+	}
+
+	return CheckResults("SidCodecTest");
+}
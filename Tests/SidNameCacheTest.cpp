@@ -0,0 +1,152 @@
+// Tests SidNameCache_t's positive and negative entries, TTLs, and counters with a stand-in resolver.
+// Build and run (from this directory):
+//   g++ -std=c++17 -pthread -I.. SidNameCacheTest.cpp ../SidNameCache.cpp -o SidNameCacheTest && ./SidNameCacheTest
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "TestCheck.h"
+#include "SidNameCache.h"
+
+// Stand-in clock, set by the test
+static std::atomic<uint64_t> st_now(1000);
+static uint64_t FakeTickCount()
+{
+	return st_now;
+}
+
+// Number of times the stand-in resolver has been called
+static std::atomic<int> st_nResolverCalls(0);
+
+/// <summary>
+/// Stand-in resolver: "SIDs" are byte strings; those starting with 'U' resolve to DOMAIN\<bytes>,
+/// and all others fail (like deleted accounts).
+/// </summary>
+static bool FakeResolver(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName)
+{
+	++st_nResolverCalls;
+	const char* pBytes = (const char*)pSid;
+	if (0 == cbSid || 'U' != pBytes[0])
+		return false;
+	sDomainName = L"DOMAIN";
+	sUserName.assign(pBytes, pBytes + cbSid);
+	return true;
+}
+
+/// <summary>
+/// Stand-in resolver that resolves everything as OTHER\<bytes>, to verify that SetResolver takes effect.
+/// </summary>
+static bool OtherResolver(const void* pSid, size_t cbSid, std::wstring& sDomainName, std::wstring& sUserName)
+{
+	++st_nResolverCalls;
+	const char* pBytes = (const char*)pSid;
+	sDomainName = L"OTHER";
+	sUserName.assign(pBytes, pBytes + cbSid);
+	return true;
+}
+
+int main()
+{
+	const uint64_t msPositiveTTL = 10000, msNegativeTTL = 1000;
+	SidNameCache_t cache(FakeResolver, FakeTickCount, msPositiveTTL, msNegativeTTL);
+	const std::string sUser1 = "User1", sUser2 = "User2", sDeleted = "Deleted";
+	std::wstring sDomain, sUser;
+
+	// A miss calls the resolver; the next lookup is a hit.
+	CHECK(cache.Lookup(sUser1.data(), sUser1.size(), sDomain, sUser));
+	CHECK(sDomain == L"DOMAIN" && sUser == L"User1");
+	CHECK(cache.Lookup(sUser1.data(), sUser1.size(), sDomain, sUser));
+	CHECK(sDomain == L"DOMAIN" && sUser == L"User1");
+	CHECK(1 == st_nResolverCalls);
+
+	// A failure is cached as a negative entry, with empty names.
+	CHECK(!cache.Lookup(sDeleted.data(), sDeleted.size(), sDomain, sUser));
+	CHECK(sDomain.empty() && sUser.empty());
+	CHECK(!cache.Lookup(sDeleted.data(), sDeleted.size(), sDomain, sUser));
+	CHECK(2 == st_nResolverCalls);
+
+	// The negative entry expires first, and is retried; the positive entry is still a hit.
+	st_now += msNegativeTTL;
+	CHECK(!cache.Lookup(sDeleted.data(), sDeleted.size(), sDomain, sUser));
+	CHECK(3 == st_nResolverCalls);
+	CHECK(cache.Lookup(sUser1.data(), sUser1.size(), sDomain, sUser));
+	CHECK(3 == st_nResolverCalls);
+
+	// The positive entry expires after its TTL.
+	st_now += msPositiveTTL;
+	CHECK(cache.Lookup(sUser1.data(), sUser1.size(), sDomain, sUser));
+	CHECK(4 == st_nResolverCalls);
+
+	// Empty and null SIDs aren't looked up.
+	CHECK(!cache.Lookup(nullptr, 0, sDomain, sUser));
+	CHECK(!cache.Lookup(sUser1.data(), 0, sDomain, sUser));
+	CHECK(4 == st_nResolverCalls);
+
+	// Peek doesn't call the resolver.
+	bool bResolved = true;
+	CHECK(!cache.Peek(sUser2.data(), sUser2.size(), sDomain, sUser, bResolved));
+	CHECK(cache.Peek(sUser1.data(), sUser1.size(), sDomain, sUser, bResolved));
+	CHECK(bResolved && sUser == L"User1");
+	CHECK(4 == st_nResolverCalls);
+
+	// Inserted entries (e.g., from a bulk lookup) are used without calling the resolver; a negative insert drops the names.
+	cache.Insert(sUser2.data(), sUser2.size(), true, L"BULK", L"User2");
+	CHECK(cache.Lookup(sUser2.data(), sUser2.size(), sDomain, sUser));
+	CHECK(sDomain == L"BULK" && sUser == L"User2");
+	cache.Insert(sUser2.data(), sUser2.size(), false, L"BULK", L"User2");
+	CHECK(!cache.Lookup(sUser2.data(), sUser2.size(), sDomain, sUser));
+	CHECK(sDomain.empty() && sUser.empty());
+	CHECK(4 == st_nResolverCalls);
+
+	// SIDs are keyed by all of their bytes, including embedded zeros.
+	const char rgSidA[] = { 'U', 0, 'A' }, rgSidB[] = { 'U', 0, 'B' };
+	CHECK(cache.Lookup(rgSidA, sizeof(rgSidA), sDomain, sUser));
+	CHECK(cache.Lookup(rgSidB, sizeof(rgSidB), sDomain, sUser));
+	CHECK(6 == st_nResolverCalls);
+
+	// A replacement resolver is used for subsequent misses.
+	cache.SetResolver(OtherResolver);
+	const std::string sOther = "Other";
+	CHECK(cache.Lookup(sOther.data(), sOther.size(), sDomain, sUser));
+	CHECK(sDomain == L"OTHER");
+	CHECK(7 == st_nResolverCalls);
+	cache.SetResolver(FakeResolver);
+
+	SidNameCacheStats_t stats = cache.GetStats();
+	CHECK(7 == stats.nMisses);
+	CHECK(3 == stats.nHits);
+	CHECK(2 == stats.nNegativeHits);
+	CHECK(2 == stats.nInserted);
+
+	// Concurrent lookups of a shared set of SIDs from several threads all get the right names.
+	std::vector<std::string> sids;
+	for (int ix = 0; ix < 64; ++ix)
+		sids.push_back("U" + std::to_string(ix));
+	std::atomic<int> nWrongResults(0);
+	std::vector<std::thread> threads;
+	for (int ixThread = 0; ixThread < 8; ++ixThread)
+	{
+		threads.push_back(std::thread([&cache, &sids, &nWrongResults]() {
+			std::wstring sThreadDomain, sThreadUser;
+			for (int nPass = 0; nPass < 100; ++nPass)
+			{
+				for (std::vector<std::string>::const_iterator iterSid = sids.begin(); iterSid != sids.end(); ++iterSid)
+				{
+					if (!cache.Lookup(iterSid->data(), iterSid->size(), sThreadDomain, sThreadUser) ||
+						sThreadUser != std::wstring(iterSid->begin(), iterSid->end()))
+						++nWrongResults;
+				}
+			}
+			}));
+	}
+	for (std::vector<std::thread>::iterator iterThread = threads.begin(); iterThread != threads.end(); ++iterThread)
+		iterThread->join();
+	CHECK(0 == nWrongResults);
+	stats = cache.GetStats();
+	// Each SID is resolved at least once, and everything else is a hit.
+	CHECK(stats.nMisses >= 7 + sids.size());
+	CHECK(stats.nHits + stats.nMisses == 3 + 7 + 8 * 100 * sids.size());
+
+	return CheckResults("SidNameCacheTest");
+}
@@ -0,0 +1,322 @@
+// Tests the columnar snapshot file writer and reader, including the reader's rejection of malformed files.
+// Build and run (from this directory):
+//   g++ -std=c++17 -I.. SnapshotColumnsTest.cpp ../SnapshotColumns.cpp ../RowWriter.cpp -o SnapshotColumnsTest && ./SnapshotColumnsTest
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include "TestCheck.h"
+#include "SnapshotColumns.h"
+
+/// <summary>
+/// Collects written bytes in memory.
+/// </summary>
+class VectorSink_t : public ByteSink_t
+{
+public:
+	bool Write(const char* pData, size_t cbData) override
+	{
+		data.insert(data.end(), pData, pData + cbData);
+		return true;
+	}
+	std::vector<char> data;
+};
+
+/// <summary>
+/// A copy of file data in 8-byte aligned memory, as the reader requires.
+/// </summary>
+struct AlignedFile_t
+{
+	explicit AlignedFile_t(const std::vector<char>& data)
+		: storage((data.size() + 7) / 8 + 1), cbData(data.size())
+	{
+		if (!data.empty())
+			memcpy(storage.data(), data.data(), data.size());
+	}
+	char* Data() { return (char*)storage.data(); }
+	SnapshotFileTrailer_t& Trailer() { return *(SnapshotFileTrailer_t*)(Data() + cbData - sizeof(SnapshotFileTrailer_t)); }
+	SnapshotColumnEntry_t* Entries() { return (SnapshotColumnEntry_t*)(Data() + Trailer().indexOffset); }
+	// Returns the index entry for a block; nullptr if there isn't one.
+	SnapshotColumnEntry_t* Entry(SnapshotColumn_t column)
+	{
+		for (uint32_t ixEntry = 0; ixEntry < Trailer().columnCount; ++ixEntry)
+		{
+			if (uint32_t(column) == Entries()[ixEntry].columnId)
+				return &Entries()[ixEntry];
+		}
+		return nullptr;
+	}
+	bool Open(SnapshotColumnReader_t& reader)
+	{
+		std::wstring sErrorInfo;
+		const bool bOpened = reader.Open(Data(), cbData, sErrorInfo);
+		// A failure is always explained.
+		CHECK(bOpened == sErrorInfo.empty());
+		return bOpened;
+	}
+
+	std::vector<uint64_t> storage;
+	size_t cbData;
+};
+
+/// <summary>
+/// Writes a snapshot with three rows: two that share strings, and one that couldn't be opened.
+/// </summary>
+static std::vector<char> WriteSampleSnapshot()
+{
+	SnapshotColumnWriter_t writer;
+	SnapshotFileHeader_t& header = writer.Header();
+	header.timestamp = 0x01DA0000AABBCCDDULL;
+	header.sessionId = 3;
+	header.skippedCount = 1;
+	header.totals[0] = 100;
+	header.global[3] = 400;
+
+	SnapshotColumnRow_t row;
+	row.session = 3;
+	row.pid = 1200;
+	row.ppid = 4;
+	row.flags = SnapshotRowOpened;
+	row.userObjects = 10;
+	row.userObjectsPeak = 11;
+	row.gdiObjects = 20;
+	row.gdiObjectsPeak = 21;
+	row.readTimeUs = 1500;
+	// U+00E9, and U+1F600 as a surrogate pair
+	row.processName = L"caf\x00E9.exe";
+	row.services = L"\xD83D\xDE00";
+	row.userSid = L"S-1-5-18";
+	row.userName = L"NT AUTHORITY\\SYSTEM";
+	writer.AddRow(row);
+
+	row.pid = 1300;
+	row.processName = L"svchost.exe";
+	row.userObjects = 12;
+	writer.AddRow(row);
+
+	SnapshotColumnRow_t unopened;
+	unopened.session = 3;
+	unopened.pid = 1400;
+	unopened.openError = 5;
+	unopened.processName = L"protected.exe";
+	writer.AddRow(unopened);
+
+	VectorSink_t sink;
+	CHECK(writer.Write(sink));
+	return sink.data;
+}
+
+static void TestRoundTrip()
+{
+	AlignedFile_t file(WriteSampleSnapshot());
+	CHECK(0 == file.cbData % 8);
+	SnapshotColumnReader_t reader;
+	if (!file.Open(reader))
+	{
+		CHECK(!"sample snapshot can't be opened");
+		return;
+	}
+
+	CHECK(3 == reader.RowCount());
+	CHECK(0x01DA0000AABBCCDDULL == reader.Header().timestamp);
+	CHECK(3 == reader.Header().sessionId);
+	CHECK(1 == reader.Header().skippedCount);
+	CHECK(100 == reader.Header().totals[0]);
+	CHECK(400 == reader.Header().global[3]);
+	CHECK(SnapshotFileVersion == reader.Header().version);
+
+	const uint32_t* pPid = reader.Column(SnapshotColumn_t::Pid);
+	const uint32_t* pFlags = reader.Column(SnapshotColumn_t::Flags);
+	const uint32_t* pOpenError = reader.Column(SnapshotColumn_t::OpenError);
+	const uint32_t* pUserObjects = reader.Column(SnapshotColumn_t::UserObjects);
+	const uint32_t* pReadTimeUs = reader.Column(SnapshotColumn_t::ReadTimeUs);
+	CHECK(pPid && pFlags && pOpenError && pUserObjects && pReadTimeUs);
+	if (pPid && pFlags && pOpenError && pUserObjects && pReadTimeUs)
+	{
+		CHECK(1200 == pPid[0] && 1300 == pPid[1] && 1400 == pPid[2]);
+		CHECK(SnapshotRowOpened == pFlags[0] && 0 == pFlags[2]);
+		CHECK(0 == pOpenError[0] && 5 == pOpenError[2]);
+		CHECK(10 == pUserObjects[0] && 12 == pUserObjects[1]);
+		CHECK(1500 == pReadTimeUs[1]);
+	}
+	CHECK(nullptr == reader.Column(SnapshotColumn_t::StringOffsets));
+	CHECK(nullptr == reader.Column(SnapshotColumn_t(0)));
+
+	// Strings come back as UTF-8.
+	CHECK(reader.RowString(SnapshotColumn_t::ProcessName, 0) == "caf\xC3\xA9.exe");
+	CHECK(reader.RowString(SnapshotColumn_t::Services, 0) == "\xF0\x9F\x98\x80");
+	CHECK(reader.RowString(SnapshotColumn_t::UserName, 1) == "NT AUTHORITY\\SYSTEM");
+	CHECK(reader.RowString(SnapshotColumn_t::ProcessName, 2) == "protected.exe");
+	CHECK(reader.RowString(SnapshotColumn_t::UserSid, 2).empty());
+	CHECK(reader.RowString(SnapshotColumn_t::ProcessName, 3).empty());
+
+	// Each distinct string is stored once: caf\xE9.exe, the services, the SID, the user name, svchost.exe,
+	// protected.exe, and the empty string.
+	const uint32_t* pUserName = reader.Column(SnapshotColumn_t::UserName);
+	const uint32_t* pServices = reader.Column(SnapshotColumn_t::Services);
+	const uint32_t* pUserSid = reader.Column(SnapshotColumn_t::UserSid);
+	if (pUserName && pServices && pUserSid)
+	{
+		CHECK(pUserName[0] == pUserName[1]);
+		CHECK(pServices[0] == pServices[1]);
+		CHECK(pUserSid[2] == pUserName[2] && pServices[2] == pUserSid[2]);
+	}
+	const SnapshotColumnEntry_t* pOffsetsEntry = file.Entry(SnapshotColumn_t::StringOffsets);
+	CHECK(nullptr != pOffsetsEntry && 7 + 1 == pOffsetsEntry->count);
+	CHECK(reader.String(4) == "svchost.exe");
+	CHECK(reader.String(6).empty());
+	CHECK(reader.String(7).empty());
+	CHECK(reader.String(0xFFFFFFFF).empty());
+}
+
+static void TestEmptySnapshot()
+{
+	SnapshotColumnWriter_t writer;
+	VectorSink_t sink;
+	CHECK(writer.Write(sink));
+	AlignedFile_t file(sink.data);
+	SnapshotColumnReader_t reader;
+	CHECK(file.Open(reader));
+	CHECK(0 == reader.RowCount());
+}
+
+static void TestRejectsMalformedFiles()
+{
+	const std::vector<char> sample = WriteSampleSnapshot();
+	SnapshotColumnReader_t reader;
+	std::wstring sErrorInfo;
+
+	// Misaligned
+	{
+		AlignedFile_t file(sample);
+		std::vector<uint64_t> shifted(file.storage.size() + 1);
+		memcpy((char*)shifted.data() + 4, file.Data(), file.cbData);
+		CHECK(!reader.Open((char*)shifted.data() + 4, file.cbData, sErrorInfo));
+	}
+
+	// Truncated: too short for a header and trailer, not a multiple of 8 bytes, or missing the trailer
+	{
+		AlignedFile_t file(sample);
+		std::wstring sError;
+		CHECK(!reader.Open(file.Data(), 0, sError));
+		CHECK(!reader.Open(file.Data(), sizeof(SnapshotFileHeader_t), sError));
+		CHECK(!reader.Open(file.Data(), file.cbData - 1, sError));
+		CHECK(!reader.Open(file.Data(), file.cbData - 8, sError));
+		CHECK(!reader.Open(file.Data(), file.cbData - sizeof(SnapshotFileTrailer_t), sError));
+	}
+
+	// Two snapshots written one after another
+	{
+		std::vector<char> concatenated(sample);
+		concatenated.insert(concatenated.end(), sample.begin(), sample.end());
+		AlignedFile_t file(concatenated);
+		CHECK(!file.Open(reader));
+	}
+
+	// Wrong magic or version
+	{
+		AlignedFile_t file(sample);
+		file.Data()[0] = 'X';
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Trailer().magic[0] = 'X';
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		((SnapshotFileHeader_t*)file.Data())->version = SnapshotFileVersion + 1;
+		CHECK(!file.Open(reader));
+	}
+
+	// Index out of bounds or misplaced
+	{
+		AlignedFile_t file(sample);
+		file.Trailer().indexOffset = 0xFFFFFFFFFFFFFFF8ULL;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Trailer().indexOffset += 4;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Trailer().columnCount = 0x7FFFFFFF;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Trailer().columnCount -= 1;
+		CHECK(!file.Open(reader));
+	}
+
+	// Blocks out of bounds, overlapping the header or index, misaligned, or the wrong size
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::Pid)->offset = file.Trailer().indexOffset + 8;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::Pid)->offset = 0;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::Pid)->offset += 4;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::StringBytes)->count = 0xFFFFFFFFFFFFFFFFULL;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::Session)->elementSize = 0;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::Session)->count = 2;
+		CHECK(!file.Open(reader));
+	}
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::StringOffsets)->count = 0;
+		CHECK(!file.Open(reader));
+	}
+
+	// Blocks with unknown IDs are ignored.
+	{
+		AlignedFile_t file(sample);
+		file.Entry(SnapshotColumn_t::ReadTimeUs)->columnId = 999;
+		CHECK(file.Open(reader));
+		CHECK(nullptr == reader.Column(SnapshotColumn_t::ReadTimeUs));
+	}
+
+	// String indexes and offsets out of bounds read as empty strings.
+	{
+		AlignedFile_t file(sample);
+		const SnapshotColumnEntry_t* pNameEntry = file.Entry(SnapshotColumn_t::ProcessName);
+		const SnapshotColumnEntry_t* pOffsetsEntry = file.Entry(SnapshotColumn_t::StringOffsets);
+		((uint32_t*)(file.Data() + pNameEntry->offset))[0] = 1000;
+		// The end of string 1 (the services) is past the end of the string bytes; string 2 then starts after it ends.
+		((uint32_t*)(file.Data() + pOffsetsEntry->offset))[2] = 0x7FFFFFFF;
+		CHECK(file.Open(reader));
+		CHECK(reader.RowString(SnapshotColumn_t::ProcessName, 0).empty());
+		CHECK(reader.RowString(SnapshotColumn_t::Services, 0).empty());
+		CHECK(reader.RowString(SnapshotColumn_t::UserSid, 0).empty());
+		CHECK(reader.RowString(SnapshotColumn_t::ProcessName, 1) == "svchost.exe");
+	}
+}
+
+int main()
+{
+	TestRoundTrip();
+	TestEmptySnapshot();
+	TestRejectsMalformedFiles();
+	return CheckResults("SnapshotColumnsTest");
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Minimal checks for the standalone tests in this directory, which exercise the platform-independent
+// modules on any platform. Each test is its own program; see the build command at the top of each file.
+
+#include <iostream>
+
+// Number of failed checks; the test program's exit code is nonzero if any failed.
+static int st_nFailedChecks = 0;
+
+// Reports a failed check with its location, and continues.
+#define CHECK(expr) \
+	do { if (!(expr)) { ++st_nFailedChecks; std::cerr << __FILE__ << "(" << __LINE__ << "): check failed: " #expr << std::endl; } } while (0)
+
+/// <summary>
+/// Reports the result of the checks; returns the exit code for main.
+/// </summary>
+inline int CheckResults(const char* szTestName)
+{
+	if (0 == st_nFailedChecks)
+		std::cout << szTestName << ": all checks passed" << std::endl;
+	else
+		std::cout << szTestName << ": " << st_nFailedChecks << " check(s) failed" << std::endl;
+	return (0 == st_nFailedChecks) ? 0 : 1;
+}